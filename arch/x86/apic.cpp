@@ -115,6 +115,24 @@ void apic_send_sipi(uint32_t physical_address, uint32_t target) {
     }
 }
 
+// 发送固定向量的IPI，调用者需要关闭中断，避免ICR的两次写入之间被打断
+void apic_send_ipi(uint8_t vector, uint32_t target) {
+    icr_low icr;
+    icr.raw = 0;
+    icr.vector = vector;
+    icr.delivery_mode = APIC_ICR_DELIVERY_FIXED;
+    icr.dest_mode = APIC_ICR_PHYSICAL_MODE;
+    icr.level = APIC_ICR_LEVEL_ASSERT;
+    icr.trigger_mode = APIC_ICR_TRIGGER_EDGE;
+
+    apic_write(LAPIC_ICR1, target << APIC_ICR_DEST_SHIFT);
+    apic_write(LAPIC_ICR0, icr.raw);
+
+    while (apic_read(LAPIC_ICR0) & APIC_ICR_PENDING_MASK) {
+        asm volatile("pause");
+    }
+}
+
 void APICController::init_timer() {
     // 设置APIC Timer为周期模式
     apic_write(LAPIC_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
@@ -164,10 +164,9 @@ page_fault_interrupt:
     add esp, 8      ; 清理参数
 
     push eax
-    ; 保存当前 CR3 的值到 eax 寄存器
-    mov eax, cr3
-    ; 将 eax 中的值重新写回到 CR3 寄存器，触发 TLB 刷新
-    mov cr3, eax
+    ; 只刷新故障地址所在页的TLB项，不重载CR3，其他映射（包括全局页）保留
+    mov eax, cr2
+    invlpg [eax]
     pop eax
     
     RESTORE_REGS
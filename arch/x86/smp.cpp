@@ -2,6 +2,7 @@
 #include <arch/x86/interrupt.h>
 #include <arch/x86/percpu.h>
 #include <arch/x86/smp.h>
+#include <arch/x86/tlb.h>
 #include <kernel/kernel.h>
 #include <kernel/scheduler.h>
 #include <lib/debug.h>
@@ -84,7 +85,7 @@ void ap_entry()
     auto cr3 = task->regs.cr3;
     log_debug("cr3: 0x%x, task: %d(0x%x)\n", cr3, task->task_id, task);
     task->print();
-    asm volatile("mov %0, %%cr3" ::"r"(cr3));
+    arch::load_cr3(cr3);
     log_debug("updating tss, esp0: 0x%x, cr3: 0x%x\n", task->stacks.esp0, cr3);
     GDT::updateTSS(current_cpu_id, task->stacks.esp0, 0x10);
     GDT::updateTSSCR3(current_cpu_id, cr3);
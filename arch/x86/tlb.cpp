@@ -0,0 +1,178 @@
+#include <arch/x86/tlb.h>
+
+#include <arch/x86/apic.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/spinlock.h>
+#include <lib/debug.h>
+
+namespace arch {
+
+namespace {
+
+TlbStats stats[MAX_CPUS];
+
+// 每个CPU当前加载的页目录物理地址，0表示该CPU还没有经过load_cr3
+uint32_t loaded_pgd[MAX_CPUS];
+
+// 同一时间只有一个刷新请求在处理：发起者持有shootdown_lock写入request，
+// 置位pending中的目标CPU后发IPI，目标处理完清除自己的位，发起者等待pending归零
+SpinLock shootdown_lock;
+TlbBatch request(0);
+uint32_t pending;
+
+// 等待确认超过这么多次循环时报告可能的死锁
+constexpr uint32_t SHOOTDOWN_WARN_SPINS = 1u << 26;
+
+uint32_t cpu_index()
+{
+    return get_cpu_id() % MAX_CPUS;
+}
+
+TlbStats& local_stats()
+{
+    return stats[cpu_index()];
+}
+
+} // namespace
+
+void tlb_enable_global_pages()
+{
+    // CPUID.1:EDX bit 13 = PGE
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, eax, ebx, ecx, edx);
+    if(!(edx & (1u << 13))) {
+        return;
+    }
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= 0x80; // CR4.PGE
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+}
+
+void load_cr3(uint32_t cr3)
+{
+    __atomic_store_n(&loaded_pgd[cpu_index()], cr3 & 0xFFFFF000, __ATOMIC_RELEASE);
+    if(read_cr3() == cr3) {
+        local_stats().cr3_skipped++;
+        return;
+    }
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    local_stats().cr3_loads++;
+}
+
+void flush_tlb_page(uint32_t vaddr)
+{
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+    local_stats().page_flushes++;
+}
+
+void flush_tlb_all()
+{
+    asm volatile("mov %0, %%cr3" : : "r"(read_cr3()) : "memory");
+    local_stats().full_flushes++;
+}
+
+uint32_t mm_cpu_mask(uint32_t pgd_phys)
+{
+    uint32_t mask = 0;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t pgd = __atomic_load_n(&loaded_pgd[cpu], __ATOMIC_ACQUIRE);
+        if(pgd && (!pgd_phys || pgd == (pgd_phys & 0xFFFFF000))) {
+            mask |= 1u << cpu;
+        }
+    }
+    return mask;
+}
+
+void TlbBatch::flush_local() const
+{
+    // 用户地址只在该页目录仍然加载时才需要刷新，切换过页目录的CPU已经没有旧表项
+    if(pgd_phys && !is_current_pgd(pgd_phys)) {
+        return;
+    }
+    if(whole) {
+        flush_tlb_all();
+        return;
+    }
+    for(uint32_t i = 0; i < nr; i++) {
+        flush_tlb_page(addrs[i]);
+    }
+}
+
+void TlbBatch::flush()
+{
+    if(empty()) {
+        return;
+    }
+    uint32_t flags = local_irq_save();
+    flush_local();
+
+    // 页表项的修改要在读取其他CPU的页目录之前完成
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t self = cpu_index();
+    uint32_t targets = mm_cpu_mask(pgd_phys) & ~(1u << self);
+    if(targets) {
+        while(!shootdown_lock.try_acquire()) {
+            tlb_shootdown_interrupt();
+            asm volatile("pause");
+        }
+        request = *this;
+        __atomic_store_n(&pending, targets, __ATOMIC_RELEASE);
+        for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            if(targets & (1u << cpu)) {
+                apic_send_ipi(IPI_TLB_SHOOTDOWN_VECTOR, cpu);
+                stats[self].ipis_sent++;
+            }
+        }
+        // 等待所有目标确认。持有shootdown_lock时不会有发给本CPU的请求，
+        // 目标只可能卡在关中断等待本CPU持有的锁上，这是调用者违反了tlb.h中的约定
+        uint32_t spins = 0;
+        while(__atomic_load_n(&pending, __ATOMIC_ACQUIRE)) {
+            if(++spins == SHOOTDOWN_WARN_SPINS) {
+                log_err("tlb cpu%d: shootdown not acknowledged, pending %x\n", self, pending);
+            }
+            asm volatile("pause");
+        }
+        shootdown_lock.release();
+    }
+    local_irq_restore(flags);
+    nr = 0;
+    whole = false;
+}
+
+// 处理发给本CPU的刷新请求；除了IPI之外，等待shootdown_lock时也会调用，
+// 避免两个CPU同时发起刷新时互相等待对方关着中断的确认
+void tlb_shootdown_interrupt()
+{
+    uint32_t bit = 1u << cpu_index();
+    if(!(__atomic_load_n(&pending, __ATOMIC_ACQUIRE) & bit)) {
+        return;
+    }
+    request.flush_local();
+    local_stats().ipis_received++;
+    // 清除之后发起者可能立即写入下一个请求，request不能再访问
+    __atomic_and_fetch(&pending, ~bit, __ATOMIC_RELEASE);
+}
+
+const TlbStats& tlb_stats(uint32_t cpu)
+{
+    return stats[cpu % MAX_CPUS];
+}
+
+void tlb_print_stats()
+{
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        const TlbStats& s = stats[cpu];
+        uint32_t switches = s.cr3_loads + s.cr3_skipped;
+        if(!switches && !s.page_flushes && !s.full_flushes) {
+            continue;
+        }
+        log_info("tlb cpu%d: cr3 loads %d, skipped %d (%d%%), invlpg %d, full flushes %d, "
+                 "ipi sent %d received %d\n",
+            cpu, s.cr3_loads, s.cr3_skipped, switches ? s.cr3_skipped * 100 / switches : 0,
+            s.page_flushes, s.full_flushes, s.ipis_sent, s.ipis_received);
+    }
+}
+
+} // namespace arch
@@ -4,10 +4,16 @@
 #include <lib/debug.h>
 #include <lib/string.h>
 #include "kernel/fs/SimplePageCache.h"
+#include <kernel/kernel.h>
+#include <kernel/process.h>
+#include <kernel/syscall.h>
+#include <kernel/user_memory.h>
 
 namespace kernel
 {
 
+DEFINE_SLAB_CACHE_OPERATORS(Ext2Inode, "ext2_inode")
+
 Ext2FileSystem::Ext2FileSystem(BlockDevice* device) : device(device)
 {
     log_debug("[ext2] 初始化文件系统 device:%p\n", device);
@@ -685,36 +691,36 @@ int Ext2FileDescriptor::iterate(void* buffer, size_t buffer_size, uint32_t* pos)
  * @param inode
  * @return block index under block device
  */
-uint32_t Ext2FileDescriptor::get_block_id(uint32_t block_idx, Ext2Inode *inode)
+uint32_t Ext2FileSystem::get_block_id(uint32_t block_idx, Ext2Inode *inode)
 {
-    auto dev = m_fs->device;
     if (block_idx < 12) {
         return inode->i_block[block_idx];
     } else if (block_idx < 12+ 256) {
         uint32_t indirect_block_id = inode->i_block[12];
-        uint32_t indirect_offset = (block_idx - 12) * sizeof(uint32_t);
-
-        uint32_t block_id;
-
-        auto key = PageKey{indirect_block_id};
-        auto page = m_fs->page_cache->get_page(key);
-
-        block_id = *((uint32_t*)(page->data + indirect_offset));
+        uint32_t block_id = read_block_entry(indirect_block_id, block_idx - 12);
         log_debug("inode_block_idx:%d, indirect_block_id:%d, block_id:%d\n", block_idx, indirect_block_id, block_id);
         return block_id;
     } else if (block_idx < 12 + 256 + 256*256) {
         uint32_t indirect_block = inode->i_block[13];
-        auto page = m_fs->page_cache->get_page(PageKey{indirect_block});
         uint32_t indirect_block_offset = ((block_idx - 12 - 256)%(256*256));
-        uint32_t double_indirect_block = *(uint32_t*)(page->data + indirect_block_offset*sizeof(uint32_t));
+        uint32_t double_indirect_block = read_block_entry(indirect_block, indirect_block_offset);
         uint32_t double_indirect_offset = (block_idx - 12 - 256)%256;
-        auto page2 = m_fs->page_cache->get_page(PageKey{double_indirect_block});
-        uint32_t block_id = *((uint32_t*)(page2->data + double_indirect_offset*sizeof(uint32_t)));
-        return block_id;
+        return double_indirect_block ? read_block_entry(double_indirect_block, double_indirect_offset) : 0;
     }
     return 0;
 }
 
+uint32_t Ext2FileSystem::read_block_entry(uint32_t block_id, uint32_t index)
+{
+    auto page = page_cache->get_page(PageKey{block_id});
+    if (!page) {
+        return 0;
+    }
+    uint32_t entry = ((uint32_t*)page->data)[index];
+    page_cache->put_page(page);
+    return entry;
+}
+
 ssize_t Ext2FileDescriptor::read(void* buffer, size_t size)
 {
     Ext2Inode* inode = m_fs->read_inode(m_inode);
@@ -735,12 +741,16 @@ ssize_t Ext2FileDescriptor::read(void* buffer, size_t size)
         uint32_t inode_block_idx = m_position / block_size;
         uint32_t data_offset = m_position % block_size;
 
-        auto device_block_id = get_block_id(m_position/block_size, inode);
+        auto device_block_id = m_fs->get_block_id(m_position/block_size, inode);
         auto page = m_fs->page_cache->get_page(PageKey{device_block_id});
+        if(!page) {
+            break;
+        }
 
-        // 复制数据到缓冲区
+        // 复制数据到缓冲区，页面已被固定，复制时缺页不会与页缓存的锁冲突
         size_t copy_size = min(block_size - data_offset, bytes_to_read);
-        memcpy(static_cast<uint8_t*>(buffer) + total_read, page->data + data_offset, copy_size);
+        memcpy(static_cast<uint8_t*>(buffer) + total_read, (uint8_t*)page->data + data_offset, copy_size);
+        m_fs->page_cache->put_page(page);
 
         m_position += copy_size;
         total_read += copy_size;
@@ -754,11 +764,85 @@ ssize_t Ext2FileDescriptor::read(void* buffer, size_t size)
 void* Ext2FileDescriptor::mmap(void* addr, size_t length, int prot, int flags, size_t offset)
 {
     log_trace("mmap: addr:%x, length:%d, prot:%d, flags:%d, offset:%d\n", addr, length, prot, flags, offset);
+    if(offset & (PAGE_SIZE - 1)) {
+        log_err("mmap: offset 0x%x is not page aligned\n", offset);
+        return (void*)MAP_FAILED;
+    }
+    // 文件页直接映射页缓存中的块，文件系统和设备的块大小都必须与页大小相同（mkfs.ext2 -b 4096）
+    if(m_fs->super_block->block_size() != PAGE_SIZE || m_fs->device->block_size() != PAGE_SIZE) {
+        log_err("mmap: block size %d is not supported\n", m_fs->super_block->block_size());
+        return (void*)MAP_FAILED;
+    }
     Ext2Inode* inode = m_fs->read_inode(m_inode);
     if(!inode) {
-        return (void*)(-1);
+        return (void*)MAP_FAILED;
+    }
+    if((inode->mode & 0xF000) == 0x4000) { // 目录不能映射
+        delete inode;
+        return (void*)MAP_FAILED;
+    }
+    auto mapping = new Ext2FileMapping(m_fs, *inode);
+    delete inode;
+    if(!mapping) {
+        return (void*)MAP_FAILED;
+    }
+
+    uint32_t area_flags = (prot & PROT_WRITE) ? PAGE_WRITE : 0;
+    uint32_t type = (flags & MAP_SHARED) ? MEM_TYPE_SHARED : MEM_TYPE_MMAP_FILE;
+    auto& user_mm = ProcessManager::get_current_task()->context->user_mm;
+    void* mapped = user_mm.allocate_file_area(length, area_flags, type, mapping, offset / PAGE_SIZE);
+    // 区域持有自己的引用，这里创建时的引用可以归还
+    mapping->put();
+    return mapped ? mapped : (void*)MAP_FAILED;
+}
+
+uint32_t Ext2FileMapping::get_page(uint32_t pgoff)
+{
+    if(pgoff >= (m_inode.size + PAGE_SIZE - 1) / PAGE_SIZE) {
+        return 0;
+    }
+    // 文件空洞没有对应的块，不能映射
+    uint32_t block_id = m_fs->get_block_id(pgoff, &m_inode);
+    if(!block_id) {
+        return 0;
+    }
+    return m_fs->page_cache->map_page(PageKey{block_id});
+}
+
+uint32_t Ext2FileMapping::find_page(uint32_t pgoff)
+{
+    if(pgoff >= (m_inode.size + PAGE_SIZE - 1) / PAGE_SIZE) {
+        return 0;
+    }
+    // 间接块在第一次缺页时已经读入页缓存，这里查块号通常不会读设备
+    uint32_t block_id = m_fs->get_block_id(pgoff, &m_inode);
+    if(!block_id) {
+        return 0;
+    }
+    return m_fs->page_cache->map_cached_page(PageKey{block_id});
+}
+
+void Ext2FileMapping::set_page_dirty(uint32_t pgoff)
+{
+    uint32_t block_id = m_fs->get_block_id(pgoff, &m_inode);
+    if(block_id) {
+        m_fs->page_cache->mark_dirty(PageKey{block_id});
+        m_dirty = true;
+    }
+}
+
+Ext2FileMapping::~Ext2FileMapping()
+{
+    if(!m_dirty) {
+        return;
+    }
+    uint32_t nr_pages = (m_inode.size + PAGE_SIZE - 1) / PAGE_SIZE;
+    for(uint32_t pgoff = 0; pgoff < nr_pages; pgoff++) {
+        uint32_t block_id = m_fs->get_block_id(pgoff, &m_inode);
+        if(block_id) {
+            m_fs->page_cache->flush(PageKey{block_id});
+        }
     }
-    return (void*)(-1);
 }
 
 
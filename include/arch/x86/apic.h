@@ -31,17 +31,18 @@ namespace arch {
 #define LAPIC_DIVIDE_CONFIG 0x3E0
 
 // APIC ICR相关常量
+#define APIC_ICR_DELIVERY_FIXED 0
 #define APIC_ICR_DELIVERY_INIT 5
 #define APIC_ICR_DELIVERY_SIPI 6
 #define APIC_ICR_PHYSICAL_MODE 0
 #define APIC_ICR_LEVEL_ASSERT 1
+#define APIC_ICR_TRIGGER_EDGE 0
 #define APIC_ICR_TRIGGER_LEVEL 1
 #define APIC_ICR_PENDING_MASK (1 << 12)
 #define APIC_ICR_DEST_SHIFT 24
 
-// 中断向量号定义
-#define IRQ_USER_BASE 0x32
-#define IRQ_IPI 0x37
+// 中断向量号定义，IRQ_USER_BASE和IRQ_IPI见interrupt.h
+#define IPI_TLB_SHOOTDOWN_VECTOR 0x40 // TLB刷新请求，由interrupt.asm中的ipi_interrupt进入
 
 // MSR寄存器地址
 #define MSR_APIC_BASE 0x1B
@@ -100,8 +101,12 @@ void apic_send_eoi();
 void apic_enable();
 void apic_send_init(uint32_t target);
 void apic_send_sipi(uint32_t physical_address, uint32_t target);
+// 向APIC ID为target的CPU发送固定向量的IPI
+void apic_send_ipi(uint8_t vector, uint32_t target);
 uint32_t apic_get_id();
 uint32_t apic_get_cpu_count();
+// 执行CPUID指令
+void cpuid(uint32_t function, uint32_t& eax, uint32_t& ebx, uint32_t& ecx, uint32_t& edx);
 
 // IOAPIC函数声明
 void ioapic_init();
@@ -40,7 +40,6 @@ extern const char* interrupt_names[256];
 #define IRQ_FLOPPY 0x26    // 软盘控制器
 #define IRQ_LPT1 0x27      // 并口1
 #define IRQ_RTC 0x28      // CMOS时钟
-#define IRQ_PS2      0x29    // 保留中断1
 #define IRQ_RESV1      0x29    // 保留中断1
 #define IRQ_RESV2      0x2A    // 保留中断2
 #define IRQ_PS2_AUX    0x2B    // PS2辅助设备
@@ -3,6 +3,8 @@
 
 #include <cstdint>
 
+class SpinLock;
+
 // 页表标志位
 constexpr uint32_t PAGE_PRESENT = 0x1;        // 页面存在 (位0)
 constexpr uint32_t PAGE_WRITE = 0x2;          // 可写 (位1)
@@ -11,8 +13,11 @@ constexpr uint32_t PAGE_WRITE_THROUGH = 0x8;  // 写透 (位3)
 constexpr uint32_t PAGE_CACHE_DISABLE = 0x10; // 禁用缓存 (位4)
 constexpr uint32_t PAGE_ACCESSED = 0x20;      // 已访问 (位5)
 constexpr uint32_t PAGE_DIRTY = 0x40;         // 已修改 (位6)
+constexpr uint32_t PAGE_PS = 0x80;            // 4MB大页 (位7)，只在页目录项中有效，需要CR4.PSE
 constexpr uint32_t PAGE_GLOBAL = 0x100;       // 全局 (位8)
 constexpr uint32_t PAGE_COW = 0x200;          // 写时复制 (位9), 系统自定义位
+constexpr uint32_t PAGE_SHARED = 0x400;       // 共享文件映射的页缓存页面 (位10), 系统自定义位，fork时不做写时复制
+constexpr uint32_t PAGE_MIGRATING = 0x800;    // 匿名页正在被内存规整迁移 (位11), 系统自定义位，不存在的表项带有该位时缺页处理等待页表锁后重试
 
 // 4M 以后开始分配内存
 // 4M -> 4M + 4K 是PDT
@@ -37,9 +42,9 @@ constexpr uint32_t KERNEL_DIRECT_MAP_START = 0xC0000000; // 3GB (内核空间起
 constexpr uint32_t KERNEL_DIRECT_MAP_END =
     0xF8000000; // 3GB + 896MB (直接映射区，用于映射DMA_ZONE和NORMAL_ZONE)
 constexpr uint32_t VMALLOC_START = KERNEL_DIRECT_MAP_END; // 3GB + 896MB
-constexpr uint32_t VMALLOC_END = 0xF8000000; // 3GB + 896MB (VMALLOC区域，64MB，用于非连续内存分配)
-constexpr uint32_t KMAP_START = 0xF8000000;  // 3GB + 896MB
-constexpr uint32_t KMAP_END = 0xFC000000;    // 3GB + 960MB (KMAP区域，64MB，用于临时内核映射)
+constexpr uint32_t VMALLOC_END = 0xFA000000; // 3GB + 928MB (VMALLOC区域，32MB，用于非连续内存分配)
+constexpr uint32_t KMAP_START = 0xFA000000;  // 3GB + 928MB
+constexpr uint32_t KMAP_END = 0xFC000000;    // 3GB + 960MB (KMAP区域，32MB，用于临时内核映射)
 } // namespace MemoryConstants
 
 // 4M 以后开始分配内存
@@ -50,38 +55,108 @@ constexpr uint32_t KMAP_END = 0xFC000000;    // 3GB + 960MB (KMAP区域，64MB
 constexpr uint32_t PAGE_DIRECTORY_ADDR = 0x400000; // 4MB地址处是页目录
 constexpr uint32_t K_FIRST_4M_PT = 0x401000;       // 4MB + 4KB地址处是前4M页表
 constexpr uint32_t K_PAGE_TABLE_START = 0x402000;  // 4MB + 8KB地址处是页表
-constexpr uint32_t K_PAGE_TABLE_COUNT = 224;       // 224 * 1024page/table * 4KB/page = 896MB
+// 直接映射区用4MB大页映射，页目录项直接指向物理内存，不再需要224个页表
+constexpr uint32_t K_DIRECT_MAP_PDE_COUNT = 224;   // 224 * 4MB = 896MB
+// VMALLOC区域的页表，启动时建好并被所有页目录共享，
+// vmalloc建立的映射因此对所有进程立即可见
+constexpr uint32_t K_VMALLOC_PT_START = K_PAGE_TABLE_START;
+constexpr uint32_t K_VMALLOC_PT_COUNT = (MemoryConstants::VMALLOC_END - MemoryConstants::VMALLOC_START) >> 22;
+// KMAP区域的页表紧跟在VMALLOC页表之后，同样在所有页目录中共享
+constexpr uint32_t K_KMAP_PT_START = K_VMALLOC_PT_START + K_VMALLOC_PT_COUNT * 0x1000;
+constexpr uint32_t K_KMAP_PT_COUNT = (MemoryConstants::KMAP_END - MemoryConstants::KMAP_START) >> 22;
 
 static const uint32_t PAGE_SIZE = 0x1000;      // 页面大小
+static const uint32_t LARGE_PAGE_SIZE = 0x400000; // 大页大小，一个页目录项映射4MB
+static const uint32_t LARGE_PAGE_ORDER = 10;      // 大页对应的伙伴系统order
 static const uint32_t USER_START = 0x40000000; // 用户空间起始地址
 static const uint32_t USER_END = 0xC0000000;   // 用户空间结束地址
-
-#define TEMP_MAPPING_VADDR 0xFFC00000 // 内核临时映射专用地址
+// 用户程序链接在1MB处，映像位于前4MB之内。每个地址空间有自己的低端页表，
+// 除这1MB之外都是内核恒等映射的副本，映像页面由UserMemory分配和释放
+static const uint32_t USER_IMAGE_START = 0x100000;
+static const uint32_t USER_IMAGE_END = 0x200000;
+
+// 递归页目录：每个页目录的第RECURSIVE_PDE项指向页目录自身，
+// 当前地址空间的1024个页表因此依次出现在PTE_WINDOW开始的4MB中，页目录自身出现在PD_WINDOW，
+// 读写任意PTE只需要一次内存访问，不要求页表位于直接映射区
+constexpr uint32_t RECURSIVE_PDE = 0x3FF;
+constexpr uint32_t PTE_WINDOW = RECURSIVE_PDE << 22;                       // 0xFFC00000
+constexpr uint32_t PD_WINDOW = PTE_WINDOW | (RECURSIVE_PDE << 12);         // 0xFFFFF000
+// 第FOREIGN_PDE项临时指向另一个地址空间的页目录（见ForeignPageDirectory），fork时填写子进程页表
+constexpr uint32_t FOREIGN_PDE = 0x3FE;
+constexpr uint32_t FOREIGN_PTE_WINDOW = FOREIGN_PDE << 22;                 // 0xFF800000
+constexpr uint32_t FOREIGN_PD_WINDOW = FOREIGN_PTE_WINDOW | (RECURSIVE_PDE << 12); // 0xFFBFF000
 
 using PFN = uint32_t;
 using VADDR = void*;
 using PADDR = uint32_t;
 
 
-// 页面状态标志
-enum class PageFlags : uint32_t {
-    PAGE_RESERVED = 1 << 0,   // 保留页面
-    PAGE_ALLOCATED = 1 << 1,  // 已分配
-    PAGE_DIRTY = 1 << 2,      // 脏页面
-    PAGE_LOCKED = 1 << 3,     // 锁定页面
-    PAGE_REFERENCED = 1 << 4, // 被引用
-    PAGE_ACTIVE = 1 << 5,     // 活跃页面
-    PAGE_INACTIVE = 1 << 6,   // 不活跃页面
-};
-
-// 物理页面描述符
+// 物理页面描述符（每个页框8字节）
+// flags低位为状态标志，高位存放块的order；只有块的首页被标记，
+// 尾页不保存任何信息，首页通过块的自然对齐关系在O(MAX_ORDER)内找到
 struct page {
-    uint32_t flags;           // 页面状态标志
-    uint32_t _count;          // 引用计数
-    uint32_t virtual_address; // 映射的虚拟地址
-    uint32_t pfn;             // 页框号
-    struct page* next;        // 链表指针，用于空闲页面链表
+    uint32_t flags; // 页面状态标志 + order
+    union {
+        uint32_t _count;   // 引用计数（仅首页有效），通过page_ref_count读取
+        uint32_t private_; // 带PG_OWNER_PRIVATE标志时为分配者的私有数据，如PG_SLAB页的Slab描述符
+    };
 };
+static_assert(sizeof(page) <= 8, "struct page must stay compact");
+
+// 页面状态标志
+constexpr uint32_t PG_RESERVED = 1u << 0; // 保留页面（描述符数组等元数据）
+constexpr uint32_t PG_HEAD = 1u << 1;     // 已分配块的首页
+constexpr uint32_t PG_COW = 1u << 2;      // 写时复制共享页
+constexpr uint32_t PG_BUDDY = 1u << 3;    // 伙伴系统空闲块的首页，order为空闲块大小
+constexpr uint32_t PG_SLAB = 1u << 4;     // slab页，private_为Slab描述符
+constexpr uint32_t PG_MOVABLE = 1u << 5;  // 可迁移页，在反向映射表中有记录（匿名页、页缓存页）
+constexpr uint32_t PG_KMALLOC = 1u << 6;  // 大块kmalloc分配的首页，private_为页数
+// 带这些标志的页面private_归分配者使用，与_count共用存储；
+// 它们只有分配者一个引用，不参与引用计数，由分配者直接释放
+constexpr uint32_t PG_OWNER_PRIVATE = PG_SLAB | PG_KMALLOC;
+constexpr uint32_t PG_ORDER_SHIFT = 24;
+constexpr uint32_t PG_ORDER_MASK = 0x1Fu << PG_ORDER_SHIFT;
+
+inline uint32_t page_order(const page* pg)
+{
+    return (pg->flags & PG_ORDER_MASK) >> PG_ORDER_SHIFT;
+}
+
+inline void set_page_order(page* pg, uint32_t order)
+{
+    pg->flags = (pg->flags & ~PG_ORDER_MASK) | (order << PG_ORDER_SHIFT);
+}
+
+// 页面的引用计数，private_被分配者占用的页面固定为1
+inline uint32_t page_ref_count(const page* pg)
+{
+    return (pg->flags & PG_OWNER_PRIVATE) ? 1 : pg->_count;
+}
+
+// 页目录项是否直接映射一个4MB大页（而不是指向页表）
+inline bool pde_is_large(uint32_t pde)
+{
+    return (pde & (PAGE_PRESENT | PAGE_PS)) == (PAGE_PRESENT | PAGE_PS);
+}
+
+// 当前地址空间中vaddr的页目录项
+inline uint32_t* current_pde(uint32_t vaddr)
+{
+    return &reinterpret_cast<uint32_t*>(PD_WINDOW)[vaddr >> 22];
+}
+
+// 当前地址空间中vaddr的页表项，调用者要先确认页目录项指向页表（存在且不是4MB大页）
+inline uint32_t* current_pte(uint32_t vaddr)
+{
+    return &reinterpret_cast<uint32_t*>(PTE_WINDOW)[vaddr >> 12];
+}
+
+// vaddr所在页表在PTE_WINDOW中的地址；页目录项被清除或替换后要刷新这一页的TLB项，
+// 否则之后通过窗口访问的仍是旧页表
+inline uint32_t pte_window_page(uint32_t vaddr)
+{
+    return PTE_WINDOW + (vaddr >> 22) * 0x1000;
+}
 
 struct PageDirectory {
     uint32_t entries[1024];
@@ -99,6 +174,34 @@ void printPTEFlags(uint32_t pte);
 
 
 void PagingValidate(PageDirectory * pd);
+/**
+ * @brief 通过FOREIGN_PDE访问另一个地址空间的页表
+ * 构造时把pgd_phys挂到当前页目录的FOREIGN_PDE项并刷新本CPU的TLB，析构时取下。
+ * 当前页目录可能被其他CPU上的线程共享，期间持有全局锁并关中断，不能分配内存或睡眠。
+ * pgd_phys的RECURSIVE_PDE项必须已经指向它自身
+ */
+class ForeignPageDirectory
+{
+public:
+    explicit ForeignPageDirectory(uint32_t pgd_phys);
+    ~ForeignPageDirectory();
+    ForeignPageDirectory(const ForeignPageDirectory&) = delete;
+    ForeignPageDirectory& operator=(const ForeignPageDirectory&) = delete;
+
+    uint32_t* pde(uint32_t vaddr)
+    {
+        return &reinterpret_cast<uint32_t*>(FOREIGN_PD_WINDOW)[vaddr >> 22];
+    }
+    // 调用者要先确认页目录项指向页表
+    uint32_t* pte(uint32_t vaddr)
+    {
+        return &reinterpret_cast<uint32_t*>(FOREIGN_PTE_WINDOW)[vaddr >> 12];
+    }
+
+private:
+    uint32_t flags;
+};
+
 class PageManager
 {
 public:
@@ -109,14 +212,19 @@ public:
      * @brief 复制内存空间，使用写时复制技术
      * @param src 源页目录
      * @param dstPgd 目标页目录, out pointer
+     * @param src_pte_lock 源地址空间的页表锁，修改源页表项期间持有，与内存规整迁移互斥
      * @return 0 成功，-1 失败
      */
-    static int copyMemorySpaceCOW(PageDirectory* src, PageDirectory* dstPgd);
+    static int copyMemorySpaceCOW(
+        PageDirectory* src, PageDirectory* dstPgd, SpinLock* src_pte_lock);
+    // 释放copyMemorySpaceCOW为dstPgd分配的内核部分页表，用户空间由UserMemory释放
+    static void freeMemorySpace(PageDirectory* pgd);
 
     static void loadPageDirectory(uint32_t dir);
     static void enablePaging();
     static void disablePaging();
 
+    // 以下函数通过递归映射操作当前CPU正在使用的地址空间
     // 映射虚拟地址到物理地址
     void mapPage(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
     void unmapPage(uint32_t virt_addr);
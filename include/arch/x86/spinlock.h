@@ -30,10 +30,17 @@ public:
         __atomic_clear(&locked, __ATOMIC_RELEASE);
     }
 
+    // 尝试获取锁，失败时立即返回false
+    bool try_acquire() {
+        return !__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE);
+    }
+
     // 保存中断状态并获取锁
     void acquire_irqsave(uint32_t& flags) {
         asm volatile("pushf; pop %0" : "=r"(flags));
-        asm volatile("cli");
+#ifndef TESTING
+        asm volatile("cli"); // 主机上的单元测试运行在用户态，不能关中断
+#endif
         acquire();
     }
 
@@ -56,4 +63,15 @@ inline void spin_unlock(SpinLock* lock) {
     if (lock) lock->release();
 }
 
+// 关闭本地中断并返回原来的EFLAGS，用于访问每CPU数据
+inline uint32_t local_irq_save() {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+inline void local_irq_restore(uint32_t flags) {
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
 #endif // ARCH_X86_SPINLOCK_H
\ No newline at end of file
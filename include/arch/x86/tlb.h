@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+
+namespace arch {
+
+// TLB刷新统计（每个CPU一份）
+// 直接映射区是全局页（CR4.PGE），切换页目录时不会被刷掉；
+// 下一个任务与当前任务使用同一个页目录时不写CR3，这里记录节省了多少次整体刷新
+struct TlbStats {
+    uint32_t cr3_loads;     // 实际写CR3的次数（非全局TLB项全部失效）
+    uint32_t cr3_skipped;   // 页目录未变、跳过写CR3的次数
+    uint32_t page_flushes;  // invlpg单页刷新次数
+    uint32_t full_flushes;  // 为使页表修改生效而主动重载CR3的次数
+    uint32_t ipis_sent;     // 发出的TLB刷新IPI（每个目标CPU计一次）
+    uint32_t ipis_received; // 处理的其他CPU的刷新请求
+};
+
+// CPU支持时打开CR4.PGE，使带PAGE_GLOBAL的内核映射在CR3切换时保留
+void tlb_enable_global_pages();
+
+inline uint32_t read_cr3()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+// 切换到cr3指定的页目录，与当前值相同时不写CR3
+void load_cr3(uint32_t cr3);
+
+// 刷新当前CPU上vaddr所在页（或4MB大页）的TLB项
+void flush_tlb_page(uint32_t vaddr);
+
+// 刷新当前CPU上所有非全局的TLB项
+void flush_tlb_all();
+
+// 正在使用pgd_phys的CPU集合（按APIC ID的位图），pgd_phys为0时返回所有已经切换过页目录的CPU
+// 由load_cr3记录每个CPU加载的页目录得到；刚切换到该页目录的CPU写CR3时已经刷新过TLB
+uint32_t mm_cpu_mask(uint32_t pgd_phys);
+
+/**
+ * @brief 批量TLB刷新
+ * 先修改页表项并add需要失效的地址，再调用flush：本CPU用invlpg（超过MAX_PAGES时整体刷新），
+ * 其他正在使用该页目录的CPU通过一次IPI处理整批地址，flush返回时所有CPU上的旧表项都已失效。
+ * 被解除映射的物理页要在flush之后才能释放
+ *
+ * flush在关中断的情况下等待其他CPU确认，调用时不能持有其他CPU会关中断获取的自旋锁
+ * （例如页表锁、rmap锁）：目标CPU关着中断等这把锁时收不到IPI，两边会互相等待。
+ * 两个CPU同时发起刷新不会死锁，等待shootdown_lock时会处理发给自己的请求
+ */
+class TlbBatch
+{
+public:
+    static constexpr uint32_t MAX_PAGES = 32;
+
+    // pgd_phys为0表示内核地址（vmalloc、kmap），需要在所有CPU上刷新
+    explicit TlbBatch(uint32_t pgd_phys) : pgd_phys(pgd_phys), nr(0), whole(false) {}
+
+    void add(uint32_t vaddr)
+    {
+        if(nr < MAX_PAGES) {
+            addrs[nr++] = vaddr;
+        } else {
+            whole = true;
+        }
+    }
+    // 整个地址空间都需要刷新，例如fork把所有可写页改成只读之后
+    void add_all() { whole = true; }
+    bool empty() const { return nr == 0 && !whole; }
+
+    void flush();
+
+private:
+    friend void tlb_shootdown_interrupt();
+    void flush_local() const;
+
+    uint32_t pgd_phys;
+    uint32_t nr;
+    bool whole;
+    uint32_t addrs[MAX_PAGES];
+};
+
+// IPI_TLB_SHOOTDOWN_VECTOR的中断处理函数
+void tlb_shootdown_interrupt();
+
+// pgd_phys是当前CPU正在使用的页目录时才需要刷新
+inline bool is_current_pgd(uint32_t pgd_phys)
+{
+    return (read_cr3() & 0xFFFFF000) == (pgd_phys & 0xFFFFF000);
+}
+
+const TlbStats& tlb_stats(uint32_t cpu);
+void tlb_print_stats();
+
+} // namespace arch
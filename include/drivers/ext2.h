@@ -2,6 +2,7 @@
 #include "block_device.h"
 #include <cstdint>
 #include <kernel/fs/PageCache.h>
+#include <kernel/slab_allocator.h>
 #include <kernel/vfs.h>
 #include <stddef.h>
 
@@ -134,6 +135,8 @@ struct Ext2Inode {
     } osd2;
     static uint32_t inode_table_block();
     void print();
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 /*
  * Structure of a blocks group descriptor
@@ -178,6 +181,7 @@ public:
 
 private:
     friend class Ext2FileDescriptor;
+    friend class Ext2FileMapping;
     BlockDevice* device;
     Ext2SuperBlock* super_block;
     Ext2GroupDesc group_desc;
@@ -192,6 +196,9 @@ private:
     bool write_inode(uint32_t inode_num, const Ext2Inode* inode);
     uint32_t allocate_block();
     uint32_t allocate_inode();
+    uint32_t get_block_id(uint32_t block_idx, Ext2Inode *inode);
+    // 读取间接块中第index个块号，块读取失败时返回0
+    uint32_t read_block_entry(uint32_t block_id, uint32_t index);
 };
 
 class Ext2FileDescriptor : public kernel::FileDescriptor
@@ -212,8 +219,24 @@ private:
     uint32_t m_inode;
     off_t m_position = 0;
     Ext2FileSystem* m_fs;
+};
 
-    uint32_t get_block_id(uint32_t block_idx, Ext2Inode *inode);
+// mmap的文件映射，通过页缓存按页提供文件内容，要求块大小等于页大小
+class Ext2FileMapping : public FileMapping
+{
+public:
+    Ext2FileMapping(Ext2FileSystem* fs, const Ext2Inode& inode) : m_fs(fs), m_inode(inode) {}
+    // 最后一个映射区域销毁时把共享映射写过的页面写回设备
+    ~Ext2FileMapping() override;
+
+    uint32_t get_page(uint32_t pgoff) override;
+    uint32_t find_page(uint32_t pgoff) override;
+    void set_page_dirty(uint32_t pgoff) override;
+
+private:
+    Ext2FileSystem* m_fs;
+    Ext2Inode m_inode; // 映射时的inode，映射期间按它的大小和块表查找页面
+    bool m_dirty = false; // 有页面被共享映射写入过
 };
 
 } // namespace kernel
@@ -1,4 +1,6 @@
 #pragma once
+#include "arch/x86/paging.h"
+#include "kernel/list.h"
 #include <cstdint>
 
 class BuddyAllocator
@@ -10,37 +12,56 @@ public:
     uint32_t allocate_pages(uint32_t gfp_mask, uint32_t order);
     void free_pages(uint32_t phys, uint32_t order);
     void increment_ref_count(uint32_t phys, uint32_t order = 0);
-    void decrement_ref_count(uint32_t phys, uint32_t order = 0);
+    // 引用计数降为0时返回true，并通过head/head_order返回需要释放的整块，
+    // 由调用者负责释放页面；复合页的尾页引用计入首页
+    bool decrement_ref_count(uint32_t phys, uint32_t& head, uint32_t& head_order);
+
+    // 以下接口供Zone的每CPU页面缓存批量搬运页面使用：
+    // take_free_block/return_free_block只操作空闲链表，不维护页元数据
+    uint32_t take_free_block(uint32_t order);
+    void return_free_block(uint32_t phys, uint32_t order);
+    // 设置/清除已分配页面的复合页信息和引用计数
+    void prep_new_pages(uint32_t phys, uint32_t order);
+    void clear_page_state(uint32_t phys, uint32_t order);
+    // 检查[phys, phys + 2^order页)是否完全位于可分配区域内
+    bool contains(uint32_t phys, uint32_t order) const;
+    // 返回phys所在页面的描述符，不在管理范围内时返回nullptr
+    page* page_of(uint32_t phys);
+    // 释放任意页数的已分配范围，按自然对齐拆成若干块归还
+    void free_range(uint32_t phys, uint32_t nr_pages);
+    // 把完全空闲的[phys, phys + nr_pages页)从空闲链表中摘出，
+    // 所在空闲块中范围之外的部分放回空闲链表；范围内有非空闲页时返回false且不做修改
+    bool claim_range(uint32_t phys, uint32_t nr_pages);
+    // 指定order的空闲块数量
+    uint32_t free_blocks(uint32_t order) const { return order <= MAX_ORDER ? nr_free[order] : 0; }
 
 private:
     static constexpr uint32_t MIN_ORDER = 0;  // 最小分配单位为1页(4KB)
     static constexpr uint32_t MAX_ORDER = 20; // 最大分配单位为 4GB
 
-    // 空闲内存块链表节点
-    struct FreeBlock {
-        FreeBlock* next;
-        uint32_t size; // 块大小(以页为单位)
-    };
-
-    // 每个order对应的空闲链表
-    FreeBlock* free_lists[MAX_ORDER + 1];
+    // 每个order对应的空闲链表，链表节点(kernel::list_head)直接存放在空闲块的首页内，
+    // 空闲块首页的描述符带PG_BUDDY标志和order，判断伙伴是否空闲以及摘链都是O(1)
+    kernel::list_head free_lists[MAX_ORDER + 1];
+    uint32_t nr_free[MAX_ORDER + 1]; // 每个order的空闲块数量
     uint32_t real_start;
     uint32_t memory_start;
     uint32_t memory_size;
 
-    struct PageInfo {
-        uint32_t ref_count;
-        bool is_cow;
-        bool is_compound;     // 是否为复合页的一部分
-        uint32_t compound_order;  // 如果是复合页，记录复合页的order
-        uint32_t compound_head;   // 复合页的首页物理地址
-    };
-    PageInfo* page_info = nullptr;
+    // 页面描述符数组，下标为(phys - real_start) / PAGE_SIZE
+    page* mem_map = nullptr;
     uint32_t page_count = 0;
+    static constexpr uint32_t NO_PAGE = 0xFFFFFFFF;
+
+    page* page_at(uint32_t index) { return &mem_map[index]; }
+    uint32_t page_index(uint32_t phys) const { return (phys - real_start) / PAGE_SIZE; }
+    // 查找包含index的已分配块的首页下标，找不到时返回NO_PAGE
+    uint32_t find_head(uint32_t index) const;
 
-    // 内部辅助函数
-    uint32_t get_buddy_address(uint32_t addr, uint32_t size);
-    uint32_t get_block_order(uint32_t num_pages);
-    void split_block(uint32_t addr, uint32_t order);
-    bool try_merge_buddy(uint32_t addr, uint32_t order);
+    // 内部辅助函数，pfn均为绝对页帧号，块按绝对页帧号自然对齐
+    kernel::list_head* pfn_to_node(uint32_t pfn);
+    void add_free_block(uint32_t pfn, uint32_t order);
+    void del_free_block(uint32_t pfn, uint32_t order);
+    bool is_free_buddy(uint32_t pfn, uint32_t order);
+    // 查找包含pfn的空闲块，返回块首页帧号并通过order返回块大小，pfn不空闲时返回NO_PAGE
+    uint32_t find_free_block(uint32_t pfn, uint32_t& order);
 };
\ No newline at end of file
@@ -166,6 +166,9 @@ public:
     // @param base_address 加载的基地址，默认为0x100000
     // @return 是否加载成功
     static bool load_elf(const void* elf_data, uint32_t size, uint32_t base_address = 0x100000);
+    // 检查需要复制到内存的段都在文件之内并且落在[USER_IMAGE_START, USER_IMAGE_END)中
+    // @return 映像的结束地址（页对齐），文件不合法时返回0
+    static uint32_t image_end(const void* elf_data, uint32_t size);
 
 private:
     // 处理重定位表
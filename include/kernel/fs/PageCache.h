@@ -2,6 +2,8 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "kernel/slab_allocator.h"
+
 // 页标识，可根据你的需求扩展
 struct PageKey {
     uint64_t block_id;   // 页号
@@ -16,6 +18,8 @@ struct Page {
     void* data;         // 指向实际页缓冲区
     size_t size;        // 页大小
     bool dirty;         // 脏页标志
+    bool referenced;    // 最近被访问过，回收时给第二次机会
+    uint32_t pins;      // get_page的固定次数，固定的页面不会被淘汰或失效
     // 可扩展引用计数、锁、时间戳等
 };
 
@@ -24,9 +28,18 @@ public:
     virtual ~PageCache() = default;
 
     virtual bool exists(const PageKey& key) const = 0;
-    // 获取页指针，create为true时若不存在则分配新页
-    // 返回nullptr表示失败
+    // 获取页面（不存在时从设备读取）并固定，返回nullptr表示失败。
+    // 固定期间页面不会被淘汰、失效或被内存规整迁移，调用者可以在不持有缓存锁的情况下
+    // 访问page->data（包括复制到可能缺页的用户缓冲区），用完后必须调用put_page
     virtual Page* get_page(const PageKey& key) = 0;
+    // 解除get_page的固定
+    virtual void put_page(Page* page) = 0;
+
+    // 获取页面（不存在时从设备读取）所在的物理页并增加一个引用，供用户地址空间直接映射；
+    // 映射解除时由put_page归还引用。有映射的页面不会被淘汰。页大小不是PAGE_SIZE时返回0
+    virtual uint32_t map_page(const PageKey& key) = 0;
+    // 与map_page相同，但页面不在缓存中时直接返回0，不从设备读取
+    virtual uint32_t map_cached_page(const PageKey& key) = 0;
 
     // 读页内容（页内偏移+长度），返回实际读取字节数
     virtual size_t read_page(const PageKey& key, size_t offset, void* buf, size_t size) = 0;
@@ -43,8 +56,8 @@ public:
     // 刷新所有脏页
     virtual void flush_all() = 0;
 
-    // 失效（移除）某页，必要时可先flush
-    virtual void invalidate(const PageKey& key) = 0;
+    // 失效（移除）某页，必要时可先flush；页面正被固定时不移除，返回false
+    virtual bool invalidate(const PageKey& key) = 0;
 
     // 清空所有缓存（必要时flush所有脏页）
     virtual void clear() = 0;
@@ -62,6 +75,8 @@ struct HashListNode {
     PageKey key;
     Page value;
     HashListNode* next;
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 
 class HashList {
@@ -80,6 +95,10 @@ public:
     template<typename Func>
     void for_each(Func f);
 
+    // 删除最多max_count个满足条件的元素，pred返回true的元素会被删除，返回删除的个数
+    template<typename Pred>
+    size_t erase_if(Pred pred, size_t max_count);
+
 private:
     size_t bucket_count_;
     size_t size_;
@@ -1,6 +1,7 @@
 #pragma once
 #include "../../lib/mutex.h"
 #include "kernel/fs/PageCache.h"
+#include "kernel/shrinker.h"
 
 class SimplePageCache : public PageCache {
 public:
@@ -9,21 +10,35 @@ public:
 
     bool exists(const PageKey& key) const override;
     Page* get_page(const PageKey& key) override;
+    void put_page(Page* page) override;
+    uint32_t map_page(const PageKey& key) override;
+    uint32_t map_cached_page(const PageKey& key) override;
     size_t read_page(const PageKey& key, size_t offset, void* buf, size_t size) override;
     size_t write_page(const PageKey& key, size_t offset, const void* buf, size_t size) override;
     void mark_dirty(const PageKey& key) override;
     bool flush(const PageKey& key) override;
     void flush_all() override;
-    void invalidate(const PageKey& key) override;
+    bool invalidate(const PageKey& key) override;
     void clear() override;
     size_t page_count() const override;
     void set_max_pages(size_t max_pages) override;
 
 private:
+    // 淘汰最多nr个干净页，调用者需持有mtx_，返回淘汰的页数
+    size_t evict(size_t nr);
+    // 查找页面，不存在时从设备读取，调用者需持有mtx_
+    Page* lookup_or_read(const PageKey& key);
+    // 固定和解除固定页面，调用者需持有mtx_
+    void pin(Page* page);
+    void unpin(Page* page);
+    // 脏页写回设备，调用者需持有mtx_，写回失败时保持脏标记
+    bool writeback(const PageKey& key, Page& page);
+
     size_t page_size_;
     size_t max_pages_;
     kernel::BlockDevice *dev_;
     mutable kernel::Mutex mtx_;
     HashList cache_;
+    kernel::Shrinker shrinker_; // 内存紧张时淘汰干净页
 };
 
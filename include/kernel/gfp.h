@@ -0,0 +1,20 @@
+#pragma once
+#include <cstdint>
+
+// 页面分配标志（gfp_mask）
+// 默认的内核分配不带任何标志
+constexpr uint32_t GFP_KERNEL = 0;
+
+// 冷页：调用者不会马上访问页面内容（如DMA缓冲、页缓存预读），
+// 优先从每CPU缓存的冷端取页，把热页留给需要立即写入的分配
+constexpr uint32_t __GFP_COLD = 1u << 0;
+
+// 不允许直接回收：调用者持有分配器内部的锁（如slab缓存锁），
+// 在分配路径上调用收缩器可能重入同一把锁，只唤醒kswapd在后台回收
+constexpr uint32_t __GFP_NORECLAIM = 1u << 1;
+
+// 返回清零的页面：order为0时优先从空闲时预先清零的页面池中取
+constexpr uint32_t __GFP_ZERO = 1u << 2;
+
+// 需要物理连续的内存（DMA缓冲区等）：大块kmalloc分配失败时不回退到vmalloc
+constexpr uint32_t __GFP_DMA = 1u << 3;
@@ -1,6 +1,10 @@
 #pragma once
 #include "arch/x86/paging.h"
+#include "kernel/gfp.h"
+#include "kernel/kmap.h"
+#include "kernel/rmap.h"
 #include "kernel/virtual_memory_tree.h"
+#include "kernel/zero_page_pool.h"
 #include "kernel/zone.h"
 #include "slab_allocator.h"
 #include <cstdint>
@@ -14,32 +18,80 @@ public:
     // 构造函数
     KernelMemory();
     PageManager& paging() { return page_manager; }
+    kernel::SlabAllocator& slab() { return slab_allocator; }
+    kernel::ReverseMap& rmap() { return reverse_map; }
 
     // 初始化内核内存管理
     void init();
 
     // 分配虚拟内存
-    VADDR kmalloc(uint32_t size);
+    VADDR kmalloc(uint32_t size, uint32_t gfp_mask = GFP_KERNEL);
     void kfree(VADDR addr);
+    // 调整kmalloc/vmalloc分配的大小，能原地扩展时不复制，失败返回nullptr且原内存不变
+    VADDR krealloc(VADDR addr, uint32_t new_size);
     VADDR vmalloc(uint32_t size);
     void vfree(VADDR addr);
+    // vmalloc分配的大小（按页取整），addr不是vmalloc分配的起始地址时返回0
+    uint32_t vmalloc_size(VADDR addr);
+    // 原地调整vmalloc区域的大小，后面的虚拟地址空间被占用或物理页不足时返回false
+    bool vresize(VADDR addr, uint32_t new_size);
+    static bool is_vmalloc_addr(const void* addr)
+    {
+        return (uint32_t)addr >= VMALLOC_START && (uint32_t)addr < VMALLOC_END;
+    }
+    // 持久映射物理页面，可以跨越调度持有，不能在中断中使用
     VADDR kmap(PADDR phys_addr);
     void kunmap(VADDR addr);
+    // 每CPU的临时映射，持有期间关中断，必须按相反顺序解除
+    VADDR kmap_atomic(PADDR phys_addr) { return kmap_area.kmap_atomic(phys_addr); }
+    void kunmap_atomic(VADDR addr) { kmap_area.kunmap_atomic(addr); }
 
-    // 分配物理页面
+    // 分配物理页面，gfp_mask带__GFP_ZERO时返回清零的页面
     PADDR alloc_pages(uint32_t gfp_mask, uint32_t order);
     void free_pages(PADDR phys_addr, uint32_t order);
+    // 分配恰好nr_pages个连续页面，向上取整到2的幂多出的尾部立即归还伙伴系统
+    PADDR alloc_pages_exact(uint32_t gfp_mask, uint32_t nr_pages);
+    void free_pages_exact(PADDR phys_addr, uint32_t nr_pages);
+    // 把alloc_pages_exact得到的nr_pages个页面原地扩展到new_pages个，后面的页面不空闲时返回false
+    bool extend_pages_exact(PADDR phys_addr, uint32_t nr_pages, uint32_t new_pages);
     void decrement_ref_count(PADDR physAddr);
     void increment_ref_count(PADDR physAddr);
 
+    // 获取物理页面的描述符，不属于任何区域时返回nullptr
+    page* phys_to_page(PADDR phys_addr);
+
     // 地址转换
     PADDR virt2Phys(VADDR virt_addr);
     VADDR phys2Virt(PADDR phys_addr);
     PFN getPfn(VADDR virt_addr);
 
+    // 打印内存分配器统计信息
+    void print_stats();
+
+    // 回收各区域的缓存直到空闲页回到WMARK_HIGH，返回回收的页数
+    uint32_t balance_zones();
+    // 空闲页是否已低于WMARK_LOW
+    bool low_on_memory();
+
+    // 由idle任务调用，在空闲时补充一批预清零页面
+    void refill_zero_pages();
+
+    // 全局共享的只读零页，匿名页的读缺页都映射到这里；
+    // 每个映射持有一个引用，init时的引用永不释放，所以它不会回到伙伴系统
+    PADDR zero_page() const { return zero_page_phys; }
+
 private:
     // 根据大小选择合适的内存区域
     Zone* get_zone_for_allocation(uint32_t size);
+    // 页帧所属的区域
+    Zone* zone_of(uint32_t pfn);
+
+    // VMALLOC区域的页表是连续的，返回vaddr对应的PTE
+    uint32_t* vmalloc_pte(uint32_t vaddr);
+    // 为[vaddr, vaddr + pages页)分配物理页面并建立映射，失败时撤销已建立的映射
+    bool vmalloc_map(uint32_t vaddr, uint32_t pages);
+    // 解除映射并释放物理页面
+    void vmalloc_unmap(uint32_t vaddr, uint32_t pages);
 
     // 内存区域
     Zone dma_zone;                  // DMA区域
@@ -47,5 +99,9 @@ private:
     Zone high_zone;                 // 高端区域
     PageManager page_manager;       // 页表管理器
     kernel::SlabAllocator slab_allocator;
+    ZeroPagePool zero_pool;         // 预清零页面池
+    PADDR zero_page_phys;           // 共享零页
+    kernel::ReverseMap reverse_map; // 可迁移页的反向映射，供内存规整使用
     VirtualMemoryTree vmalloc_tree; // 虚拟内存树
+    KmapArea kmap_area;             // 高端内存的临时映射
 };
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+#include "arch/x86/paging.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include <cstdint>
+
+// KMAP区域（KMAP_START ~ KMAP_END）的临时映射，用于访问不在直接映射区的物理页（HIGH_ZONE）
+// 区域前部是每个CPU的原子映射槽，其余是持久映射池；页表在启动时建好，被所有页目录共享。
+// 直接映射区内的物理页不占用映射，直接返回直接映射地址
+//
+// 原子映射（kmap_atomic）：每个CPU一小段槽位按栈使用，映射期间关中断，任务不会迁移到其他CPU，
+// 中断处理函数中也可以使用。槽位只会在本CPU上访问，解除映射时只需要本地invlpg。
+//
+// 持久映射（kmap）：可以跨越调度长期持有，不能在中断中使用。引用计数归零时不立即解除映射，
+// 同一物理页再次kmap时直接复用；分配指针绕回池的开头时才一次性清除所有未使用的表项，
+// 合并成一次跨CPU的TLB刷新
+class KmapArea
+{
+public:
+    // 每个CPU的原子映射槽数，即kmap_atomic的最大嵌套深度
+    static constexpr uint32_t ATOMIC_SLOTS = 16;
+    static constexpr uint32_t ATOMIC_START = MemoryConstants::KMAP_START;
+    static constexpr uint32_t ATOMIC_END = ATOMIC_START + MAX_CPUS * ATOMIC_SLOTS * PAGE_SIZE;
+    static constexpr uint32_t POOL_START = ATOMIC_END;
+    static constexpr uint32_t POOL_ENTRIES = (MemoryConstants::KMAP_END - POOL_START) / PAGE_SIZE;
+
+    void init();
+
+    // 映射一个物理页，返回的地址保留phys的页内偏移；必须按相反的顺序调用kunmap_atomic
+    void* kmap_atomic(PADDR phys);
+    void kunmap_atomic(void* addr);
+
+    // 持久映射，池中没有空闲表项时返回nullptr
+    void* kmap(PADDR phys);
+    void kunmap(void* addr);
+
+    static bool is_kmap_addr(const void* addr)
+    {
+        return (uint32_t)addr >= MemoryConstants::KMAP_START &&
+               (uint32_t)addr < MemoryConstants::KMAP_END;
+    }
+
+    // KMAP区域地址对应的物理地址，没有映射时返回0
+    static PADDR translate(const void* addr);
+
+    void print_stats();
+
+private:
+    static constexpr uint32_t HASH_BUCKETS = 256;
+    static constexpr uint16_t NO_ENTRY = 0xFFFF;
+    // count的特殊取值：0空闲，1已解除引用但表项仍有效，n>1表示有n-1个使用者
+    static constexpr uint16_t FLUSHING = 0xFFFF; // 表项已清除，等待TLB刷新完成
+
+    struct AtomicStack {
+        uint32_t depth;
+        uint32_t saved_flags[ATOMIC_SLOTS]; // 每层映射前的EFLAGS
+    };
+
+    // KMAP区域的页表是连续的，返回vaddr对应的PTE
+    static uint32_t* pte_of(uint32_t vaddr);
+    static uint32_t pool_vaddr(uint32_t idx) { return POOL_START + idx * PAGE_SIZE; }
+    uint16_t* bucket(uint32_t pfn) { return &buckets[pfn % HASH_BUCKETS]; }
+    void hash_remove(uint32_t idx);
+    // 清除所有引用计数为1的表项并批量刷新TLB，返回清除的表项数；调用者持有lock，返回时仍持有
+    uint32_t flush_unused(uint32_t& flags);
+
+    AtomicStack atomic[MAX_CPUS];
+
+    uint32_t pfns[POOL_ENTRIES];     // 表项映射的页帧号
+    uint16_t count[POOL_ENTRIES];    // 引用计数，取值见上
+    uint16_t next[POOL_ENTRIES];     // 哈希链
+    uint16_t buckets[HASH_BUCKETS];  // 页帧号 -> 表项
+    uint32_t cursor;                 // 上一次分配的表项，从它的下一项开始查找
+    bool flushing;                   // 有CPU正在批量清除，FLUSHING状态的表项属于它
+    SpinLock lock;                   // 保护持久映射池
+
+    // 统计信息
+    uint32_t atomic_maps;  // kmap_atomic建立的映射数
+    uint32_t pool_maps;    // 持久映射新建立的表项数
+    uint32_t pool_reused;  // 命中仍有效表项、不需要改页表的kmap次数
+    uint32_t pool_flushes; // 绕回时的批量刷新次数
+    uint32_t pool_cleared; // 批量刷新清除的表项数
+};
@@ -1,31 +1,71 @@
 #pragma once
 
+#include <arch/x86/paging.h>
+#include <kernel/slab_allocator.h>
 #include <kernel/vfs.h>
+#include <lib/mutex.h>
 #include <stddef.h>
 #include <cstdint>
 
 namespace kernel
 {
 
+class MemFS;
+
+/**
+ * @brief 文件数据页的基数树
+ * 与页表相同，每个节点是一个4KB页面，有1024个槽位：一层覆盖4MB，两层覆盖整个32位文件偏移。
+ * 叶子槽位保存数据页的物理地址，0表示空洞，读出全零；写入空洞时才分配页面。
+ * 数据页的引用计数由树和用户映射共同持有，mmap可以直接映射这些页面
+ */
+class MemFSPageTree
+{
+public:
+    static constexpr uint32_t SLOTS = PAGE_SIZE / sizeof(uint32_t);
+
+    // 文件第index页的物理地址，空洞返回0
+    PADDR lookup(uint32_t index) const;
+    // 文件第index页的物理地址，空洞时分配清零页面；内存不足返回0
+    PADDR get_or_alloc(uint32_t index);
+    // 释放所有节点，数据页只减少引用计数，仍被映射的页面在解除映射时释放
+    void clear();
+    uint32_t nr_pages() const { return pages; }
+
+private:
+    static uint32_t* slots(PADDR node);
+    static void release_leaf(PADDR leaf);
+
+    PADDR root = 0;      // 根节点的物理地址
+    uint32_t height = 0; // 0为空树，1时根是叶子节点，2时根的槽位指向叶子节点
+    uint32_t pages = 0;  // 已分配的数据页数
+};
+
 // 内存文件系统的文件节点
+// lock保护pages、size、refs和unlinked；目录结构（parent、children、next）由MemFS::tree_lock保护，
+// 同时需要两把锁时先取tree_lock。复制文件数据时只持有数据页的引用，不持有lock，
+// 用户缓冲区缺页时可以再进入同一个节点
 struct MemFSInode {
     char name[256];       // 文件名
     FileType type;        // 文件类型
     uint32_t mode;        // 文件权限
-    uint8_t* data;        // 文件数据
+    MemFSPageTree pages;  // 文件数据
     size_t size;          // 文件大小
-    size_t capacity;      // 数据缓冲区容量
+    uint32_t refs;        // 打开的文件描述符和文件映射持有的引用数
+    bool unlinked;        // 已从目录中删除，最后一个引用释放时再释放节点
+    Mutex lock;
     MemFSInode* parent;   // 父目录
     MemFSInode* children; // 子文件/目录列表
     MemFSInode* next;     // 同级节点链表
     void print();
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 
 // 内存文件系统的文件描述符
 class MemFSFileDescriptor : public FileDescriptor
 {
 public:
-    MemFSFileDescriptor(MemFSInode* inode);
+    MemFSFileDescriptor(MemFS* fs, MemFSInode* inode);
     virtual ~MemFSFileDescriptor();
 
     virtual ssize_t read(void* buffer, size_t size) override;
@@ -33,15 +73,39 @@ public:
     virtual int seek(size_t offset) override;
     virtual int close() override;
     virtual int iterate(void* buffer, size_t buffer_size, uint32_t* pos) override;
+    // 把文件的数据页直接映射到用户空间，不复制
+    void* mmap(void* addr, size_t length, int prot, int flags, size_t offset) override;
 
 private:
+    MemFS* fs;
     MemFSInode* inode;
     size_t offset;
 };
 
+// mmap的文件映射，缺页时直接返回节点中的数据页
+class MemFSFileMapping : public FileMapping
+{
+public:
+    explicit MemFSFileMapping(MemFSInode* inode);
+    ~MemFSFileMapping() override;
+
+    uint32_t get_page(uint32_t pgoff) override;
+    // 空洞不分配页面
+    uint32_t find_page(uint32_t pgoff) override;
+    // 数据都在内存中，预取没有意义；不能用get_page，它会给空洞分配页面
+    bool prefetch(uint32_t) override { return false; }
+    // 数据本身就在内存中，不需要写回
+    void set_page_dirty(uint32_t) override {}
+
+private:
+    MemFSInode* inode;
+};
+
 // 内存文件系统
 class MemFS : public FileSystem
 {
+    friend class MemFSFileDescriptor;
+
 public:
     MemFS();
     virtual ~MemFS();
@@ -64,6 +128,7 @@ public:
 
 private:
     MemFSInode* root; // 根目录节点
+    Mutex tree_lock;  // 保护目录树的结构
 
     // 查找文件节点
     MemFSInode* find_inode(const char* path);
@@ -71,7 +136,7 @@ private:
     // 创建新节点
     MemFSInode* create_inode(const char* name, FileType type);
 
-    // 释放节点及其所有子节点
+    // 释放节点及其所有子节点，仍被引用的节点推迟到最后一个引用释放时，调用者需持有tree_lock
     void free_inode(MemFSInode* inode);
 };
 
@@ -0,0 +1,13 @@
+#pragma once
+
+// 内存管理微基准测试，结果通过log_info输出。
+// 只在配置了-DMM_BENCHMARK=ON（定义CONFIG_MM_BENCHMARK）时由启动流程调用
+
+// 伙伴系统：各order的分配/释放平均周期数，以及改造前PageInfo逐页维护元数据的开销
+void run_buddy_benchmark();
+
+// slab分配器：各大小级别的分配/释放吞吐量和内存开销
+void run_slab_benchmark();
+
+// 写时复制fork：不同地址空间大小下复制和释放地址空间的周期数
+void run_fork_benchmark();
@@ -72,6 +72,8 @@ namespace kernel
 class FileDescriptor;
 }
 
+struct SpawnFileAction;
+
 // 进程控制块结构
 #define DEBUG_STATUS_HALT 1 << 0
 #define DEFAULT_TIME_SLICE 100
@@ -100,6 +102,10 @@ struct Task {
     int allocUserStack();
 
     int cpu = -1;
+    void* kernel_arg = nullptr; // 内核线程入口函数的参数
+    bool off_runqueue = false;  // 处于PROCESS_WAITING且已被调度器移出运行队列
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 struct Context {
     uint32_t context_id;
@@ -113,8 +119,13 @@ struct Context {
 
     int allocate_fd();
     void print();
-    void cloneMemorySpace(Context *source);
+    // 以写时复制方式复制source的地址空间，失败返回-1
+    int cloneMemorySpace(Context *source);
+    // 释放用户空间的页面、页表和页目录
+    void releaseMemorySpace();
     void cloneFiles(Context *source);
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 
 
@@ -138,6 +149,10 @@ public:
     static Task* kernel_task(
         Context* ctx, const char* name, uint32_t entry, uint32_t argc, char* argv[]);
     static int fork();
+    // 从可执行文件直接创建进程：新地址空间只包含内核映射，开销与父进程大小无关。
+    // path、actions以及其中的路径都是当前进程的用户空间地址
+    static int spawn(
+        const char* user_path, const SpawnFileAction* user_actions, uint32_t nactions);
     static Task* get_current_task();
     // static int32_t execute_process(const char* path);
     static bool schedule(); // false for no more processes
@@ -150,6 +165,11 @@ public:
 
     // static void cloneMemory(ProcessControlBlock* pcb);
     static void sleep_current_process(uint32_t ticks);
+    // 当前任务睡眠直到*flag非0：状态置为PROCESS_WAITING，下一次调度时移出运行队列。
+    // 调用者需开着中断；设置flag的一方随后调用wake_task
+    static void sleep_until(volatile uint32_t* flag);
+    // 唤醒处于PROCESS_WAITING的任务，已经移出运行队列时重新入队，可以在任意上下文调用
+    static void wake_task(Task* task);
     static Context* kernel_context;
     static struct Debug
     {
@@ -0,0 +1,78 @@
+#pragma once
+#include "arch/x86/paging.h"
+#include "arch/x86/spinlock.h"
+#include <cstdint>
+
+namespace kernel {
+
+class Mutex;
+class SlabCache;
+
+// 反向映射：物理页 -> 使用者
+// 内存规整时需要知道一个物理页被谁引用，才能把内容搬到新页后修改引用
+enum class RmapType : uint32_t {
+    ANON,       // 用户匿名页，由某个页目录中的一个PTE映射
+    PAGE_CACHE, // 页缓存页，由页缓存中的一个数据指针引用
+};
+
+struct RmapEntry {
+    uint32_t pfn;
+    RmapType type;
+    union {
+        struct {
+            PADDR pgd_phys; // 映射该页的页目录
+            uint32_t vaddr; // 用户虚拟地址
+            SpinLock* ptl;  // 该地址空间的页表锁，迁移时用try_acquire获取
+        } anon;
+        struct {
+            void** ref;  // 指向页缓存中保存数据地址的指针
+            Mutex* lock; // 保护ref的锁，迁移时用tryLock获取
+        } cache;
+    };
+    RmapEntry* next;
+};
+
+class ReverseMap
+{
+public:
+    void init();
+
+    // 记录匿名页的映射，已有记录时覆盖；ptl是修改该页目录中表项时持有的锁
+    void add_anon(PADDR phys, PADDR pgd_phys, uint32_t vaddr, SpinLock* ptl);
+    // 匿名页解除映射时调用，只删除与(pgd, vaddr)匹配的记录
+    void remove_anon(PADDR phys, PADDR pgd_phys, uint32_t vaddr);
+
+    // 记录页缓存页，*ref是该页在直接映射区的虚拟地址
+    void add_cache(PADDR phys, void** ref, Mutex* lock);
+    void remove_cache(PADDR phys);
+
+    /**
+     * @brief 把old_phys的内容迁移到new_phys，并修改唯一的引用者
+     * 页面被共享（引用计数>1）、记录已失效、引用者的锁被占用、
+     * 或者映射该页的页目录正在其他CPU上使用时返回false，此时old_phys保持不变
+     * @return 迁移成功返回true，调用者负责释放old_phys
+     */
+    bool migrate(PADDR old_phys, PADDR new_phys);
+
+    uint32_t size() const { return nr_entries; }
+
+private:
+    static constexpr uint32_t HASH_BUCKETS = 1024;
+
+    RmapEntry** bucket(uint32_t pfn) { return &buckets[pfn % HASH_BUCKETS]; }
+    RmapEntry* find(uint32_t pfn);
+    RmapEntry* add(PADDR phys, RmapType type, RmapEntry** spare);
+    void remove(uint32_t pfn);
+    uint32_t* anon_pte(PADDR pgd_phys, uint32_t vaddr);
+    // 持有页面所有者的锁之后再确认页面仍然只有一个引用且可迁移
+    static bool still_exclusive(PADDR phys);
+    bool migrate_anon(RmapEntry* entry, PADDR old_phys, PADDR new_phys);
+    bool migrate_cache(RmapEntry* entry, PADDR old_phys, PADDR new_phys);
+
+    RmapEntry* buckets[HASH_BUCKETS];
+    uint32_t nr_entries;
+    SpinLock lock; // 保护哈希表
+    SlabCache* entry_cache;
+};
+
+} // namespace kernel
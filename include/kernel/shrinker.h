@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+
+namespace kernel {
+
+// 收缩器：缓存了内存的子系统（slab、页缓存等）注册回调，
+// 内存紧张时由kswapd或分配路径上的直接回收调用
+struct Shrinker {
+    const char* name;
+    // 返回当前可回收的页数估计
+    uint32_t (*count)(Shrinker* shrinker);
+    // 尝试回收最多nr_pages个页，返回实际释放的页数
+    // 回调不能睡眠，也不能阻塞等待自己子系统的锁（用try-lock，拿不到就返回0）
+    uint32_t (*scan)(Shrinker* shrinker, uint32_t nr_pages);
+    void* priv; // 回调的私有数据
+
+    // 以下字段由注册表维护
+    Shrinker* next;
+    uint32_t scan_seq; // 最近一次被哪一轮shrink_caches调用过
+    uint32_t nr_scans; // 被调用的次数
+    uint32_t nr_freed; // 累计释放的页数
+};
+
+void register_shrinker(Shrinker* shrinker);
+// 注销收缩器，它的回调正在运行时等待回调返回；不能在回调中调用
+void unregister_shrinker(Shrinker* shrinker);
+
+/**
+ * @brief 依次调用所有收缩器，直到释放nr_pages个页或没有可回收的内容
+ * 同一时刻只允许一个回收者，其他调用者直接返回0。
+ * 回调在不持有注册表锁、不改变中断状态的情况下运行
+ * @param nr_pages 期望释放的页数
+ * @return 实际释放的页数
+ */
+uint32_t shrink_caches(uint32_t nr_pages);
+
+// 空闲页低于WMARK_LOW时唤醒kswapd，可以在任意上下文调用
+void wakeup_kswapd();
+
+// kswapd内核线程入口：没有唤醒请求时睡眠，被唤醒后回收内存直到所有区域回到WMARK_HIGH
+void kswapd_entry();
+
+// 打印各收缩器的统计信息
+void print_shrinker_stats();
+
+} // namespace kernel
@@ -3,6 +3,12 @@
 #include <stddef.h>
 #include <cstdint>
 
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "kernel/gfp.h"
+#include "kernel/list.h"
+#include "kernel/shrinker.h"
+
 namespace kernel {
 
 // Slab对象描述符
@@ -12,64 +18,226 @@ struct SlabObject {
 };
 
 // Slab页描述符
-struct SlabCache;
+// 小对象的描述符放在slab页的开头；大对象使用off-slab描述符，单独从slab_desc缓存分配，
+// 两种情况下slab页的页面描述符都带PG_SLAB标志并通过private_指向Slab
+class SlabCache;
 struct Slab {
     void* objects;     // 对象数组的起始地址
     size_t inuse;      // 已使用的对象数量
     size_t free;       // 空闲对象数量
     SlabObject* freelist;  // 空闲对象链表
-    Slab* next;        // 链表中的下一个slab
+    list_head list;    // 挂在所属缓存的full/partial/free链表上
     SlabCache* cache;  // 指向所属的SlabCache
+    void* page;        // slab页的起始虚拟地址
+    uint32_t colour;   // 本slab的着色偏移（字节）
     void print() const;
 };
 
+// 对象构造函数，每次从缓存分配对象时调用
+using SlabCtor = void (*)(void* obj);
+
+// 弹匣（magazine）：每CPU缓存的一组对象指针（Bonwick）
+static constexpr uint32_t MAGAZINE_SIZE = 15;
+struct Magazine {
+    uint32_t rounds;           // 当前持有的对象数量
+    Magazine* next;            // depot链表中的下一个弹匣
+    void* objs[MAGAZINE_SIZE]; // 对象指针栈
+};
+
+// 每CPU弹匣层：loaded为当前使用的弹匣，previous为上一个（总是满或空）。
+// 统计计数只在本CPU关中断时修改，读取时把各CPU的值相加
+struct CpuCache {
+    Magazine* loaded;
+    Magazine* previous;
+    uint32_t alloc_hits;   // 分配命中弹匣的次数
+    uint32_t free_hits;    // 释放命中弹匣的次数
+    uint32_t depot_allocs; // 从depot取满弹匣的次数
+    uint32_t depot_frees;  // 向depot交还满弹匣的次数
+    uint32_t slab_allocs;  // 弹匣未命中、回退到slab层分配的次数
+    uint32_t slab_frees;   // 弹匣未命中、回退到slab层释放的次数
+};
+
 // Slab缓存
 class SlabCache {
 public:
     SlabCache();
-    SlabCache(const char* name, size_t size, size_t align = 8);
+    SlabCache(const char* name, size_t size, size_t align = 8, bool use_magazines = true,
+              SlabCtor ctor = nullptr);
     ~SlabCache();
 
-    // 分配和释放对象
+    // 分配和释放对象，常见路径只访问本CPU的弹匣，不获取共享锁
     void* alloc();
     void free(void* ptr);
 
+    // 弹匣使用的缓存，由SlabAllocator::init设置
+    static SlabCache* magazine_cache;
+    // off-slab描述符使用的缓存，由SlabAllocator::init设置
+    static SlabCache* slab_desc_cache;
+    // 对象大小达到该值时使用off-slab描述符
+    static constexpr size_t OFF_SLAB_MIN_SIZE = 512;
+    // 着色步长，按缓存行错开不同slab中对象的起始位置
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
     // 创建和销毁slab
     Slab* create_slab();
     void destroy_slab(Slab* slab);
 
+    // 根据对象地址找到所属的slab，不是slab对象时返回nullptr
+    static Slab* slab_of(const void* ptr);
+
     // 打印缓存信息
     void print() const;
+    // 打印一行使用情况汇总
+    void report();
+
+    // 回收depot和本CPU弹匣中的对象以及空闲slab，返回释放的页数
+    uint32_t shrink(uint32_t nr_pages);
+    // 完全空闲、可以立即释放的slab数量，锁被占用时返回0
+    uint32_t reclaimable();
+
+    const char* get_name() const { return name; }
+    size_t get_object_size() const { return object_size; }
+    size_t get_objects_per_slab() const { return objects_per_slab; }
+    bool is_off_slab() const { return off_slab; }
 
 private:
+    friend class SlabAllocator;
+
     char name[32];      // 缓存名称
-    size_t object_size;    // 对象大小
+    size_t object_size;    // 对象大小（已按对齐要求向上取整）
     size_t object_align;   // 对象对齐要求
     size_t objects_per_slab;  // 每个slab中的对象数量
+    size_t objects_offset;    // 第一个对象相对slab页起始的偏移（不含着色）
+    bool off_slab;            // slab描述符是否放在页外
+    uint32_t colour_range;    // 可用着色数量（剩余空间 / CACHE_LINE_SIZE + 1）
+    uint32_t colour_next;     // 下一个新建slab使用的着色序号
+    SlabCtor ctor;            // 可选的对象构造函数
+    SlabCache* next_cache;    // SlabAllocator中的缓存链表
+
+    // 使用情况统计，由lock保护
+    uint32_t nr_slabs;        // slab数量
+    uint32_t active_objs;     // slab层已分配出去的对象数（含弹匣中缓存的对象）
 
-    Slab* slabs_full;      // 完全使用的slab链表
-    Slab* slabs_partial;   // 部分使用的slab链表
-    Slab* slabs_free;      // 完全空闲的slab链表
+    list_head slabs_full;      // 完全使用的slab链表
+    list_head slabs_partial;   // 部分使用的slab链表
+    list_head slabs_free;      // 完全空闲的slab链表
+    SpinLock lock;             // 保护slab链表
+
+    // slab层的分配与释放，调用者需持有lock
+    void* slab_alloc();
+    void slab_free(void* ptr);
+
+    // 弹匣层
+    bool use_magazines;
+    CpuCache cpu_cache[MAX_CPUS];
+
+    // depot：全局的满弹匣和空弹匣链表
+    SpinLock depot_lock;
+    Magazine* depot_full;
+    Magazine* depot_empty;
+    uint32_t depot_full_count;
+    uint32_t depot_empty_count;
+    // 获取depot_lock时发生竞争的次数，多个CPU可能同时更新，用原子加
+    uint32_t depot_contended;
+
+    void depot_acquire();
+    Magazine* depot_get(Magazine** list, uint32_t* count);
+    void depot_put(Magazine** list, uint32_t* count, Magazine* mag);
+    // 把所有弹匣中的对象还给slab层并释放弹匣
+    void flush_magazines();
+    uint32_t magazine_rounds();
 };
 
 // Slab分配器
 class SlabAllocator {
 public:
     void init();
-    void* kmalloc(size_t size);
+    /**
+     * @brief 分配内存，大于2048字节时按实际页数分配连续页面，
+     * 失败且没有__GFP_DMA时回退到vmalloc
+     */
+    void* kmalloc(size_t size, uint32_t gfp_mask = GFP_KERNEL);
     void kfree(void* ptr);
+    /**
+     * @brief 调整已分配内存的大小，原对象放得下或后面的页面空闲时原地扩展，
+     * 否则分配新内存并复制
+     * @return 新地址，失败返回nullptr，此时ptr保持有效
+     */
+    void* krealloc(void* ptr, size_t new_size);
     SlabAllocator();
     ~SlabAllocator();
 
+    // 创建/销毁专用对象缓存
+    SlabCache* create_cache(const char* name, size_t size, size_t align, SlabCtor ctor);
+    void destroy_cache(SlabCache* cache);
+    // 首次使用时创建缓存，*slot非空时直接返回
+    SlabCache* get_cache(SlabCache** slot, const char* name, size_t size, size_t align);
+    // 打印所有缓存的使用情况
+    void print_caches();
+
+    // 回收所有缓存中的空闲slab，返回释放的页数
+    uint32_t shrink(uint32_t nr_pages);
+    // 把slab层注册为收缩器，在init之后调用
+    void register_shrinker();
+
 private:
+    Shrinker shrinker;             // 内存回收时由kswapd/直接回收调用
+    SlabCache* cache_list;         // 所有缓存组成的链表
+    SpinLock cache_list_lock;      // 保护cache_list
+    SlabCache _cache_cache;        // SlabCache对象本身使用的缓存
+    void register_cache(SlabCache* cache);
+
 
     // 通用缓存数组，支持8字节到4KB的对象
     static constexpr size_t NUM_GENERAL_CACHES = 9;
     SlabCache *general_caches[NUM_GENERAL_CACHES];
     SlabCache _general_caches[NUM_GENERAL_CACHES]; // memory
+    SlabCache _magazine_cache; // 弹匣本身使用的缓存，不带弹匣层
+    SlabCache _slab_desc_cache; // off-slab描述符使用的缓存，不带弹匣层
 
     // 获取合适大小的通用缓存
     SlabCache* get_general_cache(size_t size);
+
+    // 大块分配：连续页面分配失败时，不小于该大小的请求回退到vmalloc
+    static constexpr size_t VMALLOC_FALLBACK_SIZE = 64 * 1024;
+    void* kmalloc_large(size_t size, uint32_t gfp_mask);
+    void* krealloc_large(void* ptr, size_t new_size, size_t& old_size);
+
+    // 大块分配统计，多个CPU可能同时更新，用原子加
+    uint32_t large_allocs;      // 按页分配的次数
+    uint32_t vmalloc_fallbacks; // 回退到vmalloc的次数
+    uint32_t realloc_inplace;   // krealloc原地完成的次数
+    uint32_t realloc_copied;    // krealloc分配新内存并复制的次数
 };
 
-} // namespace kernel
\ No newline at end of file
+// 专用对象缓存接口
+SlabCache* kmem_cache_create(const char* name, size_t size, size_t align = 8,
+                             SlabCtor ctor = nullptr);
+void kmem_cache_destroy(SlabCache* cache);
+void* kmem_cache_alloc(SlabCache* cache);
+void kmem_cache_free(SlabCache* cache, void* obj);
+
+} // namespace kernel
+
+// 在类定义中声明类专属的new/delete，使该类型的对象分配自专用缓存。
+// new声明为noexcept：分配失败时返回nullptr，编译器在调用构造函数前检查返回值
+#define DECLARE_SLAB_CACHE_OPERATORS()                  \
+    static void* operator new(size_t size) noexcept;    \
+    static void operator delete(void* ptr)
+
+// 在cpp中定义类专属的new/delete，缓存在第一次分配时创建；
+// 派生类大小不同，回退到kmalloc，delete统一交给kfree按slab描述符找到所属缓存
+#define DEFINE_SLAB_CACHE_OPERATORS(type, cache_name)                                   \
+    static kernel::SlabCache* type##_cache = nullptr;                                  \
+    void* type::operator new(size_t size) noexcept                                     \
+    {                                                                                  \
+        if (size != sizeof(type)) {                                                    \
+            return Kernel::instance().kernel_mm().kmalloc(size);                       \
+        }                                                                              \
+        return kernel::kmem_cache_alloc(Kernel::instance().kernel_mm().slab().get_cache( \
+            &type##_cache, cache_name, sizeof(type), alignof(type)));                  \
+    }                                                                                  \
+    void type::operator delete(void* ptr)                                              \
+    {                                                                                  \
+        ::operator delete(ptr);                                                        \
+    }
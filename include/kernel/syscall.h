@@ -27,8 +27,27 @@ enum SyscallNumber {
     SYS_PWD = 18,
     SYS_GETCWD = 19,
     SYS_MMAP = 20,
+    SYS_SPAWN = 21,
+    SYS_MADVISE = 22,
 };
 
+// spawn的文件操作，在子进程开始执行前依次应用到子进程的文件描述符表
+enum SpawnFileActionType : uint32_t {
+    SPAWN_FA_OPEN = 0,  // 打开path并放到fd
+    SPAWN_FA_CLOSE = 1, // 从子进程中移除fd
+    SPAWN_FA_DUP2 = 2,  // 把fd复制到newfd
+};
+
+struct SpawnFileAction {
+    uint32_t type;
+    int32_t fd;
+    int32_t newfd;
+    const char* path;
+};
+
+#define SPAWN_MAX_FILE_ACTIONS 16
+#define SPAWN_PATH_MAX 256
+
 // 系统调用处理函数类型
 typedef int (*SyscallHandler)(uint32_t, uint32_t, uint32_t, uint32_t);
 
@@ -36,6 +55,7 @@ typedef int (*SyscallHandler)(uint32_t, uint32_t, uint32_t, uint32_t);
 int exitHandler(uint32_t status, uint32_t, uint32_t, uint32_t);
 int execveHandler(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, uint32_t);
 int sys_execve(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, Task *task);
+int spawnHandler(uint32_t path_ptr, uint32_t actions_ptr, uint32_t nactions, uint32_t);
 int getpid_handler(uint32_t a, uint32_t b, uint32_t c, uint32_t d);
 int sys_getpid();
 int statHandler(uint32_t path_ptr, uint32_t attr_ptr, uint32_t, uint32_t);
@@ -52,8 +72,17 @@ int getcwdHandler(uint32_t buf_ptr, uint32_t size, uint32_t, uint32_t);
 int sys_getcwd(char* buf, size_t size);
 
 #define MAP_FAILED -1
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x01  // 文件映射的修改写入页缓存，对映射同一文件的其他进程可见
+#define MAP_PRIVATE 0x02 // 文件映射的修改只对本进程可见（写时复制）
+#define MAP_POPULATE 0x8000 // 映射后立即为整个范围建立页表项，之后访问不再缺页
+#define MAP_HUGE 0x40000 // 匿名映射使用4MB大页，长度向上取整到4MB
 void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset);
 int mmapHandler(uint32_t addr, uint32_t length, uint32_t prot, uint32_t user_buf_p);
+// advice取值见MemoryAdvice
+int sys_madvise(void* addr, size_t length, int advice);
+int madviseHandler(uint32_t addr, uint32_t length, uint32_t advice, uint32_t);
 
 
 // 系统调用管理器
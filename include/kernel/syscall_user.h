@@ -24,6 +24,17 @@ inline int syscall_exec(const char* path, char* const argv[])
     return ret;
 }
 
+// spawn系统调用：直接从可执行文件创建子进程，不复制父进程的地址空间
+inline int syscall_spawn(const char* path, const SpawnFileAction* actions, uint32_t nactions)
+{
+    int ret;
+    asm volatile("int $0x80"
+        : "=a"(ret)
+        : "a"(SYS_SPAWN), "b"(path), "c"(actions), "d"(nactions)
+        : "memory");
+    return ret;
+}
+
 // open系统调用
 inline int syscall_open(const char* path)
 {
@@ -173,6 +184,15 @@ inline void* syscall_mmap(void* addr, size_t length, int prot, int flags, int fd
         : "a"(SYS_MMAP), "b"(addr), "c"(length), "d"(prot), "S"(user_buf));
     return ret;
 }
+inline int syscall_madvise(void* addr, size_t length, int advice)
+{
+    int ret;
+    asm volatile("int $0x80"
+        : "=a"(ret)
+        : "a"(SYS_MADVISE), "b"(addr), "c"(length), "d"(advice)
+        : "memory");
+    return ret;
+}
 }
 
 #endif // SYSCALL_USER_H
\ No newline at end of file
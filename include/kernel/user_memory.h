@@ -1,13 +1,32 @@
 #pragma once
 #include <cstdint>
 #include "arch/x86/paging.h"
+#include "arch/x86/spinlock.h"
+#include "kernel/slab_allocator.h"
+#include "lib/rbtree.h"
 
-// 内存区域描述符
+namespace arch {
+class TlbBatch;
+}
+namespace kernel {
+class FileMapping;
+}
+
+// 内存区域描述符，挂在UserMemory按起始地址排序的红黑树上
 struct MemoryArea {
     uint32_t start_addr; // 起始地址
     uint32_t end_addr;   // 结束地址
     uint32_t flags;      // 访问权限标志
     uint32_t type;       // 区域类型(代码段、数据段、堆、栈等)
+    kernel::FileMapping* file; // 文件映射区域映射的文件（持有一个引用），其他区域为nullptr
+    uint32_t pgoff;            // start_addr对应的文件页号
+    uint32_t advice;           // madvise设置的访问模式：MADV_NORMAL、MADV_RANDOM或MADV_SEQUENTIAL
+
+    kernel::rb_node rb;
+    uint32_t gap_before;  // 与前一个区域（或USER_START）之间的空隙
+    uint32_t subtree_gap; // 子树中最大的gap_before，用于O(log n)查找空闲区域
+
+    DECLARE_SLAB_CACHE_OPERATORS();
 };
 
 // 内存区域类型定义
@@ -17,34 +36,138 @@ enum MemoryAreaType : uint32_t {
     MEM_TYPE_BSS = 2,       // 未初始化数据 (.bss)
     MEM_TYPE_HEAP = 3,      // 堆区域
     MEM_TYPE_STACK = 4,     // 栈区域
-    MEM_TYPE_MMAP_FILE = 5, // 内存映射文件
-    MEM_TYPE_SHARED = 6,    // 共享内存
+    MEM_TYPE_MMAP_FILE = 5, // 内存映射文件（MAP_PRIVATE，写时复制）
+    MEM_TYPE_SHARED = 6,    // 共享内存映射文件（MAP_SHARED，直接映射页缓存页面）
     MEM_TYPE_ANONYMOUS = 7, // 匿名映射
     MEM_TYPE_DEVICE = 8,    // 设备内存映射
     MEM_TYPE_GUARD = 9      // 保护区域（用于栈溢出检测等）
 };
 
+// madvise的访问提示
+enum MemoryAdvice : uint32_t {
+    MADV_NORMAL = 0,     // 默认：文件页读缺页时顺带映射窗口内已缓存的页面
+    MADV_RANDOM = 1,     // 随机访问：不做fault-around和预读
+    MADV_SEQUENTIAL = 2, // 顺序访问：更大的fault-around窗口，主缺页之后预读后面的文件页
+    MADV_WILLNEED = 3,   // 即将访问：立即把范围内的文件页读入页缓存，之后的缺页都是次缺页
+    MADV_DONTNEED = 4,   // 不再需要：立即解除映射并释放页面，再次访问时匿名页重新清零，文件页重新读取
+};
+
+// 缺页统计（每个进程一份）
+// 需要读取文件的是主缺页，其余（分配匿名页、零页、写时复制、页面已在页缓存中）都是次缺页
+struct FaultStats {
+    uint32_t major_faults;  // 主缺页次数
+    uint32_t minor_faults;  // 次缺页次数
+    uint32_t demand_faults; // 首次访问匿名页时分配物理页的次数
+    uint32_t zero_faults;   // 首次读匿名页时映射共享零页的次数
+    uint32_t cow_faults;    // 写时复制的次数
+    uint32_t bad_faults;    // 访问不属于任何区域的地址的次数
+    uint32_t huge_faults;   // 用4MB大页满足的缺页次数
+    uint32_t huge_fallbacks; // 大页区域分配不到4MB连续内存、回退到4KB页的次数
+    uint32_t file_faults;   // 文件映射区域从页缓存取得页面的次数
+    uint32_t dirty_faults;  // 共享文件映射第一次写入页面、标记脏页的次数
+    uint32_t around_pages;  // fault-around顺带映射的已缓存页面数
+};
+
 // 进程虚拟地址空间管理器
+// 匿名区域（栈、堆、mmap、exec的文件缓冲区）分配时只记录区域，
+// 物理页面在第一次访问时由缺页处理分配
 class UserMemory
 {
 public:
-    // 初始化内存管理器
+    // 初始化内存管理器，alloc_page必须返回清零的页面（用于页表和堆）
     void init(PADDR pgd_phys, VADDR page_dir, uint32_t (*alloc_page)(), void (*free_page)(uint32_t),
         void* (*phys_to_virt)(uint32_t));
 
-    // 分配一个新的内存区域
+    // 分配一个新的内存区域，只记录区域，不分配物理页面也不建立页表项
     void* allocate_area(uint32_t size, uint32_t flags, uint32_t type);
-    // 释放指定地址范围的内存区域
-    void free_area(uint32_t start);
+    /**
+     * @brief 分配一个4MB对齐、大小为4MB整数倍的匿名区域，区域flags带PAGE_PS
+     * 缺页时整块映射4MB大页，分配不到连续内存时回退到4KB页；释放时按4MB整块解除映射
+     */
+    void* allocate_huge_area(uint32_t size, uint32_t flags);
+    /**
+     * @brief 分配一个文件映射区域，第一页对应文件的第pgoff页，区域持有file的一个引用
+     * type为MEM_TYPE_MMAP_FILE（私有）或MEM_TYPE_SHARED（共享），flags带PAGE_WRITE时可写
+     */
+    void* allocate_file_area(
+        uint32_t size, uint32_t flags, uint32_t type, kernel::FileMapping* file, uint32_t pgoff);
+    // 返回包含addr的区域，不存在时返回nullptr
+    const MemoryArea* find_area(uint32_t addr) const;
+
+    /**
+     * @brief 处理不存在页面的缺页：地址属于某个区域或堆时分配清零页面，按区域的权限映射
+     * @return 已建立映射返回true；地址非法、写只读区域或内存不足返回false
+     */
+    bool handle_fault(uint32_t fault_addr, bool is_write);
+    // 处理对只读页面的写：共享文件映射第一次写入时标记脏页并恢复写权限，其他情况返回false
+    bool handle_shared_write(uint32_t fault_addr);
+    // 预先为[addr, addr + size)中尚未映射的页建立映射，内核在不能缺页的地方访问用户内存前
+    // 以及mmap带MAP_POPULATE时调用
+    bool populate(uint32_t addr, uint32_t size);
+    void count_cow_fault()
+    {
+        faults.cow_faults++;
+        faults.minor_faults++;
+    }
+    const FaultStats& fault_stats() const { return faults; }
+    /**
+     * @brief 把用户空间[src, src + size)复制到内核缓冲区dst
+     * 地址必须在用户空间或程序映像之内，尚未映射的页面先按需映射，不能映射时返回false
+     */
+    bool copy_from_user(void* dst, uint32_t src, uint32_t size);
+    // 复制以'\0'结尾的用户字符串，包括结尾最多max字节；返回长度，地址非法或超长返回-1
+    int strncpy_from_user(char* dst, uint32_t src, uint32_t max);
+    // 已映射的页数，不含共享零页
+    uint32_t resident_pages() const { return rss; }
+    /**
+     * @brief 释放[start, start + size)并解除映射，部分覆盖的区域会被截短或拆分
+     * size为0时释放以start开始的整个区域
+     */
+    void free_area(uint32_t start, uint32_t size = 0);
+    /**
+     * @brief 为[addr, addr + size)设置访问提示（MemoryAdvice），addr必须页对齐
+     * 访问模式只记录在文件映射区域上，只覆盖区域的一部分时先拆分，之后与访问模式相同的相邻部分合并；
+     * 范围可以包含堆
+     * @return 成功返回0；参数非法、范围内有既不属于任何区域也不在堆中的地址或内存不足返回-1
+     */
+    int madvise(uint32_t addr, uint32_t size, uint32_t advice);
 
     // 扩展或收缩堆区
     uint32_t brk(uint32_t new_brk);
 
     // 映射物理页面到虚拟地址空间
     bool map_pages(uint32_t virt_addr, uint32_t phys_addr, uint32_t size, uint32_t flags);
+    // 映射一个匿名页，并记录反向映射使其可以被内存规整迁移
+    bool map_anon_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
+    enum class InstallResult { INSTALLED, RACED, FAILED };
+    // 缺页时在页表锁内安装不需要反向映射的页面（共享零页、文件页）：表项仍为0时才写入，
+    // count_rss时计入驻留页数。RACED表示表项已被另一个线程填上或正在迁移，
+    // 这两种情况以及FAILED都由调用者归还phys的引用
+    InstallResult install_page(uint32_t vaddr, PADDR phys, uint32_t flags, bool count_rss);
+    // 丢弃旧的程序映像，为[USER_IMAGE_START, end)分配清零的私有页面，内存不足时返回false
+    bool map_image(uint32_t end);
+    // 写时复制：在页表锁内确认表项仍是old_pte后换成phys，并把反向映射转到新页面；
+    // 返回false表示表项刚被改动（fork、迁移、解除映射或另一个线程的写时复制），调用者重新访问
+    bool replace_anon_page(uint32_t vaddr, uint32_t old_pte, uint32_t phys, uint32_t flags);
+    // 写时复制：表项仍是old_pte且页面只剩这一个引用时直接以flags恢复写权限，否则返回false
+    bool reuse_anon_page(uint32_t vaddr, uint32_t old_pte, uint32_t flags);
+    // 用一个页目录项映射4MB大页，phys_addr必须4MB对齐
+    void map_large_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
 
     // 解除虚拟地址空间的映射
     void unmap_pages(uint32_t virt_addr, uint32_t size);
+    // 解除整个用户空间和程序映像的映射，释放用户页表和所有区域描述符，页目录本身由调用者释放
+    void release_user_pages();
+
+    // 页表锁：匿名页的表项只在持有它时修改，缺页、写时复制、fork、解除映射与内存规整迁移互斥；
+    // 持有期间关中断，不能分配内存或发TLB刷新IPI
+    SpinLock& page_table_lock() { return pte_lock; }
+    // vaddr的表项带有PAGE_MIGRATING时等待迁移完成并返回true，调用者重新访问即可
+    bool wait_migration(uint32_t vaddr);
+
+    // 返回vaddr的页表项，页表不存在或是4MB大页时返回nullptr；
+    // 地址空间正在当前CPU上使用时返回递归映射窗口中的地址
+    uint32_t* lookup_pte(uint32_t vaddr);
 
     bool copyFrom(const UserMemory& src);
 
@@ -52,6 +175,7 @@ public:
     VADDR getPageDirectory() { return pgd;};
     PADDR getPageDirectoryPhysical() { return pgd_phys;};
     void clone(UserMemory& src);
+    uint32_t area_count() const { return num_areas; }
 
 private:
     // 使用first-fit策略查找合适的空闲区域
@@ -59,8 +183,73 @@ private:
 
     // 查找最大的连续空闲区域
     uint32_t find_largest_free_area();
+    // 把[start, start + size)加入区域树，能与相邻区域合并时直接扩展相邻区域
+    void* insert_range(uint32_t start, uint32_t size, uint32_t flags, uint32_t type);
+    // 在大页区域中为vaddr所在的4MB建立大页映射，不满足条件时返回false由调用者回退到4KB页
+    bool handle_large_fault(const MemoryArea* area, uint32_t vaddr);
+    // 文件映射区域的缺页，从页缓存取得页面
+    bool handle_file_fault(const MemoryArea* area, uint32_t vaddr, bool is_write);
+    // 文件页读缺页时映射的页表项标志
+    static uint32_t file_read_flags(const MemoryArea* area);
+    // 读缺页之后，把vaddr所在窗口中已经在内存里的其他文件页一起映射，顺序访问时省去后续的缺页；
+    // 不读取文件，不在缓存中的页面留给之后的缺页或预读
+    void fault_around(const MemoryArea* area, uint32_t vaddr);
+    // MADV_SEQUENTIAL区域主缺页之后，把vaddr后面的READAHEAD_PAGES页读入页缓存，不建立映射
+    void readahead(const MemoryArea* area, uint32_t vaddr);
+    void count_fault(bool major)
+    {
+        if(major) {
+            faults.major_faults++;
+        } else {
+            faults.minor_faults++;
+        }
+    }
+
+    // 区域树操作
+    static void augment_gap(kernel::rb_node* node);
+    MemoryArea* first_area() const;
+    MemoryArea* last_area() const;
+    MemoryArea* next_area(const MemoryArea* area) const;
+    MemoryArea* prev_area(const MemoryArea* area) const;
+    // 第一个end_addr大于addr的区域
+    MemoryArea* lower_bound(uint32_t addr) const;
+    void insert_area(MemoryArea* area);
+    void erase_area(MemoryArea* area);
+    // 区域的起始地址或前一个区域的结束地址变化后重新计算gap_before
+    void update_gap(MemoryArea* area);
+    // 只合并匿名映射：其他区域（栈、exec缓冲区）按起始地址整体释放
+    static bool can_merge(const MemoryArea* area, uint32_t flags, uint32_t type);
+    // prev和next是同一文件连续的两段映射，属性和访问模式都相同，madvise之后可以合并回一个区域
+    static bool can_merge_file(const MemoryArea* prev, const MemoryArea* next);
+    // 在addr处把区域拆成两个并插入后一半，返回后一半，内存不足返回nullptr
+    MemoryArea* split_area(MemoryArea* area, uint32_t addr);
+    // MADV_WILLNEED：把区域中[start, end)对应的文件页读入页缓存，不建立映射
+    void prefetch(const MemoryArea* area, uint32_t start, uint32_t end);
+    // 复制区域描述符（不插入树），文件映射增加引用
+    static MemoryArea* clone_area(const MemoryArea* area);
+    // 释放已从树上摘下的区域描述符，文件映射减少引用
+    static void destroy_area(MemoryArea* area);
+    void free_all_areas();
+
+    // 减少页面引用计数，不属于任何区域的页面直接释放
+    void put_page(uint32_t phys_page);
+    // 刷新TLB后释放pages中的nr个页面，nr清零
+    void flush_and_put(arch::TlbBatch& batch, uint32_t* pages, uint32_t& nr);
+    // 刷新TLB后释放已从页目录摘下的页目录项，nr清零
+    void release_detached(
+        arch::TlbBatch& batch, const uint32_t* pdes, const uint32_t* indexes, uint32_t& nr);
+    void release_page_table(uint32_t pde, uint32_t pde_idx);
 
-    static const uint32_t MAX_MEMORY_AREAS = 32;   // 最大内存区域数
+    // unmap_pages每次刷新TLB前最多积攒的页面数
+    static constexpr uint32_t UNMAP_BATCH = 64;
+    // release_user_pages每次刷新TLB前最多摘下的页表数
+    static constexpr uint32_t RELEASE_BATCH = 16;
+    // fault-around窗口的页数，必须是2的幂
+    static constexpr uint32_t FAULT_AROUND_PAGES = 16;
+    // MADV_SEQUENTIAL区域的fault-around窗口页数，必须是2的幂
+    static constexpr uint32_t SEQUENTIAL_AROUND_PAGES = 64;
+    // MADV_SEQUENTIAL区域每次主缺页后预读的页数；只有读到预读窗口之外才会再次主缺页
+    static constexpr uint32_t READAHEAD_PAGES = 16;
 
     // 物理页面分配和释放函数声明
     uint32_t (*allocate_physical_page)() = nullptr;
@@ -78,6 +267,9 @@ private:
     uint32_t end_stack;                 // 栈区结束地址
     uint32_t total_vm = 0;                  // 总虚拟内存大小(页数)
     uint32_t locked_vm = 0;                 // 锁定的虚拟内存大小(页数)
-    MemoryArea areas[MAX_MEMORY_AREAS]; // 内存区域数组
+    kernel::rb_root area_tree;              // 内存区域，按起始地址排序
     uint32_t num_areas = 0;                 // 当前内存区域数量
+    uint32_t rss = 0;                       // 已映射的页数，不含共享零页
+    FaultStats faults = {};                 // 缺页统计
+    SpinLock pte_lock;                      // 页表锁，见page_table_lock
 };
\ No newline at end of file
@@ -42,6 +42,38 @@ int sys_close(uint32_t fd_num, Task* pcb);
 int sys_seek(uint32_t fd_num, uint32_t offset, Task* pcb);
 
 void init_vfs();
+
+/**
+ * @brief 文件映射：mmap把文件的一段映射到用户空间，缺页时按页取得文件内容所在的物理页
+ * 由映射了该文件的内存区域共同持有（fork复制、区域拆分都会增加引用），
+ * 最后一个引用释放时销毁，与打开文件的描述符的生命周期无关
+ */
+class FileMapping
+{
+public:
+    virtual ~FileMapping() = default;
+    // 返回文件第pgoff页所在的物理页并增加一个引用，超出文件末尾或读取失败时返回0
+    virtual uint32_t get_page(uint32_t pgoff) = 0;
+    // 与get_page相同，但只返回已经在内存中的页面，不发起读取；fault-around用它顺带映射相邻页面
+    virtual uint32_t find_page(uint32_t) { return 0; }
+    // 预取提示：把文件第pgoff页读入内存但不映射。默认用get_page读入后立即归还引用；
+    // 返回false表示不需要继续预取后面的页面（文件结束、读取失败或数据本来就在内存中）
+    virtual bool prefetch(uint32_t pgoff);
+    // 共享映射写入了文件第pgoff页，标记为需要写回
+    virtual void set_page_dirty(uint32_t pgoff) = 0;
+
+    void get() { __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED); }
+    void put()
+    {
+        if(__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            delete this;
+        }
+    }
+
+private:
+    uint32_t refs = 1; // 创建者持有第一个引用
+};
+
 // 文件描述符
 class FileDescriptor
 {
@@ -53,7 +85,7 @@ public:
     virtual int close() = 0;
     virtual int iterate(void* buffer, size_t buffer_size, uint32_t* pos) = 0;
     // mmap接口：将文件内容映射到用户空间
-    virtual void* mmap(void* addr, size_t length, int prot, int flags, size_t offset) {
+    virtual void* mmap(void*, size_t, int, int, size_t) {
         return nullptr;
     }
 };
@@ -1,59 +1,87 @@
 #pragma once
 #include <cstdint>
 
-// 红黑树节点颜色
-enum class Color { RED, BLACK };
+#include "arch/x86/spinlock.h"
+#include "kernel/slab_allocator.h"
+#include "lib/rbtree.h"
 
-// 虚拟内存区域节点
+// 已分配的虚拟内存区域节点，按起始地址排序，区域之间的空隙即为空闲空间
 struct VmArea {
-    uint32_t start_addr; // 起始地址
-    uint32_t size;       // 区域大小
-    Color color;         // 节点颜色
-    VmArea* parent;      // 父节点
-    VmArea* left;        // 左子节点
-    VmArea* right;       // 右子节点
-
-    VmArea(uint32_t start, uint32_t sz)
-        : start_addr(start), size(sz), color(Color::RED), parent(nullptr), left(nullptr),
-          right(nullptr)
+    uint32_t start_addr;  // 起始地址
+    uint32_t size;        // 区域大小
+    uint32_t gap_before;  // 与前一个区域（或树的起始地址）之间的空隙
+    uint32_t subtree_gap; // 子树中最大的gap_before
+    kernel::rb_node rb;
+
+    VmArea(uint32_t start, uint32_t sz) : start_addr(start), size(sz), gap_before(0), subtree_gap(0)
     {
     }
+
+#ifndef TESTING
+    DECLARE_SLAB_CACHE_OPERATORS();
+#endif
+};
+
+// 碎片统计
+struct VmFragmentation {
+    uint32_t free_size;    // 空闲空间总大小
+    uint32_t largest_gap;  // 最大的连续空闲空间
+    uint32_t nr_areas;     // 已分配区域数
+    uint32_t nr_gaps;      // 非空的空隙数
 };
 
 // 虚拟内存红黑树
+// 每个节点记录子树中最大的空隙，分配时沿着有足够大空隙的分支向下，O(log n)找到地址最低的空隙
 class VirtualMemoryTree
 {
 public:
     VirtualMemoryTree(uint32_t start, uint32_t end);
     ~VirtualMemoryTree();
+    void init();
 
-    // 分配指定大小的虚拟内存区域
+    // 分配指定大小的虚拟内存区域（按地址首次适配），失败返回0
     uint32_t allocate(uint32_t size);
 
-    // 释放指定地址的虚拟内存区域
-    void free(uint32_t addr);
+    // 释放指定地址的虚拟内存区域，返回区域大小，addr不是区域起始地址时返回0
+    uint32_t free(uint32_t addr);
+
+    // 返回以addr开始的已分配区域的大小，不存在时返回0
+    uint32_t size_of(uint32_t addr) const;
+
+    // 后面的空隙足够时原地把区域调整为new_size，成功返回true
+    bool resize(uint32_t addr, uint32_t new_size);
 
     // 获取可用内存大小
     uint32_t get_free_size() const;
 
+    // 最大的连续空闲空间，O(1)
+    uint32_t get_largest_gap() const;
+
+    // 碎片统计，需要遍历所有区域
+    VmFragmentation fragmentation() const;
+    void print_fragmentation(const char* name) const;
+
 private:
-    VmArea* root;            // 根节点
+    kernel::rb_root root;    // 按起始地址排序的已分配区域
     uint32_t start_addr;     // 起始地址
     uint32_t end_addr;       // 结束地址
     uint32_t total_size;     // 总大小
     uint32_t allocated_size; // 已分配大小
+    uint32_t nr_areas;       // 已分配区域数
+    mutable SpinLock lock;   // 保护整棵树，节点在加锁前分配、解锁后释放
 
-    // 红黑树操作
-    void left_rotate(VmArea* node);
-    void right_rotate(VmArea* node);
-    void insert_fixup(VmArea* node);
-    void delete_fixup(VmArea* node);
-    void transplant(VmArea* u, VmArea* v);
-    VmArea* minimum(VmArea* node);
-
-    // 查找合适的空闲区域
-    VmArea* find_free_area(uint32_t size);
+    static void augment_gap(kernel::rb_node* node);
+    static VmArea* area_of(kernel::rb_node* node);
+    // 前一个区域的结束地址，没有前一个区域时为start_addr
+    uint32_t prev_end(VmArea* area) const;
+    void update_gap(VmArea* area);
+    // 树中最后一个区域之后的空隙
+    uint32_t tail_gap() const;
+    uint32_t find_gap(uint32_t size) const;
+    void insert(VmArea* node);
+    void erase(VmArea* node);
+    VmArea* find(uint32_t addr) const;
 
     // 清理红黑树
-    void cleanup(VmArea* node);
-};
\ No newline at end of file
+    void cleanup(kernel::rb_node* node);
+};
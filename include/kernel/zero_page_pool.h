@@ -0,0 +1,49 @@
+#pragma once
+#include "arch/x86/spinlock.h"
+#include "kernel/shrinker.h"
+#include <cstdint>
+
+// 预清零页面池
+// 空闲CPU在idle任务中分配页面并用非临时存储（movnti）清零后放入池中，
+// 带__GFP_ZERO的单页分配直接取用，不必在缺页或分配路径上memset。
+// 池中的页面在伙伴系统看来是已分配的，内存紧张时由收缩器归还
+class ZeroPagePool
+{
+public:
+    // 池容量（页），最多占用1MB物理内存
+    static constexpr uint32_t CAPACITY = 256;
+    // idle任务每次最多清零的页数，避免长时间不响应调度
+    static constexpr uint32_t REFILL_BATCH = 16;
+
+    void init();
+
+    // 取出一个已清零的页，池为空时返回0
+    uint32_t get();
+
+    // 补充最多max个清零页，返回补充的页数
+    uint32_t refill(uint32_t max);
+
+    // 归还最多nr个页给伙伴系统，返回归还的页数
+    uint32_t drain(uint32_t nr);
+
+    uint32_t size() const { return count; }
+
+    // 清零一个页面，支持SSE2时使用movnti绕过缓存
+    void clear_page(void* addr);
+
+    void print_stats();
+
+private:
+    uint32_t pages[CAPACITY]; // 已清零页面的物理地址（栈）
+    uint32_t count;
+    SpinLock lock;            // 保护pages和count
+    bool use_movnti;          // CPU是否支持SSE2（movnti/sfence）
+
+    // 统计信息
+    uint32_t hits;    // 分配时直接从池中取到清零页的次数
+    uint32_t misses;  // 池为空、回退到同步清零的次数
+    uint32_t refilled; // 空闲时清零的页数
+    uint32_t drained;  // 内存紧张时归还的页数
+
+    kernel::Shrinker shrinker;
+};
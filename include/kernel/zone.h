@@ -1,7 +1,10 @@
 #ifndef KERNEL_ZONE_H
 #define KERNEL_ZONE_H
 
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
 #include "kernel/buddy_allocator.h"
+#include "kernel/list.h"
 #include <cstdint>
 
 // 内存区域类型
@@ -33,6 +36,10 @@ public:
     // 释放页面
     void freePages(uint32_t pfn, uint32_t order);
     void decRefPage(uint32_t pfn);
+    // 释放任意页数的连续页面，直接归还伙伴系统以便与相邻空闲页合并
+    void freeRange(uint32_t pfn, uint32_t nr_pages);
+    // 把紧跟在已分配页面之后的nr_pages个空闲页面划归调用者，有非空闲页时返回false
+    bool claimRange(uint32_t pfn, uint32_t nr_pages);
     void increment_ref_count(uint32_t pfn);
 
     // 获取区域空闲页面数量
@@ -50,13 +57,75 @@ public:
     // 迁移页面到其他区域
     bool migratePagesTo(Zone* target, uint32_t count);
 
+    // 返回页帧的描述符，不属于本区域时返回nullptr
+    page* pageOf(uint32_t pfn);
+
+    // 将当前CPU缓存的页面全部归还给伙伴系统
+    void drainPcp();
+    // 将所有CPU缓存的页面归还给伙伴系统，返回归还的页数
+    uint32_t drainAllPcp();
+
+    // 打印每CPU页面缓存的命中率和批量搬运统计
+    void printPcpStats();
+
+    // 调用收缩器回收内存，直到空闲页回到WMARK_HIGH，返回回收的页数
+    uint32_t balance();
+
+    // 内存规整：把可迁移页（匿名页、页缓存页）搬出一个2^order对齐的窗口，
+    // 使窗口合并成一个order阶的空闲块，成功返回true
+    bool compact(uint32_t order);
+
+    // 打印内存规整统计
+    void printCompactStats();
+
     // 获取区域类型
     ZoneType getType() const
     {
         return type;
     }
 
+    // 每CPU缓存的最大order，更大的分配直接走伙伴系统
+    static constexpr uint32_t PCP_MAX_ORDER = 3;
+    // 直接回收时在所需页数之外多回收的页数，避免每次分配都进入回收
+    static constexpr uint32_t RECLAIM_BATCH = 32;
+    // 内存规整支持的最大order（窗口内最多64页需要迁移）
+    static constexpr uint32_t COMPACT_MAX_ORDER = 6;
+    // 每次规整最多检查的窗口数，限制持锁扫描的时间
+    static constexpr uint32_t COMPACT_SCAN_WINDOWS = 512;
+
 private:
+    // 每CPU页面缓存（per-cpu pageset）
+    // 链表节点直接存放在空闲页面内，链表头部是刚释放的热页，尾部是冷页。
+    // 平时只有所属CPU访问，lock几乎没有竞争；伙伴系统耗尽时其他CPU也会获取它来清空缓存
+    struct PerCpuPages {
+        SpinLock lock;
+        kernel::list_head lists[PCP_MAX_ORDER + 1];
+        uint32_t count[PCP_MAX_ORDER + 1];
+        // 统计信息
+        uint32_t alloc_hit;  // 直接从缓存分配成功的次数
+        uint32_t alloc_miss; // 缓存为空需要批量补充的次数
+        uint32_t free_fast;  // 直接释放到缓存的次数
+        uint32_t refills;    // 从伙伴系统批量补充的次数
+        uint32_t drains;     // 批量归还给伙伴系统的次数
+    };
+
+    uint32_t pcpAlloc(uint32_t gfp_mask, uint32_t order);
+    bool pcpFree(uint32_t pfn, uint32_t order);
+    uint32_t pcpRefill(PerCpuPages& pcp, uint32_t order);
+    void pcpDrain(PerCpuPages& pcp, uint32_t order, uint32_t nr);
+    // 关中断并锁住当前CPU的缓存，返回原来的EFLAGS
+    PerCpuPages& lockLocalPcp(uint32_t& irq_flags);
+    uint32_t buddyAlloc(uint32_t gfp_mask, uint32_t order);
+    void directReclaim(uint32_t count);
+    uint32_t allocAfterCompact(uint32_t gfp_mask, uint32_t order);
+    uint32_t findCompactWindow(uint32_t order, uint32_t* movable, uint32_t& nr_movable);
+    bool migrateWindow(uint32_t start_pfn, uint32_t order, const uint32_t* movable,
+        uint32_t nr_movable);
+    void freeToBuddy(uint32_t pfn, uint32_t order);
+    // 每CPU缓存在zone锁之外修改nr_free_pages，所以无论是否持有lock，所有修改都用原子操作
+    void addFreePages(uint32_t nr) { __atomic_add_fetch(&nr_free_pages, nr, __ATOMIC_RELAXED); }
+    void subFreePages(uint32_t nr) { __atomic_sub_fetch(&nr_free_pages, nr, __ATOMIC_RELAXED); }
+
     ZoneType type;                  // 区域类型
     uint32_t nr_free_pages;         // 空闲页面数量
     uint32_t zone_num;              // 空闲页面数量
@@ -65,6 +134,19 @@ private:
     uint32_t size;                  // 区域大小（以页为单位）
     uint32_t watermark[3];          // 水位标记
     BuddyAllocator buddy_allocator; // 伙伴系统分配器
+    SpinLock lock;                  // 保护伙伴系统的空闲链表
+    PerCpuPages pcp[MAX_CPUS];      // 每CPU页面缓存
+    // 回收统计
+    uint32_t direct_reclaims;       // 直接回收的次数
+    uint32_t direct_reclaimed;      // 直接回收释放的页数
+    uint32_t kswapd_wakeups;        // 低于WMARK_LOW唤醒kswapd的次数
+    // 内存规整状态和统计
+    uint32_t compact_cursor;        // 下一次扫描的起始页帧号
+    uint32_t compact_stalls;        // 高阶分配失败后进入规整的次数
+    uint32_t compact_success;       // 规整出目标块的次数
+    uint32_t compact_fail;          // 规整失败的次数
+    uint32_t pages_migrated;        // 迁移成功的页数
+    uint32_t migrate_failed;        // 迁移失败的页数
 };
 
 #endif // KERNEL_ZONE_H
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+
+namespace kernel {
+
+// 侵入式红黑树，节点嵌入在使用者的结构体中，用rb_entry取回外层结构体。
+// 树本身不比较键值：使用者自己从根向下找到插入位置，调用rb_link_node挂上节点，
+// 再调用rb_insert_color恢复平衡。
+//
+// 增强树：节点可以保存由子树计算出来的附加信息（例如子树中最大的空隙），
+// rb_root::augment根据节点自身和左右子节点重新计算该信息。
+// 旋转、插入和删除都会自动调用augment；节点自身的信息变化时调用rb_augment_propagate
+struct rb_node {
+    rb_node* parent;
+    rb_node* left;
+    rb_node* right;
+    bool red;
+};
+
+struct rb_root {
+    rb_node* node = nullptr;
+    void (*augment)(rb_node* node) = nullptr; // 普通树为nullptr
+};
+
+// 把node挂到parent下的*link位置，link是使用者查找时得到的&parent->left或&parent->right
+inline void rb_link_node(rb_node* node, rb_node* parent, rb_node** link)
+{
+    node->parent = parent;
+    node->left = node->right = nullptr;
+    node->red = true;
+    *link = node;
+}
+
+// 插入：rb_link_node之后调用，重新计算增强信息并恢复平衡
+void rb_insert_color(rb_node* node, rb_root* root);
+// 从树中摘除节点，不释放节点本身
+void rb_erase(rb_node* node, rb_root* root);
+// 从node开始向上重新计算增强信息直到根
+void rb_augment_propagate(rb_node* node, rb_root* root);
+
+// 中序遍历
+rb_node* rb_first(const rb_root* root);
+rb_node* rb_last(const rb_root* root);
+rb_node* rb_next(const rb_node* node);
+rb_node* rb_prev(const rb_node* node);
+
+#define rb_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+} // namespace kernel
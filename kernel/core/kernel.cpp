@@ -4,11 +4,53 @@
 #include <lib/serial.h>
 
 #include "arch/x86/paging.h"
+#include "arch/x86/tlb.h"
 #include "lib/debug.h"
 
 #define E_OK 0
 #define E_NOT_COW 1
 #define E_PANIC 2
+// 其他CPU上运行同一地址空间的任务可能还缓存着旧的表项
+static void flush_user_page(UserMemory& user_mm, uint32_t vaddr)
+{
+    arch::TlbBatch batch(user_mm.getPageDirectoryPhysical());
+    batch.add(vaddr);
+    batch.flush();
+}
+
+// 4MB大页的写时复制：整块复制，不拆分成4KB页
+static int copyCOWLargePage(uint32_t fault_addr, uint32_t original_pgd, UserMemory& user_mm,
+    uint32_t flags)
+{
+    // fork只把可写的大页改成COW，这里再按区域的权限确认一次，只读区域的写入按权限错误处理
+    const MemoryArea* area = user_mm.find_area(fault_addr);
+    if(!area || !(area->flags & PAGE_WRITE)) {
+        return E_NOT_COW;
+    }
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    uint32_t vaddr = fault_addr & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t old_phys = ((uint32_t*)original_pgd)[fault_addr >> 22] & 0xFFFFF000;
+    uint32_t new_flags = (flags & ~PAGE_COW) | PAGE_WRITE;
+
+    page* pg = kernel_mm.phys_to_page(old_phys);
+    if(pg && page_ref_count(pg) == 1) {
+        user_mm.map_large_page(vaddr, old_phys, new_flags);
+        flush_user_page(user_mm, vaddr);
+        return E_OK;
+    }
+
+    uint32_t new_phys = kernel_mm.alloc_pages(0, LARGE_PAGE_ORDER);
+    if(!new_phys) {
+        log_err("COW failed to allocate 4MB page\n");
+        return E_PANIC;
+    }
+    memcpy(kernel_mm.phys2Virt(new_phys), kernel_mm.phys2Virt(old_phys), LARGE_PAGE_SIZE);
+    user_mm.map_large_page(vaddr, new_phys, new_flags);
+    flush_user_page(user_mm, vaddr);
+    kernel_mm.decrement_ref_count(old_phys);
+    return E_OK;
+}
+
 int copyCOWPage(uint32_t fault_addr, uint32_t original_pgd, UserMemory& user_mm)
 {
     auto& kernel_mm = Kernel::instance().kernel_mm();
@@ -16,39 +58,63 @@ int copyCOWPage(uint32_t fault_addr, uint32_t original_pgd, UserMemory& user_mm)
     // 修改后的COW处理逻辑
     uint32_t flags = Kernel::instance().kernel_mm().paging().getPageFlags(fault_addr);
 
+    // 大页的标志位在页目录项中
+    if((flags & PAGE_COW) && (flags & PAGE_PRESENT) && (flags & PAGE_PS)) {
+        return copyCOWLargePage(fault_addr, original_pgd, user_mm, flags);
+    }
+
     // 检查COW标志
     if((flags & PAGE_COW) && (flags & PAGE_PRESENT)) {
         // 找到对应的物理页
-        auto pd_index = (fault_addr >> 22) & 0x3FF;
-        auto pde = ((uint32_t*)original_pgd)[pd_index];
-        auto pt_phys = pde & 0xFFFFF000;
-        auto pt_virt = pt_phys | 0xC0000000;
-        auto pt_index = (fault_addr >> 12) & 0x3FF;
-        auto pte = ((uint32_t*)pt_virt)[pt_index];
-        uint32_t old_phys = pte & 0xFFFFF000;
-        // 分配新物理页
-        uint32_t new_phys = Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
+        uint32_t* pte = user_mm.lookup_pte(fault_addr);
+        if(!pte) {
+            return E_NOT_COW;
+        }
+        uint32_t old_pte = *pte;
+        if(!(old_pte & PAGE_PRESENT)) {
+            return E_OK; // 刚被解除映射或正在迁移，重新访问时按不存在的页处理
+        }
+        uint32_t old_phys = old_pte & 0xFFFFF000;
+        uint32_t vaddr = fault_addr & ~0xFFF;
+        uint32_t new_flags = (flags & ~PAGE_COW) | PAGE_WRITE;
+
+        // 其他地址空间都已经复制走或退出，只剩这一个映射，直接恢复写权限；
+        // 共享零页还有init时的引用，不会走到这里。
+        // 页表锁内的复查失败说明表项或引用计数刚被fork、迁移改动，重新访问一次
+        page* pg = kernel_mm.phys_to_page(old_phys);
+        bool is_zero = old_phys == kernel_mm.zero_page();
+        if(pg && page_ref_count(pg) == 1 && !is_zero) {
+            if(user_mm.reuse_anon_page(vaddr, old_pte, new_flags)) {
+                flush_user_page(user_mm, vaddr);
+            }
+            return E_OK;
+        }
+
+        // 分配新物理页，替换共享零页时直接取清零的页面，不需要复制
+        uint32_t new_phys = kernel_mm.alloc_pages(is_zero ? __GFP_ZERO : 0, 0);
         if(!new_phys) {
             log_err("COW failed to allocate new page\n");
             return E_PANIC;
         }
 
-        // 旧的地址应该是可以读的，只是不可以写而已
-        // 新物理页先映射到别处完成拷贝
-        uint32_t tmp_virt = TEMP_MAPPING_VADDR; // 使用固定的临时映射地址
-        Kernel::instance().kernel_mm().paging().mapPage(
-            tmp_virt, new_phys, PAGE_PRESENT | PAGE_WRITE);
-        memcpy((void*)tmp_virt, (void*)fault_addr, PAGE_SIZE);
-        Kernel::instance().kernel_mm().paging().unmapPage(tmp_virt);
-
-        // 更新页表项
-        user_mm.map_pages(
-            fault_addr & ~0xFFF, new_phys, PAGE_SIZE, (flags & ~PAGE_COW) | PAGE_WRITE);
-
-        // 减少原页面的引用计数
-        // 如果是复合页，BuddyAllocator会自动处理复合页的引用计数
-        // 只会减少复合页首页的引用计数，不会导致错误释放
-        //Kernel::instance().kernel_mm().decrement_ref_count(old_phys);
+        if(!is_zero) {
+            // 页面不在直接映射区时通过每CPU的临时映射复制
+            void* dst = kernel_mm.kmap_atomic(new_phys);
+            void* src = kernel_mm.kmap_atomic(old_phys);
+            memcpy(dst, src, PAGE_SIZE);
+            kernel_mm.kunmap_atomic(src);
+            kernel_mm.kunmap_atomic(dst);
+        }
+
+        // 更新页表项；复制期间表项被另一个线程的写时复制或迁移换掉时丢弃副本，重新访问
+        if(!user_mm.replace_anon_page(vaddr, old_pte, new_phys, new_flags)) {
+            kernel_mm.free_pages(new_phys, 0);
+            return E_OK;
+        }
+        flush_user_page(user_mm, vaddr);
+
+        // 减少原页面的引用计数，最后一个引用者释放时页面回到伙伴系统
+        kernel_mm.decrement_ref_count(old_phys);
         return E_OK;
     }
     return E_NOT_COW;
@@ -67,13 +133,14 @@ void page_fault_handler(uint32_t error_code, uint32_t fault_addr)
         is_write, is_user, is_reserved, is_instruction);
 
     auto pcb = ProcessManager::get_current_task();
-    pcb->print();
     auto pgd = pcb->context->user_mm.getPageDirectory();
     auto& user_mm = pcb->context->user_mm;
 
     // __printPDPTE((void*)fault_addr, (PageDirectory*)pgd);
 
-    if(fault_addr >= 0x40000000 && fault_addr < 0xC0000000) {
+    // 内核在系统调用中访问用户缓冲区（包括低端的程序映像）引起的缺页也按用户缺页处理
+    if((fault_addr >= USER_START && fault_addr < USER_END) ||
+        (fault_addr >= USER_IMAGE_START && fault_addr < USER_IMAGE_END)) {
         is_user = true;
     }
 
@@ -81,28 +148,28 @@ void page_fault_handler(uint32_t error_code, uint32_t fault_addr)
     if(is_user) {
         // 用户态缺页中断
         if(!is_present) {
-            // 页面不存在，需要分配新页面
-            auto phys_page = Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
-            // debug_debug("Allocated pfn 0x%x\n", phys_page);
-            if(phys_page) {
-                // 建立用户态页表映射
-                uint32_t flags = PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
-                if(!is_write) {
-                    flags &= ~PAGE_WRITE; // 如果不是写操作，清除写权限
-                }
-
-                user_mm.map_pages(fault_addr & ~0xFFF, phys_page, PAGE_SIZE, flags);
-                log_debug("fixed page mapping\n");
+            // 页面不存在：区域内的匿名页第一次被访问
+            if(user_mm.handle_fault(fault_addr, is_write)) {
                 return;
             }
+            goto panic;
         } else if(is_write) {
+            // 表项在缺页之后被换成了迁移标记
+            if(user_mm.wait_migration(fault_addr)) {
+                return;
+            }
             auto ret = copyCOWPage(fault_addr, pgd, user_mm);
             if (ret == E_OK) {
+                user_mm.count_cow_fault();
                 log_debug("copied page\n");
                 return;
             } else if (ret == E_PANIC) {
                 goto panic;
             }
+            // 共享文件映射的页面第一次被写入
+            if(user_mm.handle_shared_write(fault_addr)) {
+                return;
+            }
         }
     } else {
         log_debug("kernel page fault unexpected\n");
@@ -128,6 +195,8 @@ panic:
     log_debug("Present: %d, Write: %d, User: %d, Reserved: %d, Instruction: %d\n", is_present,
         is_write, is_user, is_reserved, is_instruction);
     printPDPTE((void*)fault_addr);
+    pcb->print();
+    user_mm.print();
     log_debug("will panic\n");
     asm volatile("hlt");
 
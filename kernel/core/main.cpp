@@ -4,14 +4,17 @@
 #include <arch/x86/interrupt.h>
 #include <arch/x86/paging.h>
 #include <arch/x86/smp.h>
+#include <arch/x86/tlb.h>
 #include <drivers/block_device.h>
 #include <drivers/ext2.h>
 #include <drivers/keyboard.h>
 #include <kernel/buddy_allocator.h>
 #include <kernel/elf_loader.h>
 #include <kernel/memfs.h>
+#include <kernel/mm_benchmark.h>
 #include <kernel/process.h>
 #include <kernel/scheduler.h>
+#include <kernel/shrinker.h>
 #include <kernel/smp_scheduler.h>
 #include <kernel/syscall_user.h>
 #include <kernel/vfs.h>
@@ -35,6 +38,7 @@ extern "C" void keyboard_interrupt();
 extern "C" void cascade_interrupt();
 extern "C" void ide1_interrupt();
 extern "C" void ide2_interrupt();
+extern "C" void ipi_interrupt();
 extern "C" void syscall_interrupt();
 extern "C" void page_fault_interrupt();
 extern "C" void general_protection_interrupt();
@@ -44,8 +48,11 @@ Task* init_task = nullptr;
 
 void idle_task_entry()
 {
+    auto& mm = Kernel::instance().kernel_mm();
     while(true) {
         log_debug("idle task!\n");
+        // 没有其他任务可运行时预先清零一批页面，供__GFP_ZERO分配使用
+        mm.refill_zero_pages();
         asm volatile("hlt");
     }
 }
@@ -59,7 +66,7 @@ void init()
 
     log_debug(
         "loading page directory 0x%x for pcb 0x%x(pid %d)\n", task->regs.cr3, task, task->task_id);
-    Kernel::instance().kernel_mm().paging().loadPageDirectory(task->regs.cr3);
+    arch::load_cr3(task->regs.cr3);
     log_debug(
         "load page directory 0x%x for pcb 0x%x(pid %d)\n", task->regs.cr3, task, task->task_id);
     while(true) {
@@ -104,6 +111,19 @@ extern "C" Task* create_idle_task(Context* context, int apic_id)
     return idle_task;
 }
 
+// kswapd：空闲页低于WMARK_LOW时在后台调用收缩器回收内存
+Task* create_kswapd_task(Context* context)
+{
+    auto& kernel = Kernel::instance();
+    auto kswapd_task =
+        ProcessManager::kernel_task(context, "kswapd", (uint32_t)kernel::kswapd_entry, 0, nullptr);
+    kswapd_task->alloc_stack(kernel.kernel_mm());
+    kswapd_task->state = PROCESS_READY;
+    kswapd_task->regs.cr3 = kswapd_task->context->user_mm.getPageDirectoryPhysical();
+    log_debug("kswapd_task: %d(0x%x)\n", kswapd_task->task_id, kswapd_task);
+    return kswapd_task;
+}
+
 int initialize_kernel_context()
 {
     ProcessManager::kernel_context = new Context();
@@ -112,7 +132,7 @@ int initialize_kernel_context()
         0x400000, (PageDirectory*)0xC0400000,
         []() {
             auto page = Kernel::instance().kernel_mm().alloc_pages(
-                0, 0); // gfp_mask = 0, order = 0 (1 page)
+                __GFP_ZERO, 0); // order = 0 (1 page)，页表和堆页面都需要清零
             log_debug("ProcessManager: Allocated Page at %x\n", page);
             return page;
         },
@@ -158,6 +178,10 @@ extern "C" void kernel_main()
 
     // 运行格式化字符串测试
     run_format_string_tests();
+#ifdef CONFIG_MM_BENCHMARK
+    run_buddy_benchmark();
+    run_slab_benchmark();
+#endif
     log_debug("Kernel initialized!\n");
     // 注册系统调用处理函数
     SyscallManager::init();
@@ -206,6 +230,8 @@ extern "C" void kernel_main()
         // debug_debug("ascii 0x%x scancode 0x%x\n", ascii, code);
     });
     kernel->interrupt_manager().registerHandler(0x22, []() { });
+    kernel->interrupt_manager().registerHandler(
+        IPI_TLB_SHOOTDOWN_VECTOR, arch::tlb_shootdown_interrupt);
 
     // 初始化IDT
     IDT::init();
@@ -222,6 +248,8 @@ extern "C" void kernel_main()
     IDT::setGate(IRQ_CASCADE, (uint32_t)cascade_interrupt, 0x08, 0xEE);
     IDT::setGate(IRQ_ATA1, (uint32_t)ide1_interrupt, 0x08, 0xEE);
     IDT::setGate(IRQ_ATA2, (uint32_t)ide2_interrupt, 0x08, 0xEE);
+    // IPI只由其他CPU发出，用户态不能用int指令触发
+    IDT::setGate(IPI_TLB_SHOOTDOWN_VECTOR, (uint32_t)ipi_interrupt, 0x08, 0x8E);
     // 软中断
     IDT::setGate(INT_SYSCALL, (uint32_t)syscall_interrupt, 0x08, 0xEE);
     IDT::loadIDT();
@@ -335,6 +363,9 @@ extern "C" void kernel_main()
     Console::print("MemFS initialized and initramfs loaded!\n");
 
     initialize_kernel_context();
+#ifdef CONFIG_MM_BENCHMARK
+    run_fork_benchmark();
+#endif
 
     log_debug("Initializing idle task!\n");
     auto idle_task = create_idle_task(ProcessManager::kernel_context, 0);
@@ -348,6 +379,7 @@ extern "C" void kernel_main()
     kernel->scheduler().set_idle_task(idle_task);
     kernel->scheduler().set_current_task(idle_task);
     kernel->scheduler().enqueue_task(init_task, 1);
+    kernel->scheduler().enqueue_task(create_kswapd_task(ProcessManager::kernel_context));
 
     log_debug("Initializing SMP...\n");
     arch::smp_init();
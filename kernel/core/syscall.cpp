@@ -86,10 +86,16 @@ int statHandler(uint32_t path_ptr, uint32_t attr_ptr, uint32_t, uint32_t)
 
 int execveHandler(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, uint32_t)
 {
-    auto ret = sys_execve(path_ptr, argv_ptr, envp_ptr, nullptr);
+    auto ret = sys_execve(path_ptr, argv_ptr, envp_ptr, ProcessManager::get_current_task());
     return ret;
 }
 
+int spawnHandler(uint32_t path_ptr, uint32_t actions_ptr, uint32_t nactions, uint32_t)
+{
+    return ProcessManager::spawn(reinterpret_cast<const char*>(path_ptr),
+        reinterpret_cast<const SpawnFileAction*>(actions_ptr), nactions);
+}
+
 int getcwdHandler(uint32_t buf_ptr, uint32_t size, uint32_t, uint32_t)
 {
     char* buf = reinterpret_cast<char*>(buf_ptr);
@@ -133,9 +139,17 @@ void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, size_t of
 
     log_trace("addr = %x, length = %x, prot = %x, flags = %x, fd = %x, offset = %x\n", addr, length, prot, flags, fd, offset);
 
+    auto& user_mm = ProcessManager::get_current_task()->context->user_mm;
     if(fd < 0) {
-        auto task = ProcessManager::get_current_task();
-        auto mapped_addr = task->context->user_mm.allocate_area(length, 0, MEM_TYPE_ANONYMOUS);
+        // 区域只记录写权限，缺页时按它决定页表项是否可写
+        uint32_t area_flags = (prot & PROT_WRITE) ? PAGE_WRITE : 0;
+        auto mapped_addr = (flags & MAP_HUGE)
+                               ? user_mm.allocate_huge_area(length, area_flags)
+                               : user_mm.allocate_area(length, area_flags, MEM_TYPE_ANONYMOUS);
+        if(mapped_addr && (flags & MAP_POPULATE)) {
+            // 与Linux相同，预先映射失败不影响mmap本身，之后访问时按需缺页
+            user_mm.populate((uint32_t)mapped_addr, length);
+        }
         log_trace("return mapped_addr = %x\n", mapped_addr);
         return mapped_addr;
     }
@@ -149,11 +163,26 @@ void* sys_mmap(void* addr, size_t length, int prot, int flags, int fd, size_t of
     //     return (void*)MAP_FAILED;
     // }
     auto ret = fd_ptr->mmap(addr, length, prot, flags, offset);
+    if(ret != (void*)MAP_FAILED && ret && (flags & MAP_POPULATE)) {
+        user_mm.populate((uint32_t)ret, length);
+    }
 
     log_trace("return 0x%x\n", ret);
     return ret;
 }
 
+int madviseHandler(uint32_t addr, uint32_t length, uint32_t advice, uint32_t)
+{
+    return sys_madvise(reinterpret_cast<void*>(addr), length, advice);
+}
+
+int sys_madvise(void* addr, size_t length, int advice)
+{
+    log_trace("madvise: addr = %x, length = %x, advice = %d\n", addr, length, advice);
+    auto& user_mm = ProcessManager::get_current_task()->context->user_mm;
+    return user_mm.madvise((uint32_t)addr, length, advice);
+}
+
 int nanosleepHandler(uint32_t req_ptr, uint32_t rem_ptr, uint32_t, uint32_t)
 {
     // 将用户空间指针转换为内核可访问的指针
@@ -195,6 +224,8 @@ void SyscallManager::init()
     registerHandler(SYS_LOG, logHandler);
     registerHandler(SYS_CHDIR, chdirHandler);
     registerHandler(SYS_MMAP, mmapHandler);
+    registerHandler(SYS_SPAWN, spawnHandler);
+    registerHandler(SYS_MADVISE, madviseHandler);
 
     Console::print("SyscallManager initialized\n");
 }
@@ -271,25 +302,24 @@ int sys_execve(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, Task* ta
         return -1;
     }
     log_debug("open successful, fd: %d\n", fd);
-    auto attr = new kernel::FileAttribute();
-    int ret = kernel::VFSManager::instance().stat("/init", attr);
+    kernel::FileAttribute attr;
+    int ret = kernel::VFSManager::instance().stat(path, &attr);
     if(ret < 0) {
-        log_err("Failed to stat /init!\n");
+        log_err("Failed to stat %s!\n", path);
+        kernel::sys_close(fd, task);
         return -1;
     }
-    log_debug("File stat ret %d, size %d!\n", ret, attr->size);
+    log_debug("File stat ret %d, size %d!\n", ret, attr.size);
 
-    // 读取文件内容
-    auto filep = task->context->user_mm.allocate_area(attr->size, PAGE_WRITE, 0);
-    log_debug("File allocated at %x\n", filep);
-    uint32_t num_pages = (attr->size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for(uint32_t i = 0; i < num_pages; i++) {
-        auto phys_addr = Kernel::instance().kernel_mm().alloc_pages(0, 0); // 每次分配一页
-        task->context->user_mm.map_pages((uint32_t)filep + i * PAGE_SIZE, phys_addr, PAGE_SIZE,
-            PAGE_USER | PAGE_WRITE | PAGE_PRESENT);
+    // 读取文件内容：只记录区域，sys_read写入时逐页缺页分配清零页面
+    auto filep = task->context->user_mm.allocate_area(attr.size, PAGE_WRITE, 0);
+    if(!filep) {
+        log_err("Failed to allocate %d bytes for executable\n", attr.size);
+        kernel::sys_close(fd, task);
+        return -1;
     }
     log_debug("File allocated at %x\n", filep);
-    int size = kernel::sys_read(fd, (uint32_t)filep, attr->size, task);
+    int size = kernel::sys_read(fd, (uint32_t)filep, attr.size, task);
     if(size <= 0) {
         task->context->user_mm.free_area((uint32_t)filep);
         log_err("Failed to read executable file\n");
@@ -304,8 +334,13 @@ int sys_execve(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, Task* ta
     // // 清理当前进程的地址空间
     // pcb->mm.unmap_pages(0x40000000, 0x80000000 - 0x40000000);
 
-    // 加载ELF文件
-    task->context->user_mm.map_pages(0x100000, 0x100000, 0x100000, PAGE_WRITE | PAGE_USER);
+    // 加载ELF文件：映像放在本进程私有的页面中，不再恒等映射到所有进程共用的物理内存；
+    // 段的地址先检查过，不会写到映像之外的内核内存
+    uint32_t image_end = ElfLoader::image_end(filep, size);
+    if(!image_end || !task->context->user_mm.map_image(image_end)) {
+        task->context->user_mm.free_area((uint32_t)filep);
+        return -1;
+    }
 
     // auto loadAddr = pcb->user_mm.allocate_area(0x4000, PAGE_WRITE, 0);
     // auto paddr = Kernel::instance().kernel_mm().allocPage();
@@ -317,8 +352,6 @@ int sys_execve(uint32_t path_ptr, uint32_t argv_ptr, uint32_t envp_ptr, Task* ta
         log_err("Failed to load ELF file\n");
         return -1;
     }
-    task->context->user_mm.map_pages(
-        0x100000, 0x100000, 0x100000, PAGE_USER | PAGE_WRITE | PAGE_PRESENT);
 
     const ElfHeader* header = static_cast<const ElfHeader*>(filep);
     uint32_t entry_point = header->entry;
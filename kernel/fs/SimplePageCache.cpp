@@ -1,70 +1,257 @@
 #include "kernel/fs/PageCache.h"
 #include <drivers/block_device.h>
 #include <kernel/fs/SimplePageCache.h>
+#include <kernel/kernel.h>
+#include <lib/debug.h>
 #include <lib/string.h>
 
+namespace {
+
+// 与页大小相同的数据页直接从伙伴系统分配，页面的引用计数记录缓存本身和用户映射的引用；
+// 其他大小的页面用kmalloc，不能被映射
+void* alloc_page_data(size_t size)
+{
+    if(size != PAGE_SIZE) {
+        return new uint8_t[size];
+    }
+    auto& mm = Kernel::instance().kernel_mm();
+    PADDR phys = mm.alloc_pages(0, 0);
+    return phys ? mm.phys2Virt(phys) : nullptr;
+}
+
+// 释放页缓存的数据页，先删除反向映射，避免内存规整访问已释放的页；
+// 仍被用户映射的页面在最后一个映射解除时才真正释放
+void release_page_data(Page& page)
+{
+    if(page.size != PAGE_SIZE) {
+        delete[] static_cast<uint8_t*>(page.data);
+        return;
+    }
+    auto& mm = Kernel::instance().kernel_mm();
+    PADDR phys = mm.virt2Phys(page.data);
+    mm.rmap().remove_cache(phys);
+    mm.decrement_ref_count(phys);
+}
+
+// 页面被映射到用户地址空间或被get_page固定时，除了缓存自己的引用还有其他引用
+bool page_mapped(const Page& page)
+{
+    if(page.size != PAGE_SIZE) {
+        return false;
+    }
+    auto& mm = Kernel::instance().kernel_mm();
+    auto pg = mm.phys_to_page(mm.virt2Phys(page.data));
+    return pg && page_ref_count(pg) > 1;
+}
+
+} // namespace
+
 SimplePageCache::SimplePageCache(kernel::BlockDevice* dev, size_t page_size, size_t max_pages)
     : dev_(dev), page_size_(page_size), max_pages_(max_pages)
 {
+    shrinker_.name = "page_cache";
+    shrinker_.priv = this;
+    shrinker_.count = [](kernel::Shrinker* s) -> uint32_t {
+        auto self = (SimplePageCache*)s->priv;
+        return self->cache_.size() * self->page_size_ / PAGE_SIZE;
+    };
+    // 回收路径不能等待mtx_：持有mtx_的get_page可能正是触发回收的分配者。
+    // 只有不小于PAGE_SIZE的数据页直接还给伙伴系统，计入返回值；
+    // 更小的页面释放到slab，由slab的收缩器在整页空闲后回收
+    shrinker_.scan = [](kernel::Shrinker* s, uint32_t nr_pages) -> uint32_t {
+        auto self = (SimplePageCache*)s->priv;
+        if(!self->mtx_.tryLock()) {
+            return 0;
+        }
+        size_t page_size = self->page_size_;
+        size_t n = self->evict((nr_pages * PAGE_SIZE + page_size - 1) / page_size);
+        self->mtx_.unlock();
+        return page_size >= PAGE_SIZE ? n * ((page_size + PAGE_SIZE - 1) / PAGE_SIZE) : 0;
+    };
+    kernel::register_shrinker(&shrinker_);
+}
+SimplePageCache::~SimplePageCache()
+{
+    kernel::unregister_shrinker(&shrinker_);
+    clear();
+}
+
+// 近似LRU（second chance）：第一遍清除最近访问过的页的referenced标志，
+// 只淘汰没有被再次访问的干净页；第一遍淘汰不够时第二遍淘汰所有干净页。
+// 脏页需要先写回，被用户映射的页面还在使用，这里都不淘汰
+size_t SimplePageCache::evict(size_t nr)
+{
+    size_t evicted = 0;
+    for(int pass = 0; pass < 2 && evicted < nr; pass++) {
+        evicted += cache_.erase_if(
+            [](const PageKey&, Page& page) {
+                if(page.dirty || page.pins || page_mapped(page)) {
+                    return false;
+                }
+                if(page.referenced) {
+                    page.referenced = false;
+                    return false;
+                }
+                release_page_data(page);
+                return true;
+            },
+            nr - evicted);
+    }
+    return evicted;
 }
-SimplePageCache::~SimplePageCache() { clear(); }
 
 bool SimplePageCache::exists(const PageKey& key) const
 {
     return cache_.find(key) != nullptr;
 }
 
+// 固定计数阻止淘汰和失效；PAGE_SIZE的数据页另外持有一个页面引用，
+// 内存规整看到多个引用就不会迁移它，page->data在固定期间保持不变
 Page* SimplePageCache::get_page(const PageKey& key)
 {
     kernel::LockGuard lock(mtx_);
+    Page* page = lookup_or_read(key);
+    if(page) {
+        pin(page);
+    }
+    return page;
+}
+
+void SimplePageCache::put_page(Page* page)
+{
+    kernel::LockGuard lock(mtx_);
+    unpin(page);
+}
+
+void SimplePageCache::pin(Page* page)
+{
+    page->pins++;
+    if(page->size == PAGE_SIZE) {
+        auto& mm = Kernel::instance().kernel_mm();
+        mm.increment_ref_count(mm.virt2Phys(page->data));
+    }
+}
+
+void SimplePageCache::unpin(Page* page)
+{
+    if(!page || page->pins == 0) {
+        log_err("put_page: page is not pinned\n");
+        return;
+    }
+    page->pins--;
+    if(page->size == PAGE_SIZE) {
+        auto& mm = Kernel::instance().kernel_mm();
+        mm.decrement_ref_count(mm.virt2Phys(page->data));
+    }
+}
+
+uint32_t SimplePageCache::map_page(const PageKey& key)
+{
+    if(page_size_ != PAGE_SIZE) {
+        return 0;
+    }
+    // 持有mtx_期间内存规整不会迁移该页，增加引用之后迁移也会因为多个引用而跳过
+    kernel::LockGuard lock(mtx_);
+    Page* page = lookup_or_read(key);
+    if(!page) {
+        return 0;
+    }
+    auto& mm = Kernel::instance().kernel_mm();
+    PADDR phys = mm.virt2Phys(page->data);
+    mm.increment_ref_count(phys);
+    return phys;
+}
+
+uint32_t SimplePageCache::map_cached_page(const PageKey& key)
+{
+    if(page_size_ != PAGE_SIZE) {
+        return 0;
+    }
+    kernel::LockGuard lock(mtx_);
+    Page* page = cache_.find(key);
+    if(!page) {
+        return 0;
+    }
+    page->referenced = true;
+    auto& mm = Kernel::instance().kernel_mm();
+    PADDR phys = mm.virt2Phys(page->data);
+    mm.increment_ref_count(phys);
+    return phys;
+}
+
+Page* SimplePageCache::lookup_or_read(const PageKey& key)
+{
     auto it = cache_.find(key);
     if (it) {
+        it->referenced = true;
         return it;
     }
 
     // 从设备读取页面
     if(cache_.size() >= max_pages_) {
-        // 淘汰策略：移除最早插入的页
-        // TODO:
-        // cache_.erase(cache_.begin());
+        // 缓存已满，淘汰一个最近没有访问过的干净页
+        evict(1);
     }
     Page page{};
     page.size = page_size_;
-    page.data = new uint8_t[page_size_];
+    page.data = alloc_page_data(page_size_);
+    if(!page.data) {
+        return nullptr;
+    }
     dev_->read_block(key.block_id, page.data);
     page.dirty = false;
+    page.referenced = true;
     auto ret = cache_.insert(key, page);
+    // 数据页可以被内存规整迁移，迁移时会在持有mtx_的情况下修改ret->data
+    if(page_size_ == PAGE_SIZE) {
+        auto& mm = Kernel::instance().kernel_mm();
+        mm.rmap().add_cache(mm.virt2Phys(ret->data), &ret->data, &mtx_);
+    }
     return ret;
 }
 
+// buf可能是会缺页的用户缓冲区，缺页处理又可能进入页缓存，
+// 所以只在mtx_下固定页面，复制在解锁之后进行
 size_t SimplePageCache::read_page(
     const PageKey& key, size_t offset, void* buf, size_t size)
 {
-    kernel::LockGuard lock(mtx_);
-    auto it = cache_.find(key);
-    if (!it) {
-        return 0;
-    }
     if(offset >= page_size_)
         return 0;
+    Page* page;
+    {
+        kernel::LockGuard lock(mtx_);
+        page = cache_.find(key);
+        if(!page) {
+            return 0;
+        }
+        pin(page);
+    }
     size_t n = min(size, page_size_ - offset);
-    memcpy(buf, static_cast<uint8_t*>(it->data) + offset, n);
+    memcpy(buf, static_cast<uint8_t*>(page->data) + offset, n);
+    put_page(page);
     return n;
 }
 
 size_t SimplePageCache::write_page(
     const PageKey& key, size_t offset, const void* buf, size_t size)
 {
-    kernel::LockGuard lock(mtx_);
-    auto it = cache_.find(key);
-    if (!it) {
-        return 0;
-    }
     if(offset >= page_size_)
         return 0;
+    Page* page;
+    {
+        kernel::LockGuard lock(mtx_);
+        page = cache_.find(key);
+        if(!page) {
+            return 0;
+        }
+        pin(page);
+    }
     size_t n = min(size, page_size_ - offset);
-    memcpy(static_cast<uint8_t*>(it->data) + offset, buf, n);
-    it->dirty = true;
+    memcpy(static_cast<uint8_t*>(page->data) + offset, buf, n);
+    // 复制完成之后才标记，避免并发的写回在复制完成前清除脏标记
+    kernel::LockGuard lock(mtx_);
+    page->dirty = true;
+    unpin(page);
     return n;
 }
 
@@ -77,6 +264,21 @@ void SimplePageCache::mark_dirty(const PageKey& key)
     }
 }
 
+// 共享映射只有第一次写入时缺页并标记脏页，之后通过映射的写入不再经过页缓存，
+// 所以仍被映射的页面写回后保持脏标记，下次刷新时再写一次
+bool SimplePageCache::writeback(const PageKey& key, Page& page)
+{
+    if(!page.dirty) {
+        return true;
+    }
+    if(!dev_->write_block(key.block_id, page.data)) {
+        log_err("page cache: write back block %d failed\n", (uint32_t)key.block_id);
+        return false;
+    }
+    page.dirty = page_mapped(page);
+    return true;
+}
+
 bool SimplePageCache::flush(const PageKey& key)
 {
     kernel::LockGuard lock(mtx_);
@@ -84,39 +286,34 @@ bool SimplePageCache::flush(const PageKey& key)
     if(!it) {
         return false;
     }
-    if(!it->dirty)
-        return true;
-    // TODO: 实际写回到后端存储，这里仅标记为已刷写
-    it->dirty = false;
-    return true;
+    return writeback(key, *it);
 }
 
 void SimplePageCache::flush_all()
 {
     kernel::LockGuard lock(mtx_);
-    cache_.for_each([](const PageKey& key, Page& page) {
-        if(page.dirty) {
-            // TODO: 实际写回到后端存储
-            page.dirty = false;
-        }
-    });
+    cache_.for_each([this](const PageKey& key, Page& page) { writeback(key, page); });
 }
 
-void SimplePageCache::invalidate(const PageKey& key)
+bool SimplePageCache::invalidate(const PageKey& key)
 {
     kernel::LockGuard lock(mtx_);
     auto it = cache_.find(key);
     if(it != nullptr) {
-        delete[] static_cast<uint8_t*>(it->data);
+        if(it->pins) {
+            return false;
+        }
+        release_page_data(*it);
         cache_.erase(key);
     }
+    return true;
 }
 
 void SimplePageCache::clear()
 {
     kernel::LockGuard lock(mtx_);
-    cache_.for_each([this](const PageKey& key, Page& page) {
-        delete[] static_cast<uint8_t*>(page.data);
+    cache_.for_each([](const PageKey&, Page& page) {
+        release_page_data(page);
     });
     cache_.clear();
 }
@@ -131,12 +328,14 @@ void SimplePageCache::set_max_pages(size_t max_pages)
 {
     kernel::LockGuard lock(mtx_);
     max_pages_ = max_pages;
-    while(cache_.size() > max_pages_) {
-        //cache_.erase(cache_.begin());
-        // TODO:
+    if(cache_.size() > max_pages_) {
+        // 只剩脏页时无法继续淘汰，超出部分留到写回之后
+        evict(cache_.size() - max_pages_);
     }
 }
 
+DEFINE_SLAB_CACHE_OPERATORS(HashListNode, "page_cache_node")
+
 HashList::HashList(size_t bucket_count)
     : bucket_count_(bucket_count), size_(0)
 {
@@ -229,3 +428,23 @@ void HashList::for_each(Func f) {
         }
     }
 }
+
+template<typename Pred>
+size_t HashList::erase_if(Pred pred, size_t max_count) {
+    size_t erased = 0;
+    for (size_t i = 0; i < bucket_count_ && erased < max_count; ++i) {
+        HashListNode** pnode = &buckets[i];
+        while (*pnode && erased < max_count) {
+            HashListNode* node = *pnode;
+            if (pred(node->key, node->value)) {
+                *pnode = node->next;
+                delete node;
+                --size_;
+                ++erased;
+            } else {
+                pnode = &node->next;
+            }
+        }
+    }
+    return erased;
+}
@@ -2,6 +2,9 @@
 #include <kernel/dirent.h>
 #include <kernel/kernel.h>
 #include <kernel/memfs.h>
+#include <kernel/process.h>
+#include <kernel/syscall.h>
+#include <kernel/user_memory.h>
 #include <lib/console.h>
 #include <lib/debug.h>
 #include <lib/string.h>
@@ -9,39 +12,202 @@
 namespace kernel
 {
 
-MemFSFileDescriptor::MemFSFileDescriptor(MemFSInode* inode) : inode(inode), offset(0) {}
+DEFINE_SLAB_CACHE_OPERATORS(MemFSInode, "memfs_inode")
 
-MemFSFileDescriptor::~MemFSFileDescriptor() {}
+namespace
+{
+
+// 释放节点的数据页和节点本身
+void destroy_inode(MemFSInode* inode)
+{
+    inode->pages.clear();
+    delete inode;
+}
+
+void get_inode(MemFSInode* inode)
+{
+    LockGuard guard(inode->lock);
+    inode->refs++;
+}
+
+// 归还一个引用，节点已被删除且这是最后一个引用时释放节点
+void put_inode(MemFSInode* inode)
+{
+    inode->lock.lock();
+    bool last = --inode->refs == 0 && inode->unlinked;
+    inode->lock.unlock();
+    if(last) {
+        destroy_inode(inode);
+    }
+}
+
+// 在lock下取得第index页并增加一个引用，之后不持有lock也可以访问页面内容；
+// alloc为false时空洞返回0
+PADDR get_data_page(MemFSInode* inode, uint32_t index, bool alloc)
+{
+    LockGuard guard(inode->lock);
+    PADDR phys = alloc ? inode->pages.get_or_alloc(index) : inode->pages.lookup(index);
+    if(phys) {
+        Kernel::instance().kernel_mm().increment_ref_count(phys);
+    }
+    return phys;
+}
+
+// 从offset开始写入size字节，需要的页面按需分配，返回写入的字节数
+size_t write_pages(MemFSInode* inode, size_t offset, const void* buffer, size_t size)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    auto src = static_cast<const uint8_t*>(buffer);
+    size_t done = 0;
+    while(done < size) {
+        size_t pos = offset + done;
+        size_t in_page = pos & (PAGE_SIZE - 1);
+        size_t n = min(size - done, PAGE_SIZE - in_page);
+        PADDR phys = get_data_page(inode, pos / PAGE_SIZE, true);
+        if(!phys) {
+            break;
+        }
+        memcpy((uint8_t*)mm.phys2Virt(phys) + in_page, src + done, n);
+        mm.decrement_ref_count(phys);
+        done += n;
+    }
+    LockGuard guard(inode->lock);
+    if(offset + done > inode->size) {
+        inode->size = offset + done;
+    }
+    return done;
+}
+
+} // namespace
+
+uint32_t* MemFSPageTree::slots(PADDR node)
+{
+    return (uint32_t*)Kernel::instance().kernel_mm().phys2Virt(node);
+}
+
+PADDR MemFSPageTree::lookup(uint32_t index) const
+{
+    if(height == 0 || (height == 1 && index >= SLOTS)) {
+        return 0;
+    }
+    PADDR leaf = height == 2 ? slots(root)[index / SLOTS] : root;
+    return leaf ? slots(leaf)[index % SLOTS] : 0;
+}
+
+PADDR MemFSPageTree::get_or_alloc(uint32_t index)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    // 高度不够时在上面加一层，原来的根成为新根的第0个槽位
+    uint32_t need = index < SLOTS ? 1 : 2;
+    while(height < need) {
+        PADDR new_root = mm.alloc_pages(__GFP_ZERO, 0);
+        if(!new_root) {
+            return 0;
+        }
+        if(height) {
+            slots(new_root)[0] = root;
+        }
+        root = new_root;
+        height++;
+    }
+
+    PADDR leaf = root;
+    if(height == 2) {
+        uint32_t& slot = slots(root)[index / SLOTS];
+        if(!slot) {
+            slot = mm.alloc_pages(__GFP_ZERO, 0);
+            if(!slot) {
+                return 0;
+            }
+        }
+        leaf = slot;
+    }
+    uint32_t& page = slots(leaf)[index % SLOTS];
+    if(!page) {
+        // 页面的一部分可能永远不会被写入，读出的内容必须是零
+        page = mm.alloc_pages(__GFP_ZERO, 0);
+        if(page) {
+            pages++;
+        }
+    }
+    return page;
+}
+
+void MemFSPageTree::release_leaf(PADDR leaf)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    uint32_t* pt = slots(leaf);
+    for(uint32_t i = 0; i < SLOTS; i++) {
+        if(pt[i]) {
+            mm.decrement_ref_count(pt[i]);
+        }
+    }
+    mm.free_pages(leaf, 0);
+}
+
+void MemFSPageTree::clear()
+{
+    if(height == 2) {
+        uint32_t* pt = slots(root);
+        for(uint32_t i = 0; i < SLOTS; i++) {
+            if(pt[i]) {
+                release_leaf(pt[i]);
+            }
+        }
+        Kernel::instance().kernel_mm().free_pages(root, 0);
+    } else if(height == 1) {
+        release_leaf(root);
+    }
+    root = 0;
+    height = 0;
+    pages = 0;
+}
+
+// 描述符持有节点的引用，文件被删除后已打开的描述符仍然可以访问
+MemFSFileDescriptor::MemFSFileDescriptor(MemFS* fs, MemFSInode* inode)
+    : fs(fs), inode(inode), offset(0)
+{
+    get_inode(inode);
+}
+
+MemFSFileDescriptor::~MemFSFileDescriptor()
+{
+    put_inode(inode);
+}
 
 ssize_t MemFSFileDescriptor::read(void* buffer, size_t size)
 {
     log_debug(
         "MemFSFileDescriptor::read inode: %x, offset:%d, inode->size:%d\n", inode, offset, size);
-    if(offset >= inode->size) {
+    size_t file_size;
+    {
+        LockGuard guard(inode->lock);
+        file_size = inode->size;
+    }
+    if(offset >= file_size) {
         return 0;
     }
-    log_debug("inode->data %x\n", inode->data);
 
-    size_t remaining = inode->size - offset;
+    size_t remaining = file_size - offset;
     size_t read_size = size < remaining ? size : remaining;
 
-    log_debug("read to buffer %x, from:%x, size: %d\n", buffer, inode->data + offset, read_size);
-    auto to = buffer;
-    auto from = inode->data + offset;
-
-    // auto pde = *(uint32_t*)(0xc0400404);
-    // debug_debug("pde: %x", pde);
-    // Kernel::instance().kernel_mm().paging().disablePaging();
-    // pde = *(uint32_t*)(0x400404);
-    // debug_debug("pde: %x", pde);
-    // Kernel::instance().kernel_mm().paging().enablePaging();
-
-    for(size_t i = 0; i < read_size; i++) {
-        // debug_debug("read %d, %d", i, read_size);
-        ((uint8_t*)to)[i] = ((uint8_t*)from)[i];
+    // 逐页复制，空洞读出全零
+    auto& mm = Kernel::instance().kernel_mm();
+    auto to = static_cast<uint8_t*>(buffer);
+    size_t done = 0;
+    while(done < read_size) {
+        size_t pos = offset + done;
+        size_t in_page = pos & (PAGE_SIZE - 1);
+        size_t n = min(read_size - done, PAGE_SIZE - in_page);
+        PADDR phys = get_data_page(inode, pos / PAGE_SIZE, false);
+        if(phys) {
+            memcpy(to + done, (uint8_t*)mm.phys2Virt(phys) + in_page, n);
+            mm.decrement_ref_count(phys);
+        } else {
+            memset(to + done, 0, n);
+        }
+        done += n;
     }
-    log_debug("read from %x, to:%x, done\n", from, to);
-    // memcpy(buffer, inode->data + offset, read_size);
     offset += read_size;
     log_debug("read_size %x\n", read_size);
     return read_size;
@@ -49,30 +215,21 @@ ssize_t MemFSFileDescriptor::read(void* buffer, size_t size)
 
 ssize_t MemFSFileDescriptor::write(const void* buffer, size_t size)
 {
-    if(offset + size > inode->capacity) {
-        size_t new_capacity = (offset + size) * 2;
-        uint8_t* new_data = new uint8_t[new_capacity];
-
-        if(inode->data) {
-            memcpy(new_data, inode->data, inode->size);
-            delete[] inode->data;
+    // 文件按页存放，追加只需要分配新页面，不复制已有数据
+    size_t written = write_pages(inode, offset, buffer, size);
+    if(written < size) {
+        log_err("MemFS: out of memory writing %s at offset %d\n", inode->name, offset + written);
+        if(!written) {
+            return -1;
         }
-
-        inode->data = new_data;
-        inode->capacity = new_capacity;
     }
-
-    memcpy(inode->data + offset, buffer, size);
-    offset += size;
-    if(offset > inode->size)
-        inode->size = offset;
-    return size;
+    offset += written;
+    return written;
 }
 
 int MemFSFileDescriptor::seek(size_t new_offset)
 {
-    if(new_offset > inode->size)
-        return -1;
+    // 允许越过文件末尾，之后的写入在中间留下空洞
     offset = new_offset;
     return 0;
 }
@@ -88,6 +245,7 @@ int MemFSFileDescriptor::iterate(void* buffer, size_t buffer_size, uint32_t* pos
     if (!inode || inode->type != FT_DIR) {
         return -1; // 非目录不支持遍历
     }
+    LockGuard guard(fs->tree_lock);
 
     MemFSInode* child = inode->children;
     uint32_t count = 0;
@@ -120,6 +278,61 @@ int MemFSFileDescriptor::iterate(void* buffer, size_t buffer_size, uint32_t* pos
 
 }
 
+void* MemFSFileDescriptor::mmap(void*, size_t length, int prot, int flags, size_t offset)
+{
+    if(inode->type != FT_REG || (offset & (PAGE_SIZE - 1))) {
+        return (void*)MAP_FAILED;
+    }
+    auto mapping = new MemFSFileMapping(inode);
+    if(!mapping) {
+        return (void*)MAP_FAILED;
+    }
+    uint32_t area_flags = (prot & PROT_WRITE) ? PAGE_WRITE : 0;
+    uint32_t type = (flags & MAP_SHARED) ? MEM_TYPE_SHARED : MEM_TYPE_MMAP_FILE;
+    auto& user_mm = ProcessManager::get_current_task()->context->user_mm;
+    void* mapped = user_mm.allocate_file_area(length, area_flags, type, mapping, offset / PAGE_SIZE);
+    // 区域持有自己的引用
+    mapping->put();
+    return mapped ? mapped : (void*)MAP_FAILED;
+}
+
+MemFSFileMapping::MemFSFileMapping(MemFSInode* inode) : inode(inode)
+{
+    get_inode(inode);
+}
+
+MemFSFileMapping::~MemFSFileMapping()
+{
+    put_inode(inode);
+}
+
+uint32_t MemFSFileMapping::get_page(uint32_t pgoff)
+{
+    LockGuard guard(inode->lock);
+    if(pgoff >= (inode->size + PAGE_SIZE - 1) / PAGE_SIZE) {
+        return 0;
+    }
+    // 映射空洞时补上页面，共享映射的写入才能留在文件中
+    PADDR phys = inode->pages.get_or_alloc(pgoff);
+    if(phys) {
+        Kernel::instance().kernel_mm().increment_ref_count(phys);
+    }
+    return phys;
+}
+
+uint32_t MemFSFileMapping::find_page(uint32_t pgoff)
+{
+    LockGuard guard(inode->lock);
+    if(pgoff >= (inode->size + PAGE_SIZE - 1) / PAGE_SIZE) {
+        return 0;
+    }
+    PADDR phys = inode->pages.lookup(pgoff);
+    if(phys) {
+        Kernel::instance().kernel_mm().increment_ref_count(phys);
+    }
+    return phys;
+}
+
 MemFS::MemFS() : root(nullptr) {}
 
 char* MemFS::get_name()
@@ -206,22 +419,17 @@ int MemFS::load_initramfs(const void* data, size_t size)
 
         log_debug("Inode created at %x\n", (unsigned int)inode);
         if(type == FT_REG && filesize > 0) {
-            log_debug("Creating data buffer for file, size: %d bytes\n", filesize);
-            inode->data = new uint8_t[filesize];
-            inode->size = filesize;
-            inode->capacity = filesize;
-            log_debug(
-                "Data buffer created at %x, size: %d bytes\n", (unsigned int)inode->data, filesize);
-            memcpy(inode->data, ptr, filesize);
-            log_debug("Data copied, size: %d bytes\n", filesize);
+            if(write_pages(inode, 0, ptr, filesize) < filesize) {
+                log_err("MemFS: out of memory loading %s\n", name);
+            }
+            log_debug("Data copied, size: %d bytes, %d pages\n", inode->size,
+                inode->pages.nr_pages());
         } else {
             log_debug("filetype is %d, filesize is %d\n", type, filesize);
-            inode->data = nullptr;
-            inode->size = 0;
-            inode->capacity = 0;
         }
 
         // 添加到文件系统
+        LockGuard guard(tree_lock);
         inode->parent = root;
         inode->next = root->children;
         root->children = inode;
@@ -292,9 +500,9 @@ MemFSInode* MemFS::create_inode(const char* name, FileType type)
     strncpy(inode->name, name, sizeof(inode->name) - 1);
     inode->type = type;
     inode->mode = 0755; // 设置默认权限
-    inode->data = nullptr;
     inode->size = 0;
-    inode->capacity = 0;
+    inode->refs = 0;
+    inode->unlinked = false;
     inode->parent = nullptr;
     inode->children = nullptr;
     inode->next = nullptr;
@@ -306,9 +514,8 @@ MemFSInode* MemFS::create_inode(const char* name, FileType type)
 //     char name[256];       // 文件名
 //     FileType type;        // 文件类型
 //     FilePermission perm;  // 文件权限
-//     uint8_t* data;        // 文件数据
+//     MemFSPageTree pages;  // 文件数据
 //     size_t size;          // 文件大小
-//     size_t capacity;      // 数据缓冲区容量
 //     MemFSInode* parent;   // 父目录
 //     MemFSInode* children; // 子文件/目录列表
 //     MemFSInode* next;     // 同级节点链表
@@ -316,7 +523,8 @@ MemFSInode* MemFS::create_inode(const char* name, FileType type)
 // };
 void MemFSInode::print()
 {
-    log_debug("Inode: %s, type: %d, size: %d, capacity: %d\n", name, (int)type, size, capacity);
+    log_debug("Inode: %s, type: %d, size: %d, pages: %d\n", name, (int)type, size,
+        pages.nr_pages());
 }
 
 
@@ -338,29 +546,38 @@ void MemFS::free_inode(MemFSInode* inode)
         free_inode(child);
     }
 
-    // 释放数据和节点本身
-    if(inode->data)
-        delete[] inode->data;
-    delete inode;
+    // 还有描述符或文件映射时只标记删除，最后一个引用释放时再释放数据和节点本身
+    inode->lock.lock();
+    bool busy = inode->refs;
+    inode->unlinked = true;
+    inode->parent = nullptr;
+    inode->lock.unlock();
+    if(!busy) {
+        destroy_inode(inode);
+    }
 }
 
 FileDescriptor* MemFS::open(const char* path)
 {
     log_debug("Opening filedescriptor for path: %s\n", path);
+    // 描述符在tree_lock下取得引用，之后节点被删除也不会被释放
+    LockGuard guard(tree_lock);
     MemFSInode* inode = find_inode(path);
     if(!inode)
         return nullptr;
-    return new MemFSFileDescriptor(inode);
+    return new MemFSFileDescriptor(this, inode);
 }
 
 int MemFS::stat(const char* path, FileAttribute* attr)
 {
+    LockGuard guard(tree_lock);
     MemFSInode* inode = find_inode(path);
     if(!inode)
         return -1;
 
     attr->type = inode->type;
     attr->mode = inode->mode;
+    LockGuard inode_guard(inode->lock);
     attr->size = inode->size;
     return 0;
 }
@@ -380,6 +597,7 @@ int MemFS::mkdir(const char* path)
     strncpy(parent_path, path, parent_len);
     parent_path[parent_len] = '\0';
 
+    LockGuard guard(tree_lock);
     MemFSInode* parent = find_inode(parent_path);
     if(!parent || parent->type != FT_DIR)
         return -1;
@@ -409,6 +627,7 @@ int MemFS::unlink(const char* path)
     if(!path || !*path)
         return -1;
 
+    LockGuard guard(tree_lock);
     MemFSInode* file = find_inode(path);
     if(!file || file->type != FT_REG)
         return -1;
@@ -439,6 +658,7 @@ int MemFS::rmdir(const char* path)
     if(!path || !*path || strcmp(path, "/") == 0)
         return -1;
 
+    LockGuard guard(tree_lock);
     MemFSInode* dir = find_inode(path);
     if(!dir || dir->type != FT_DIR)
         return -1;
@@ -1,4 +1,5 @@
 #include <arch/x86/interrupt.h>
+#include <kernel/kernel.h>
 #include <kernel/syscall.h>
 #include <kernel/vfs.h>
 #include <lib/console.h>
@@ -8,6 +9,17 @@
 namespace kernel
 {
 
+// 页缓存持有读入的页面，get_page的引用立即归还
+bool FileMapping::prefetch(uint32_t pgoff)
+{
+    uint32_t phys = get_page(pgoff);
+    if(!phys) {
+        return false;
+    }
+    Kernel::instance().kernel_mm().decrement_ref_count(phys);
+    return true;
+}
+
 // 最大挂载点数量
 const int MAX_MOUNT_POINTS = 16;
 
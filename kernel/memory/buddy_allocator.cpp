@@ -7,44 +7,178 @@
 void BuddyAllocator::init(uint32_t start_addr, uint32_t size)
 {
     log_info("BuddyAllocator::init(start_addr 0x%x, size:%d(0x%x))\n", start_addr, size, size);
-    // 先分配PageInfo元数据空间
+    // 先分配页面描述符数组
     page_count = size / PAGE_SIZE;
-    uint32_t info_bytes = page_count * sizeof(PageInfo);
+    uint32_t info_bytes = page_count * sizeof(page);
     info_bytes = (info_bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); // 按页对齐
 
     // 调整实际管理的内存区域
     real_start = start_addr;
     memory_start = start_addr + info_bytes;
     memory_size = size - info_bytes;
-    log_info("page_info size:%d(0x%x), memory_start:0x%x\n", info_bytes, info_bytes, memory_start);
-
-    // 设置page_info指针并初始化
-    page_info = reinterpret_cast<PageInfo*>(Kernel::instance().kernel_mm().phys2Virt(start_addr));
-    log_debug("memset page_info(0x%x, phys:0x%x), size:%d(0x%x)\n", page_info, start_addr, info_bytes, info_bytes);
-    memset(page_info, 0, info_bytes);
-    log_debug("memset page_info done\n");
+    log_info("mem_map size:%d(0x%x), memory_start:0x%x\n", info_bytes, info_bytes, memory_start);
+
+    // 设置mem_map指针并初始化
+    mem_map = reinterpret_cast<page*>(Kernel::instance().kernel_mm().phys2Virt(start_addr));
+    log_debug("memset mem_map(0x%x, phys:0x%x), size:%d(0x%x)\n", mem_map, start_addr, info_bytes, info_bytes);
+    memset(mem_map, 0, info_bytes);
+    // 描述符数组本身占用的页面标记为保留
+    for(uint32_t i = 0; i < info_bytes / PAGE_SIZE; i++) {
+        mem_map[i].flags = PG_RESERVED;
+    }
+    log_debug("memset mem_map done\n");
 
 
     // 初始化所有空闲链表为空
     log_debug("init free_lists\n");
-    for(int i = 0; i <= MAX_ORDER; i++) {
-        free_lists[i] = nullptr;
+    for(uint32_t i = 0; i <= MAX_ORDER; i++) {
+        kernel::INIT_LIST_HEAD(&free_lists[i]);
+        nr_free[i] = 0;
+    }
+
+    // 把[memory_start, end)切分成按绝对页帧号自然对齐的最大块加入空闲链表，
+    // 区域大小不是2的幂或起点不对齐时会得到多个块
+    uint32_t pfn = memory_start / PAGE_SIZE;
+    uint32_t end_pfn = (memory_start + memory_size) / PAGE_SIZE;
+    uint32_t blocks = 0;
+    while(pfn < end_pfn) {
+        uint32_t order = 0;
+        while(order < MAX_ORDER && (pfn & ((1u << (order + 1)) - 1)) == 0 &&
+              pfn + (1u << (order + 1)) <= end_pfn) {
+            order++;
+        }
+        add_free_block(pfn, order);
+        pfn += 1u << order;
+        blocks++;
+    }
+    log_debug("BuddyAllocator: init, %d pages seeded as %d blocks\n", end_pfn - memory_start / PAGE_SIZE,
+        blocks);
+}
+
+uint32_t BuddyAllocator::allocate_pages([[maybe_unused]] uint32_t gfp_mask, uint32_t order)
+{
+    uint32_t block_phys = take_free_block(order);
+    if(block_phys == 0) {
+        return 0;
     }
 
-    // 将整个内存区域作为一个大块加入到合适的空闲链表中
-    // 修改这里使用的总页数为调整后的值
-    uint32_t total_pages = memory_size / PAGE_SIZE;
-    uint32_t order = get_block_order(total_pages);
-
-    log_debug("total_pages:%d\n", total_pages);
-    FreeBlock* block = (FreeBlock*)Kernel::instance().kernel_mm().phys2Virt(memory_start);
-    block->next = nullptr;
-    block->size = 1 << order;
-    log_debug("BuddyAllocator: init, block size: %d, order:%d\n", block->size, order);
-    free_lists[order] = block;
+    prep_new_pages(block_phys, order);
+    return block_phys;
 }
 
-uint32_t BuddyAllocator::allocate_pages(uint32_t gfp_mask, uint32_t order)
+void BuddyAllocator::free_pages(uint32_t phys, uint32_t order)
+{
+    // 验证地址是否有效
+    if(!contains(phys, order)) {
+        log_err("Invalid phys address: 0x%x\n", phys);
+        return;
+    }
+
+    clear_page_state(phys, order);
+    return_free_block(phys, order);
+}
+
+void BuddyAllocator::free_range(uint32_t phys, uint32_t nr_pages)
+{
+    uint32_t pfn = phys / PAGE_SIZE;
+    while(nr_pages) {
+        uint32_t order = 0;
+        while(order < MAX_ORDER && (pfn & ((1u << (order + 1)) - 1)) == 0 &&
+              (1u << (order + 1)) <= nr_pages) {
+            order++;
+        }
+        free_pages(pfn * PAGE_SIZE, order);
+        pfn += 1u << order;
+        nr_pages -= 1u << order;
+    }
+}
+
+uint32_t BuddyAllocator::find_free_block(uint32_t pfn, uint32_t& order)
+{
+    uint32_t start_pfn = memory_start / PAGE_SIZE;
+    for(uint32_t o = 0; o <= MAX_ORDER; o++) {
+        uint32_t candidate = pfn & ~((1u << o) - 1);
+        if(candidate < start_pfn) {
+            break;
+        }
+        const page* pg = page_at(candidate - real_start / PAGE_SIZE);
+        if((pg->flags & PG_BUDDY) && candidate + (1u << page_order(pg)) > pfn) {
+            order = page_order(pg);
+            return candidate;
+        }
+    }
+    return NO_PAGE;
+}
+
+bool BuddyAllocator::claim_range(uint32_t phys, uint32_t nr_pages)
+{
+    uint32_t start = phys / PAGE_SIZE;
+    uint32_t end = start + nr_pages;
+    if(phys % PAGE_SIZE != 0 || phys < memory_start ||
+        end > (memory_start + memory_size) / PAGE_SIZE) {
+        return false;
+    }
+
+    // 先确认整个范围都是空闲的
+    uint32_t order;
+    for(uint32_t pfn = start; pfn < end;) {
+        uint32_t head = find_free_block(pfn, order);
+        if(head == NO_PAGE) {
+            return false;
+        }
+        pfn = head + (1u << order);
+    }
+
+    // 只有第一个块可能从范围之前开始，只有最后一个块可能越过范围末尾
+    for(uint32_t pfn = start; pfn < end;) {
+        uint32_t head = find_free_block(pfn, order);
+        uint32_t block_end = head + (1u << order);
+        del_free_block(head, order);
+        if(head < start) {
+            free_range(head * PAGE_SIZE, start - head);
+        }
+        if(block_end > end) {
+            free_range(end * PAGE_SIZE, block_end - end);
+        }
+        pfn = block_end;
+    }
+    return true;
+}
+
+kernel::list_head* BuddyAllocator::pfn_to_node(uint32_t pfn)
+{
+    return (kernel::list_head*)Kernel::instance().kernel_mm().phys2Virt(pfn * PAGE_SIZE);
+}
+
+void BuddyAllocator::add_free_block(uint32_t pfn, uint32_t order)
+{
+    page* pg = page_at(pfn - real_start / PAGE_SIZE);
+    pg->flags = PG_BUDDY;
+    set_page_order(pg, order);
+    kernel::list_add(pfn_to_node(pfn), &free_lists[order]);
+    nr_free[order]++;
+}
+
+void BuddyAllocator::del_free_block(uint32_t pfn, uint32_t order)
+{
+    page_at(pfn - real_start / PAGE_SIZE)->flags = 0;
+    kernel::list_del_init(pfn_to_node(pfn));
+    nr_free[order]--;
+}
+
+// 伙伴块完全落在可分配区域内，且其首页是同order的空闲块时才能合并
+bool BuddyAllocator::is_free_buddy(uint32_t pfn, uint32_t order)
+{
+    uint32_t start_pfn = memory_start / PAGE_SIZE;
+    uint32_t end_pfn = (memory_start + memory_size) / PAGE_SIZE;
+    if(pfn < start_pfn || pfn + (1u << order) > end_pfn) {
+        return false;
+    }
+    const page* pg = page_at(pfn - real_start / PAGE_SIZE);
+    return (pg->flags & PG_BUDDY) && page_order(pg) == order;
+}
+
+uint32_t BuddyAllocator::take_free_block(uint32_t order)
 {
     // 检查order是否超出范围
     if(order > MAX_ORDER) {
@@ -52,227 +186,158 @@ uint32_t BuddyAllocator::allocate_pages(uint32_t gfp_mask, uint32_t order)
         return 0;
     }
 
-    // 计算页面数量
-    uint32_t num_pages = 1 << order;
-
     // 查找可用的最小块
     uint32_t current_order = order;
-    while(current_order <= MAX_ORDER && !free_lists[current_order]) {
+    while(current_order <= MAX_ORDER && kernel::list_empty(&free_lists[current_order])) {
         current_order++;
     }
-    //    debug_debug("current order: %d\n", current_order);
 
     // 如果没有找到足够大的块
     if(current_order > MAX_ORDER) {
-        log_debug("BuddyAllocator: No available blocks!, current order: %d, order:%d\n",
-            current_order, order);
+        log_debug("BuddyAllocator: No available blocks!, order:%d\n", order);
         return 0;
     }
 
     // 获取块并从空闲链表中移除
-    FreeBlock* block = free_lists[current_order];
-    //    debug_debug("block: %x\n", block);
-    if(block == nullptr) {
-        log_debug("BuddyAllocator:  invalid block, current_order: %d!\n", current_order);
-        return 0;
-    }
-    //    debug_debug("block1: %x\n", block);
-    free_lists[current_order] = block->next;
-    //    debug_debug("block2: %x\n", block);
+    uint32_t phys = (uint32_t)Kernel::instance().kernel_mm().virt2Phys(free_lists[current_order].next);
+    uint32_t pfn = phys / PAGE_SIZE;
+    del_free_block(pfn, current_order);
 
-    // 如果块太大，需要分割
+    // 如果块太大，需要分割，后半部分放回低一级的空闲链表
     while(current_order > order) {
         current_order--;
-        //     debug_debug("start current order:%d\n", current_order);
-        uint32_t buddy_addr = (uint32_t)block + (1 << current_order) * PAGE_SIZE;
-        block->size = 1 << current_order;
-        FreeBlock* buddy = (FreeBlock*)buddy_addr;
-        //      debug_debug("buddy addr: %x\n", buddy_addr);
-        buddy->size = 1 << current_order;
-        buddy->next = free_lists[current_order];
-        free_lists[current_order] = buddy;
-        //       debug_debug("end");
+        add_free_block(pfn + (1u << current_order), current_order);
     }
 
-    // debug_debug("block3: %x, count:%d\n", block, num_pages);
-    auto block_phys = (uint32_t)Kernel::instance().kernel_mm().virt2Phys(block);
-    
-    // 设置复合页信息
-    uint32_t start_index = (block_phys - memory_start) / PAGE_SIZE;
-    for(uint32_t i = 0; i < num_pages; i++) {
-        page_info[start_index + i].is_compound = true;
-        page_info[start_index + i].compound_order = order;
-        page_info[start_index + i].compound_head = block_phys;
-    }
-
-    increment_ref_count((uint32_t)block_phys);
-    return block_phys;
+    return phys;
 }
 
-void BuddyAllocator::free_pages(uint32_t phys, uint32_t order)
+void BuddyAllocator::return_free_block(uint32_t phys, uint32_t order)
 {
-    // 验证地址是否有效
-    if(phys < memory_start || phys >= (memory_start + memory_size) ||
-        (phys % PAGE_SIZE != 0)) {
-        log_err("Invalid phys address: 0x%x\n", phys);
-        return;
-    }
-
-    // 检查所有页面的引用计数
-    uint32_t num_pages = 1 << order;
-    uint32_t start_index = (phys - memory_start) / PAGE_SIZE;
-    
-    // 清除复合页信息并将引用计数清零
-    for(uint32_t i = 0; i < num_pages; i++) {
-        page_info[start_index + i].is_compound = false;
-        page_info[start_index + i].compound_order = 0;
-        page_info[start_index + i].compound_head = 0;
-        page_info[start_index + i].ref_count = 0;
-    }
+    uint32_t pfn = phys / PAGE_SIZE;
 
-    // 转换为虚拟地址并尝试合并
-    auto virt = (uint32_t)Kernel::instance().kernel_mm().phys2Virt(phys);
-    uint32_t current_order = order;
-
-    // 尝试合并伙伴块
-    while(current_order < MAX_ORDER) {
-        uint32_t buddy_addr = get_buddy_address(virt, 1 << current_order);
-        bool merged = try_merge_buddy(virt, current_order);
-        if(!merged)
+    // 伙伴空闲则摘链合并，继续向上一级尝试
+    while(order < MAX_ORDER) {
+        uint32_t buddy_pfn = pfn ^ (1u << order);
+        if(!is_free_buddy(buddy_pfn, order)) {
             break;
-
-        // 如果合并成功，移除伙伴块并继续尝试合并更大的块
-        virt = virt < buddy_addr ? virt : buddy_addr;
-        current_order++;
+        }
+        del_free_block(buddy_pfn, order);
+        pfn &= buddy_pfn;
+        order++;
     }
 
-    // 将最终的块添加到对应的空闲链表中
-    FreeBlock* block = (FreeBlock*)virt;
-    block->size = 1 << current_order;
-    block->next = free_lists[current_order];
-    free_lists[current_order] = block;
+    add_free_block(pfn, order);
 }
 
-uint32_t BuddyAllocator::get_buddy_address(uint32_t addr, uint32_t size)
+void BuddyAllocator::prep_new_pages(uint32_t phys, uint32_t order)
 {
-    return addr ^ (size * PAGE_SIZE);
+    page* head = page_at(page_index(phys));
+    head->flags = PG_HEAD;
+    set_page_order(head, order);
+    head->_count = 1;
 }
 
-uint32_t BuddyAllocator::get_block_order(uint32_t num_pages)
+void BuddyAllocator::clear_page_state(uint32_t phys, [[maybe_unused]] uint32_t order)
 {
-    uint32_t order = 0;
-    num_pages--;
-    while(num_pages > 0) {
-        num_pages >>= 1;
-        order++;
-    }
-    return order;
+    page* head = page_at(page_index(phys));
+    head->flags = 0;
+    head->_count = 0;
 }
 
-void BuddyAllocator::split_block(uint32_t addr, uint32_t order)
+// 已分配的块按绝对页帧号自然对齐，因此包含index的块首页
+// 一定是该页帧号按某个order向下对齐后的位置，最多检查MAX_ORDER + 1个候选
+uint32_t BuddyAllocator::find_head(uint32_t index) const
 {
-    if(order == 0)
-        return;
-
-    uint32_t buddy_addr = addr + (1 << (order - 1)) * PAGE_SIZE;
-    FreeBlock* buddy = (FreeBlock*)buddy_addr;
-    buddy->size = 1 << (order - 1);
-    buddy->next = free_lists[order - 1];
-    free_lists[order - 1] = buddy;
+    uint32_t base = (memory_start - real_start) / PAGE_SIZE;
+    if(index < base || index >= page_count) {
+        return NO_PAGE;
+    }
+    uint32_t real_pfn = real_start / PAGE_SIZE;
+    uint32_t pfn = real_pfn + index;
+    for(uint32_t order = 0; order <= MAX_ORDER; order++) {
+        uint32_t candidate = pfn & ~((1u << order) - 1);
+        if(candidate < real_pfn + base) {
+            break;
+        }
+        const page* pg = &mem_map[candidate - real_pfn];
+        if((pg->flags & PG_HEAD) && page_order(pg) >= order) {
+            return candidate - real_pfn;
+        }
+    }
+    return NO_PAGE;
 }
 
-bool BuddyAllocator::try_merge_buddy(uint32_t addr, uint32_t order)
+page* BuddyAllocator::page_of(uint32_t phys)
 {
-    uint32_t buddy_addr = get_buddy_address(addr, 1 << order);
-
-    // 检查伙伴块是否在空闲链表中
-    FreeBlock** current = &free_lists[order];
-    while(*current) {
-        if((uint32_t)*current == buddy_addr) {
-            // 找到伙伴块，从链表中移除
-            *current = (*current)->next;
-            return true;
-        }
-        current = &(*current)->next;
+    if(phys < real_start || phys >= memory_start + memory_size) {
+        return nullptr;
     }
+    return page_at(page_index(phys));
+}
 
-    return false;
+bool BuddyAllocator::contains(uint32_t phys, uint32_t order) const
+{
+    if(phys % PAGE_SIZE != 0 || order > MAX_ORDER) {
+        return false;
+    }
+    uint32_t end = memory_start + memory_size;
+    return phys >= memory_start && phys < end && (1u << order) <= (end - phys) / PAGE_SIZE;
 }
 
 void BuddyAllocator::increment_ref_count(uint32_t phys, uint32_t order)
 {
     // 验证地址在管理范围内且是合法页对齐地址
-    if(phys < real_start || phys >= (memory_start + memory_size) || (phys % PAGE_SIZE != 0)) {
+    if(phys < memory_start || phys >= (memory_start + memory_size) || (phys % PAGE_SIZE != 0)) {
         log_err("Invalid phys address: 0x%x, memory start:0x%x, end:0x%x\n", phys, real_start,
             memory_start + memory_size);
         return;
     }
-    uint32_t index = phys / PAGE_SIZE;
-    
-    // 如果是复合页的一部分，增加复合页首页的引用计数
-    if(page_info[index].is_compound) {
-        uint32_t head_index = page_info[index].compound_head / PAGE_SIZE;
-        page_info[head_index].ref_count++;
-    } else {
-        // 如果指定了order，将其标记为复合页
-        if(order > 0) {
-            uint32_t num_pages = 1 << order;
-            for(uint32_t i = 0; i < num_pages; i++) {
-                page_info[index + i].is_compound = true;
-                page_info[index + i].compound_order = order;
-                page_info[index + i].compound_head = phys;
-            }
-            page_info[index].ref_count++;
-        } else {
-            page_info[index].ref_count++;
+    uint32_t index = page_index(phys);
+
+    // 如果是已分配块的一部分，增加块首页的引用计数
+    uint32_t head = find_head(index);
+    if(head != NO_PAGE) {
+        if(page_at(head)->flags & PG_OWNER_PRIVATE) {
+            log_err("increment_ref_count: page 0x%x is owned by slab/kmalloc\n", phys);
+            return;
         }
+        page_at(head)->_count++;
+        return;
     }
-}
 
+    // 不属于任何已分配块的页面，以phys为首页建立一个order大小的块
+    page* pg = page_at(index);
+    pg->flags = PG_HEAD;
+    set_page_order(pg, order);
+    pg->_count++;
+}
 
-void BuddyAllocator::decrement_ref_count(uint32_t phys, uint32_t order)
+bool BuddyAllocator::decrement_ref_count(uint32_t phys, uint32_t& head, uint32_t& head_order)
 {
-    if(phys < real_start || phys >= (memory_start + memory_size) || (phys % PAGE_SIZE != 0)) {
+    if(phys < memory_start || phys >= (memory_start + memory_size) || (phys % PAGE_SIZE != 0)) {
         log_err("Invalid phys address: 0x%x\n", phys);
-        return;
+        return false;
     }
-    uint32_t index = phys / PAGE_SIZE;
-    
-    // 如果order > 0，表示对整个复合页进行操作
-    if(order > 0) {
-        // 确保这是一个复合页的首页
-        if(!page_info[index].is_compound || page_info[index].compound_head != phys) {
-            log_err("Invalid compound page head: 0x%x\n", phys);
-            return;
-        }
-        
-        // 减少复合页首页的引用计数
-        if(--page_info[index].ref_count == 0) {
-            // 引用计数为0时释放整个复合页
-            free_pages(phys, order);
-        }
-        return;
+
+    uint32_t head_index = find_head(page_index(phys));
+    if(head_index == NO_PAGE) {
+        log_err("decrement_ref_count: page 0x%x is not allocated\n", phys);
+        return false;
     }
-    
-    // order = 0，表示单页操作
-    if(page_info[index].is_compound) {
-        // 如果是复合页的一部分，需要将其拆分出来
-        uint32_t head_index = page_info[index].compound_head / PAGE_SIZE;
-        
-        // 清除复合页标记
-        page_info[index].is_compound = false;
-        page_info[index].compound_order = 0;
-        page_info[index].compound_head = 0;
-        page_info[index].ref_count = 1; // 设置初始引用计数为1
-        
-        // 减少引用计数并在必要时释放页面
-        if(--page_info[index].ref_count == 0) {
-            free_pages(phys, 0);
-        }
-    } else {
-        // 普通页面，直接减少引用计数
-        if(--page_info[index].ref_count == 0) {
-            free_pages(phys, 0);
-        }
+
+    page* pg = page_at(head_index);
+    if(pg->flags & PG_OWNER_PRIVATE) {
+        log_err("decrement_ref_count: page 0x%x is owned by slab/kmalloc\n", phys);
+        return false;
     }
-}
\ No newline at end of file
+    if(pg->_count == 0) {
+        log_err("decrement_ref_count: page 0x%x ref count underflow\n", phys);
+        return false;
+    }
+
+    // 引用计数为0时由调用者释放整个块
+    head = real_start + head_index * PAGE_SIZE;
+    head_order = page_order(pg);
+    return --pg->_count == 0;
+}
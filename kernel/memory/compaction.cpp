@@ -0,0 +1,200 @@
+// 内存规整（compaction）
+// 长时间运行后伙伴系统中空闲页总数充足但没有连续的高阶块。
+// 规整在区域中寻找一个2^order对齐、只包含空闲页和可迁移页的窗口，
+// 把其中的可迁移页通过反向映射搬到窗口之外，窗口随后在伙伴系统中合并成目标块
+#include "kernel/zone.h"
+
+#include "kernel/gfp.h"
+#include "kernel/kernel.h"
+#include "kernel/kernel_memory.h"
+#include "kernel/rmap.h"
+#include "lib/debug.h"
+
+namespace {
+
+// 为迁移分配目标页时，落在窗口内的页暂存在这里，最后放回伙伴系统
+constexpr uint32_t MAX_HELD_PAGES = 8;
+
+} // namespace
+
+// 绕过每CPU缓存直接把块还给伙伴系统，使其能与窗口中的其他空闲页合并
+void Zone::freeToBuddy(uint32_t pfn, uint32_t order)
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    buddy_allocator.free_pages(pfn * PAGE_SIZE, order);
+    addFreePages(1u << order);
+    lock.release_irqrestore(flags);
+}
+
+/**
+ * @brief 从compact_cursor开始查找可以规整的窗口
+ * @param order 目标块的order
+ * @param movable 输出窗口中需要迁移的页帧号
+ * @param nr_movable 输出需要迁移的页数
+ * @return 窗口起始页帧号，没有找到时返回0
+ */
+uint32_t Zone::findCompactWindow(uint32_t order, uint32_t* movable, uint32_t& nr_movable)
+{
+    uint32_t window = 1u << order;
+    uint32_t first = (zone_start_pfn + window - 1) & ~(window - 1);
+    uint32_t last = zone_end_pfn & ~(window - 1); // 最后一个完整窗口的结束
+    if(first >= last) {
+        return 0;
+    }
+    if(compact_cursor < first || compact_cursor >= last) {
+        compact_cursor = first;
+    }
+    compact_cursor &= ~(window - 1);
+
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    uint32_t found = 0;
+    for(uint32_t n = 0; n < COMPACT_SCAN_WINDOWS && !found; n++) {
+        uint32_t start = compact_cursor;
+        compact_cursor += window;
+        if(compact_cursor >= last) {
+            compact_cursor = first;
+        }
+
+        nr_movable = 0;
+        bool usable = true;
+        for(uint32_t pfn = start; pfn < start + window && usable;) {
+            page* pg = buddy_allocator.page_of(pfn * PAGE_SIZE);
+            if(!pg) {
+                usable = false;
+            } else if(pg->flags & PG_BUDDY) {
+                pfn += 1u << page_order(pg);
+            } else if((pg->flags & PG_MOVABLE) && (pg->flags & PG_HEAD) && page_order(pg) == 0 &&
+                      page_ref_count(pg) == 1) {
+                movable[nr_movable++] = pfn;
+                pfn++;
+            } else {
+                // 不可迁移的页（内核对象、页表、共享页、其他CPU缓存的空闲页等）
+                usable = false;
+            }
+        }
+        if(usable && nr_movable > 0) {
+            found = start;
+        }
+    }
+    lock.release_irqrestore(flags);
+    return found;
+}
+
+/**
+ * @brief 把窗口中的可迁移页逐个迁移到窗口之外
+ * @return 全部迁移成功返回true
+ */
+bool Zone::migrateWindow(
+    uint32_t start_pfn, uint32_t order, const uint32_t* movable, uint32_t nr_movable)
+{
+    auto& rmap = Kernel::instance().kernel_mm().rmap();
+    uint32_t end_pfn = start_pfn + (1u << order);
+    uint32_t held[MAX_HELD_PAGES];
+    uint32_t nr_held = 0;
+    bool ok = true;
+
+    for(uint32_t i = 0; i < nr_movable && ok; i++) {
+        // 目标页不能落在窗口内
+        uint32_t new_pfn = 0;
+        while(true) {
+            uint32_t flags;
+            lock.acquire_irqsave(flags);
+            uint32_t phys = buddy_allocator.allocate_pages(GFP_KERNEL, 0);
+            if(phys) {
+                subFreePages(1);
+            }
+            lock.release_irqrestore(flags);
+            new_pfn = phys / PAGE_SIZE;
+            if(!new_pfn || new_pfn < start_pfn || new_pfn >= end_pfn) {
+                break;
+            }
+            if(nr_held == MAX_HELD_PAGES) {
+                freeToBuddy(new_pfn, 0);
+                new_pfn = 0;
+                break;
+            }
+            held[nr_held++] = new_pfn;
+        }
+        if(!new_pfn) {
+            ok = false;
+            break;
+        }
+
+        if(rmap.migrate(movable[i] * PAGE_SIZE, new_pfn * PAGE_SIZE)) {
+            pages_migrated++;
+            freeToBuddy(movable[i], 0);
+        } else {
+            migrate_failed++;
+            freeToBuddy(new_pfn, 0);
+            ok = false;
+        }
+    }
+
+    // 窗口内的页放回伙伴系统，与迁移后空出的页合并
+    for(uint32_t i = 0; i < nr_held; i++) {
+        freeToBuddy(held[i], 0);
+    }
+    return ok;
+}
+
+bool Zone::compact(uint32_t order)
+{
+    if(order == 0 || order > COMPACT_MAX_ORDER) {
+        return false;
+    }
+    compact_stalls++;
+
+    // 每CPU缓存中的页在描述符中没有标记，会被当成不可迁移页，先归还伙伴系统
+    drainPcp();
+
+    uint32_t movable[1u << COMPACT_MAX_ORDER];
+    uint32_t nr_movable = 0;
+    // 迁移失败（页面正被其他CPU使用等）时换一个窗口再试
+    for(int attempt = 0; attempt < 4; attempt++) {
+        uint32_t start = findCompactWindow(order, movable, nr_movable);
+        if(!start) {
+            break;
+        }
+        if(migrateWindow(start, order, movable, nr_movable)) {
+            compact_success++;
+            log_debug("compacted order %d block at pfn 0x%x, moved %d pages\n", order, start,
+                nr_movable);
+            return true;
+        }
+    }
+    compact_fail++;
+    return false;
+}
+
+uint32_t Zone::allocAfterCompact(uint32_t gfp_mask, uint32_t order)
+{
+    uint32_t count = 1u << order;
+    drainPcp();
+    for(int attempt = 0; attempt < 2; attempt++) {
+        uint32_t flags;
+        lock.acquire_irqsave(flags);
+        uint32_t phys = buddy_allocator.allocate_pages(gfp_mask, order);
+        if(phys) {
+            subFreePages(count);
+        }
+        lock.release_irqrestore(flags);
+        if(phys) {
+            return phys / PAGE_SIZE;
+        }
+        if(!compact(order)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void Zone::printCompactStats()
+{
+    uint32_t total = compact_success + compact_fail;
+    log_info("compaction: stalls %d, success %d, fail %d (success rate %d%%), migrated %d pages, "
+             "migrate failed %d, rmap entries %d\n",
+        compact_stalls, compact_success, compact_fail, total ? compact_success * 100 / total : 0,
+        pages_migrated, migrate_failed, Kernel::instance().kernel_mm().rmap().size());
+}
@@ -2,7 +2,11 @@
 #include <lib/serial.h>
 
 #include "arch/x86/paging.h"
+#include "arch/x86/tlb.h"
+#include "kernel/gfp.h"
+#include "kernel/shrinker.h"
 #include "lib/debug.h"
+#include "lib/string.h"
 
 KernelMemory::KernelMemory()
     : dma_zone(), normal_zone(), high_zone(), page_manager(),
@@ -19,6 +23,14 @@ PADDR KernelMemory::alloc_pages(uint32_t gfp_mask, uint32_t order)
         return 0;
     }
 
+    // 单页清零分配优先使用空闲时预先清零的页面
+    if((gfp_mask & __GFP_ZERO) && order == 0) {
+        PADDR phys_addr = zero_pool.get();
+        if(phys_addr) {
+            return phys_addr;
+        }
+    }
+
     // 根据页面数量选择合适的区域
     uint32_t size = (1 << order) * PAGE_SIZE;
     Zone* zone = get_zone_for_allocation(size);
@@ -35,6 +47,9 @@ PADDR KernelMemory::alloc_pages(uint32_t gfp_mask, uint32_t order)
     }
 
     PADDR phys_addr = pfn * PAGE_SIZE;
+    if(gfp_mask & __GFP_ZERO) {
+        memset(phys2Virt(phys_addr), 0, size);
+    }
     log_debug("KernelMemory::alloc_pages() addr: 0x%x\n", phys_addr);
     return phys_addr;
 }
@@ -62,6 +77,63 @@ void KernelMemory::free_pages(PADDR phys_addr, uint32_t order)
     zone->freePages(pfn, order);
 }
 
+Zone* KernelMemory::zone_of(uint32_t pfn)
+{
+    if(pfn < DMA_ZONE_END) {
+        return &dma_zone;
+    } else if(pfn < NORMAL_ZONE_END) {
+        return &normal_zone;
+    }
+    return &high_zone;
+}
+
+PADDR KernelMemory::alloc_pages_exact(uint32_t gfp_mask, uint32_t nr_pages)
+{
+    if(nr_pages <= 1) {
+        return nr_pages ? alloc_pages(gfp_mask, 0) : 0;
+    }
+    uint32_t order = 0;
+    while((1u << order) < nr_pages) {
+        order++;
+    }
+    PADDR phys_addr = alloc_pages(gfp_mask & ~__GFP_ZERO, order);
+    if(!phys_addr) {
+        return 0;
+    }
+    if(nr_pages < (1u << order)) {
+        zone_of(phys_addr / PAGE_SIZE)->freeRange(phys_addr / PAGE_SIZE + nr_pages,
+            (1u << order) - nr_pages);
+    }
+    // 块的大小由调用者记录，首页不再代表2^order个页面
+    set_page_order(phys_to_page(phys_addr), 0);
+    if(gfp_mask & __GFP_ZERO) {
+        memset(phys2Virt(phys_addr), 0, nr_pages * PAGE_SIZE);
+    }
+    return phys_addr;
+}
+
+void KernelMemory::free_pages_exact(PADDR phys_addr, uint32_t nr_pages)
+{
+    if(phys_addr == 0 || nr_pages == 0) {
+        return;
+    }
+    // 单页走每CPU缓存
+    if(nr_pages == 1) {
+        free_pages(phys_addr, 0);
+        return;
+    }
+    zone_of(phys_addr / PAGE_SIZE)->freeRange(phys_addr / PAGE_SIZE, nr_pages);
+}
+
+bool KernelMemory::extend_pages_exact(PADDR phys_addr, uint32_t nr_pages, uint32_t new_pages)
+{
+    if(new_pages <= nr_pages) {
+        return true;
+    }
+    uint32_t pfn = phys_addr / PAGE_SIZE + nr_pages;
+    return zone_of(pfn)->claimRange(pfn, new_pages - nr_pages);
+}
+
 // 释放已分配的页面
 void KernelMemory::decrement_ref_count(PADDR physAddr)
 {
@@ -119,15 +191,20 @@ void KernelMemory::init()
     serial_puts("KernelMemory::init() 3");
 
     slab_allocator.init();
+    slab_allocator.register_shrinker();
+    zero_pool.init();
+    zero_page_phys = alloc_pages(__GFP_ZERO, 0);
+    reverse_map.init();
 
     // 初始化VMALLOC区域
-    //    vmalloc_tree.init();
+    vmalloc_tree.init();
+    kmap_area.init();
 }
 
 // 分配小块连续物理内存（返回虚拟地址）
-VADDR KernelMemory::kmalloc(uint32_t size)
+VADDR KernelMemory::kmalloc(uint32_t size, uint32_t gfp_mask)
 {
-    return slab_allocator.kmalloc(size);
+    return slab_allocator.kmalloc(size, gfp_mask);
     // // 根据大小选择合适的区域
     // Zone* zone = get_zone_for_allocation(size);
     // if(!zone) {
@@ -180,6 +257,57 @@ void KernelMemory::kfree(VADDR addr)
     // }
 }
 
+VADDR KernelMemory::krealloc(VADDR addr, uint32_t new_size)
+{
+    return slab_allocator.krealloc(addr, new_size);
+}
+
+uint32_t* KernelMemory::vmalloc_pte(uint32_t vaddr)
+{
+    auto* ptes = reinterpret_cast<uint32_t*>(phys2Virt(K_VMALLOC_PT_START));
+    return &ptes[(vaddr - VMALLOC_START) >> 12];
+}
+
+bool KernelMemory::vmalloc_map(uint32_t vaddr, uint32_t pages)
+{
+    for(uint32_t i = 0; i < pages; i++) {
+        PADDR phys_addr = alloc_pages(GFP_KERNEL, 0);
+        if(!phys_addr) {
+            vmalloc_unmap(vaddr, i);
+            return false;
+        }
+        // 页表被所有页目录共享，写入后所有进程都能看到
+        *vmalloc_pte(vaddr + i * PAGE_SIZE) = phys_addr | 3; // Supervisor, read/write, present
+    }
+    return true;
+}
+
+// vmalloc页表被所有CPU共享，页面要等所有CPU的TLB都刷新之后才能释放：
+// 先清除存在位并收集地址，一次刷新（页数多时整体刷新），再释放页面
+void KernelMemory::vmalloc_unmap(uint32_t vaddr, uint32_t pages)
+{
+    arch::TlbBatch batch(0);
+    for(uint32_t i = 0; i < pages; i++) {
+        uint32_t va = vaddr + i * PAGE_SIZE;
+        uint32_t* pte = vmalloc_pte(va);
+        if(*pte & PAGE_PRESENT) {
+            *pte &= ~PAGE_PRESENT;
+            batch.add(va);
+        }
+    }
+    batch.flush();
+
+    // 该范围仍属于调用者，清除存在位后不会有其他人修改这些页表项
+    for(uint32_t i = 0; i < pages; i++) {
+        uint32_t* pte = vmalloc_pte(vaddr + i * PAGE_SIZE);
+        PADDR phys_addr = *pte & 0xFFFFF000;
+        *pte = 0;
+        if(phys_addr) {
+            free_pages(phys_addr, 0);
+        }
+    }
+}
+
 // 分配大块非连续虚拟内存
 VADDR KernelMemory::vmalloc(uint32_t size)
 {
@@ -192,43 +320,15 @@ VADDR KernelMemory::vmalloc(uint32_t size)
     // 从虚拟内存树中分配虚拟地址空间
     uint32_t virt_addr = vmalloc_tree.allocate(pages * PAGE_SIZE);
     if(!virt_addr) {
+        log_debug("vmalloc: no virtual space for %d pages\n", pages);
         return nullptr;
     }
 
     // 逐页分配物理内存并建立映射
-    for(uint32_t i = 0; i < pages; i++) {
-        // 优先从普通区域分配物理页面
-        Zone* zone = &normal_zone;
-        uint32_t pfn = zone->allocPages(0, 0);
-
-        // 如果普通区域分配失败，尝试从高端区域分配
-        if(!pfn) {
-            zone = &high_zone;
-            pfn = zone->allocPages(0, 0);
-
-            // 如果高端区域也分配失败，回滚并返回
-            if(!pfn) {
-                // 释放已分配的页面
-                for(uint32_t j = 0; j < i; j++) {
-                    uint32_t prev_virt = virt_addr + j * PAGE_SIZE;
-                    uint32_t prev_phys = virt2Phys((void*)prev_virt);
-                    page_manager.unmapPage(prev_virt);
-                    if(prev_phys < normal_zone.getWatermark(WatermarkLevel::WMARK_HIGH)) {
-                        normal_zone.freePages(prev_phys >> 12, 1);
-                    } else {
-                        high_zone.freePages(prev_phys >> 12, 1);
-                    }
-                }
-                vmalloc_tree.free(virt_addr);
-                return nullptr;
-            }
-        }
-
-        // 建立映射
-        uint32_t phys_addr = pfn << 12;
-        page_manager.mapPage(virt_addr + i * PAGE_SIZE, phys_addr, 3);
+    if(!vmalloc_map(virt_addr, pages)) {
+        vmalloc_tree.free(virt_addr);
+        return nullptr;
     }
-
     return (void*)virt_addr;
 }
 
@@ -239,51 +339,49 @@ void KernelMemory::vfree(VADDR addr)
         return;
 
     uint32_t virt_addr = (uint32_t)addr;
-
-    // 确保地址在VMALLOC区域
-    if(virt_addr < VMALLOC_START || virt_addr >= VMALLOC_END) {
+    uint32_t size = vmalloc_tree.size_of(virt_addr);
+    if(!size) {
+        log_err("vfree: 0x%x is not a vmalloc area\n", virt_addr);
         return;
     }
+    // 先解除映射再归还虚拟地址空间，避免被并发的vmalloc重用
+    vmalloc_unmap(virt_addr, size / PAGE_SIZE);
+    vmalloc_tree.free(virt_addr);
+}
 
-    // 逐页处理，直到遇到未映射的页面
-    uint32_t current_addr = virt_addr;
-    while(true) {
-        // 获取物理地址
-        uint32_t phys_addr = virt2Phys((void*)current_addr);
-        if(!phys_addr)
-            break; // 遇到未映射的页面
-
-        // 获取物理页框号
-        uint32_t pfn = phys_addr >> 12;
-
-        // 解除页表映射
-        page_manager.unmapPage(current_addr);
-
-        // 找到对应的区域并释放物理页面
-        Zone* zone = get_zone_for_allocation(PAGE_SIZE);
-        if(zone) {
-            zone->freePages(pfn, 0); // 释放单个页面，order为0
-        }
+uint32_t KernelMemory::vmalloc_size(VADDR addr)
+{
+    return vmalloc_tree.size_of((uint32_t)addr);
+}
 
-        current_addr += PAGE_SIZE;
+bool KernelMemory::vresize(VADDR addr, uint32_t new_size)
+{
+    uint32_t virt_addr = (uint32_t)addr;
+    uint32_t old_size = vmalloc_tree.size_of(virt_addr);
+    uint32_t new_bytes = (new_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(!old_size || !new_bytes) {
+        return false;
     }
-
-    // 释放虚拟地址空间
-    vmalloc_tree.free(virt_addr);
+    if(new_bytes <= old_size) {
+        vmalloc_unmap(virt_addr + new_bytes, (old_size - new_bytes) / PAGE_SIZE);
+        vmalloc_tree.resize(virt_addr, new_bytes);
+        return true;
+    }
+    // 先占住后面的虚拟地址空间，再补充物理页面
+    if(!vmalloc_tree.resize(virt_addr, new_bytes)) {
+        return false;
+    }
+    if(!vmalloc_map(virt_addr + old_size, (new_bytes - old_size) / PAGE_SIZE)) {
+        vmalloc_tree.resize(virt_addr, old_size);
+        return false;
+    }
+    return true;
 }
 
-// 将物理页面临时映射到内核空间
+// 将物理页面映射到内核空间，直接映射区内的页面直接返回直接映射地址
 VADDR KernelMemory::kmap(PADDR phys_addr)
 {
-    // 从KMAP区域分配虚拟地址
-    static uint32_t next_kmap_addr = KMAP_START;
-    uint32_t virt_addr = next_kmap_addr;
-    next_kmap_addr += PAGE_SIZE;
-
-    // 建立临时映射
-    page_manager.mapPage(virt_addr, phys_addr & ~(PAGE_SIZE - 1), 3);
-
-    return (void*)(virt_addr | (phys_addr & 0xFFF));
+    return kmap_area.kmap(phys_addr);
 }
 
 // 解除kmap的映射
@@ -291,16 +389,23 @@ void KernelMemory::kunmap(VADDR addr)
 {
     if(!addr)
         return;
-
-    uint32_t virt_addr = (uint32_t)addr & ~0xFFF;
-    if(virt_addr >= KMAP_START && virt_addr < KMAP_END) {
-        page_manager.unmapPage(virt_addr);
-    }
+    kmap_area.kunmap(addr);
 }
 
 // 获取虚拟地址对应的物理地址
 PADDR KernelMemory::virt2Phys(VADDR virt_addr)
 {
+    // VMALLOC区域不是线性映射，需要查页表
+    if(is_vmalloc_addr(virt_addr)) {
+        uint32_t pte = *vmalloc_pte((uint32_t)virt_addr);
+        if(!(pte & PAGE_PRESENT)) {
+            return 0;
+        }
+        return (pte & 0xFFFFF000) | ((uint32_t)virt_addr & 0xFFF);
+    }
+    if(KmapArea::is_kmap_addr(virt_addr)) {
+        return KmapArea::translate(virt_addr);
+    }
     return (uint32_t)virt_addr - KERNEL_DIRECT_MAP_START;
 }
 VADDR KernelMemory::phys2Virt(PADDR phys_addr)
@@ -315,6 +420,43 @@ PFN KernelMemory::getPfn(VADDR virt_addr)
     return phys_addr >> 12; // 右移12位得到页框号
 }
 
+page* KernelMemory::phys_to_page(PADDR phys_addr)
+{
+    uint32_t pfn = phys_addr / PAGE_SIZE;
+    if(pfn >= NORMAL_ZONE_START && pfn < NORMAL_ZONE_END) {
+        return normal_zone.pageOf(pfn);
+    }
+    return nullptr;
+}
+
+void KernelMemory::print_stats()
+{
+    normal_zone.printPcpStats();
+    normal_zone.printCompactStats();
+    slab_allocator.print_caches();
+    zero_pool.print_stats();
+    vmalloc_tree.print_fragmentation("vmalloc");
+    kmap_area.print_stats();
+    kernel::print_shrinker_stats();
+    arch::tlb_print_stats();
+}
+
+// 由kswapd调用，把所有已初始化的区域回收到高水位
+uint32_t KernelMemory::balance_zones()
+{
+    return normal_zone.balance();
+}
+
+bool KernelMemory::low_on_memory()
+{
+    return normal_zone.isWatermarkReached(WatermarkLevel::WMARK_LOW);
+}
+
+void KernelMemory::refill_zero_pages()
+{
+    zero_pool.refill(ZeroPagePool::REFILL_BATCH);
+}
+
 // 根据大小选择合适的内存区域
 Zone* KernelMemory::get_zone_for_allocation(uint32_t size)
 {
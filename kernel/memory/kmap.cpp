@@ -0,0 +1,236 @@
+#include "kernel/kmap.h"
+
+#include "arch/x86/percpu.h"
+#include "arch/x86/tlb.h"
+#include "lib/debug.h"
+
+using namespace MemoryConstants;
+
+namespace {
+
+// 直接映射区覆盖的物理内存，这部分不需要临时映射
+constexpr uint32_t LOWMEM_END = NORMAL_ZONE_END * PAGE_SIZE;
+
+uint32_t cpu_index()
+{
+    return arch::get_cpu_id() % MAX_CPUS;
+}
+
+} // namespace
+
+void KmapArea::init()
+{
+    for(uint32_t i = 0; i < MAX_CPUS; i++) {
+        atomic[i].depth = 0;
+    }
+    for(uint32_t i = 0; i < POOL_ENTRIES; i++) {
+        pfns[i] = 0;
+        count[i] = 0;
+        next[i] = NO_ENTRY;
+    }
+    for(uint32_t i = 0; i < HASH_BUCKETS; i++) {
+        buckets[i] = NO_ENTRY;
+    }
+    cursor = 0;
+    flushing = false;
+    atomic_maps = pool_maps = pool_reused = pool_flushes = pool_cleared = 0;
+    log_info("KmapArea: %d atomic slots per cpu, %d persistent entries\n", ATOMIC_SLOTS,
+        POOL_ENTRIES);
+}
+
+uint32_t* KmapArea::pte_of(uint32_t vaddr)
+{
+    auto* ptes = reinterpret_cast<uint32_t*>(KERNEL_DIRECT_MAP_START + K_KMAP_PT_START);
+    return &ptes[(vaddr - KMAP_START) >> 12];
+}
+
+void* KmapArea::kmap_atomic(PADDR phys)
+{
+    if(phys < LOWMEM_END) {
+        return (void*)(phys + KERNEL_DIRECT_MAP_START);
+    }
+
+    // 关中断直到kunmap_atomic，期间不会被调度到其他CPU；中断中的嵌套映射使用更深的槽位
+    uint32_t flags = local_irq_save();
+    uint32_t cpu = cpu_index();
+    AtomicStack& st = atomic[cpu];
+    if(st.depth == ATOMIC_SLOTS) {
+        local_irq_restore(flags);
+        log_err("kmap_atomic: cpu %d nested too deep\n", cpu);
+        return nullptr;
+    }
+    uint32_t vaddr = ATOMIC_START + (cpu * ATOMIC_SLOTS + st.depth) * PAGE_SIZE;
+    st.saved_flags[st.depth++] = flags;
+    // 空闲槽位的表项总是无效的，TLB中不会有缓存，建立映射时不需要刷新
+    *pte_of(vaddr) = (phys & 0xFFFFF000) | PAGE_WRITE | PAGE_PRESENT;
+    __atomic_fetch_add(&atomic_maps, 1, __ATOMIC_RELAXED);
+    return (void*)(vaddr | (phys & 0xFFF));
+}
+
+void KmapArea::kunmap_atomic(void* addr)
+{
+    uint32_t vaddr = (uint32_t)addr & 0xFFFFF000;
+    if(vaddr < ATOMIC_START || vaddr >= ATOMIC_END) {
+        return; // 直接映射区的地址
+    }
+
+    uint32_t cpu = cpu_index();
+    AtomicStack& st = atomic[cpu];
+    if(!st.depth || vaddr != ATOMIC_START + (cpu * ATOMIC_SLOTS + st.depth - 1) * PAGE_SIZE) {
+        log_err("kunmap_atomic: 0x%x is not the innermost mapping of cpu %d\n", vaddr, cpu);
+        return;
+    }
+    // 其他CPU不会访问本CPU的槽位，只需要刷新本地TLB
+    *pte_of(vaddr) = 0;
+    arch::flush_tlb_page(vaddr);
+    local_irq_restore(st.saved_flags[--st.depth]);
+}
+
+// 调用者需持有lock
+void KmapArea::hash_remove(uint32_t idx)
+{
+    for(uint16_t* p = bucket(pfns[idx]); *p != NO_ENTRY; p = &next[*p]) {
+        if(*p == idx) {
+            *p = next[idx];
+            next[idx] = NO_ENTRY;
+            return;
+        }
+    }
+}
+
+uint32_t KmapArea::flush_unused(uint32_t& flags)
+{
+    // 同一时间只有一个CPU在清理，FLUSHING状态的表项都属于它
+    if(flushing) {
+        return 0;
+    }
+    arch::TlbBatch batch(0);
+    uint32_t cleared = 0;
+    for(uint32_t i = 0; i < POOL_ENTRIES; i++) {
+        if(count[i] != 1) {
+            continue;
+        }
+        *pte_of(pool_vaddr(i)) = 0;
+        hash_remove(i);
+        count[i] = FLUSHING;
+        batch.add(pool_vaddr(i));
+        cleared++;
+    }
+    if(!cleared) {
+        return 0;
+    }
+
+    // 等待其他CPU确认时要能响应它们发来的刷新请求，不能持有锁关着中断
+    flushing = true;
+    lock.release_irqrestore(flags);
+    batch.flush();
+    lock.acquire_irqsave(flags);
+    for(uint32_t i = 0; i < POOL_ENTRIES; i++) {
+        if(count[i] == FLUSHING) {
+            count[i] = 0;
+        }
+    }
+    flushing = false;
+    pool_flushes++;
+    pool_cleared += cleared;
+    return cleared;
+}
+
+void* KmapArea::kmap(PADDR phys)
+{
+    if(phys < LOWMEM_END) {
+        return (void*)(phys + KERNEL_DIRECT_MAP_START);
+    }
+
+    uint32_t pfn = phys / PAGE_SIZE;
+    uint32_t offset = phys & 0xFFF;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    // 该页已有映射（包括已经kunmap但还没清除的表项）时直接复用
+    for(uint16_t idx = *bucket(pfn); idx != NO_ENTRY; idx = next[idx]) {
+        if(pfns[idx] == pfn) {
+            if(count[idx] == 1) {
+                pool_reused++;
+            }
+            count[idx]++;
+            lock.release_irqrestore(flags);
+            return (void*)(pool_vaddr(idx) | offset);
+        }
+    }
+
+    uint32_t idx = NO_ENTRY;
+    uint32_t i = cursor;
+    for(uint32_t n = 0; n < POOL_ENTRIES; n++) {
+        i = (i + 1) % POOL_ENTRIES;
+        if(i == 0) {
+            // 绕回开头：把所有不再使用的表项一次清除
+            flush_unused(flags);
+        }
+        if(count[i] == 0) {
+            idx = i;
+            break;
+        }
+    }
+    cursor = i;
+    if(idx == NO_ENTRY) {
+        lock.release_irqrestore(flags);
+        log_err("kmap: no free entry for phys 0x%x\n", phys);
+        return nullptr;
+    }
+
+    // 空闲表项在清除后已经刷新过TLB，这里不需要再刷新
+    pfns[idx] = pfn;
+    count[idx] = 2;
+    next[idx] = *bucket(pfn);
+    *bucket(pfn) = idx;
+    *pte_of(pool_vaddr(idx)) = (pfn * PAGE_SIZE) | PAGE_WRITE | PAGE_PRESENT;
+    pool_maps++;
+    lock.release_irqrestore(flags);
+    return (void*)(pool_vaddr(idx) | offset);
+}
+
+void KmapArea::kunmap(void* addr)
+{
+    uint32_t vaddr = (uint32_t)addr & 0xFFFFF000;
+    if(vaddr < POOL_START || vaddr >= KMAP_END) {
+        return; // 直接映射区的地址
+    }
+
+    uint32_t idx = (vaddr - POOL_START) / PAGE_SIZE;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    // 引用计数降到1时保留映射，等到下一次绕回时批量清除
+    if(count[idx] < 2 || count[idx] == FLUSHING) {
+        log_err("kunmap: 0x%x is not mapped\n", vaddr);
+    } else {
+        count[idx]--;
+    }
+    lock.release_irqrestore(flags);
+}
+
+PADDR KmapArea::translate(const void* addr)
+{
+    uint32_t pte = *pte_of((uint32_t)addr);
+    if(!(pte & PAGE_PRESENT)) {
+        return 0;
+    }
+    return (pte & 0xFFFFF000) | ((uint32_t)addr & 0xFFF);
+}
+
+void KmapArea::print_stats()
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    uint32_t in_use = 0, cached = 0;
+    for(uint32_t i = 0; i < POOL_ENTRIES; i++) {
+        if(count[i] == 1) {
+            cached++;
+        } else if(count[i] > 1 && count[i] != FLUSHING) {
+            in_use++;
+        }
+    }
+    lock.release_irqrestore(flags);
+    log_info("kmap: atomic maps %d; pool %d in use, %d cached, new maps %d, reused %d, "
+             "flushes %d (%d entries)\n",
+        atomic_maps, in_use, cached, pool_maps, pool_reused, pool_flushes, pool_cleared);
+}
@@ -0,0 +1,258 @@
+#include "kernel/mm_benchmark.h"
+
+#include "kernel/buddy_allocator.h"
+#include "kernel/gfp.h"
+#include "kernel/kernel.h"
+#include "kernel/process.h"
+#include "kernel/slab_allocator.h"
+#include "lib/debug.h"
+
+namespace {
+
+inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// 基准测试在一块私有的伙伴系统区域上进行，不经过Zone的每CPU缓存和zone锁
+constexpr uint32_t BUDDY_BENCH_REGION_ORDER = 11;
+constexpr uint32_t BUDDY_BENCH_MAX_ORDER = 10;
+constexpr uint32_t BUDDY_BENCH_ROUNDS = 64;
+constexpr uint32_t BUDDY_BENCH_BATCH = 8;
+
+// 改造前的页面元数据布局，分配和释放时逐页设置/清除复合页信息，
+// 用来对比改造前后每个order的元数据开销
+struct LegacyPageInfo {
+    uint32_t ref_count;
+    bool is_cow;
+    bool is_compound;
+    uint32_t compound_order;
+    uint32_t compound_head;
+};
+
+void legacy_prep_pages(LegacyPageInfo* info, uint32_t phys, uint32_t order)
+{
+    for(uint32_t i = 0; i < (1u << order); i++) {
+        info[i].is_compound = true;
+        info[i].compound_order = order;
+        info[i].compound_head = phys;
+    }
+    info[0].ref_count++;
+}
+
+void legacy_clear_pages(LegacyPageInfo* info, uint32_t order)
+{
+    for(uint32_t i = 0; i < (1u << order); i++) {
+        info[i].is_compound = false;
+        info[i].compound_order = 0;
+        info[i].compound_head = 0;
+        info[i].ref_count = 0;
+    }
+}
+
+constexpr uint32_t SLAB_BENCH_OBJECTS = 256;
+constexpr uint32_t SLAB_BENCH_ROUNDS = 4;
+
+constexpr uint32_t FORK_BENCH_ROUNDS = 8;
+
+} // namespace
+
+// 从内核申请一块2^BUDDY_BENCH_REGION_ORDER页的内存，在上面初始化一个私有的伙伴系统，
+// 直接测量BuddyAllocator的分配/释放，不受每CPU缓存命中与否的影响。
+// 每轮先连续分配BUDDY_BENCH_BATCH个块再全部释放，让拆分与合并路径都被覆盖；
+// 同时对同一批块执行改造前PageInfo的逐页元数据维护，作为改造前的对照
+void run_buddy_benchmark()
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    const uint32_t region_pages = 1u << BUDDY_BENCH_REGION_ORDER;
+    PADDR region = mm.alloc_pages(GFP_KERNEL, BUDDY_BENCH_REGION_ORDER);
+    LegacyPageInfo* legacy = new LegacyPageInfo[region_pages];
+    if(!region || !legacy) {
+        log_info("buddy benchmark: failed to allocate %d pages\n", region_pages);
+        if(region) {
+            mm.free_pages(region, BUDDY_BENCH_REGION_ORDER);
+        }
+        delete[] legacy;
+        return;
+    }
+
+    BuddyAllocator buddy;
+    buddy.init(region, region_pages * PAGE_SIZE);
+    PADDR blocks[BUDDY_BENCH_BATCH];
+
+    log_info("buddy benchmark: sizeof(page)=%d, sizeof(PageInfo)=%d, "
+             "descriptor overhead %d -> %d bytes per MB\n",
+        sizeof(page), sizeof(LegacyPageInfo), sizeof(LegacyPageInfo) * 256, sizeof(page) * 256);
+    for(uint32_t order = 0; order <= BUDDY_BENCH_MAX_ORDER; order++) {
+        uint64_t alloc_cycles = 0;
+        uint64_t free_cycles = 0;
+        uint64_t legacy_alloc_cycles = 0;
+        uint64_t legacy_free_cycles = 0;
+        uint32_t ops = 0;
+
+        for(uint32_t round = 0; round < BUDDY_BENCH_ROUNDS; round++) {
+            uint32_t n = 0;
+            uint64_t start = rdtsc();
+            for(; n < BUDDY_BENCH_BATCH; n++) {
+                blocks[n] = buddy.allocate_pages(GFP_KERNEL, order);
+                if(!blocks[n]) {
+                    break;
+                }
+            }
+            alloc_cycles += rdtsc() - start;
+
+            start = rdtsc();
+            for(uint32_t i = 0; i < n; i++) {
+                legacy_prep_pages(&legacy[(blocks[i] - region) / PAGE_SIZE], blocks[i], order);
+            }
+            legacy_alloc_cycles += rdtsc() - start;
+
+            start = rdtsc();
+            for(uint32_t i = 0; i < n; i++) {
+                legacy_clear_pages(&legacy[(blocks[i] - region) / PAGE_SIZE], order);
+            }
+            legacy_free_cycles += rdtsc() - start;
+
+            start = rdtsc();
+            for(uint32_t i = 0; i < n; i++) {
+                buddy.free_pages(blocks[i], order);
+            }
+            free_cycles += rdtsc() - start;
+            ops += n;
+            if(n < BUDDY_BENCH_BATCH) {
+                break;
+            }
+        }
+
+        if(ops == 0) {
+            log_info("  order %d: allocation failed\n", order);
+            continue;
+        }
+        log_info("  order %2d: page alloc %d / free %d cycles, "
+                 "PageInfo per-page metadata +%d / +%d cycles (%d ops)\n",
+            order, (uint32_t)(alloc_cycles / ops), (uint32_t)(free_cycles / ops),
+            (uint32_t)(legacy_alloc_cycles / ops), (uint32_t)(legacy_free_cycles / ops), ops);
+    }
+
+    delete[] legacy;
+    mm.free_pages(region, BUDDY_BENCH_REGION_ORDER);
+}
+
+// 对每个通用大小级别建立一个独立的缓存，反复分配SLAB_BENCH_OBJECTS个对象再全部释放。
+// 第一轮包含slab的创建，之后各轮主要命中每CPU弹匣；
+// 内存开销 = 每个slab页中没有用来存放对象的字节（含页内或页外的slab描述符）
+void run_slab_benchmark()
+{
+    const size_t sizes[] = {8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+    static void* objs[SLAB_BENCH_OBJECTS];
+
+    log_info("slab benchmark: %d objects x %d rounds\n", SLAB_BENCH_OBJECTS, SLAB_BENCH_ROUNDS);
+    for(size_t size : sizes) {
+        char name[32];
+        format_string(name, sizeof(name), "bench-%d", size);
+        kernel::SlabCache* cache = kernel::kmem_cache_create(name, size);
+        if(!cache) {
+            log_info("  size %d: cache creation failed\n", size);
+            continue;
+        }
+
+        uint64_t first_cycles = 0;
+        uint64_t warm_cycles = 0;
+        uint32_t n = 0;
+        for(uint32_t round = 0; round < SLAB_BENCH_ROUNDS; round++) {
+            uint64_t start = rdtsc();
+            for(n = 0; n < SLAB_BENCH_OBJECTS; n++) {
+                objs[n] = kernel::kmem_cache_alloc(cache);
+                if(!objs[n]) {
+                    break;
+                }
+            }
+            for(uint32_t i = 0; i < n; i++) {
+                kernel::kmem_cache_free(cache, objs[i]);
+            }
+            uint64_t cycles = rdtsc() - start;
+            if(round == 0) {
+                first_cycles = cycles;
+            } else {
+                warm_cycles += cycles;
+            }
+        }
+
+        size_t per_slab = cache->get_objects_per_slab();
+        size_t overhead = PAGE_SIZE - per_slab * cache->get_object_size();
+        if(cache->is_off_slab()) {
+            overhead += sizeof(kernel::Slab);
+        }
+        uint32_t ops = n ? n * 2 : 1;
+        log_info("  size %4d: first %d cycles/op, warm %d cycles/op, %d objs/slab, "
+                 "overhead %d bytes/page (%d%%)%s\n",
+            size, (uint32_t)(first_cycles / ops),
+            (uint32_t)(warm_cycles / ops / (SLAB_BENCH_ROUNDS - 1)), per_slab, overhead,
+            overhead * 100 / PAGE_SIZE, cache->is_off_slab() ? " off-slab" : "");
+        kernel::kmem_cache_destroy(cache);
+    }
+}
+
+// 为源地址空间映射不同数量的页面，测量写时复制fork（复制页目录和页表、共享数据页）
+// 与释放子地址空间的平均周期数；按页数换算出每页开销，用来确认fork与数据量无关
+void run_fork_benchmark()
+{
+    const uint32_t sizes[] = {0, 16, 64, 256, 1024, 4096};
+
+    log_info("fork benchmark: %d rounds per size\n", FORK_BENCH_ROUNDS);
+    for(uint32_t pages : sizes) {
+        Context* parent = ProcessManager::create_context("fork-bench");
+        if(parent->cloneMemorySpace(ProcessManager::kernel_context) < 0) {
+            log_info("  %4d pages: address space creation failed\n", pages);
+            PidManager::free(parent->context_id);
+            delete parent;
+            continue;
+        }
+        auto& user_mm = parent->user_mm;
+        void* area = pages ? user_mm.allocate_area(pages * PAGE_SIZE, PAGE_WRITE, MEM_TYPE_ANONYMOUS)
+                           : nullptr;
+        if(pages && (!area || !user_mm.populate((uint32_t)area, pages * PAGE_SIZE))) {
+            log_info("  %4d pages: populate failed\n", pages);
+            parent->releaseMemorySpace();
+            PidManager::free(parent->context_id);
+            delete parent;
+            continue;
+        }
+
+        uint64_t fork_cycles = 0;
+        uint64_t exit_cycles = 0;
+        uint32_t rounds = 0;
+        for(; rounds < FORK_BENCH_ROUNDS; rounds++) {
+            Context* child = ProcessManager::create_context("fork-bench");
+            uint64_t start = rdtsc();
+            int ret = child->cloneMemorySpace(parent);
+            fork_cycles += rdtsc() - start;
+            if(ret < 0) {
+                PidManager::free(child->context_id);
+                delete child;
+                break;
+            }
+            child->user_mm.clone(user_mm);
+
+            start = rdtsc();
+            child->releaseMemorySpace();
+            exit_cycles += rdtsc() - start;
+            PidManager::free(child->context_id);
+            delete child;
+        }
+
+        if(rounds == 0) {
+            log_info("  %4d pages: fork failed\n", pages);
+        } else {
+            uint32_t fork_avg = (uint32_t)(fork_cycles / rounds);
+            log_info("  %4d pages (%d KB): fork %d cycles (%d/page), release %d cycles\n", pages,
+                pages * PAGE_SIZE / 1024, fork_avg, pages ? fork_avg / pages : 0,
+                (uint32_t)(exit_cycles / rounds));
+        }
+        parent->releaseMemorySpace();
+        PidManager::free(parent->context_id);
+        delete parent;
+    }
+}
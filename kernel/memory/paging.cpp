@@ -2,6 +2,8 @@
 #include "../include/lib/console.h"
 #include <cstdint>
 
+#include <arch/x86/spinlock.h>
+#include <arch/x86/tlb.h>
 #include <lib/debug.h>
 #include <lib/serial.h>
 #include <lib/string.h>
@@ -47,16 +49,38 @@ void PageManager::mapKernelSpace()
     }
 
     // map 0xC0000000
+    // 直接映射区用4MB大页：每个页目录项映射4MB物理内存，省去224个页表(896KB)，
+    // 内核访问直接映射区时TLB只需要224个条目；直接映射区在所有页目录中都相同，
+    // 标记为全局页，切换页目录时不会被刷掉
     uint32_t pteStart = 0xC0000000 >> 22;
-    for(int j = 0; j < K_PAGE_TABLE_COUNT; j++) { // each pde
-        auto* table = reinterpret_cast<PageTable*>(K_PAGE_TABLE_START + j * sizeof(PageTable));
+    for(uint32_t j = 0; j < K_DIRECT_MAP_PDE_COUNT; j++) { // each pde
+        // 4MB page, global, Supervisor, read/write, present
+        dir->entries[j + pteStart] = (j * LARGE_PAGE_SIZE) | PAGE_GLOBAL | PAGE_PS | 3;
+    }
+
+    // VMALLOC区域的页表，初始时没有任何映射
+    uint32_t vmallocPdeStart = VMALLOC_START >> 22;
+    for(uint32_t j = 0; j < K_VMALLOC_PT_COUNT; j++) {
+        auto* table = reinterpret_cast<PageTable*>(K_VMALLOC_PT_START + j * sizeof(PageTable));
+        for(uint32_t i = 0; i < 1024; i++) {
+            table->entries[i] = 0;
+        }
+        dir->entries[j + vmallocPdeStart] = reinterpret_cast<uintptr_t>(table) | 3;
+    }
+
+    // KMAP区域的页表，kmap_atomic和持久kmap只修改PTE，不需要同步各个页目录
+    uint32_t kmapPdeStart = KMAP_START >> 22;
+    for(uint32_t j = 0; j < K_KMAP_PT_COUNT; j++) {
+        auto* table = reinterpret_cast<PageTable*>(K_KMAP_PT_START + j * sizeof(PageTable));
         for(uint32_t i = 0; i < 1024; i++) {
-            table->entries[i] = (i * 4096 + j * 1024 * 4096) | 3; // Supervisor, read/write, present
+            table->entries[i] = 0;
         }
-        dir->entries[j + pteStart] =
-            reinterpret_cast<uintptr_t>(table) | 3; // Supervisor, read/write, present
+        dir->entries[j + kmapPdeStart] = reinterpret_cast<uintptr_t>(table) | 3;
     }
 
+    // 递归映射，页表通过PTE_WINDOW访问
+    dir->entries[RECURSIVE_PDE] = PAGE_DIRECTORY_ADDR | 3;
+
     // 映射APIC区域 (0xFEC00000 - 0xFEEFFFFF)
     constexpr uint32_t APIC_START = 0xFEC00000;
     constexpr uint32_t APIC_END = 0xFEEFFFFF;
@@ -83,62 +107,61 @@ void PageManager::loadPageDirectory(uint32_t dir)
 
 void PageManager::enablePaging()
 {
+    // 直接映射区使用4MB大页，开启分页前先打开CR4.PSE（Pentium及以后的CPU都支持）
+    uint32_t cr4_val;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4_val));
+    cr4_val |= 0x10; // CR4.PSE
+    asm volatile("mov %0, %%cr4" : : "r"(cr4_val));
+
     uint32_t cr0_val;
     // 获取当前 CR0 寄存器的值
     asm volatile("mov %%cr0, %0" : "=r"(cr0_val));
-    cr0_val |= 0x80000000; // 启用分页
+    // CR0.WP：内核写只读的用户页（共享零页、写时复制页）时同样触发缺页，而不是直接改掉共享页面
+    cr0_val |= 0x80000000 | 0x10000; // 启用分页和写保护
     // 将修改后的 CR0 值写回 CR0 寄存器
     asm volatile("mov %0, %%cr0" : : "r"(cr0_val));
+
+    arch::tlb_enable_global_pages();
 }
 
 // 映射虚拟地址到物理地址
 void PageManager::mapPage(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
 {
-    // debug_debug("trying to map virt:%x, phys:%x, flags:%x\n", virt_addr,
-    // phys_addr, flags);
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-
-    // 获取页目录项
-    if(!curPgdVirt) {
-        log_err("PageManager: currentPageDirectory is null\n");
-        return;
-    }
-
-    // 检查页表是否存在
-    PageTable* pt;
-    if(!(curPgdVirt->entries[pd_index] & 0x1)) {
+    uint32_t* pde = current_pde(virt_addr);
+    if(!(*pde & PAGE_PRESENT)) {
         // 创建新页表
         log_debug("creating new page table\n");
-        pt = (PageTable*)Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
-        // debug_debug("created phys:%x\n", pt);
-        curPgdVirt->entries[pd_index] =
-            reinterpret_cast<uint32_t>(pt) | 3; // Supervisor, read/write, present
-    } else {
-        pt = reinterpret_cast<PageTable*>(curPgdVirt->entries[pd_index] & 0xFFFFF000);
-        // debug_debug("page table exists, phys: %x\n", pt);
+        PADDR pt = Kernel::instance().kernel_mm().alloc_pages(__GFP_ZERO, 0); // 新页表必须清零
+        if(!pt) {
+            log_err("PageManager: failed to allocate page table for 0x%x\n", virt_addr);
+            return;
+        }
+        *pde = pt | 3; // Supervisor, read/write, present
+    } else if(*pde & PAGE_PS) {
+        log_err("PageManager: 0x%x is inside a 4MB page\n", virt_addr);
+        return;
     }
 
     // 设置页表项
-    pt = (PageTable*)Kernel::instance().kernel_mm().phys2Virt((uint32_t)pt);
-    // debug_debug("page table virt: %x\n", pt);
-    pt->entries[pt_index] = (phys_addr & 0xFFFFF000) | (flags & 0xFFF) | 0x1; // Present
-    // debug_debug("mapped virt:%x, phys:%x, flags:%x, pte:%x, pd_index:%x,
-    // pt_index:%x\n", virt_addr, phys_addr, flags, pt->entries[pt_index],
-    // pd_index, pt_index);
+    *current_pte(virt_addr) = (phys_addr & 0xFFFFF000) | (flags & 0xFFF) | 0x1; // Present
 }
 
 // 解除虚拟地址映射
 void PageManager::unmapPage(uint32_t virt_addr)
 {
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-
-    if(!curPgdVirt || !(curPgdVirt->entries[pd_index] & 0x1))
+    uint32_t pde = *current_pde(virt_addr);
+    if(!(pde & PAGE_PRESENT))
+        return;
+    if(pde & PAGE_PS) {
+        log_err("PageManager: can not unmap 0x%x inside a 4MB page\n", virt_addr);
         return;
+    }
 
-    PageTable* pt = reinterpret_cast<PageTable*>(curPgdVirt->entries[pd_index] & 0xFFFFF000);
-    pt->entries[pt_index] = 0x00000002; // Supervisor, read/write, not present
+    *current_pte(virt_addr) = 0x00000002; // Supervisor, read/write, not present
+    // 内核地址，所有CPU的TLB中都可能有这一项
+    arch::TlbBatch batch(0);
+    batch.add(virt_addr);
+    batch.flush();
 }
 
 // 切换页目录
@@ -151,31 +174,31 @@ void PageManager::switchPageDirectory(PageDirectory* dirVirt, void* dirPhys)
 // 获取页表项标志位
 uint32_t PageManager::getPageFlags(uint32_t virt_addr)
 {
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-
-    if(!curPgdVirt || !(curPgdVirt->entries[pd_index] & 0x1)) {
+    uint32_t pde = *current_pde(virt_addr);
+    if(!(pde & PAGE_PRESENT)) {
         return 0; // 页目录项不存在
     }
-
-    PageTable* pt = reinterpret_cast<PageTable*>(curPgdVirt->entries[pd_index] & 0xFFFFF000);
-    return pt->entries[pt_index] & 0xFFF; // 返回标志位
+    if(pde & PAGE_PS) {
+        return pde & 0xFFF; // 4MB大页，标志位在页目录项中（含PAGE_PS）
+    }
+    return *current_pte(virt_addr) & 0xFFF; // 返回标志位
 }
 
 // 设置页表项标志位
 void PageManager::setPageFlags(uint32_t virt_addr, uint32_t flags)
 {
-    uint32_t pd_index = virt_addr >> 22;
-    uint32_t pt_index = (virt_addr >> 12) & 0x3FF;
-
-    if(!curPgdVirt || !(curPgdVirt->entries[pd_index] & 0x1)) {
+    uint32_t* pde = current_pde(virt_addr);
+    if(!(*pde & PAGE_PRESENT)) {
         return; // 页目录项不存在
     }
+    if(*pde & PAGE_PS) {
+        *pde = (*pde & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PS;
+        return;
+    }
 
-    PageTable* pt = reinterpret_cast<PageTable*>(curPgdVirt->entries[pd_index] & 0xFFFFF000);
-    uint32_t entry = pt->entries[pt_index];
-    if(entry & 0x1) { // 如果页面存在
-        pt->entries[pt_index] = (entry & 0xFFFFF000) | (flags & 0xFFF);
+    uint32_t* pte = current_pte(virt_addr);
+    if(*pte & 0x1) { // 如果页面存在
+        *pte = (*pte & 0xFFFFF000) | (flags & 0xFFF);
     }
 }
 
@@ -190,20 +213,63 @@ void PageManager::disablePaging()
 }
 
 
-int PageManager::copyMemorySpaceCOW(PageDirectory* src, PageDirectory* dstPgd)
+// fork时共享一个用户页表项并返回子进程中的表项：可写页面在父子进程中都变为只读并打上COW标志，
+// 第一次写时再复制；共享文件映射的页面父子进程继续共享同一个页缓存页面。
+// 所有共享的页面都增加引用计数，包括上一次fork留下的COW页面，
+// 否则其中一方复制或退出时会把另一方仍在使用的页面释放
+static uint32_t cow_share_pte(uint32_t& src_entry)
+{
+    uint32_t entry = src_entry;
+    if(entry & PAGE_PRESENT) {
+        if((entry & PAGE_WRITE) && !(entry & PAGE_SHARED)) {
+            entry = (entry & ~PAGE_WRITE) | PAGE_COW;
+            src_entry = entry;
+        }
+        Kernel::instance().kernel_mm().increment_ref_count(entry & 0xFFFFF000);
+    }
+    return entry;
+}
+
+int PageManager::copyMemorySpaceCOW(
+    PageDirectory* src, PageDirectory* dstPgd, SpinLock* src_pte_lock)
 {
     auto& kernel_mm = Kernel::instance().kernel_mm();
     for(int i = 0; i < 1024; i++) {
         dstPgd->entries[i] = 0x00000000; // Supervisor, read, not present
     }
-    // 前4M空间
-    dstPgd->entries[0] = src->entries[0];
+    // 前4M空间：内核恒等映射加上用户程序映像，映像是私有的，低端页表每个地址空间一份；
+    // 映像部分先留空，持有页表锁时再按写时复制共享。
+    // 内核上下文的低端页表就是K_FIRST_4M_PT，其中映像范围是恒等映射，不是映像页面
+    PADDR low_pt = kernel_mm.alloc_pages(0, 0);
+    if(!low_pt) {
+        log_err("PageManager: failed to allocate low page table\n");
+        return -1;
+    }
+    auto src_low = (uint32_t*)kernel_mm.phys2Virt(src->entries[0] & 0xFFFFF000);
+    auto dst_low = (uint32_t*)kernel_mm.phys2Virt(low_pt);
+    bool src_has_image = (src->entries[0] & 0xFFFFF000) != K_FIRST_4M_PT;
+    for(uint32_t i = 0; i < 1024; i++) {
+        bool image = i >= (USER_IMAGE_START >> 12) && i < (USER_IMAGE_END >> 12);
+        dst_low[i] = image ? 0 : src_low[i];
+    }
+    dstPgd->entries[0] = low_pt | (src->entries[0] & 0xFFF);
 
-    // 映射0xC0000000后896MB空间, 页表是已经存在的
+    // 映射0xC0000000后896MB空间, 直接映射区是4MB大页，页目录项直接复制
     uint32_t kernelPteStart = 0xC0000000 >> 22;
-    for(int j = kernelPteStart; j < kernelPteStart + K_PAGE_TABLE_COUNT; j++) {
+    for(uint32_t j = kernelPteStart; j < kernelPteStart + K_DIRECT_MAP_PDE_COUNT; j++) {
+        dstPgd->entries[j] = src->entries[j];
+    }
+    // VMALLOC区域的页表是共享的
+    uint32_t vmallocPdeStart = VMALLOC_START >> 22;
+    for(uint32_t j = vmallocPdeStart; j < vmallocPdeStart + K_VMALLOC_PT_COUNT; j++) {
         dstPgd->entries[j] = src->entries[j];
     }
+    uint32_t kmapPdeStart = KMAP_START >> 22;
+    for(uint32_t j = kmapPdeStart; j < kmapPdeStart + K_KMAP_PT_COUNT; j++) {
+        dstPgd->entries[j] = src->entries[j];
+    }
+    // 新页目录的递归映射指向它自己
+    dstPgd->entries[RECURSIVE_PDE] = kernel_mm.virt2Phys(dstPgd) | 3;
 
     // 映射APIC区域 (0xFEC00000 - 0xFEEFFFFF)
     constexpr uint32_t APIC_START = 0xFEC00000;
@@ -220,52 +286,138 @@ int PageManager::copyMemorySpaceCOW(PageDirectory* src, PageDirectory* dstPgd)
 
 
     // 复制用户空间页表项并设置COW标志
+    // 子进程的页表通过FOREIGN_PDE窗口填写，期间关着中断不能分配内存，先为每个页表分配好页面
     uint32_t userPteStart = USER_START >> 22;
     uint32_t userPteEnd = USER_END >> 22;
+    uint32_t nr_pts = 0;
     for(uint32_t pde_idx = userPteStart; pde_idx < userPteEnd; pde_idx++) {
-        // 复制所有页目录项（包含present和非present）
-        dstPgd->entries[pde_idx] = src->entries[pde_idx];
-
-        // 仅处理存在的页表
-        if(src->entries[pde_idx] & PAGE_PRESENT) {
-            auto src_pt_paddr = src->entries[pde_idx] & 0xFFFFF000;
-            if (src_pt_paddr > 896 * 1024*1024) {
-                log_err("PageManager: src_pt_paddr 0x%x, pde_idx:%d, pde:0x%x \n", src_pt_paddr, pde_idx, src->entries[pde_idx]);
+        if((src->entries[pde_idx] & PAGE_PRESENT) && !pde_is_large(src->entries[pde_idx])) {
+            nr_pts++;
+        }
+    }
+    PADDR* new_pts = nullptr;
+    if(nr_pts) {
+        new_pts = (PADDR*)kernel_mm.kmalloc(nr_pts * sizeof(PADDR));
+        if(!new_pts) {
+            log_err("PageManager: failed to allocate page table list\n");
+            return -1;
+        }
+    }
+    for(uint32_t i = 0; i < nr_pts; i++) {
+        new_pts[i] = kernel_mm.alloc_pages(0, 0); // order=0表示分配单个页面
+        if(!new_pts[i]) {
+            log_err("PageManager: failed to allocate page table %d of %d\n", i, nr_pts);
+            while(i--) {
+                kernel_mm.free_pages(new_pts[i], 0);
+            }
+            kernel_mm.kfree(new_pts);
+            return -1;
+        }
+    }
+
+    // fork由父进程执行，源地址空间就是当前地址空间，它的页表通过递归映射访问
+    bool src_current = arch::is_current_pgd(kernel_mm.virt2Phys(src));
+    uint32_t next_pt = 0;
+    // 写保护父进程页表项、增加引用计数期间不能有内存规整把页面迁走
+    uint32_t lock_flags;
+    src_pte_lock->acquire_irqsave(lock_flags);
+    if(src_has_image) {
+        for(uint32_t i = USER_IMAGE_START >> 12; i < (USER_IMAGE_END >> 12); i++) {
+            dst_low[i] = cow_share_pte(src_low[i]);
+        }
+    }
+    {
+        ForeignPageDirectory child(kernel_mm.virt2Phys(dstPgd));
+        for(uint32_t pde_idx = userPteStart; pde_idx < userPteEnd; pde_idx++) {
+            uint32_t base = pde_idx << 22;
+            uint32_t src_pde = src->entries[pde_idx];
+
+            // 4MB大页没有页表，父子进程共享同一个页目录项内容，整块按COW处理
+            if(pde_is_large(src_pde)) {
+                if(src_pde & PAGE_WRITE) {
+                    src_pde = (src_pde & ~PAGE_WRITE) | PAGE_COW;
+                    src->entries[pde_idx] = src_pde;
+                }
+                kernel_mm.increment_ref_count(src_pde & 0xFFFFF000);
+                *child.pde(base) = src_pde;
                 continue;
             }
-            auto dst_pt_paddr = Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
-            log_debug("src_pt_paddr:0x%x, dst_pt_paddr:0x%x\n", src_pt_paddr, dst_pt_paddr);
-            PageTable* dst_pt = (PageTable*)kernel_mm.phys2Virt(dst_pt_paddr);
-            PageTable* src_pt = (PageTable*)kernel_mm.phys2Virt(src_pt_paddr);
+
+            // 复制不存在的页目录项，仅为存在的页表复制内容
+            if(!(src_pde & PAGE_PRESENT)) {
+                *child.pde(base) = src_pde;
+                continue;
+            }
+            uint32_t* src_pt = src_current
+                                   ? current_pte(base)
+                                   : (uint32_t*)kernel_mm.phys2Virt(src_pde & 0xFFFFF000);
+            *child.pde(base) = new_pts[next_pt++] | (src_pde & 0xFFF);
+            uint32_t* dst_pt = child.pte(base);
 
             // 复制所有页表项
-            log_debug("copyMemorySpaceCOW: src_pt:%x, dst_pt:%x\n", src_pt, dst_pt);
             for(uint32_t pte_idx = 0; pte_idx < 1024; pte_idx++) {
-                // 如果是可写页面，设置COW标志
-                if(src_pt->entries[pte_idx] & PAGE_WRITE) {
-                    // 清除原页面的可写标志
-                    src_pt->entries[pte_idx] &= ~PAGE_WRITE;
-                    // 设置COW标志位（假设PAGE_COW是第9位）
-                    src_pt->entries[pte_idx] |= PAGE_COW;
-
-                    // 增加物理页引用计数
-                    uint32_t phys_addr = src_pt->entries[pte_idx] & 0xFFFFF000;
-                    Kernel::instance().kernel_mm().increment_ref_count(phys_addr);
-                }
-                // 复制修改后的条目到新页表
-                dst_pt->entries[pte_idx] = src_pt->entries[pte_idx];
+                dst_pt[pte_idx] = cow_share_pte(src_pt[pte_idx]);
             }
-            // 更新页目录项
-            dstPgd->entries[pde_idx] = dst_pt_paddr | (src->entries[pde_idx] & 0xFFF);
         }
     }
+    src_pte_lock->release_irqrestore(lock_flags);
+    if(new_pts) {
+        kernel_mm.kfree(new_pts);
+    }
 
+    // 源地址空间的可写页刚被改为只读，所有正在使用它的CPU都要丢掉可写的TLB项
+    arch::TlbBatch batch(kernel_mm.virt2Phys(src));
+    batch.add_all();
+    batch.flush();
     return 0;
 }
 
+namespace {
+// 保护FOREIGN_PDE：线程共享页目录，同一个页目录的窗口可能被多个CPU同时使用
+SpinLock foreign_lock;
+} // namespace
+
+ForeignPageDirectory::ForeignPageDirectory(uint32_t pgd_phys)
+{
+    foreign_lock.acquire_irqsave(flags);
+    *current_pde(FOREIGN_PTE_WINDOW) = (pgd_phys & 0xFFFFF000) | 3;
+    // 窗口之前可能指向别的页目录，其他CPU挂上时本CPU也可能预取了窗口中的表项
+    arch::flush_tlb_all();
+}
+
+ForeignPageDirectory::~ForeignPageDirectory()
+{
+    // 残留的TLB项不会被访问，下一次挂上时会整体刷新
+    *current_pde(FOREIGN_PTE_WINDOW) = 0;
+    foreign_lock.release_irqrestore(flags);
+}
+
+void PageManager::freeMemorySpace(PageDirectory* pgd)
+{
+    // copyMemorySpaceCOW为低端和APIC区域复制的页表是私有的，其余内核页表都是共享的；
+    // 低端页表中的映像页面已由UserMemory::release_user_pages释放
+    uint32_t low_pt = pgd->entries[0] & 0xFFFFF000;
+    if((pgd->entries[0] & PAGE_PRESENT) && low_pt != K_FIRST_4M_PT) {
+        Kernel::instance().kernel_mm().free_pages(low_pt, 0);
+        pgd->entries[0] = 0;
+    }
+    constexpr uint32_t APIC_START = 0xFEC00000;
+    uint32_t pd_index = APIC_START >> 22;
+    if(pgd->entries[pd_index] & PAGE_PRESENT) {
+        Kernel::instance().kernel_mm().free_pages(pgd->entries[pd_index] & 0xFFFFF000, 0);
+        pgd->entries[pd_index] = 0;
+    }
+}
+
 void PagingValidate(PageDirectory * pd)
 {
     for (int i = 0; i < 1024; i++) {
+        if (pde_is_large(pd->entries[i])) {
+            continue; // 4MB大页没有页表
+        }
+        if (i == (int)RECURSIVE_PDE || i == (int)FOREIGN_PDE) {
+            continue; // 指向页目录而不是页表
+        }
         if (pd->entries[i] & 0x1) {
             PADDR pt_paddr = pd->entries[i] & 0xFFFFF000;
             if(pt_paddr > 896*1024*1024) {
@@ -331,10 +483,29 @@ void __printPDPTE(VADDR vaddr, PageDirectory* pdVirt)
     auto fault_addr = (uint32_t)vaddr;
     auto pd_index = (fault_addr >> 22) & 0x3FF;
     auto pde = pdVirt->entries[fault_addr >> 22];
+    if(pde_is_large(pde)) {
+        log_debug("PD: 0x%x(phys:0x%x), PD index:%d(0x%x), PDE:0x%x (4MB page), phys:0x%x\n", pdVirt,
+            pdPhys, pd_index, pd_index, pde, (pde & 0xFFC00000) | (fault_addr & 0x3FF000));
+        printPTEFlags(pde);
+        return;
+    }
     auto pt_phys = pde & 0xFFFFF000;
-    auto pt_virt = (PageTable*)Kernel::instance().kernel_mm().phys2Virt(pt_phys);
     auto pt_index = (fault_addr >> 12) & 0x3FF;
-    auto pte = pt_virt->entries[pt_index];
+    uint32_t pte = 0;
+    if(!(pde & PAGE_PRESENT)) {
+        log_debug("PD: 0x%x(phys:0x%x), PD index:%d(0x%x), PDE:0x%x (not present)\n", pdVirt,
+            pdPhys, pd_index, pd_index, pde);
+        return;
+    }
+    // 页表在递归映射窗口中的地址
+    uint32_t pt_virt = pte_window_page(fault_addr);
+    if(arch::is_current_pgd(pdPhys)) {
+        pte = *current_pte(fault_addr);
+    } else {
+        ForeignPageDirectory foreign(pdPhys);
+        pte = *foreign.pte(fault_addr);
+        pt_virt += FOREIGN_PTE_WINDOW - PTE_WINDOW;
+    }
     auto phys = pte & 0xFFFFF000;
     log_debug("PD: 0x%x(phys:0x%x), PD index:%d(0x%x), PDE:0x%x\n", pdVirt, pdPhys, pd_index,
         pd_index, pde);
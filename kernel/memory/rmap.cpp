@@ -0,0 +1,254 @@
+#include "kernel/rmap.h"
+
+#include "arch/x86/percpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/tlb.h"
+#include "kernel/kernel.h"
+#include "kernel/slab_allocator.h"
+#include "lib/debug.h"
+#include "lib/mutex.h"
+#include "lib/string.h"
+
+namespace kernel {
+
+void ReverseMap::init()
+{
+    for(uint32_t i = 0; i < HASH_BUCKETS; i++) {
+        buckets[i] = nullptr;
+    }
+    nr_entries = 0;
+    entry_cache = kmem_cache_create("rmap_entry", sizeof(RmapEntry), alignof(RmapEntry), nullptr);
+}
+
+// 调用者需持有lock
+RmapEntry* ReverseMap::find(uint32_t pfn)
+{
+    for(RmapEntry* e = *bucket(pfn); e; e = e->next) {
+        if(e->pfn == pfn) {
+            return e;
+        }
+    }
+    return nullptr;
+}
+
+// 调用者需持有lock
+void ReverseMap::remove(uint32_t pfn)
+{
+    for(RmapEntry** pe = bucket(pfn); *pe; pe = &(*pe)->next) {
+        RmapEntry* e = *pe;
+        if(e->pfn == pfn) {
+            *pe = e->next;
+            nr_entries--;
+            page* pg = Kernel::instance().kernel_mm().phys_to_page(pfn * PAGE_SIZE);
+            if(pg) {
+                pg->flags &= ~PG_MOVABLE;
+            }
+            kmem_cache_free(entry_cache, e);
+            return;
+        }
+    }
+}
+
+// 调用者需持有lock；已有记录时复用，否则使用spare并把*spare置空
+// 新记录要在加锁前分配：分配可能触发回收，页缓存收缩器会回到remove_cache
+RmapEntry* ReverseMap::add(PADDR phys, RmapType type, RmapEntry** spare)
+{
+    page* pg = Kernel::instance().kernel_mm().phys_to_page(phys);
+    if(!pg) {
+        return nullptr;
+    }
+    uint32_t pfn = phys / PAGE_SIZE;
+    RmapEntry* e = find(pfn);
+    if(!e) {
+        e = *spare;
+        if(!e) {
+            return nullptr;
+        }
+        *spare = nullptr;
+        e->pfn = pfn;
+        e->next = *bucket(pfn);
+        *bucket(pfn) = e;
+        nr_entries++;
+    }
+    e->type = type;
+    pg->flags |= PG_MOVABLE;
+    return e;
+}
+
+void ReverseMap::add_anon(PADDR phys, PADDR pgd_phys, uint32_t vaddr, SpinLock* ptl)
+{
+    RmapEntry* spare = (RmapEntry*)kmem_cache_alloc(entry_cache);
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    RmapEntry* e = add(phys, RmapType::ANON, &spare);
+    if(e) {
+        e->anon.pgd_phys = pgd_phys;
+        e->anon.vaddr = vaddr & ~(PAGE_SIZE - 1);
+        e->anon.ptl = ptl;
+    }
+    lock.release_irqrestore(flags);
+    kmem_cache_free(entry_cache, spare);
+}
+
+void ReverseMap::remove_anon(PADDR phys, PADDR pgd_phys, uint32_t vaddr)
+{
+    uint32_t pfn = phys / PAGE_SIZE;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    RmapEntry* e = find(pfn);
+    if(e && e->type == RmapType::ANON && e->anon.pgd_phys == pgd_phys &&
+        e->anon.vaddr == (vaddr & ~(PAGE_SIZE - 1))) {
+        remove(pfn);
+    }
+    lock.release_irqrestore(flags);
+}
+
+void ReverseMap::add_cache(PADDR phys, void** ref, Mutex* mutex)
+{
+    RmapEntry* spare = (RmapEntry*)kmem_cache_alloc(entry_cache);
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    RmapEntry* e = add(phys, RmapType::PAGE_CACHE, &spare);
+    if(e) {
+        e->cache.ref = ref;
+        e->cache.lock = mutex;
+    }
+    lock.release_irqrestore(flags);
+    kmem_cache_free(entry_cache, spare);
+}
+
+void ReverseMap::remove_cache(PADDR phys)
+{
+    uint32_t pfn = phys / PAGE_SIZE;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    RmapEntry* e = find(pfn);
+    if(e && e->type == RmapType::PAGE_CACHE) {
+        remove(pfn);
+    }
+    lock.release_irqrestore(flags);
+}
+
+// 返回pgd中vaddr对应的PTE，页表不存在或是4MB大页时返回nullptr
+uint32_t* ReverseMap::anon_pte(PADDR pgd_phys, uint32_t vaddr)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    auto pgd = (uint32_t*)mm.phys2Virt(pgd_phys);
+    uint32_t pde = pgd[vaddr >> 22];
+    if(!(pde & PAGE_PRESENT) || (pde & PAGE_PS)) {
+        return nullptr;
+    }
+    auto pt = (uint32_t*)mm.phys2Virt(pde & 0xFFFFF000);
+    return &pt[(vaddr >> 12) & 0x3FF];
+}
+
+// migrate在取得所有者的锁之前检查过引用计数，但fork在页表锁内、页缓存的pin在mtx_内
+// 增加引用，可能正好发生在检查之后；拿到锁之后不会再有新的引用，这里再确认一次
+bool ReverseMap::still_exclusive(PADDR phys)
+{
+    page* pg = Kernel::instance().kernel_mm().phys_to_page(phys);
+    return pg && (pg->flags & PG_MOVABLE) && page_ref_count(pg) == 1;
+}
+
+bool ReverseMap::migrate_anon(RmapEntry* e, PADDR old_phys, PADDR new_phys)
+{
+    // 缺页、写时复制、fork和解除映射都在页表锁内修改表项；这里已经持有rmap的锁，
+    // 只能尝试获取，拿不到说明地址空间正在被修改，放弃这一页
+    if(!e->anon.ptl->try_acquire()) {
+        return false;
+    }
+    uint32_t* pte = anon_pte(e->anon.pgd_phys, e->anon.vaddr);
+    if(!pte || (*pte & 0xFFFFF000) != old_phys || !(*pte & PAGE_PRESENT)) {
+        e->anon.ptl->release();
+        return false; // 记录已失效
+    }
+    if(!still_exclusive(old_phys)) {
+        e->anon.ptl->release();
+        return false;
+    }
+
+    // 先把表项换成不存在的迁移标记再看哪些CPU在使用这个页目录：之后才切换过来的CPU
+    // 访问该页时缺页并等待页表锁；已经在使用的CPU的TLB中可能缓存着旧的映射，
+    // 持有锁时不能发IPI，放弃迁移并恢复表项
+    uint32_t old_pte = __atomic_exchange_n(
+        pte, (*pte & ~PAGE_PRESENT) | PAGE_MIGRATING, __ATOMIC_SEQ_CST);
+    uint32_t self = arch::get_cpu_id() % MAX_CPUS;
+    if(arch::mm_cpu_mask(e->anon.pgd_phys) & ~(1u << self)) {
+        *pte = old_pte;
+        e->anon.ptl->release();
+        return false;
+    }
+    if(arch::is_current_pgd(e->anon.pgd_phys)) {
+        arch::flush_tlb_page(e->anon.vaddr);
+    }
+
+    auto& mm = Kernel::instance().kernel_mm();
+    memcpy(mm.phys2Virt(new_phys), mm.phys2Virt(old_phys), PAGE_SIZE);
+    __atomic_store_n(pte, new_phys | (old_pte & 0xFFF), __ATOMIC_RELEASE);
+    e->anon.ptl->release();
+    return true;
+}
+
+bool ReverseMap::migrate_cache(RmapEntry* e, PADDR old_phys, PADDR new_phys)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    void* old_virt = mm.phys2Virt(old_phys);
+    if(!e->cache.lock->tryLock()) {
+        return false;
+    }
+    bool ok = *e->cache.ref == old_virt && still_exclusive(old_phys);
+    if(ok) {
+        void* new_virt = mm.phys2Virt(new_phys);
+        memcpy(new_virt, old_virt, PAGE_SIZE);
+        *e->cache.ref = new_virt;
+    }
+    e->cache.lock->unlock();
+    return ok;
+}
+
+bool ReverseMap::migrate(PADDR old_phys, PADDR new_phys)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    page* old_pg = mm.phys_to_page(old_phys);
+    page* new_pg = mm.phys_to_page(new_phys);
+    if(!old_pg || !new_pg) {
+        return false;
+    }
+
+    uint32_t old_pfn = old_phys / PAGE_SIZE;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    RmapEntry* e = find(old_pfn);
+    bool ok = false;
+    // 共享页（COW）有多个映射，这里只记录了一个，不能迁移；
+    // kmalloc页只迁移单页的（private_为页数）
+    bool single = !(old_pg->flags & PG_KMALLOC) || old_pg->private_ == 1;
+    if(e && (old_pg->flags & PG_MOVABLE) && page_ref_count(old_pg) == 1 && single) {
+        ok = e->type == RmapType::ANON ? migrate_anon(e, old_phys, new_phys)
+                                       : migrate_cache(e, old_phys, new_phys);
+    }
+    if(ok) {
+        // 记录换到新页的哈希桶中
+        for(RmapEntry** pe = bucket(old_pfn); *pe; pe = &(*pe)->next) {
+            if(*pe == e) {
+                *pe = e->next;
+                break;
+            }
+        }
+        e->pfn = new_phys / PAGE_SIZE;
+        e->next = *bucket(e->pfn);
+        *bucket(e->pfn) = e;
+        // kmalloc分配的页面由kfree依据PG_KMALLOC和private_中的页数释放，一并转移；
+        // 普通页面新页分配时引用计数已经是1，不需要复制
+        new_pg->flags |= PG_MOVABLE;
+        if(old_pg->flags & PG_KMALLOC) {
+            new_pg->flags |= PG_KMALLOC;
+            new_pg->private_ = old_pg->private_;
+        }
+        old_pg->flags &= ~(PG_MOVABLE | PG_KMALLOC);
+    }
+    lock.release_irqrestore(flags);
+    return ok;
+}
+
+} // namespace kernel
@@ -0,0 +1,152 @@
+#include "kernel/shrinker.h"
+
+#include "arch/x86/spinlock.h"
+#include "kernel/kernel.h"
+#include "kernel/kernel_memory.h"
+#include "kernel/process.h"
+#include "lib/debug.h"
+
+namespace kernel {
+
+namespace {
+
+Shrinker* shrinker_list = nullptr;
+SpinLock shrinker_lock;               // 保护shrinker_list和shrinker_running
+uint32_t reclaim_active = 0;          // 是否有回收者正在运行
+uint32_t reclaim_seq = 0;             // shrink_caches的轮次，用来标记本轮已调用过的收缩器
+Shrinker* shrinker_running = nullptr; // 回调正在运行的收缩器，注销时要等它返回
+
+volatile uint32_t kswapd_pending = 0; // 有未处理的唤醒请求
+Task* kswapd_task = nullptr;
+uint32_t kswapd_wakeups = 0;          // kswapd实际执行回收的次数
+uint32_t kswapd_reclaimed = 0;        // kswapd累计回收的页数
+
+} // namespace
+
+void register_shrinker(Shrinker* shrinker)
+{
+    shrinker->scan_seq = 0;
+    shrinker->nr_scans = 0;
+    shrinker->nr_freed = 0;
+    uint32_t flags;
+    shrinker_lock.acquire_irqsave(flags);
+    shrinker->next = shrinker_list;
+    shrinker_list = shrinker;
+    shrinker_lock.release_irqrestore(flags);
+}
+
+void unregister_shrinker(Shrinker* shrinker)
+{
+    uint32_t flags;
+    shrinker_lock.acquire_irqsave(flags);
+    Shrinker** prev = &shrinker_list;
+    while(*prev && *prev != shrinker) {
+        prev = &(*prev)->next;
+    }
+    if(*prev) {
+        *prev = shrinker->next;
+    }
+    while(shrinker_running == shrinker) {
+        shrinker_lock.release_irqrestore(flags);
+        asm volatile("pause");
+        shrinker_lock.acquire_irqsave(flags);
+    }
+    shrinker_lock.release_irqrestore(flags);
+}
+
+namespace {
+
+// 取下一个本轮还没有调用过的收缩器并标记为正在运行，没有时返回nullptr。
+// 每次都从表头查找，回调期间其他收缩器被注销也不会访问到已经摘除的节点
+Shrinker* next_shrinker(uint32_t seq)
+{
+    uint32_t flags;
+    shrinker_lock.acquire_irqsave(flags);
+    Shrinker* s = shrinker_list;
+    while(s && s->scan_seq == seq) {
+        s = s->next;
+    }
+    if(s) {
+        s->scan_seq = seq;
+    }
+    shrinker_running = s;
+    shrinker_lock.release_irqrestore(flags);
+    return s;
+}
+
+} // namespace
+
+uint32_t shrink_caches(uint32_t nr_pages)
+{
+    // 回收过程中释放内存不会再进入这里，但其他CPU可能同时触发直接回收，
+    // 只保留一个回收者，避免多个CPU争抢同一批缓存
+    uint32_t expected = 0;
+    if(!__atomic_compare_exchange_n(
+           &reclaim_active, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    // 回调中会释放内存、获取各子系统的锁，不在持有shrinker_lock或关中断的情况下调用
+    uint32_t seq = ++reclaim_seq;
+    uint32_t freed = 0;
+    Shrinker* s = nullptr;
+    while(freed < nr_pages && (s = next_shrinker(seq))) {
+        if(s->count && s->count(s) == 0) {
+            continue;
+        }
+        uint32_t n = s->scan(s, nr_pages - freed);
+        s->nr_scans++;
+        s->nr_freed += n;
+        freed += n;
+    }
+    if(s) {
+        uint32_t flags;
+        shrinker_lock.acquire_irqsave(flags);
+        shrinker_running = nullptr;
+        shrinker_lock.release_irqrestore(flags);
+    }
+
+    __atomic_store_n(&reclaim_active, 0, __ATOMIC_RELEASE);
+    return freed;
+}
+
+void wakeup_kswapd()
+{
+    if(kswapd_pending) {
+        return;
+    }
+    kswapd_pending = 1;
+    Task* task = __atomic_load_n(&kswapd_task, __ATOMIC_ACQUIRE);
+    if(task) {
+        ProcessManager::wake_task(task);
+    }
+}
+
+void kswapd_entry()
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    __atomic_store_n(&kswapd_task, ProcessManager::get_current_task(), __ATOMIC_RELEASE);
+    log_info("kswapd started\n");
+    while(true) {
+        // 分配路径发现空闲页低于WMARK_LOW时设置kswapd_pending并唤醒kswapd，
+        // 没有请求时kswapd不在运行队列上，不占用CPU
+        ProcessManager::sleep_until(&kswapd_pending);
+        kswapd_pending = 0;
+        kswapd_wakeups++;
+        kswapd_reclaimed += mm.balance_zones();
+    }
+}
+
+void print_shrinker_stats()
+{
+    log_info("kswapd: wakeups %d, reclaimed %d pages\n", kswapd_wakeups, kswapd_reclaimed);
+    uint32_t flags;
+    shrinker_lock.acquire_irqsave(flags);
+    for(Shrinker* s = shrinker_list; s; s = s->next) {
+        log_info("  shrinker %-12s reclaimable %5d, scans %d, freed %d pages\n", s->name,
+            s->count ? s->count(s) : 0, s->nr_scans, s->nr_freed);
+    }
+    shrinker_lock.release_irqrestore(flags);
+}
+
+} // namespace kernel
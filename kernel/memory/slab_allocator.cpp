@@ -1,21 +1,18 @@
 #include <arch/x86/paging.h>
 #include <kernel/buddy_allocator.h>
+#include <kernel/gfp.h>
 #include <kernel/kernel.h>
 #include <kernel/slab_allocator.h>
 #include <lib/debug.h>
 #include <lib/string.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/percpu.h>
 #include <arch/x86/spinlock.h>
 
 namespace kernel {
 
-static SpinLock slab_global_lock;
-
-class Locker
-{
-    public:
-    Locker() { slab_global_lock.acquire(); }
-    ~Locker() { slab_global_lock.release(); }
-};
+SlabCache* SlabCache::magazine_cache = nullptr;
+SlabCache* SlabCache::slab_desc_cache = nullptr;
 
 void SlabObject::print() const {
     log_info("SlabObject at %p, next=%p\n", this, next);
@@ -24,7 +21,7 @@ void SlabObject::print() const {
 void Slab::print() const {
     log_info("Slab at %p:\n", this);
     log_info("  inuse=%d, free=%d\n", inuse, free);
-    log_info("  freelist=%p, objects=%p, next=%p\n", freelist, objects, next);
+    log_info("  freelist=%p, objects=%p, page=%p, colour=%d\n", freelist, objects, page, colour);
     
     // 打印空闲对象链表
     log_info("  Free objects: \n");
@@ -39,41 +36,53 @@ void SlabCache::print() const {
     log_info("  object_size=%d, object_align=%d, objects_per_slab=%d\n",
               object_size, object_align, objects_per_slab);
     
-    // 打印完全使用的slabs
-    log_info("  Full slabs: ");
-    Slab* slab = slabs_full;
-    while (slab) {
-        log_info("%p -> ", slab);
-        slab = slab->next;
-    }
-    log_info("null\n");
-    
-    // 打印部分使用的slabs
-    log_info("  Partial slabs: ");
-    slab = slabs_partial;
-    while (slab) {
-        log_info("%p -> ", slab);
-        slab = slab->next;
-    }
-    log_info("null\n");
-    
-    // 打印空闲的slabs
-    log_info("  Free slabs: ");
-    slab = slabs_free;
-    while (slab) {
-        log_info("%p -> ", slab);
-        slab = slab->next;
+    log_info("  off_slab=%d, colour_range=%d\n", off_slab, colour_range);
+
+    const list_head* lists[3] = {&slabs_full, &slabs_partial, &slabs_free};
+    const char* titles[3] = {"Full", "Partial", "Free"};
+    for (int i = 0; i < 3; i++) {
+        log_info("  %s slabs: ", titles[i]);
+        for (const list_head* pos = lists[i]->next; pos != lists[i]; pos = pos->next) {
+            log_info("%p -> ", list_entry(pos, Slab, list));
+        }
+        log_info("null\n");
+    }
+
+    if (use_magazines) {
+        uint32_t alloc_hits = 0;
+        uint32_t free_hits = 0;
+        uint32_t depot_allocs = 0;
+        uint32_t depot_frees = 0;
+        uint32_t slab_allocs = 0;
+        uint32_t slab_frees = 0;
+        for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+            alloc_hits += cpu_cache[cpu].alloc_hits;
+            free_hits += cpu_cache[cpu].free_hits;
+            depot_allocs += cpu_cache[cpu].depot_allocs;
+            depot_frees += cpu_cache[cpu].depot_frees;
+            slab_allocs += cpu_cache[cpu].slab_allocs;
+            slab_frees += cpu_cache[cpu].slab_frees;
+        }
+        log_info("  magazines: alloc hits=%d, free hits=%d, slab allocs=%d, slab frees=%d\n",
+                 alloc_hits, free_hits, slab_allocs, slab_frees);
+        log_info("  depot: full=%d, empty=%d, allocs=%d, frees=%d, contended=%d\n",
+                 depot_full_count, depot_empty_count, depot_allocs, depot_frees, depot_contended);
     }
-    log_info("null\n");
 }
 
 /**
  * @brief 默认构造函数，创建一个空的Slab缓存
  */
 SlabCache::SlabCache()
-    : name("---"), object_size(0), object_align(0), objects_per_slab(0), slabs_full(nullptr),
-      slabs_partial(nullptr), slabs_free(nullptr)
+    : name("---"), object_size(0), object_align(0), objects_per_slab(0), objects_offset(0),
+      off_slab(false), colour_range(0), colour_next(0), ctor(nullptr), next_cache(nullptr),
+      nr_slabs(0), active_objs(0), use_magazines(false), cpu_cache(),
+      depot_full(nullptr), depot_empty(nullptr), depot_full_count(0), depot_empty_count(0),
+      depot_contended(0)
 {
+    INIT_LIST_HEAD(&slabs_full);
+    INIT_LIST_HEAD(&slabs_partial);
+    INIT_LIST_HEAD(&slabs_free);
 }
 
 /**
@@ -81,20 +90,56 @@ SlabCache::SlabCache()
  * @param name 缓存名称
  * @param size 对象大小
  * @param align 对象对齐要求
+ * @param use_magazines 是否启用每CPU弹匣层
+ * @param ctor 可选的对象构造函数
  */
-SlabCache::SlabCache(const char* name, size_t size, size_t align)
+SlabCache::SlabCache(const char* name, size_t size, size_t align, bool use_magazines,
+                     SlabCtor ctor)
     : object_size(size)
     , object_align(align)
-    , slabs_full(nullptr)
-    , slabs_partial(nullptr)
-    , slabs_free(nullptr)
+    , off_slab(false)
+    , colour_range(0)
+    , colour_next(0)
+    , ctor(ctor)
+    , next_cache(nullptr)
+    , nr_slabs(0)
+    , active_objs(0)
+    , use_magazines(use_magazines)
+    , cpu_cache()
+    , depot_full(nullptr)
+    , depot_empty(nullptr)
+    , depot_full_count(0)
+    , depot_empty_count(0)
+    , depot_contended(0)
 {
-    strcpy(this->name, name);
+    strncpy(this->name, name, sizeof(this->name) - 1);
+    this->name[sizeof(this->name) - 1] = '\0';
+
+    // 对象至少要能放下空闲链表指针，并按对齐要求向上取整
+    if (object_align < sizeof(void*)) {
+        object_align = sizeof(void*);
+    }
+    if (object_size < sizeof(SlabObject)) {
+        object_size = sizeof(SlabObject);
+    }
+    object_size = (object_size + object_align - 1) & ~(object_align - 1);
+    INIT_LIST_HEAD(&slabs_full);
+    INIT_LIST_HEAD(&slabs_partial);
+    INIT_LIST_HEAD(&slabs_free);
+
+    // 大对象把描述符放到页外，整页都用来放对象
+    off_slab = object_size >= OFF_SLAB_MIN_SIZE;
+    objects_offset = off_slab ? 0 : (sizeof(Slab) + object_align - 1) & ~(object_align - 1);
+
     // 计算每个slab中可以容纳的对象数量
     size_t page_size = PAGE_SIZE;
-    size_t available = page_size - sizeof(Slab);
+    size_t available = page_size - objects_offset;
     log_info("SlabCache('%s') PAGE_SIZE=%d sizeof(Slab)=%d available=%d object_size=%d\n", name, page_size, sizeof(Slab), available, object_size);
     objects_per_slab = available / object_size;
+
+    // 剩余空间用于着色，着色步长不小于对象的对齐要求
+    size_t colour_step = object_align > CACHE_LINE_SIZE ? object_align : CACHE_LINE_SIZE;
+    colour_range = (available - objects_per_slab * object_size) / colour_step + 1;
     log_info("Created slab cache '%s' with object size %d, align %d, objects per slab %d\n",
               name, size, align, objects_per_slab);
 }
@@ -104,68 +149,273 @@ SlabCache::SlabCache(const char* name, size_t size, size_t align)
  */
 SlabCache::~SlabCache()
 {
+    flush_magazines();
+    if (active_objs) {
+        log_err("Destroying slab cache '%s' with %d objects still in use\n", name, active_objs);
+    }
+
     // 释放所有slab
-    Slab* slab;
-    while ((slab = slabs_full)) {
-        slabs_full = slab->next;
-        destroy_slab(slab);
+    list_head* lists[3] = {&slabs_full, &slabs_partial, &slabs_free};
+    for (list_head* head : lists) {
+        while (!list_empty(head)) {
+            Slab* slab = list_entry(head->next, Slab, list);
+            list_del_init(&slab->list);
+            destroy_slab(slab);
+        }
     }
-    while ((slab = slabs_partial)) {
-        slabs_partial = slab->next;
-        destroy_slab(slab);
+    log_info("Destroyed slab cache '%s'\n", name);
+}
+
+void SlabCache::depot_acquire()
+{
+    if (!depot_lock.try_acquire()) {
+        arch::atomic_add(&depot_contended, 1);
+        depot_lock.acquire();
     }
-    while ((slab = slabs_free)) {
-        slabs_free = slab->next;
-        destroy_slab(slab);
+}
+
+Magazine* SlabCache::depot_get(Magazine** list, uint32_t* count)
+{
+    depot_acquire();
+    Magazine* mag = *list;
+    if (mag) {
+        *list = mag->next;
+        (*count)--;
     }
-    log_info("Destroyed slab cache '%s'\n", name);
+    depot_lock.release();
+    return mag;
+}
+
+void SlabCache::depot_put(Magazine** list, uint32_t* count, Magazine* mag)
+{
+    depot_acquire();
+    mag->next = *list;
+    *list = mag;
+    (*count)++;
+    depot_lock.release();
 }
 
 /**
  * @brief 从Slab缓存中分配一个对象
+ * 依次尝试loaded弹匣、previous弹匣、depot中的满弹匣，都失败时才进入slab层
  * @return 分配的对象指针，如果分配失败则返回nullptr
  */
 void* SlabCache::alloc()
 {
-    Slab* slab = slabs_partial ? slabs_partial : slabs_free;
-    if (!slab) {
+    if (use_magazines) {
+        uint32_t irq_flags = local_irq_save();
+        CpuCache& cc = cpu_cache[arch::get_cpu_id() % MAX_CPUS];
+        if (!(cc.loaded && cc.loaded->rounds > 0)) {
+            if (cc.previous && cc.previous->rounds > 0) {
+                // previous是满的，与loaded交换
+                Magazine* tmp = cc.loaded;
+                cc.loaded = cc.previous;
+                cc.previous = tmp;
+            } else {
+                Magazine* full = depot_get(&depot_full, &depot_full_count);
+                if (full) {
+                    // previous为空弹匣，交还depot
+                    cc.depot_allocs++;
+                    if (cc.previous) {
+                        depot_put(&depot_empty, &depot_empty_count, cc.previous);
+                    }
+                    cc.previous = cc.loaded;
+                    cc.loaded = full;
+                }
+            }
+        }
+        void* obj = nullptr;
+        if (cc.loaded && cc.loaded->rounds > 0) {
+            obj = cc.loaded->objs[--cc.loaded->rounds];
+            cc.alloc_hits++;
+        } else {
+            cc.slab_allocs++;
+        }
+        local_irq_restore(irq_flags);
+        if (obj) {
+            if (ctor) {
+                ctor(obj);
+            }
+            return obj;
+        }
+    }
+
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    void* obj = slab_alloc();
+    lock.release_irqrestore(flags);
+    if (obj && ctor) {
+        ctor(obj);
+    }
+    return obj;
+}
+
+/**
+ * @brief 统计所有弹匣中缓存的对象数量
+ */
+uint32_t SlabCache::magazine_rounds()
+{
+    uint32_t rounds = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu_cache[cpu].loaded) {
+            rounds += cpu_cache[cpu].loaded->rounds;
+        }
+        if (cpu_cache[cpu].previous) {
+            rounds += cpu_cache[cpu].previous->rounds;
+        }
+    }
+    depot_acquire();
+    for (Magazine* mag = depot_full; mag; mag = mag->next) {
+        rounds += mag->rounds;
+    }
+    depot_lock.release();
+    return rounds;
+}
+
+/**
+ * @brief 把depot和各CPU弹匣中的对象全部还给slab层，并释放弹匣本身
+ * 只在缓存销毁或内存回收时调用，调用者需保证其他CPU不再访问该缓存的弹匣
+ */
+void SlabCache::flush_magazines()
+{
+    if (!use_magazines) {
+        return;
+    }
+
+    Magazine* mags = nullptr;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        Magazine* pair[2] = {cpu_cache[cpu].loaded, cpu_cache[cpu].previous};
+        cpu_cache[cpu].loaded = nullptr;
+        cpu_cache[cpu].previous = nullptr;
+        for (Magazine* mag : pair) {
+            if (mag) {
+                mag->next = mags;
+                mags = mag;
+            }
+        }
+    }
+    depot_acquire();
+    Magazine* lists[2] = {depot_full, depot_empty};
+    depot_full = depot_empty = nullptr;
+    depot_full_count = depot_empty_count = 0;
+    depot_lock.release();
+    for (Magazine* list : lists) {
+        while (list) {
+            Magazine* next = list->next;
+            list->next = mags;
+            mags = list;
+            list = next;
+        }
+    }
+
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    while (mags) {
+        Magazine* next = mags->next;
+        for (uint32_t i = 0; i < mags->rounds; i++) {
+            slab_free(mags->objs[i]);
+        }
+        if (magazine_cache) {
+            magazine_cache->free(mags);
+        }
+        mags = next;
+    }
+    lock.release_irqrestore(flags);
+}
+
+/**
+ * @brief 释放一个对象回Slab缓存
+ * 依次尝试loaded弹匣、空的previous弹匣、depot中的空弹匣（或新分配一个），
+ * 都失败时才直接还给slab层
+ * @param ptr 要释放的对象指针
+ */
+void SlabCache::free(void* ptr)
+{
+    if (use_magazines) {
+        uint32_t irq_flags = local_irq_save();
+        CpuCache& cc = cpu_cache[arch::get_cpu_id() % MAX_CPUS];
+        if (!(cc.loaded && cc.loaded->rounds < MAGAZINE_SIZE)) {
+            if (cc.previous && cc.previous->rounds == 0) {
+                // previous是空的，与loaded交换
+                Magazine* tmp = cc.loaded;
+                cc.loaded = cc.previous;
+                cc.previous = tmp;
+            } else {
+                Magazine* empty = depot_get(&depot_empty, &depot_empty_count);
+                if (!empty && magazine_cache) {
+                    empty = (Magazine*)magazine_cache->alloc();
+                    if (empty) {
+                        empty->rounds = 0;
+                    }
+                }
+                if (empty) {
+                    // previous为满弹匣，交给depot
+                    if (cc.previous) {
+                        cc.depot_frees++;
+                        depot_put(&depot_full, &depot_full_count, cc.previous);
+                    }
+                    cc.previous = cc.loaded;
+                    cc.loaded = empty;
+                }
+            }
+        }
+        if (cc.loaded && cc.loaded->rounds < MAGAZINE_SIZE) {
+            cc.loaded->objs[cc.loaded->rounds++] = ptr;
+            cc.free_hits++;
+            local_irq_restore(irq_flags);
+            return;
+        }
+        cc.slab_frees++;
+        local_irq_restore(irq_flags);
+    }
+
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    slab_free(ptr);
+    lock.release_irqrestore(flags);
+}
+
+/**
+ * @brief 从slab层分配一个对象，调用者需持有lock
+ * @return 分配的对象指针，如果分配失败则返回nullptr
+ */
+void* SlabCache::slab_alloc()
+{
+    Slab* slab = nullptr;
+    if (!list_empty(&slabs_partial)) {
+        slab = list_entry(slabs_partial.next, Slab, list);
+    } else if (!list_empty(&slabs_free)) {
+        slab = list_entry(slabs_free.next, Slab, list);
+    } else {
         // 没有可用的slab，创建新的
         slab = create_slab();
         if (!slab) {
             log_debug("Failed to create new slab in cache '%s'\n", name);
             return nullptr;
         }
-        slabs_free = slab;
-        log_info("Created new slab in cache '%s'\n", name);
+        list_add(&slab->list, &slabs_free);
+        log_debug("Created new slab in cache '%s'\n", name);
     }
 
     // 从空闲链表中获取一个对象
     SlabObject* obj = slab->freelist;
+    if (obj == nullptr) {
+        log_err("Failed to allocate object from slab in cache '%s'\n", name);
+        slab->print();
+        return nullptr;
+    }
     slab->freelist = obj->next;
     slab->inuse++;
+    active_objs++;
     slab->free--;
 
-    // 更新slab状态
+    // 更新slab状态：free->partial、partial->full，都是O(1)的摘链和插入
     if (slab->free == 0) {
-        // 将slab从partial/free链表移到full链表
-        if (slab == slabs_partial)
-            slabs_partial = slab->next;
-        else
-            slabs_free = slab->next;
-        slab->next = slabs_full;
-        slabs_full = slab;
-        log_debug("Slab in cache '%s' became full\n", name);
-    } else if (slab == slabs_free) {
-        // 将slab从free链表移到partial链表
-        slabs_free = slab->next;
-        slab->next = slabs_partial;
-        slabs_partial = slab;
-        log_debug("Slab in cache '%s' became partial\n", name);
-    }
-    if (obj == nullptr) {
-        log_err("Failed to allocate object from slab in cache '%s'\n", name);
-        slab->print();
-        return nullptr;
+        list_del_init(&slab->list);
+        list_add(&slab->list, &slabs_full);
+    } else if (slab->inuse == 1) {
+        list_del_init(&slab->list);
+        list_add(&slab->list, &slabs_partial);
     }
 
     log_debug("Allocated object %p from cache '%s'\n", obj, name);
@@ -173,52 +423,51 @@ void* SlabCache::alloc()
 }
 
 /**
- * @brief 释放一个对象回Slab缓存
+ * @brief 释放一个对象回slab层，调用者需持有lock
  * @param ptr 要释放的对象指针
  */
-void SlabCache::free(void* ptr)
+void SlabCache::slab_free(void* ptr)
 {
     // 获取对象所在的slab
-    Slab* slab = (Slab*)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
-    
+    Slab* slab = slab_of(ptr);
+    if (!slab || slab->cache != this) {
+        log_err("Object %p does not belong to cache '%s'\n", ptr, name);
+        return;
+    }
+
     // 将对象添加到空闲链表
     SlabObject* obj = (SlabObject*)ptr;
     obj->next = slab->freelist;
     slab->freelist = obj;
     slab->inuse--;
+    active_objs--;
     slab->free++;
 
-    // 更新slab状态
+    // 更新slab状态：full->partial、partial->free
     if (slab->inuse == 0) {
-        // 将slab从full/partial链表移到free链表
-        if (slab == slabs_full)
-            slabs_full = slab->next;
-        else {
-            Slab** prev = &slabs_partial;
-            while (*prev && *prev != slab)
-                prev = &(*prev)->next;
-            if (*prev)
-                *prev = slab->next;
-        }
-        slab->next = slabs_free;
-        slabs_free = slab;
+        list_del_init(&slab->list);
+        list_add(&slab->list, &slabs_free);
         log_debug("Slab in cache '%s' became free\n", name);
     } else if (slab->free == 1) {
-        // 将slab从full链表移到partial链表
-        Slab** prev = &slabs_full;
-        while (*prev && *prev != slab)
-            prev = &(*prev)->next;
-        if (*prev) {
-            *prev = slab->next;
-            slab->next = slabs_partial;
-            slabs_partial = slab;
-            log_debug("Slab in cache '%s' became partial\n", name);
-        }
+        list_del_init(&slab->list);
+        list_add(&slab->list, &slabs_partial);
+        log_debug("Slab in cache '%s' became partial\n", name);
     }
 
     log_debug("Freed object %p back to cache '%s'\n", ptr, name);
 }
 
+Slab* SlabCache::slab_of(const void* ptr)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    PADDR pa = mm.virt2Phys((void*)((uintptr_t)ptr & ~(PAGE_SIZE - 1)));
+    page* pg = mm.phys_to_page(pa);
+    if (!pg || !(pg->flags & PG_SLAB)) {
+        return nullptr;
+    }
+    return (Slab*)pg->private_;
+}
+
 /**
  * @brief 创建一个新的slab
  * @return 创建的slab指针，如果创建失败则返回nullptr
@@ -226,49 +475,55 @@ void SlabCache::free(void* ptr)
 Slab* SlabCache::create_slab()
 {
     // 分配一个页面
-    auto &paging = Kernel::instance().kernel_mm().paging();
-    PADDR pa = Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
-    void * page = Kernel::instance().kernel_mm().phys2Virt(pa);
-    if (!page) {
+    auto& mm = Kernel::instance().kernel_mm();
+    // 调用者持有本缓存的lock，不能在这里直接回收（收缩器会尝试获取同一把锁）
+    PADDR pa = mm.alloc_pages(__GFP_NORECLAIM, 0); // order=0表示分配单个页面
+    if (!pa) {
         log_err("Failed to allocate page for new slab in cache '%s'\n", name);
         return nullptr;
     }
+    char* page_addr = (char*)mm.phys2Virt(pa);
 
     // 初始化slab描述符
-    Slab* slab = (Slab*)page;
-    if(slab == (Slab*)0xc17cf000) {
-        printPDPTE((VADDR)slab);
-        printPD(paging.getCurrentPageDirectory(), 0, 0x400);
-
+    Slab* slab = nullptr;
+    if (off_slab) {
+        slab = slab_desc_cache ? (Slab*)slab_desc_cache->alloc() : nullptr;
+        if (!slab) {
+            log_err("Failed to allocate off-slab descriptor in cache '%s'\n", name);
+            mm.free_pages(pa, 0);
+            return nullptr;
+        }
+    } else {
+        slab = (Slab*)page_addr;
     }
+
+    // 着色：相邻slab的对象起始位置依次错开一个缓存行
+    size_t colour_step = object_align > CACHE_LINE_SIZE ? object_align : CACHE_LINE_SIZE;
+    slab->colour = colour_next * colour_step;
+    colour_next = (colour_next + 1) % colour_range;
+
     slab->inuse = 0;
     slab->free = objects_per_slab;
-    auto tmp = page + sizeof(Slab);
-    slab->next = nullptr;
+    INIT_LIST_HEAD(&slab->list);
     slab->cache = this;  // 设置指向所属的SlabCache的指针
-    slab->objects = tmp;
-    log_debug("debug ----0x%x\n", slab);
-    slab->objects = tmp;
-    log_debug("debug objects ---- 0x%x, 0x%x\n", tmp,slab->objects);
-    log_debug("debug page ----0x%x\n", page);
-    log_debug("debug sizeof(Slab) ----%d\n", sizeof(Slab));
+    slab->page = page_addr;
+    slab->objects = page_addr + objects_offset + slab->colour;
+
+    // 页面描述符指向slab，kfree和slab_free据此找到所属的slab
+    page* pg = mm.phys_to_page(pa);
+    pg->flags |= PG_SLAB;
+    pg->private_ = (uint32_t)slab;
 
     // 初始化空闲对象链表
     char* obj = (char*)slab->objects;
-    if(obj == nullptr) {
-        log_debug("page: %p, slab: %p, slab->objects: %p\n", page, slab, slab->objects);
-    }
     slab->freelist = (SlabObject*)obj;
-    if(slab->freelist == nullptr) {
-        log_debug("Failed to allocate page for new slab in cache '%s'\n", name);
-        return nullptr;
-    }
     for (size_t i = 0; i < objects_per_slab - 1; i++) {
         ((SlabObject*)obj)->next = (SlabObject*)(obj + object_size);
         obj += object_size;
     }
     ((SlabObject*)obj)->next = nullptr;
 
+    nr_slabs++;
     log_debug("Created new slab at %p in cache '%s'\n", slab, name);
     return slab;
 }
@@ -280,15 +535,128 @@ Slab* SlabCache::create_slab()
 void SlabCache::destroy_slab(Slab* slab)
 {
     log_debug("Destroying slab at %p in cache '%s'\n", slab, name);
-    auto va = (void *)slab;
-    auto pa = Kernel::instance().kernel_mm().virt2Phys(va);
-    Kernel::instance().kernel_mm().free_pages(pa, 0); // order=0表示释放单个页面
+    auto& mm = Kernel::instance().kernel_mm();
+    auto pa = mm.virt2Phys(slab->page);
+    // free_pages会清除页面描述符中的PG_SLAB和private_
+    if (off_slab && slab_desc_cache) {
+        slab_desc_cache->free(slab);
+    }
+    mm.free_pages(pa, 0); // order=0表示释放单个页面
+    nr_slabs--;
+}
+
+/**
+ * @brief 打印一行缓存使用情况：活跃对象/总对象、slab数、占用内存
+ */
+void SlabCache::report()
+{
+    uint32_t cached = magazine_rounds();
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    uint32_t active = active_objs - cached;
+    uint32_t total = nr_slabs * objects_per_slab;
+    uint32_t slabs = nr_slabs;
+    lock.release_irqrestore(flags);
+    log_info("%-16s objsize %4d active %5d/%5d cached %4d slabs %4d mem %dKB\n", name,
+             object_size, active, total, cached, slabs, slabs * PAGE_SIZE / 1024);
+}
+
+/**
+ * @brief 回收缓存中闲置的内存
+ * depot中的弹匣和本CPU的弹匣先还给slab层，然后释放完全空闲的slab。
+ * 其他CPU的弹匣不动，它们最多缓存2个弹匣的对象。
+ * 锁只用try_acquire获取，拿不到（可能正被触发回收的分配路径持有）时直接跳过
+ * @param nr_pages 最多释放的slab页数
+ * @return 释放的页数
+ */
+uint32_t SlabCache::shrink(uint32_t nr_pages)
+{
+    uint32_t irq_flags = local_irq_save();
+    Magazine* mags = nullptr;
+    if (use_magazines) {
+        if (depot_lock.try_acquire()) {
+            Magazine* lists[2] = {depot_full, depot_empty};
+            depot_full = depot_empty = nullptr;
+            depot_full_count = depot_empty_count = 0;
+            depot_lock.release();
+            for (Magazine* list : lists) {
+                while (list) {
+                    Magazine* next = list->next;
+                    list->next = mags;
+                    mags = list;
+                    list = next;
+                }
+            }
+        }
+        CpuCache& cc = cpu_cache[arch::get_cpu_id() % MAX_CPUS];
+        Magazine* pair[2] = {cc.loaded, cc.previous};
+        cc.loaded = cc.previous = nullptr;
+        for (Magazine* mag : pair) {
+            if (mag) {
+                mag->next = mags;
+                mags = mag;
+            }
+        }
+    }
+
+    if (!lock.try_acquire()) {
+        // slab层正忙，弹匣原样放回depot
+        while (mags) {
+            Magazine* next = mags->next;
+            if (mags->rounds) {
+                depot_put(&depot_full, &depot_full_count, mags);
+            } else {
+                depot_put(&depot_empty, &depot_empty_count, mags);
+            }
+            mags = next;
+        }
+        local_irq_restore(irq_flags);
+        return 0;
+    }
+
+    while (mags) {
+        Magazine* next = mags->next;
+        for (uint32_t i = 0; i < mags->rounds; i++) {
+            slab_free(mags->objs[i]);
+        }
+        if (magazine_cache) {
+            magazine_cache->free(mags);
+        }
+        mags = next;
+    }
+
+    uint32_t freed = 0;
+    while (freed < nr_pages && !list_empty(&slabs_free)) {
+        Slab* slab = list_entry(slabs_free.prev, Slab, list);
+        list_del_init(&slab->list);
+        destroy_slab(slab);
+        freed++;
+    }
+    lock.release();
+    local_irq_restore(irq_flags);
+    return freed;
+}
+
+uint32_t SlabCache::reclaimable()
+{
+    uint32_t irq_flags = local_irq_save();
+    uint32_t n = 0;
+    if (lock.try_acquire()) {
+        list_for_each(pos, &slabs_free) {
+            n++;
+        }
+        lock.release();
+    }
+    local_irq_restore(irq_flags);
+    return n;
 }
 
 /**
  * @brief 构造函数，初始化通用缓存数组
  */
 SlabAllocator::SlabAllocator()
+    : cache_list(nullptr), large_allocs(0), vmalloc_fallbacks(0), realloc_inplace(0),
+      realloc_copied(0)
 {
     // 初始化通用缓存
     const size_t sizes[] = {8, 16, 32, 64, 128, 256, 512, 1024, 2048};
@@ -321,34 +689,74 @@ void SlabAllocator::init()
         format_string(name, sizeof(name), "size-%u", sizes[i]);
         general_caches[i] = new ((void*)&_general_caches[i]) SlabCache(name, sizes[i]);
     }
+    // 弹匣缓存自身不能再使用弹匣层，否则释放弹匣时会递归申请弹匣
+    SlabCache::magazine_cache =
+        new ((void*)&_magazine_cache) SlabCache("magazine", sizeof(Magazine), 8, false);
+    new ((void*)&_cache_cache) SlabCache("kmem_cache", sizeof(SlabCache), alignof(SlabCache));
+    SlabCache::slab_desc_cache =
+        new ((void*)&_slab_desc_cache) SlabCache("slab_desc", sizeof(Slab), 8, false);
+
+    cache_list = nullptr;
+    for (size_t i = 0; i < NUM_GENERAL_CACHES; i++) {
+        register_cache(general_caches[i]);
+    }
+    register_cache(&_magazine_cache);
+    register_cache(&_cache_cache);
+    register_cache(&_slab_desc_cache);
     log_info("Initialized slab allocator with %d general caches\n", NUM_GENERAL_CACHES);
 }
 
+/**
+ * @brief 按实际页数分配大块内存，首页带PG_KMALLOC并在private_中记录页数
+ * 不再向上取整到2的幂：例如12KB只占3页而不是4页
+ */
+void* SlabAllocator::kmalloc_large(size_t size, uint32_t gfp_mask)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    uint32_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    PADDR phys_addr = mm.alloc_pages_exact(gfp_mask, num_pages);
+    if (phys_addr) {
+        page* pg = mm.phys_to_page(phys_addr);
+        pg->flags |= PG_KMALLOC;
+        pg->private_ = num_pages;
+        arch::atomic_add(&large_allocs, 1);
+        log_debug("Allocated %d pages for large allocation of size %d\n", num_pages, size);
+        return mm.phys2Virt(phys_addr);
+    }
+
+    // 不要求物理连续的大块请求可以由零散的页面拼成
+    if (!(gfp_mask & __GFP_DMA) && size >= VMALLOC_FALLBACK_SIZE) {
+        void* ptr = mm.vmalloc(size);
+        if (ptr) {
+            // vmalloc的页面不清零，__GFP_ZERO的语义不能因为回退而改变
+            if (gfp_mask & __GFP_ZERO) {
+                memset(ptr, 0, size);
+            }
+            arch::atomic_add(&vmalloc_fallbacks, 1);
+            log_debug("Large allocation of size %d fell back to vmalloc at %p\n", size, ptr);
+            return ptr;
+        }
+    }
+    log_err("Failed to allocate %d pages for large allocation\n", num_pages);
+    return nullptr;
+}
+
 /**
  * @brief 分配指定大小的内存
  * @param size 要分配的内存大小
+ * @param gfp_mask 分配标志，__GFP_DMA要求物理连续
  * @return 分配的内存指针，如果分配失败则返回nullptr
  */
-void* SlabAllocator::kmalloc(size_t size)
+void* SlabAllocator::kmalloc(size_t size, uint32_t gfp_mask)
 {
-    Locker lock;
     if (size == 0) {
         log_warn("Attempted to allocate 0 bytes\n");
         return nullptr;
     }
 
-    // 对于大于4KB的分配，直接使用页分配器
+    // 对于大于2KB的分配，直接使用页分配器
     if (size > 2048) {
-        size_t num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        uint32_t order = 0;
-        while ((1U << order) < num_pages) order++;
-        auto phys_addr = Kernel::instance().kernel_mm().alloc_pages(0, order);
-        if (!phys_addr) {
-            log_err("Failed to allocate %d pages for large allocation\n", num_pages);
-            return nullptr;
-        }
-        log_info("Allocated %d pages for large allocation of size %d\n", num_pages, size);
-        return (void*)Kernel::instance().kernel_mm().phys2Virt(phys_addr);
+        return kmalloc_large(size, gfp_mask);
     }
 
     // 使用合适的通用缓存
@@ -362,6 +770,9 @@ void* SlabAllocator::kmalloc(size_t size)
         log_err("Failed to allocate object of size %d from cache\n", size);
         return nullptr;
     }
+    if (gfp_mask & __GFP_ZERO) {
+        memset(ret, 0, size);
+    }
     log_debug("Allocated memory of size %d at %p\n", size, ret);
     return ret;
 }
@@ -372,17 +783,21 @@ void* SlabAllocator::kmalloc(size_t size)
  */
 void SlabAllocator::kfree(void* ptr)
 {
-    Locker lock;
     if (!ptr) {
         log_warn("Attempted to free null pointer\n");
         return;
     }
 
-    // 检查指针是否在页面边界上，用于区分大内存分配和小对象分配
-    if ((uintptr_t)ptr & (PAGE_SIZE - 1)) {
-        // 通过将指针地址对齐到页面边界，获取对象所在的slab描述符
-        Slab* slab = (Slab*)((uintptr_t)ptr & ~(PAGE_SIZE - 1));
-        
+    auto& mm = Kernel::instance().kernel_mm();
+    if (KernelMemory::is_vmalloc_addr(ptr)) {
+        mm.vfree(ptr);
+        return;
+    }
+
+    // 通过页面描述符的PG_SLAB标志区分slab对象和大内存分配
+    // （off-slab缓存和着色为0的对象可能正好位于页边界上）
+    Slab* slab = SlabCache::slab_of(ptr);
+    if (slab) {
         // 获取对象所属的SlabCache
         SlabCache* cache = slab->cache;
         if (!cache) {
@@ -391,11 +806,246 @@ void SlabAllocator::kfree(void* ptr)
         }
         cache->free(ptr);
         log_debug("Freed small object at %p\n", ptr);
+        return;
+    }
+
+    // 大内存分配按首页记录的页数归还
+    PADDR pa = mm.virt2Phys(ptr);
+    page* pg = mm.phys_to_page(pa);
+    if (!pg || !(pg->flags & PG_KMALLOC) || (pa & (PAGE_SIZE - 1))) {
+        log_err("kfree: %p was not allocated by kmalloc\n", ptr);
+        return;
+    }
+    mm.free_pages_exact(pa, pg->private_);
+    log_debug("Freed large object at %p\n", ptr);
+}
+
+/**
+ * @brief 尝试原地调整大块分配的大小
+ * @param old_size 输出原分配的可用大小，供复制使用
+ * @return 原地完成时返回ptr，否则返回nullptr
+ */
+void* SlabAllocator::krealloc_large(void* ptr, size_t new_size, size_t& old_size)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    if (KernelMemory::is_vmalloc_addr(ptr)) {
+        old_size = mm.vmalloc_size(ptr);
+        return mm.vresize(ptr, new_size) ? ptr : nullptr;
+    }
+
+    PADDR pa = mm.virt2Phys(ptr);
+    page* pg = mm.phys_to_page(pa);
+    if (!pg || !(pg->flags & PG_KMALLOC)) {
+        old_size = 0;
+        return nullptr;
+    }
+    uint32_t old_pages = pg->private_;
+    uint32_t new_pages = (new_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    old_size = old_pages * PAGE_SIZE;
+    if (new_pages < old_pages) {
+        mm.free_pages_exact(pa + new_pages * PAGE_SIZE, old_pages - new_pages);
+    } else if (new_pages > old_pages && !mm.extend_pages_exact(pa, old_pages, new_pages)) {
+        return nullptr;
+    }
+    pg->private_ = new_pages;
+    return ptr;
+}
+
+void* SlabAllocator::krealloc(void* ptr, size_t new_size)
+{
+    if (!ptr) {
+        return kmalloc(new_size);
+    }
+    if (new_size == 0) {
+        kfree(ptr);
+        return nullptr;
+    }
+
+    size_t old_size = 0;
+    Slab* slab = KernelMemory::is_vmalloc_addr(ptr) ? nullptr : SlabCache::slab_of(ptr);
+    if (slab) {
+        // 通用缓存的对象按缓存大小分配，尾部的空间可以直接使用
+        old_size = slab->cache->get_object_size();
+        if (new_size <= old_size) {
+            arch::atomic_add(&realloc_inplace, 1);
+            return ptr;
+        }
     } else {
-        // 对于大内存分配，直接通过页分配器释放
-        PADDR pa = Kernel::instance().kernel_mm().virt2Phys(ptr);
-        Kernel::instance().kernel_mm().free_pages(pa, 0); // order=0表示释放单个页面
-        log_debug("Freed large object at %p\n", ptr);
+        // 大块分配缩小到slab大小时保留一页，不搬回slab
+        size_t keep = new_size < PAGE_SIZE ? PAGE_SIZE : new_size;
+        if (krealloc_large(ptr, keep, old_size)) {
+            arch::atomic_add(&realloc_inplace, 1);
+            return ptr;
+        }
+        if (old_size == 0) {
+            log_err("krealloc: %p was not allocated by kmalloc\n", ptr);
+            return nullptr;
+        }
+    }
+
+    void* new_ptr = kmalloc(new_size);
+    if (!new_ptr) {
+        return nullptr;
+    }
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    kfree(ptr);
+    arch::atomic_add(&realloc_copied, 1);
+    return new_ptr;
+}
+
+void SlabAllocator::register_cache(SlabCache* cache)
+{
+    uint32_t flags;
+    cache_list_lock.acquire_irqsave(flags);
+    cache->next_cache = cache_list;
+    cache_list = cache;
+    cache_list_lock.release_irqrestore(flags);
+}
+
+/**
+ * @brief 创建一个专用对象缓存
+ * @param name 缓存名称
+ * @param size 对象大小
+ * @param align 对象对齐要求
+ * @param ctor 可选的对象构造函数，每次分配对象时调用
+ * @return 新建的缓存，失败返回nullptr
+ */
+SlabCache* SlabAllocator::create_cache(const char* name, size_t size, size_t align, SlabCtor ctor)
+{
+    if (size == 0 || size > PAGE_SIZE) {
+        log_err("create_cache('%s'): unsupported object size %d\n", name, size);
+        return nullptr;
+    }
+    void* mem = _cache_cache.alloc();
+    if (!mem) {
+        log_err("create_cache('%s'): out of memory\n", name);
+        return nullptr;
+    }
+    auto cache = new (mem) SlabCache(name, size, align, true, ctor);
+    register_cache(cache);
+    return cache;
+}
+
+/**
+ * @brief 销毁一个由create_cache创建的缓存
+ * @param cache 要销毁的缓存
+ */
+void SlabAllocator::destroy_cache(SlabCache* cache)
+{
+    if (!cache) {
+        return;
+    }
+    uint32_t flags;
+    cache_list_lock.acquire_irqsave(flags);
+    SlabCache** prev = &cache_list;
+    while (*prev && *prev != cache) {
+        prev = &(*prev)->next_cache;
+    }
+    if (*prev) {
+        *prev = cache->next_cache;
+    }
+    cache_list_lock.release_irqrestore(flags);
+
+    cache->~SlabCache();
+    _cache_cache.free(cache);
+}
+
+/**
+ * @brief 返回*slot中的缓存，第一次调用时创建
+ */
+SlabCache* SlabAllocator::get_cache(SlabCache** slot, const char* name, size_t size, size_t align)
+{
+    SlabCache* cache = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (cache) {
+        return cache;
+    }
+
+    // 创建过程中可能分配页面，不能持有cache_list_lock，
+    // 用CAS决定谁的缓存生效，失败的一方销毁自己创建的缓存
+    cache = create_cache(name, size, align, nullptr);
+    if (!cache) {
+        return nullptr;
+    }
+    SlabCache* expected = nullptr;
+    if (!__atomic_compare_exchange_n(slot, &expected, cache, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        destroy_cache(cache);
+        return expected;
+    }
+    return cache;
+}
+
+/**
+ * @brief 打印所有缓存的使用情况
+ */
+void SlabAllocator::print_caches()
+{
+    log_info("slab caches:\n");
+    uint32_t flags;
+    cache_list_lock.acquire_irqsave(flags);
+    for (SlabCache* cache = cache_list; cache; cache = cache->next_cache) {
+        cache->report();
+    }
+    cache_list_lock.release_irqrestore(flags);
+    log_info("large allocations: %d, vmalloc fallbacks %d, krealloc in place %d, copied %d\n",
+        large_allocs, vmalloc_fallbacks, realloc_inplace, realloc_copied);
+}
+
+/**
+ * @brief 依次收缩所有缓存，直到释放nr_pages个页
+ */
+uint32_t SlabAllocator::shrink(uint32_t nr_pages)
+{
+    uint32_t freed = 0;
+    uint32_t flags;
+    cache_list_lock.acquire_irqsave(flags);
+    for (SlabCache* cache = cache_list; cache && freed < nr_pages; cache = cache->next_cache) {
+        freed += cache->shrink(nr_pages - freed);
+    }
+    cache_list_lock.release_irqrestore(flags);
+    return freed;
+}
+
+void SlabAllocator::register_shrinker()
+{
+    shrinker.name = "slab";
+    shrinker.priv = this;
+    shrinker.count = [](Shrinker* s) -> uint32_t {
+        auto self = (SlabAllocator*)s->priv;
+        uint32_t n = 0;
+        uint32_t flags;
+        self->cache_list_lock.acquire_irqsave(flags);
+        for (SlabCache* cache = self->cache_list; cache; cache = cache->next_cache) {
+            n += cache->reclaimable();
+        }
+        self->cache_list_lock.release_irqrestore(flags);
+        return n;
+    };
+    shrinker.scan = [](Shrinker* s, uint32_t nr_pages) -> uint32_t {
+        return ((SlabAllocator*)s->priv)->shrink(nr_pages);
+    };
+    kernel::register_shrinker(&shrinker);
+}
+
+SlabCache* kmem_cache_create(const char* name, size_t size, size_t align, SlabCtor ctor)
+{
+    return Kernel::instance().kernel_mm().slab().create_cache(name, size, align, ctor);
+}
+
+void kmem_cache_destroy(SlabCache* cache)
+{
+    Kernel::instance().kernel_mm().slab().destroy_cache(cache);
+}
+
+void* kmem_cache_alloc(SlabCache* cache)
+{
+    return cache ? cache->alloc() : nullptr;
+}
+
+void kmem_cache_free(SlabCache* cache, void* obj)
+{
+    if (cache && obj) {
+        cache->free(obj);
     }
 }
 
@@ -1,9 +1,15 @@
 #include <arch/x86/paging.h>
+#include <arch/x86/tlb.h>
 #include <kernel/kernel.h>
 #include <kernel/user_memory.h>
+#include <kernel/vfs.h>
 #include <lib/debug.h>
 #include <lib/string.h>
 
+DEFINE_SLAB_CACHE_OPERATORS(MemoryArea, "user_area")
+
+using kernel::rb_node;
+
 // 初始化内存管理器
 void UserMemory::init(PADDR page_dir_phys, VADDR page_dir, uint32_t (*alloc_page)(), void (*free_page)(uint32_t),
     void* (*phys_to_virt)(uint32_t))
@@ -11,15 +17,17 @@ void UserMemory::init(PADDR page_dir_phys, VADDR page_dir, uint32_t (*alloc_page
     pgd = page_dir;
     pgd_phys = page_dir_phys;
     log_debug("pgd:0x%x\n", pgd);
+    area_tree.node = nullptr;
+    area_tree.augment = augment_gap;
     num_areas = 0;
     total_vm = 0;
     locked_vm = 0;
+    start_heap = end_heap = 0;
+    rss = 0;
+    faults = {};
     allocate_physical_page = alloc_page;
     free_physical_page = free_page;
     this->phys_to_virt = phys_to_virt;
-
-    // 初始化内存区域数组
-    memset(areas, 0, sizeof(areas));
 }
 void UserMemory::clone(UserMemory& src)
 {
@@ -28,8 +36,11 @@ void UserMemory::clone(UserMemory& src)
     free_physical_page = src.free_physical_page;
     phys_to_virt = src.phys_to_virt;
 
-    memcpy(areas, src.areas, sizeof(areas));
-    num_areas = src.num_areas;
+    // 区域描述符逐个复制，按顺序插入新树
+    free_all_areas();
+    for(MemoryArea* area = src.first_area(); area; area = src.next_area(area)) {
+        insert_area(clone_area(area));
+    }
 
     start_code = src.start_code;
     end_code = src.end_code;
@@ -41,37 +52,183 @@ void UserMemory::clone(UserMemory& src)
     end_stack = src.end_stack;
     total_vm = src.total_vm;
     locked_vm = src.locked_vm;
+    rss = src.rss;
 }
 
-// 分配一个新的内存区域
-// 使用first-fit策略查找合适的空闲区域
-uint32_t UserMemory::find_free_area(uint32_t size)
+void UserMemory::augment_gap(rb_node* node)
 {
-    // 确保大小按页对齐
-    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    auto area = rb_entry(node, MemoryArea, rb);
+    uint32_t gap = area->gap_before;
+    if(node->left) {
+        uint32_t left = rb_entry(node->left, MemoryArea, rb)->subtree_gap;
+        gap = left > gap ? left : gap;
+    }
+    if(node->right) {
+        uint32_t right = rb_entry(node->right, MemoryArea, rb)->subtree_gap;
+        gap = right > gap ? right : gap;
+    }
+    area->subtree_gap = gap;
+}
+
+MemoryArea* UserMemory::first_area() const
+{
+    rb_node* node = kernel::rb_first(&area_tree);
+    return node ? rb_entry(node, MemoryArea, rb) : nullptr;
+}
+
+MemoryArea* UserMemory::last_area() const
+{
+    rb_node* node = kernel::rb_last(&area_tree);
+    return node ? rb_entry(node, MemoryArea, rb) : nullptr;
+}
+
+MemoryArea* UserMemory::next_area(const MemoryArea* area) const
+{
+    rb_node* node = kernel::rb_next(&area->rb);
+    return node ? rb_entry(node, MemoryArea, rb) : nullptr;
+}
+
+MemoryArea* UserMemory::prev_area(const MemoryArea* area) const
+{
+    rb_node* node = kernel::rb_prev(&area->rb);
+    return node ? rb_entry(node, MemoryArea, rb) : nullptr;
+}
+
+MemoryArea* UserMemory::lower_bound(uint32_t addr) const
+{
+    MemoryArea* found = nullptr;
+    rb_node* node = area_tree.node;
+    while(node) {
+        auto area = rb_entry(node, MemoryArea, rb);
+        if(addr < area->end_addr) {
+            found = area;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+void UserMemory::update_gap(MemoryArea* area)
+{
+    MemoryArea* prev = prev_area(area);
+    area->gap_before = area->start_addr - (prev ? prev->end_addr : USER_START);
+    kernel::rb_augment_propagate(&area->rb, &area_tree);
+}
+
+void UserMemory::insert_area(MemoryArea* area)
+{
+    rb_node* parent = nullptr;
+    rb_node** link = &area_tree.node;
+    while(*link) {
+        parent = *link;
+        link = area->start_addr < rb_entry(parent, MemoryArea, rb)->start_addr ? &parent->left
+                                                                              : &parent->right;
+    }
+    kernel::rb_link_node(&area->rb, parent, link);
+    MemoryArea* prev = prev_area(area);
+    area->gap_before = area->start_addr - (prev ? prev->end_addr : USER_START);
+    area->subtree_gap = area->gap_before;
+    kernel::rb_insert_color(&area->rb, &area_tree);
+
+    // 后一个区域前面的空隙被新区域占去了一部分
+    MemoryArea* next = next_area(area);
+    if(next) {
+        update_gap(next);
+    }
+    num_areas++;
+}
+
+void UserMemory::erase_area(MemoryArea* area)
+{
+    MemoryArea* next = next_area(area);
+    kernel::rb_erase(&area->rb, &area_tree);
+    if(next) {
+        update_gap(next);
+    }
+    num_areas--;
+}
+
+bool UserMemory::can_merge(const MemoryArea* area, uint32_t flags, uint32_t type)
+{
+    // 新区域没有访问提示，设置过madvise的区域保持独立
+    return area->type == MEM_TYPE_ANONYMOUS && type == MEM_TYPE_ANONYMOUS && area->flags == flags &&
+           area->advice == MADV_NORMAL;
+}
 
-    // 如果没有已分配区域，从用户空间起始地址开始分配
-    if(num_areas == 0) {
-        return USER_START;
+bool UserMemory::can_merge_file(const MemoryArea* prev, const MemoryArea* next)
+{
+    return prev->file && prev->file == next->file && prev->end_addr == next->start_addr &&
+           prev->type == next->type && prev->flags == next->flags && prev->advice == next->advice &&
+           next->pgoff == prev->pgoff + ((prev->end_addr - prev->start_addr) >> 12);
+}
+
+MemoryArea* UserMemory::clone_area(const MemoryArea* area)
+{
+    auto copy = new MemoryArea();
+    if(!copy) {
+        return nullptr;
+    }
+    copy->start_addr = area->start_addr;
+    copy->end_addr = area->end_addr;
+    copy->flags = area->flags;
+    copy->type = area->type;
+    copy->file = area->file;
+    copy->pgoff = area->pgoff;
+    copy->advice = area->advice;
+    if(copy->file) {
+        copy->file->get();
     }
+    return copy;
+}
 
-    // 检查用户空间起始位置到第一个区域之间的空间
-    if(areas[0].start_addr > USER_START && areas[0].start_addr - USER_START >= size) {
-        return USER_START;
+void UserMemory::destroy_area(MemoryArea* area)
+{
+    if(area->file) {
+        area->file->put();
     }
+    delete area;
+}
 
-    // 检查相邻区域之间的空隙
-    for(uint32_t i = 0; i < num_areas - 1; i++) {
-        uint32_t gap_start = areas[i].end_addr;
-        uint32_t gap_size = areas[i + 1].start_addr - gap_start;
+void UserMemory::free_all_areas()
+{
+    while(area_tree.node) {
+        auto area = rb_entry(area_tree.node, MemoryArea, rb);
+        kernel::rb_erase(area_tree.node, &area_tree);
+        destroy_area(area);
+    }
+    num_areas = 0;
+}
 
-        if(gap_size >= size) {
-            return gap_start;
+// 分配一个新的内存区域
+// 使用first-fit策略查找合适的空闲区域：先看左子树中是否有足够大的空隙，
+// 再看当前区域前面的空隙，最后看右子树，每层只走一个分支
+uint32_t UserMemory::find_free_area(uint32_t size)
+{
+    // 确保大小按页对齐
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(size == 0) {
+        return 0;
+    }
+
+    rb_node* node = area_tree.node;
+    if(node && rb_entry(node, MemoryArea, rb)->subtree_gap >= size) {
+        while(node) {
+            auto area = rb_entry(node, MemoryArea, rb);
+            if(node->left && rb_entry(node->left, MemoryArea, rb)->subtree_gap >= size) {
+                node = node->left;
+            } else if(area->gap_before >= size) {
+                return area->start_addr - area->gap_before;
+            } else {
+                node = node->right;
+            }
         }
     }
 
     // 检查最后一个区域之后到用户空间结束位置之间的空间
-    uint32_t last_end = areas[num_areas - 1].end_addr;
+    MemoryArea* last = last_area();
+    uint32_t last_end = last ? last->end_addr : USER_START;
     if(last_end < USER_END && USER_END - last_end >= size) {
         return last_end;
     }
@@ -81,10 +238,6 @@ uint32_t UserMemory::find_free_area(uint32_t size)
 
 void* UserMemory::allocate_area(uint32_t size, uint32_t flags, uint32_t type)
 {
-    if(num_areas >= MAX_MEMORY_AREAS) {
-        return nullptr;
-    }
-
     // 查找合适的空闲区域
     uint32_t start = find_free_area(size);
     if(start == 0) {
@@ -93,95 +246,562 @@ void* UserMemory::allocate_area(uint32_t size, uint32_t flags, uint32_t type)
 
     // 确保大小按页对齐
     size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    uint32_t end = start + size;
+    return insert_range(start, size, flags, type);
+}
 
-    // 添加新的内存区域
-    areas[num_areas].start_addr = start;
-    areas[num_areas].end_addr = end;
-    areas[num_areas].flags = flags;
-    areas[num_areas].type = type;
-    num_areas++;
+void* UserMemory::allocate_huge_area(uint32_t size, uint32_t flags)
+{
+    size = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if(size == 0) {
+        return nullptr;
+    }
+    // 多找一个大页减一页的空间，空隙中就一定有4MB对齐的起点
+    uint32_t gap = find_free_area(size + LARGE_PAGE_SIZE - PAGE_SIZE);
+    if(gap == 0) {
+        return nullptr;
+    }
+    uint32_t start = (gap + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    return insert_range(start, size, flags | PAGE_PS, MEM_TYPE_ANONYMOUS);
+}
 
-    log_debug("allocated area, start:0x%x, end:0x%x, size:0x%x\n", start, end, size);
+void* UserMemory::allocate_file_area(
+    uint32_t size, uint32_t flags, uint32_t type, kernel::FileMapping* file, uint32_t pgoff)
+{
+    // 文件映射区域不与相邻区域合并，insert_range总是新建一个区域
+    void* addr = allocate_area(size, flags, type);
+    if(!addr) {
+        return nullptr;
+    }
+    auto area = const_cast<MemoryArea*>(find_area((uint32_t)addr));
+    area->file = file;
+    area->pgoff = pgoff;
+    file->get();
+    return addr;
+}
+
+void* UserMemory::insert_range(uint32_t start, uint32_t size, uint32_t flags, uint32_t type)
+{
+    uint32_t end = start + size;
+
+    // first-fit通常从空隙的开头分配，新区域紧接在前一个区域之后，
+    // 属性相同的匿名映射直接扩展相邻区域，不增加节点
+    MemoryArea* next = lower_bound(start);
+    MemoryArea* prev = next ? prev_area(next) : last_area();
+    if(prev && prev->end_addr == start && can_merge(prev, flags, type)) {
+        prev->end_addr = end;
+        if(next && next->start_addr == end && can_merge(next, flags, type)) {
+            prev->end_addr = next->end_addr;
+            erase_area(next);
+            delete next;
+        } else if(next) {
+            update_gap(next);
+        }
+    } else if(next && next->start_addr == end && can_merge(next, flags, type)) {
+        next->start_addr = start;
+        update_gap(next);
+    } else {
+        auto area = new MemoryArea();
+        if(!area) {
+            return nullptr;
+        }
+        area->start_addr = start;
+        area->end_addr = end;
+        area->flags = flags;
+        area->type = type;
+        insert_area(area);
+    }
 
     // 更新总虚拟内存大小
     total_vm += size >> 12; // 已经按页对齐，直接除以页大小
+    log_debug("allocated area, start:0x%x, end:0x%x, size:0x%x, total_vm: %d\n", start, end, size,
+        total_vm);
 
-    // 为VMA区域建立页表项，但不分配物理页面
-    uint32_t num_pages = (size + 0xFFF) >> 12;
-    log_debug("size: %d\n", size);
-    log_debug("num_pages: %d\n", num_pages);
-    log_debug("total_vm: %d\n", total_vm);
-    for(uint32_t i = 0; i < num_pages; i++) {
-        uint32_t vaddr = start + (i << 12);
-        uint32_t pde_idx = vaddr >> 22;
-        uint32_t pte_idx = (vaddr >> 12) & 0x3FF;
+    // 页表和物理页面都在第一次访问时由handle_fault建立
+    return (void*)start;
+}
 
-        // 获取页目录项
-        uint32_t* pde = (uint32_t*)(pgd) + pde_idx;
-        if(vaddr == 0x40000000) {
-            log_debug("pde_idx: %d\n", pde_idx);
-            printPDPTE((void*)vaddr);
+const MemoryArea* UserMemory::find_area(uint32_t addr) const
+{
+    rb_node* node = area_tree.node;
+    while(node) {
+        auto area = rb_entry(node, MemoryArea, rb);
+        if(addr < area->start_addr) {
+            node = node->left;
+        } else if(addr >= area->end_addr) {
+            node = node->right;
+        } else {
+            return area;
         }
-        // debug_debug("pgd:%x, pde_addr:%x,  pde %x\n", pgd, pde, *pde);
+    }
+    return nullptr;
+}
 
-        // 如果页表不存在，创建新的页表
-        if(!(*pde & PAGE_PRESENT)) {
-            log_debug("allocating pt\n");
-            uint32_t page_table = allocate_physical_page();
-            auto virt = phys_to_virt(page_table);
-            *pde = page_table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
-            log_debug("pdg:%x, pde:%x, *pde:%x, page_table: %x\n", pgd, pde, *pde, page_table);
-            memset((void*)virt, 0, 0x1000);
-        }
-
-        // 获取页表物理地址并转换为虚拟地址
-        uint32_t page_table = *pde & 0xFFFFF000;
-        uint32_t* page_table_virt = (uint32_t*)phys_to_virt(page_table);
-        uint32_t* pte = &page_table_virt[pte_idx];
-        // 页表项已经是虚拟地址，不需要再次转换
-        uint32_t* pte0 = pte;
-
-        if(type == MEM_TYPE_STACK) {
-            auto phys = (uint32_t)Kernel::instance().kernel_mm().alloc_pages(0, 0); // order=0表示分配单个页面
-            // debug_debug("stack virt:0x%x, phys:0x%x\n", vaddr, phys);
-            *pte0 = (phys | flags | PAGE_USER | PAGE_WRITE | PAGE_PRESENT);
-            //__printPDPTE( (void*)vaddr, (PageDirectory*)pgd);
-        } else {
-            // 设置页表项为不存在，但保留权限标志，这样在page
-            // fault时可以知道应该设置什么权限
-            *pte0 = (flags | PAGE_USER | PAGE_WRITE) & ~PAGE_PRESENT;
+bool UserMemory::handle_fault(uint32_t fault_addr, bool is_write)
+{
+    uint32_t vaddr = fault_addr & ~(PAGE_SIZE - 1);
+    if(wait_migration(vaddr)) {
+        return true;
+    }
+    const MemoryArea* area = find_area(vaddr);
+    bool in_heap = vaddr >= start_heap && vaddr < end_heap;
+    if((!area && !in_heap) || (area && area->type == MEM_TYPE_GUARD)) {
+        faults.bad_faults++;
+        log_err("page fault at 0x%x outside any area\n", fault_addr);
+        return false;
+    }
+    // 堆没有区域描述符，总是可写；其他地址按区域的权限映射
+    bool writable = !area || (area->flags & PAGE_WRITE);
+    if(is_write && !writable) {
+        faults.bad_faults++;
+        log_err("write to read-only area at 0x%x\n", fault_addr);
+        return false;
+    }
+
+    if(area && (area->flags & PAGE_PS) && handle_large_fault(area, vaddr)) {
+        return true;
+    }
+    if(area && area->file) {
+        return handle_file_fault(area, vaddr, is_write);
+    }
+
+    // 匿名页第一次被读时映射只读的共享零页，第一次写时再由写时复制换成私有页面；
+    // 只读区域不打COW标志，之后的写入按权限错误处理，不会换成可写页面
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    PADDR zero = kernel_mm.zero_page();
+    if(!is_write && zero) {
+        kernel_mm.increment_ref_count(zero);
+        uint32_t zero_flags = PAGE_USER | (writable ? PAGE_COW : 0) | PAGE_PRESENT;
+        InstallResult result = install_page(vaddr, zero, zero_flags, false);
+        if(result == InstallResult::INSTALLED) {
+            faults.zero_faults++;
+            faults.minor_faults++;
+            return true;
+        }
+        kernel_mm.decrement_ref_count(zero);
+        if(result == InstallResult::RACED) {
+            return true;
         }
     }
 
-    return (void*)start;
+    // 写缺页分配清零页面
+    auto phys_page = kernel_mm.alloc_pages(__GFP_ZERO, 0);
+    if(!phys_page) {
+        log_err("out of memory on page fault at 0x%x\n", fault_addr);
+        return false;
+    }
+    uint32_t flags = PAGE_USER | (writable ? PAGE_WRITE : 0) | PAGE_PRESENT;
+    if(!map_anon_page(vaddr, phys_page, flags)) {
+        kernel_mm.free_pages(phys_page, 0);
+        return false;
+    }
+    faults.demand_faults++;
+    faults.minor_faults++;
+    return true;
+}
+
+uint32_t UserMemory::file_read_flags(const MemoryArea* area)
+{
+    // 共享映射在第一次写之前保持只读，写入时才标记脏页；
+    // 可写的私有映射先共享页缓存的页面，第一次写时由写时复制换成私有页面
+    if(area->type == MEM_TYPE_SHARED) {
+        return PAGE_USER | PAGE_SHARED | PAGE_PRESENT;
+    }
+    return PAGE_USER | ((area->flags & PAGE_WRITE) ? PAGE_COW : 0) | PAGE_PRESENT;
+}
+
+bool UserMemory::handle_file_fault(const MemoryArea* area, uint32_t vaddr, bool is_write)
+{
+    bool writable = area->flags & PAGE_WRITE;
+    if(is_write && !writable) {
+        faults.bad_faults++;
+        log_err("write to read-only file mapping at 0x%x\n", vaddr);
+        return false;
+    }
+    // 页面已在内存中是次缺页，需要读取文件的是主缺页
+    uint32_t pgoff = area->pgoff + ((vaddr - area->start_addr) >> 12);
+    bool major = false;
+    PADDR phys = area->file->find_page(pgoff);
+    if(!phys) {
+        phys = area->file->get_page(pgoff);
+        major = true;
+    }
+    if(!phys) {
+        faults.bad_faults++;
+        log_err("file mapping at 0x%x: page %d is not backed by the file\n", vaddr, pgoff);
+        return false;
+    }
+
+    // get_page返回的引用归页表项所有，解除映射时由put_page归还
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    uint32_t flags = file_read_flags(area);
+    if(is_write && area->type == MEM_TYPE_SHARED) {
+        area->file->set_page_dirty(pgoff);
+        flags |= PAGE_WRITE;
+        faults.dirty_faults++;
+    } else if(is_write) {
+        // 私有映射的写缺页直接复制出私有页面，不先映射页缓存页面再走一次写时复制
+        PADDR copy = kernel_mm.alloc_pages(0, 0);
+        if(!copy) {
+            kernel_mm.decrement_ref_count(phys);
+            log_err("out of memory on page fault at 0x%x\n", vaddr);
+            return false;
+        }
+        void* dst = kernel_mm.kmap_atomic(copy);
+        void* src = kernel_mm.kmap_atomic(phys);
+        memcpy(dst, src, PAGE_SIZE);
+        kernel_mm.kunmap_atomic(src);
+        kernel_mm.kunmap_atomic(dst);
+        kernel_mm.decrement_ref_count(phys);
+        if(!map_anon_page(vaddr, copy, PAGE_USER | PAGE_WRITE | PAGE_PRESENT)) {
+            kernel_mm.free_pages(copy, 0);
+            return false;
+        }
+        count_fault(major);
+        faults.file_faults++;
+        return true;
+    }
+    InstallResult result = install_page(vaddr, phys, flags, true);
+    if(result != InstallResult::INSTALLED) {
+        kernel_mm.decrement_ref_count(phys);
+        return result == InstallResult::RACED;
+    }
+    count_fault(major);
+    faults.file_faults++;
+    if(!is_write) {
+        fault_around(area, vaddr);
+    }
+    if(major && area->advice == MADV_SEQUENTIAL) {
+        readahead(area, vaddr);
+    }
+    return true;
+}
+
+void UserMemory::fault_around(const MemoryArea* area, uint32_t vaddr)
+{
+    if(area->advice == MADV_RANDOM) {
+        return;
+    }
+    // 窗口按页数对齐，不会跨越页表，缺页的页表已经建好
+    bool sequential = area->advice == MADV_SEQUENTIAL;
+    uint32_t window = (sequential ? SEQUENTIAL_AROUND_PAGES : FAULT_AROUND_PAGES) * PAGE_SIZE;
+    uint32_t start = vaddr & ~(window - 1);
+    uint32_t end = start + window;
+    if(start < area->start_addr) {
+        start = area->start_addr;
+    }
+    if(end > area->end_addr) {
+        end = area->end_addr;
+    }
+
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    uint32_t flags = file_read_flags(area);
+    for(uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        uint32_t* pte = lookup_pte(addr);
+        // 不存在但带有PAGE_MIGRATING的表项正在被迁移，不能覆盖
+        if(addr == vaddr || !pte || *pte) {
+            continue;
+        }
+        // find_page可能等待页缓存的锁，不能持有页表锁；拿到页面后在锁内重新检查表项
+        PADDR phys = area->file->find_page(area->pgoff + ((addr - area->start_addr) >> 12));
+        if(!phys) {
+            continue;
+        }
+        uint32_t lock_flags;
+        pte_lock.acquire_irqsave(lock_flags);
+        bool mapped = !*pte;
+        if(mapped) {
+            // 原来不存在的表项不会在TLB中，不需要刷新
+            *pte = phys | flags;
+            rss++;
+            faults.around_pages++;
+        }
+        pte_lock.release_irqrestore(lock_flags);
+        if(!mapped) {
+            kernel_mm.decrement_ref_count(phys);
+        }
+    }
+}
+
+void UserMemory::readahead(const MemoryArea* area, uint32_t vaddr)
+{
+    uint32_t start = vaddr + PAGE_SIZE;
+    uint32_t end = area->end_addr - start > READAHEAD_PAGES * PAGE_SIZE
+                       ? start + READAHEAD_PAGES * PAGE_SIZE
+                       : area->end_addr;
+    if(start < end) {
+        prefetch(area, start, end);
+    }
+}
+
+bool UserMemory::handle_shared_write(uint32_t fault_addr)
+{
+    uint32_t vaddr = fault_addr & ~(PAGE_SIZE - 1);
+    const MemoryArea* area = find_area(vaddr);
+    if(!area || !area->file || area->type != MEM_TYPE_SHARED || !(area->flags & PAGE_WRITE)) {
+        return false;
+    }
+    uint32_t* pte = lookup_pte(vaddr);
+    if(!pte || !(*pte & PAGE_PRESENT) || !(*pte & PAGE_SHARED)) {
+        return false;
+    }
+    area->file->set_page_dirty(area->pgoff + ((vaddr - area->start_addr) >> 12));
+    // 只是放宽权限，其他CPU上的只读表项最多再触发一次缺页，只需要刷新本地TLB
+    *pte |= PAGE_WRITE;
+    arch::flush_tlb_page(vaddr);
+    faults.dirty_faults++;
+    faults.minor_faults++;
+    return true;
+}
+
+bool UserMemory::handle_large_fault(const MemoryArea* area, uint32_t vaddr)
+{
+    uint32_t base = vaddr & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t pde = ((uint32_t*)pgd)[base >> 22];
+    // 之前回退到4KB页后已经有页表了，这4MB继续按小页处理
+    if((pde & PAGE_PRESENT) || base < area->start_addr || base + LARGE_PAGE_SIZE > area->end_addr) {
+        return false;
+    }
+    // 有4KB页可以回退，不为凑出4MB连续内存而回收页面
+    auto phys = Kernel::instance().kernel_mm().alloc_pages(
+        __GFP_ZERO | __GFP_NORECLAIM, LARGE_PAGE_ORDER);
+    if(!phys) {
+        faults.huge_fallbacks++;
+        return false;
+    }
+    map_large_page(base, phys, PAGE_USER | (area->flags & PAGE_WRITE) | PAGE_PRESENT);
+    faults.huge_faults++;
+    faults.minor_faults++;
+    return true;
 }
 
 // 释放指定地址范围的内存区域
-void UserMemory::free_area(uint32_t start)
+void UserMemory::free_area(uint32_t start, uint32_t size)
 {
+    if(size == 0) {
+        const MemoryArea* area = find_area(start);
+        if(!area || area->start_addr != start) {
+            return;
+        }
+        size = area->end_addr - area->start_addr;
+    }
+    start &= ~(PAGE_SIZE - 1);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t end = start + size;
+
+    // 大页区域只能按4MB整块释放，区域本身是4MB对齐的，取整后不会越过区域边界
+    const MemoryArea* head = find_area(start);
+    if(head && (head->flags & PAGE_PS)) {
+        start &= ~(LARGE_PAGE_SIZE - 1);
+    }
+    const MemoryArea* tail_area = find_area(end - 1);
+    if(tail_area && (tail_area->flags & PAGE_PS)) {
+        end = (end + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    }
+    size = end - start;
 
-    uint32_t size = 0;
-    // 查找并移除匹配的内存区域
-    for(uint32_t i = 0; i < num_areas; i++) {
-        if(areas[i].start_addr == start) {
-            // 更新总虚拟内存大小
-            size = areas[i].end_addr - areas[i].start_addr;
-            total_vm -= (size + 0xFFF) >> 12;
+    MemoryArea* area = lower_bound(start);
+    while(area && area->start_addr < end) {
+        MemoryArea* next = next_area(area);
+        uint32_t from = area->start_addr > start ? area->start_addr : start;
+        uint32_t to = area->end_addr < end ? area->end_addr : end;
+        total_vm -= (to - from) >> 12;
 
-            // 移动后续区域
-            for(uint32_t j = i; j < num_areas - 1; j++) {
-                areas[j] = areas[j + 1];
+        if(area->start_addr < start && area->end_addr > end) {
+            // 从中间挖掉一段，拆成两个区域
+            auto tail = clone_area(area);
+            if(!tail) {
+                log_err("free_area: failed to split area at 0x%x\n", area->start_addr);
+                total_vm += (to - from) >> 12;
+                return;
             }
-            num_areas--;
-            break;
+            tail->start_addr = end;
+            tail->pgoff += (end - area->start_addr) >> 12;
+            area->end_addr = start;
+            insert_area(tail);
+        } else if(area->start_addr < start) {
+            area->end_addr = start;
+            if(next) {
+                update_gap(next);
+            }
+        } else if(area->end_addr > end) {
+            area->pgoff += (end - area->start_addr) >> 12;
+            area->start_addr = end;
+            update_gap(area);
+        } else {
+            erase_area(area);
+            destroy_area(area);
         }
+        area = next;
     }
 
     // 解除该区域的页面映射
     unmap_pages(start, size);
 }
 
+MemoryArea* UserMemory::split_area(MemoryArea* area, uint32_t addr)
+{
+    auto tail = clone_area(area);
+    if(!tail) {
+        log_err("failed to split area at 0x%x\n", area->start_addr);
+        return nullptr;
+    }
+    tail->start_addr = addr;
+    tail->pgoff += (addr - area->start_addr) >> 12;
+    area->end_addr = addr;
+    insert_area(tail);
+    return tail;
+}
+
+void UserMemory::prefetch(const MemoryArea* area, uint32_t start, uint32_t end)
+{
+    // 没有异步读，这里同步读入；是否需要读入、读到哪里由文件映射决定
+    for(uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if(!area->file->prefetch(area->pgoff + ((addr - area->start_addr) >> 12))) {
+            break;
+        }
+    }
+}
+
+int UserMemory::madvise(uint32_t addr, uint32_t size, uint32_t advice)
+{
+    if((addr & (PAGE_SIZE - 1)) || advice > MADV_DONTNEED) {
+        return -1;
+    }
+    uint32_t end = addr + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    if(end <= addr) {
+        return end == addr ? 0 : -1;
+    }
+
+    // 整个范围必须被区域或堆连续覆盖；堆没有区域描述符，页面在第一次访问时分配
+    uint32_t heap_end = (end_heap + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t covered = addr;
+    while(covered < end) {
+        if(covered >= start_heap && covered < heap_end) {
+            covered = heap_end;
+            continue;
+        }
+        MemoryArea* area = lower_bound(covered);
+        if(!area || area->start_addr > covered) {
+            return -1;
+        }
+        covered = area->end_addr;
+    }
+
+    if(advice == MADV_DONTNEED) {
+        // 匿名页释放后再访问得到清零页面，文件页重新从页缓存映射；大页只在整块被覆盖时释放
+        unmap_pages(addr, end - addr);
+        return 0;
+    }
+
+    if(advice == MADV_WILLNEED) {
+        // 匿名页没有后备存储，不需要预取
+        for(MemoryArea* area = lower_bound(addr); area && area->start_addr < end;
+            area = next_area(area)) {
+            if(area->file) {
+                prefetch(area, area->start_addr > addr ? area->start_addr : addr,
+                    area->end_addr < end ? area->end_addr : end);
+            }
+        }
+        return 0;
+    }
+
+    // 访问模式只影响文件页的fault-around和预读，匿名区域和堆不需要记录，也就不必拆分
+    MemoryArea* area = lower_bound(addr);
+    while(area && area->start_addr < end) {
+        if(area->file && area->advice != advice) {
+            if(area->start_addr < addr) {
+                area = split_area(area, addr);
+                if(!area) {
+                    return -1;
+                }
+                continue;
+            }
+            if(area->end_addr > end && !split_area(area, end)) {
+                return -1;
+            }
+            area->advice = advice;
+        }
+        area = next_area(area);
+    }
+
+    // 与相邻的、访问模式相同的同一文件映射合并回去，反复madvise不会让区域越拆越碎
+    area = lower_bound(addr ? addr - 1 : 0);
+    while(area && area->start_addr <= end) {
+        MemoryArea* next = next_area(area);
+        if(next && can_merge_file(area, next)) {
+            area->end_addr = next->end_addr;
+            erase_area(next);
+            destroy_area(next);
+            continue;
+        }
+        area = next;
+    }
+    return 0;
+}
+
+bool UserMemory::populate(uint32_t addr, uint32_t size)
+{
+    uint32_t end = addr + size;
+    uint32_t vaddr = addr & ~(PAGE_SIZE - 1);
+    while(vaddr < end) {
+        if(pde_is_large(((uint32_t*)pgd)[vaddr >> 22])) {
+            vaddr = (vaddr & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            continue;
+        }
+        uint32_t* pte = lookup_pte(vaddr);
+        if(!(pte && (*pte & PAGE_PRESENT))) {
+            // 可写的匿名页和私有文件页按写缺页建立，避免之后再写时复制；只读区域按读缺页映射，
+            // 共享文件页也按读缺页映射，保留写入时的脏页标记，读缺页还会顺带映射相邻的已缓存页面
+            const MemoryArea* area = find_area(vaddr);
+            bool writable = !area || (area->flags & PAGE_WRITE);
+            bool write = writable && (!(area && area->file) || area->type == MEM_TYPE_MMAP_FILE);
+            if(!handle_fault(vaddr, write)) {
+                return false;
+            }
+        }
+        vaddr += PAGE_SIZE;
+    }
+    return true;
+}
+
+bool UserMemory::copy_from_user(void* dst, uint32_t src, uint32_t size)
+{
+    if(size == 0) {
+        return true;
+    }
+    bool in_user = src >= USER_START && src < USER_END && size <= USER_END - src;
+    bool in_image = src >= USER_IMAGE_START && src < USER_IMAGE_END &&
+                    size <= USER_IMAGE_END - src &&
+                    (((uint32_t*)pgd)[0] & 0xFFFFF000) != K_FIRST_4M_PT;
+    if((!in_user && !in_image) || !populate(src, size)) {
+        return false;
+    }
+    memcpy(dst, (const void*)src, size);
+    return true;
+}
+
+int UserMemory::strncpy_from_user(char* dst, uint32_t src, uint32_t max)
+{
+    // 按页检查，字符串可能在一个区域的末尾结束，不能按max整体检查
+    uint32_t i = 0;
+    while(i < max) {
+        uint32_t chunk = PAGE_SIZE - ((src + i) & (PAGE_SIZE - 1));
+        if(chunk > max - i) {
+            chunk = max - i;
+        }
+        if(!copy_from_user(dst + i, src + i, chunk)) {
+            return -1;
+        }
+        for(uint32_t j = 0; j < chunk; j++) {
+            if(!dst[i + j]) {
+                return i + j;
+            }
+        }
+        i += chunk;
+    }
+    return -1;
+}
+
 // 扩展或收缩堆区
 uint32_t UserMemory::brk(uint32_t new_brk)
 {
@@ -197,18 +817,10 @@ uint32_t UserMemory::brk(uint32_t new_brk)
     int32_t old_pages = (end_heap - start_heap + 0xFFF) >> 12;
     int32_t new_pages = (new_brk - start_heap + 0xFFF) >> 12;
 
-    if(new_pages > old_pages) {
-        // 需要扩展堆
-        for(uint32_t addr = end_heap; addr < new_brk; addr += 0x1000) {
-            // 分配物理页面并建立映射
-            uint32_t phys_page = allocate_physical_page();
-            if(!map_pages(addr, phys_page, 0x1000, PAGE_USER | PAGE_WRITE)) {
-                return end_heap;
-            }
-        }
-    } else if(new_pages < old_pages) {
-        // 需要收缩堆
-        unmap_pages(new_brk, end_heap - new_brk);
+    // 扩展时只移动堆顶，页面在第一次访问时分配
+    if(new_pages < old_pages) {
+        // 需要收缩堆，新堆顶所在的页仍然保留
+        unmap_pages(start_heap + (new_pages << 12), (old_pages - new_pages) << 12);
     }
 
     end_heap = new_brk;
@@ -224,41 +836,180 @@ bool UserMemory::map_pages(uint32_t virt_addr, uint32_t phys_addr, uint32_t size
         uint32_t vaddr = virt_addr + (i << 12);
         uint32_t paddr = phys_addr + (i << 12);
 
-        // 获取页目录项和页表项的索引
-        uint32_t pde_idx = vaddr >> 22;
-        uint32_t pte_idx = (vaddr >> 12) & 0x3FF;
-
         // 获取页目录项
-        uint32_t* pde = (uint32_t*)(pgd + (pde_idx << 2));
+        uint32_t* pde = (uint32_t*)(pgd + ((vaddr >> 22) << 2));
+
+        if(*pde & PAGE_PS) {
+            log_err("map_pages: 0x%x is inside a 4MB page\n", vaddr);
+            return false;
+        }
 
         // 如果页表不存在，创建新的页表
         if(!(*pde & PAGE_PRESENT)) {
+            // allocate_physical_page返回的页面已清零（__GFP_ZERO）
             uint32_t page_table = allocate_physical_page();
-            auto virt = phys_to_virt(page_table);
             *pde = page_table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
-            memset((void*)virt, 0, 0x1000);
         }
 
-        // 获取页表物理地址并转换为虚拟地址
-        uint32_t page_table = *pde & 0xFFFFF000;
-        uint32_t* page_table_virt = (uint32_t*)phys_to_virt(page_table);
-        uint32_t* pte = &page_table_virt[pte_idx];
-        // 页表项已经是虚拟地址，不需要再次转换
-        uint32_t* pte0 = pte;
-
         // 建立页表项映射，确保用户态权限
-        *pte0 = paddr | (flags | PAGE_USER) | PAGE_PRESENT;
+        *lookup_pte(vaddr) = paddr | (flags | PAGE_USER) | PAGE_PRESENT;
     }
 
     return true;
 }
 
+uint32_t* UserMemory::lookup_pte(uint32_t vaddr)
+{
+    uint32_t pde = ((uint32_t*)pgd)[vaddr >> 22];
+    if(!(pde & PAGE_PRESENT) || (pde & PAGE_PS)) {
+        return nullptr;
+    }
+    // 正在使用的地址空间通过递归映射访问页表
+    if(arch::is_current_pgd(pgd_phys)) {
+        return current_pte(vaddr);
+    }
+    uint32_t* page_table_virt = (uint32_t*)phys_to_virt(pde & 0xFFFFF000);
+    return &page_table_virt[(vaddr >> 12) & 0x3FF];
+}
+
+bool UserMemory::map_anon_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
+{
+    // 反向映射记录也在页表锁内增删，记录存在期间迁移可以放心使用&pte_lock
+    uint32_t lock_flags;
+    pte_lock.acquire_irqsave(lock_flags);
+    // 写时复制替换的是已经存在的映射，不增加驻留页数；共享零页不计入驻留页数
+    uint32_t* pte = lookup_pte(virt_addr);
+    bool was_present = pte && (*pte & PAGE_PRESENT) &&
+                       (*pte & 0xFFFFF000) != Kernel::instance().kernel_mm().zero_page();
+    bool ok = map_pages(virt_addr, phys_addr, PAGE_SIZE, flags);
+    if(ok) {
+        if(!was_present) {
+            rss++;
+        }
+        Kernel::instance().kernel_mm().rmap().add_anon(
+            phys_addr, pgd_phys, virt_addr, &pte_lock);
+    }
+    pte_lock.release_irqrestore(lock_flags);
+    return ok;
+}
+
+UserMemory::InstallResult UserMemory::install_page(
+    uint32_t vaddr, PADDR phys, uint32_t flags, bool count_rss)
+{
+    // 页表也在锁内创建，两个线程同时缺页不会各分配一个页表
+    uint32_t lock_flags;
+    pte_lock.acquire_irqsave(lock_flags);
+    uint32_t* pte = lookup_pte(vaddr);
+    InstallResult result = InstallResult::RACED;
+    if(!pte || !*pte) {
+        result = map_pages(vaddr, phys, PAGE_SIZE, flags) ? InstallResult::INSTALLED
+                                                          : InstallResult::FAILED;
+    }
+    if(result == InstallResult::INSTALLED && count_rss) {
+        rss++;
+    }
+    pte_lock.release_irqrestore(lock_flags);
+    return result;
+}
+
+bool UserMemory::map_image(uint32_t end)
+{
+    // 内核上下文的低端页表是所有内核线程共享的恒等映射，不能放映像
+    if(end > USER_IMAGE_END || (((uint32_t*)pgd)[0] & 0xFFFFF000) == K_FIRST_4M_PT) {
+        return false;
+    }
+    unmap_pages(USER_IMAGE_START, USER_IMAGE_END - USER_IMAGE_START);
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    for(uint32_t vaddr = USER_IMAGE_START; vaddr < end; vaddr += PAGE_SIZE) {
+        PADDR phys = kernel_mm.alloc_pages(__GFP_ZERO, 0);
+        if(!phys || !map_anon_page(vaddr, phys, PAGE_USER | PAGE_WRITE | PAGE_PRESENT)) {
+            if(phys) {
+                kernel_mm.free_pages(phys, 0);
+            }
+            log_err("out of memory mapping the program image at 0x%x\n", vaddr);
+            unmap_pages(USER_IMAGE_START, vaddr - USER_IMAGE_START);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UserMemory::replace_anon_page(uint32_t vaddr, uint32_t old_pte, uint32_t phys, uint32_t flags)
+{
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    uint32_t old_phys = old_pte & 0xFFFFF000;
+    uint32_t lock_flags;
+    pte_lock.acquire_irqsave(lock_flags);
+    uint32_t* pte = lookup_pte(vaddr);
+    bool ok = pte && *pte == old_pte;
+    if(ok) {
+        *pte = phys | ((flags | PAGE_USER) & 0xFFF) | PAGE_PRESENT;
+        // 共享零页不计入驻留页数
+        if(old_phys == kernel_mm.zero_page()) {
+            rss++;
+        }
+        kernel_mm.rmap().remove_anon(old_phys, pgd_phys, vaddr);
+        kernel_mm.rmap().add_anon(phys, pgd_phys, vaddr, &pte_lock);
+    }
+    pte_lock.release_irqrestore(lock_flags);
+    return ok;
+}
+
+bool UserMemory::reuse_anon_page(uint32_t vaddr, uint32_t old_pte, uint32_t flags)
+{
+    uint32_t old_phys = old_pte & 0xFFFFF000;
+    page* pg = Kernel::instance().kernel_mm().phys_to_page(old_phys);
+    uint32_t lock_flags;
+    pte_lock.acquire_irqsave(lock_flags);
+    // fork在页表锁内增加引用计数，锁内看到的计数不会再被fork改变
+    uint32_t* pte = lookup_pte(vaddr);
+    bool ok = pte && *pte == old_pte && pg && page_ref_count(pg) == 1;
+    if(ok) {
+        *pte = old_phys | ((flags | PAGE_USER) & 0xFFF) | PAGE_PRESENT;
+    }
+    pte_lock.release_irqrestore(lock_flags);
+    return ok;
+}
+
+bool UserMemory::wait_migration(uint32_t vaddr)
+{
+    uint32_t* pte = lookup_pte(vaddr);
+    if(!pte || !(__atomic_load_n(pte, __ATOMIC_ACQUIRE) & PAGE_MIGRATING)) {
+        return false;
+    }
+    // 迁移全程持有页表锁，拿到锁时表项已经指向新页面或者恢复原样
+    uint32_t lock_flags;
+    pte_lock.acquire_irqsave(lock_flags);
+    pte_lock.release_irqrestore(lock_flags);
+    return true;
+}
+
+void UserMemory::map_large_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
+{
+    uint32_t* pde = &((uint32_t*)pgd)[virt_addr >> 22];
+    // 写时复制替换的是已经存在的映射，不增加驻留页数
+    if(!pde_is_large(*pde)) {
+        rss += LARGE_PAGE_SIZE / PAGE_SIZE;
+    }
+    *pde = (phys_addr & ~(LARGE_PAGE_SIZE - 1)) | (flags & 0xFFF) | PAGE_USER | PAGE_PS |
+           PAGE_PRESENT;
+}
+
 // 解除虚拟地址空间的映射
+// 其他CPU上可能还缓存着这些页的表项，清除的页面先攒在released中，
+// 整批刷新TLB之后再释放
 void UserMemory::unmap_pages(uint32_t virt_addr, uint32_t size)
 {
     uint32_t num_pages = (size + 0xFFF) >> 12;
+    constexpr uint32_t LARGE_PAGES = LARGE_PAGE_SIZE / PAGE_SIZE;
+    arch::TlbBatch batch(pgd_phys);
+    uint32_t released[UNMAP_BATCH];
+    uint32_t nr_released = 0;
 
     for(uint32_t i = 0; i < num_pages; i++) {
+        if(nr_released == UNMAP_BATCH) {
+            flush_and_put(batch, released, nr_released);
+        }
         uint32_t vaddr = virt_addr + (i << 12);
 
         // 获取页目录项和页表项的索引
@@ -268,55 +1019,144 @@ void UserMemory::unmap_pages(uint32_t virt_addr, uint32_t size)
         // 获取页目录项
         uint32_t* pde = (uint32_t*)(pgd + (pde_idx << 2));
 
+        if(pde_is_large(*pde)) {
+            // 大页只能整块解除映射，只覆盖一部分时保留到整块被释放
+            if(pte_idx == 0 && num_pages - i >= LARGE_PAGES) {
+                released[nr_released++] = *pde & 0xFFFFF000;
+                *pde = 0;
+                rss = rss > LARGE_PAGES ? rss - LARGE_PAGES : 0;
+                batch.add(vaddr);
+                // 之后这里可能换成页表，递归映射窗口中的旧表项也要失效
+                batch.add(pte_window_page(vaddr));
+            }
+            i += LARGE_PAGES - 1 - pte_idx;
+            continue;
+        }
+
         if(*pde & PAGE_PRESENT) {
-            // 获取页表物理地址并转换为虚拟地址
-            uint32_t page_table = *pde & 0xFFFFF000;
-            uint32_t* page_table_virt = (uint32_t*)phys_to_virt(page_table);
-            uint32_t* pte = &page_table_virt[pte_idx];
-            uint32_t* pte0 = pte;
+            uint32_t lock_flags;
+            pte_lock.acquire_irqsave(lock_flags);
+            uint32_t* pte0 = lookup_pte(vaddr);
 
             // 清除页表项
             if(*pte0 & PAGE_PRESENT) {
                 uint32_t phys_page = *pte0 & 0xFFFFF000;
-                free_physical_page(phys_page);
+                auto& kernel_mm = Kernel::instance().kernel_mm();
+                kernel_mm.rmap().remove_anon(phys_page, pgd_phys, vaddr);
+                released[nr_released++] = phys_page;
                 *pte0 = 0;
+                if(rss && phys_page != kernel_mm.zero_page()) {
+                    rss--;
+                }
+                batch.add(vaddr);
             }
+            pte_lock.release_irqrestore(lock_flags);
         }
     }
+    flush_and_put(batch, released, nr_released);
 }
 
-// 查找最大的连续空闲区域
-uint32_t UserMemory::find_largest_free_area()
+void UserMemory::flush_and_put(arch::TlbBatch& batch, uint32_t* pages, uint32_t& nr)
 {
-    uint32_t largest_size = 0;
+    batch.flush();
+    for(uint32_t i = 0; i < nr; i++) {
+        put_page(pages[i]);
+    }
+    nr = 0;
+}
 
-    // 如果没有已分配区域，返回用户空间的总大小
-    if(num_areas == 0) {
-        return USER_END - USER_START;
+// fork之后页面可能被多个地址空间共享，只减少引用计数，最后一个引用者释放页面
+void UserMemory::put_page(uint32_t phys_page)
+{
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    if(kernel_mm.phys_to_page(phys_page)) {
+        kernel_mm.decrement_ref_count(phys_page);
+    } else {
+        free_physical_page(phys_page);
     }
+}
 
-    // 检查用户空间起始位置到第一个区域之间的空间
-    if(areas[0].start_addr > USER_START) {
-        largest_size = areas[0].start_addr - USER_START;
+void UserMemory::release_user_pages()
+{
+    // 程序映像在私有的低端页表中，页表本身由PageManager::freeMemorySpace释放
+    if((((uint32_t*)pgd)[0] & 0xFFFFF000) != K_FIRST_4M_PT) {
+        unmap_pages(USER_IMAGE_START, USER_IMAGE_END - USER_IMAGE_START);
+    }
+    // 先从页目录上摘下一批页表，整体刷新TLB后再释放其中的页面
+    auto pde = (uint32_t*)pgd;
+    arch::TlbBatch batch(pgd_phys);
+    uint32_t detached[RELEASE_BATCH];
+    uint32_t detached_idx[RELEASE_BATCH];
+    uint32_t nr = 0;
+    for(uint32_t pde_idx = USER_START >> 22; pde_idx < (USER_END >> 22); pde_idx++) {
+        if(!(pde[pde_idx] & PAGE_PRESENT)) {
+            continue;
+        }
+        // 摘下之后迁移就找不到这个页表了
+        uint32_t lock_flags;
+        pte_lock.acquire_irqsave(lock_flags);
+        detached[nr] = pde[pde_idx];
+        detached_idx[nr++] = pde_idx;
+        pde[pde_idx] = 0;
+        pte_lock.release_irqrestore(lock_flags);
+        if(nr == RELEASE_BATCH) {
+            release_detached(batch, detached, detached_idx, nr);
+        }
     }
+    release_detached(batch, detached, detached_idx, nr);
+    rss = 0;
+    free_all_areas();
+    total_vm = 0;
+}
 
-    // 检查相邻区域之间的空隙
-    for(uint32_t i = 0; i < num_areas - 1; i++) {
-        uint32_t gap_start = areas[i].end_addr;
-        uint32_t gap_size = areas[i + 1].start_addr - gap_start;
+void UserMemory::release_detached(
+    arch::TlbBatch& batch, const uint32_t* pdes, const uint32_t* indexes, uint32_t& nr)
+{
+    if(!nr) {
+        return;
+    }
+    batch.add_all();
+    batch.flush();
+    for(uint32_t i = 0; i < nr; i++) {
+        release_page_table(pdes[i], indexes[i]);
+    }
+    nr = 0;
+}
 
-        if(gap_size > largest_size) {
-            largest_size = gap_size;
+// 释放一个已经从页目录上摘下的页目录项所映射的页面（大页或页表中的所有页）
+void UserMemory::release_page_table(uint32_t pde, uint32_t pde_idx)
+{
+    if(pde & PAGE_PS) {
+        put_page(pde & 0xFFFFF000);
+        return;
+    }
+    auto& rmap = Kernel::instance().kernel_mm().rmap();
+    uint32_t page_table = pde & 0xFFFFF000;
+    auto pt = (uint32_t*)phys_to_virt(page_table);
+    for(uint32_t pte_idx = 0; pte_idx < 1024; pte_idx++) {
+        if(pt[pte_idx] & PAGE_PRESENT) {
+            uint32_t phys_page = pt[pte_idx] & 0xFFFFF000;
+            rmap.remove_anon(phys_page, pgd_phys, (pde_idx << 22) | (pte_idx << 12));
+            put_page(phys_page);
         }
     }
+    free_physical_page(page_table);
+}
+
+// 查找最大的连续空闲区域
+uint32_t UserMemory::find_largest_free_area()
+{
+    // 如果没有已分配区域，返回用户空间的总大小
+    if(!area_tree.node) {
+        return USER_END - USER_START;
+    }
+
+    uint32_t largest_size = rb_entry(area_tree.node, MemoryArea, rb)->subtree_gap;
 
     // 检查最后一个区域之后到用户空间结束位置之间的空间
-    uint32_t last_end = areas[num_areas - 1].end_addr;
-    if(last_end < USER_END) {
-        uint32_t final_gap = USER_END - last_end;
-        if(final_gap > largest_size) {
-            largest_size = final_gap;
-        }
+    uint32_t last_end = last_area()->end_addr;
+    if(last_end < USER_END && USER_END - last_end > largest_size) {
+        largest_size = USER_END - last_end;
     }
 
     return largest_size;
@@ -326,12 +1166,16 @@ uint32_t UserMemory::find_largest_free_area()
 bool UserMemory::copyFrom(const UserMemory& src)
 {
     // 复制内存区域元数据
-    num_areas = src.num_areas;
-    for(uint32_t i = 0; i < num_areas; i++) {
-        if(MEM_TYPE_STACK == src.areas[i].type) {
+    free_all_areas();
+    for(MemoryArea* area = src.first_area(); area; area = src.next_area(area)) {
+        if(MEM_TYPE_STACK == area->type) {
             continue;
         }
-        memcpy(&areas[i], &src.areas[i], sizeof(MemoryArea));
+        auto copy = clone_area(area);
+        if(!copy) {
+            return false;
+        }
+        insert_area(copy);
     }
     total_vm = src.total_vm;
     locked_vm = src.locked_vm;
@@ -340,13 +1184,20 @@ bool UserMemory::copyFrom(const UserMemory& src)
 void UserMemory::print()
 {
     log_debug("UserMemory: total_vm: %d, locked_vm: %d\n", total_vm, locked_vm);
-    log_debug("UserMemory: num_areas: %d\n", num_areas);
-    for(uint32_t i = 0; i < num_areas; i++) {
-        log_debug("UserMemory: area[%d]: start: %x, end: %x, flags: %x, type: %d\n", i,
-            areas[i].start_addr, areas[i].end_addr, areas[i].flags, areas[i].type);
+    log_debug("UserMemory: num_areas: %d, resident pages: %d, largest gap: 0x%x\n", num_areas, rss,
+        find_largest_free_area());
+    log_debug("UserMemory: faults major %d, minor %d; demand %d, zero %d, cow %d, bad %d, "
+              "huge %d (fallback %d), file %d (dirty %d, around %d pages)\n",
+        faults.major_faults, faults.minor_faults, faults.demand_faults, faults.zero_faults,
+        faults.cow_faults, faults.bad_faults, faults.huge_faults, faults.huge_fallbacks,
+        faults.file_faults, faults.dirty_faults, faults.around_pages);
+    uint32_t i = 0;
+    for(MemoryArea* area = first_area(); area; area = next_area(area), i++) {
+        log_debug("UserMemory: area[%d]: start: %x, end: %x, flags: %x, type: %d, advice: %d\n",
+            i, area->start_addr, area->end_addr, area->flags, area->type, area->advice);
         if(i > 20) {
             log_debug("too many areas, stop here\n");
             break;
         }
     }
-}
\ No newline at end of file
+}
@@ -1,264 +1,208 @@
 #include "kernel/virtual_memory_tree.h"
 
+#include "lib/debug.h"
+
+// 主机上的单元测试（tests/virtual_memory_tree_test.cpp）用全局new/delete分配节点
+#ifndef TESTING
+#include "kernel/kernel.h"
+
+DEFINE_SLAB_CACHE_OPERATORS(VmArea, "vm_area")
+#endif
+
+using kernel::rb_node;
+
 VirtualMemoryTree::VirtualMemoryTree(uint32_t start, uint32_t end)
-    : root(nullptr), start_addr(start), end_addr(end), total_size(end - start), allocated_size(0)
+    : start_addr(start), end_addr(end), total_size(end - start), allocated_size(0), nr_areas(0)
 {
-    // 创建一个表示整个空闲空间的节点
-    root = new VmArea(start, total_size);
-    root->color = Color::BLACK;
+    root.augment = augment_gap;
 }
 
-VirtualMemoryTree::~VirtualMemoryTree()
+// 树中只保存已分配的区域，初始为空
+void VirtualMemoryTree::init()
 {
-    cleanup(root);
+    root.node = nullptr;
+    root.augment = augment_gap;
+    allocated_size = 0;
+    nr_areas = 0;
 }
 
-// 左旋操作
-void VirtualMemoryTree::left_rotate(VmArea* x)
+VirtualMemoryTree::~VirtualMemoryTree()
 {
-    VmArea* y = x->right;
-    x->right = y->left;
-
-    if(y->left)
-        y->left->parent = x;
-
-    y->parent = x->parent;
-
-    if(!x->parent)
-        root = y;
-    else if(x == x->parent->left)
-        x->parent->left = y;
-    else
-        x->parent->right = y;
-
-    y->left = x;
-    x->parent = y;
+    cleanup(root.node);
 }
 
-// 右旋操作
-void VirtualMemoryTree::right_rotate(VmArea* y)
+VmArea* VirtualMemoryTree::area_of(rb_node* node)
 {
-    VmArea* x = y->left;
-    y->left = x->right;
-
-    if(x->right)
-        x->right->parent = y;
-
-    x->parent = y->parent;
-
-    if(!y->parent)
-        root = x;
-    else if(y == y->parent->left)
-        y->parent->left = x;
-    else
-        y->parent->right = x;
+    return node ? rb_entry(node, VmArea, rb) : nullptr;
+}
 
-    x->right = y;
-    y->parent = x;
+// 节点的subtree_gap = max(自身前面的空隙, 左右子树的subtree_gap)，旋转和插入删除时由rbtree调用
+void VirtualMemoryTree::augment_gap(rb_node* node)
+{
+    VmArea* area = area_of(node);
+    uint32_t gap = area->gap_before;
+    if(node->left && area_of(node->left)->subtree_gap > gap)
+        gap = area_of(node->left)->subtree_gap;
+    if(node->right && area_of(node->right)->subtree_gap > gap)
+        gap = area_of(node->right)->subtree_gap;
+    area->subtree_gap = gap;
 }
 
-// 插入修复
-void VirtualMemoryTree::insert_fixup(VmArea* z)
+uint32_t VirtualMemoryTree::prev_end(VmArea* area) const
 {
-    while(z->parent && z->parent->color == Color::RED) {
-        if(z->parent == z->parent->parent->left) {
-            VmArea* y = z->parent->parent->right;
-            if(y && y->color == Color::RED) {
-                z->parent->color = Color::BLACK;
-                y->color = Color::BLACK;
-                z->parent->parent->color = Color::RED;
-                z = z->parent->parent;
-            } else {
-                if(z == z->parent->right) {
-                    z = z->parent;
-                    left_rotate(z);
-                }
-                z->parent->color = Color::BLACK;
-                z->parent->parent->color = Color::RED;
-                right_rotate(z->parent->parent);
-            }
-        } else {
-            VmArea* y = z->parent->parent->left;
-            if(y && y->color == Color::RED) {
-                z->parent->color = Color::BLACK;
-                y->color = Color::BLACK;
-                z->parent->parent->color = Color::RED;
-                z = z->parent->parent;
-            } else {
-                if(z == z->parent->left) {
-                    z = z->parent;
-                    right_rotate(z);
-                }
-                z->parent->color = Color::BLACK;
-                z->parent->parent->color = Color::RED;
-                left_rotate(z->parent->parent);
-            }
-        }
-    }
-    root->color = Color::BLACK;
+    VmArea* prev = area_of(kernel::rb_prev(&area->rb));
+    return prev ? prev->start_addr + prev->size : start_addr;
 }
 
-// 查找最小节点
-VmArea* VirtualMemoryTree::minimum(VmArea* node)
+// 前一个区域变化后重新计算area前面的空隙，并向上更新子树最大值
+void VirtualMemoryTree::update_gap(VmArea* area)
 {
-    while(node->left)
-        node = node->left;
-    return node;
+    area->gap_before = area->start_addr - prev_end(area);
+    kernel::rb_augment_propagate(&area->rb, &root);
 }
 
-// 节点替换
-void VirtualMemoryTree::transplant(VmArea* u, VmArea* v)
+uint32_t VirtualMemoryTree::tail_gap() const
 {
-    if(!u->parent)
-        root = v;
-    else if(u == u->parent->left)
-        u->parent->left = v;
-    else
-        u->parent->right = v;
-    if(v)
-        v->parent = u->parent;
+    VmArea* last = area_of(kernel::rb_last(&root));
+    return end_addr - (last ? last->start_addr + last->size : start_addr);
 }
 
-// 删除修复
-void VirtualMemoryTree::delete_fixup(VmArea* x)
+// 左子树中有足够大的空隙就往左走，否则看当前节点前面的空隙，再否则往右走
+uint32_t VirtualMemoryTree::find_gap(uint32_t size) const
 {
-    while(x != root && (!x || x->color == Color::BLACK)) {
-        if(x == x->parent->left) {
-            VmArea* w = x->parent->right;
-            if(w->color == Color::RED) {
-                w->color = Color::BLACK;
-                x->parent->color = Color::RED;
-                left_rotate(x->parent);
-                w = x->parent->right;
-            }
-            if((!w->left || w->left->color == Color::BLACK) &&
-                (!w->right || w->right->color == Color::BLACK)) {
-                w->color = Color::RED;
-                x = x->parent;
+    rb_node* node = root.node;
+    if(node && area_of(node)->subtree_gap >= size) {
+        while(node) {
+            VmArea* area = area_of(node);
+            if(node->left && area_of(node->left)->subtree_gap >= size) {
+                node = node->left;
+            } else if(area->gap_before >= size) {
+                return area->start_addr - area->gap_before;
             } else {
-                if(!w->right || w->right->color == Color::BLACK) {
-                    if(w->left)
-                        w->left->color = Color::BLACK;
-                    w->color = Color::RED;
-                    right_rotate(w);
-                    w = x->parent->right;
-                }
-                w->color = x->parent->color;
-                x->parent->color = Color::BLACK;
-                if(w->right)
-                    w->right->color = Color::BLACK;
-                left_rotate(x->parent);
-                x = root;
-            }
-        } else {
-            VmArea* w = x->parent->left;
-            if(w->color == Color::RED) {
-                w->color = Color::BLACK;
-                x->parent->color = Color::RED;
-                right_rotate(x->parent);
-                w = x->parent->left;
-            }
-            if((!w->right || w->right->color == Color::BLACK) &&
-                (!w->left || w->left->color == Color::BLACK)) {
-                w->color = Color::RED;
-                x = x->parent;
-            } else {
-                if(!w->left || w->left->color == Color::BLACK) {
-                    if(w->right)
-                        w->right->color = Color::BLACK;
-                    w->color = Color::RED;
-                    left_rotate(w);
-                    w = x->parent->left;
-                }
-                w->color = x->parent->color;
-                x->parent->color = Color::BLACK;
-                if(w->left)
-                    w->left->color = Color::BLACK;
-                right_rotate(x->parent);
-                x = root;
+                node = node->right;
             }
         }
     }
-    if(x)
-        x->color = Color::BLACK;
+    if(tail_gap() >= size) {
+        VmArea* last = area_of(kernel::rb_last(&root));
+        return last ? last->start_addr + last->size : start_addr;
+    }
+    return 0;
 }
 
-// 查找合适的空闲区域
-VmArea* VirtualMemoryTree::find_free_area(uint32_t size)
+// 按起始地址插入节点
+void VirtualMemoryTree::insert(VmArea* node)
 {
-    VmArea* best_fit = nullptr;
-    VmArea* current = root;
-
-    while(current) {
-        if(current->size >= size) {
-            if(!best_fit || current->size < best_fit->size)
-                best_fit = current;
-            current = current->left;
-        } else {
-            current = current->right;
-        }
+    rb_node* parent = nullptr;
+    rb_node** link = &root.node;
+    while(*link) {
+        parent = *link;
+        link = node->start_addr < area_of(parent)->start_addr ? &parent->left : &parent->right;
     }
+    kernel::rb_link_node(&node->rb, parent, link);
+    node->gap_before = node->start_addr - prev_end(node);
+    node->subtree_gap = node->gap_before;
+    kernel::rb_insert_color(&node->rb, &root);
 
-    return best_fit;
+    // 新区域占去了后一个区域前面空隙的一部分
+    VmArea* next = area_of(kernel::rb_next(&node->rb));
+    if(next)
+        update_gap(next);
+    nr_areas++;
 }
 
-// 分配内存区域
-uint32_t VirtualMemoryTree::allocate(uint32_t size)
+// 从树中摘除节点，不释放节点本身
+void VirtualMemoryTree::erase(VmArea* node)
 {
-    VmArea* area = find_free_area(size);
-    if(!area)
-        return 0;
+    VmArea* next = area_of(kernel::rb_next(&node->rb));
+    kernel::rb_erase(&node->rb, &root);
+    if(next)
+        update_gap(next);
+    nr_areas--;
+}
 
-    uint32_t alloc_addr = area->start_addr;
+VmArea* VirtualMemoryTree::find(uint32_t addr) const
+{
+    rb_node* node = root.node;
+    while(node && area_of(node)->start_addr != addr) {
+        node = addr < area_of(node)->start_addr ? node->left : node->right;
+    }
+    return area_of(node);
+}
 
-    // 如果区域大小大于请求大小，分割区域
-    if(area->size > size) {
-        VmArea* new_area = new VmArea(area->start_addr + size, area->size - size);
-        area->size = size;
+// 分配内存区域：取地址最低的足够大的空隙
+uint32_t VirtualMemoryTree::allocate(uint32_t size)
+{
+    if(size == 0 || size > total_size)
+        return 0;
 
-        // 插入新的空闲区域
-        new_area->parent = area->parent;
-        if(!area->parent)
-            root = new_area;
-        else if(area == area->parent->left)
-            area->parent->left = new_area;
-        else
-            area->parent->right = new_area;
+    VmArea* area = new VmArea(0, size);
+    if(!area)
+        return 0;
 
-        insert_fixup(new_area);
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    uint32_t alloc_addr = find_gap(size);
+    if(alloc_addr) {
+        area->start_addr = alloc_addr;
+        insert(area);
+        allocated_size += size;
     }
+    lock.release_irqrestore(flags);
 
-    allocated_size += size;
+    if(!alloc_addr)
+        delete area;
     return alloc_addr;
 }
 
 // 释放内存区域
-void VirtualMemoryTree::free(uint32_t addr)
+uint32_t VirtualMemoryTree::free(uint32_t addr)
 {
-    VmArea* area = root;
-    while(area) {
-        if(area->start_addr == addr) {
-            allocated_size -= area->size;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    VmArea* area = find(addr);
+    uint32_t size = 0;
+    if(area) {
+        size = area->size;
+        erase(area);
+        allocated_size -= size;
+    }
+    lock.release_irqrestore(flags);
 
-            // 合并相邻的空闲区域
-            VmArea* next = area->right;
-            if(next && area->start_addr + area->size == next->start_addr) {
-                area->size += next->size;
-                transplant(next, next->right);
-                delete next;
-            }
+    if(area)
+        delete area;
+    return size;
+}
 
-            VmArea* prev = area->left;
-            if(prev && prev->start_addr + prev->size == area->start_addr) {
-                prev->size += area->size;
-                transplant(area, area->right);
-                delete area;
-            }
+uint32_t VirtualMemoryTree::size_of(uint32_t addr) const
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    VmArea* area = find(addr);
+    uint32_t size = area ? area->size : 0;
+    lock.release_irqrestore(flags);
+    return size;
+}
 
-            return;
+bool VirtualMemoryTree::resize(uint32_t addr, uint32_t new_size)
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    VmArea* area = find(addr);
+    bool ok = false;
+    if(area && new_size) {
+        VmArea* next = area_of(kernel::rb_next(&area->rb));
+        uint32_t limit = next ? next->start_addr : end_addr;
+        if(new_size <= limit - addr) {
+            allocated_size = allocated_size - area->size + new_size;
+            area->size = new_size;
+            if(next)
+                update_gap(next);
+            ok = true;
         }
-        area = (addr < area->start_addr) ? area->left : area->right;
     }
+    lock.release_irqrestore(flags);
+    return ok;
 }
 
 // 获取可用内存大小
@@ -267,12 +211,53 @@ uint32_t VirtualMemoryTree::get_free_size() const
     return total_size - allocated_size;
 }
 
+uint32_t VirtualMemoryTree::get_largest_gap() const
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    uint32_t largest = tail_gap();
+    if(root.node && area_of(root.node)->subtree_gap > largest)
+        largest = area_of(root.node)->subtree_gap;
+    lock.release_irqrestore(flags);
+    return largest;
+}
+
+VmFragmentation VirtualMemoryTree::fragmentation() const
+{
+    VmFragmentation frag = {};
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    frag.free_size = total_size - allocated_size;
+    frag.nr_areas = nr_areas;
+    frag.largest_gap = tail_gap();
+    if(frag.largest_gap)
+        frag.nr_gaps++;
+    for(rb_node* node = kernel::rb_first(&root); node; node = kernel::rb_next(node)) {
+        if(area_of(node)->gap_before)
+            frag.nr_gaps++;
+    }
+    if(root.node && area_of(root.node)->subtree_gap > frag.largest_gap)
+        frag.largest_gap = area_of(root.node)->subtree_gap;
+    lock.release_irqrestore(flags);
+    return frag;
+}
+
+// 碎片率 = 1 - 最大空隙 / 空闲总量：空闲空间全部连续时为0
+void VirtualMemoryTree::print_fragmentation(const char* name) const
+{
+    VmFragmentation frag = fragmentation();
+    uint32_t percent =
+        frag.free_size ? 100 - (uint32_t)((uint64_t)frag.largest_gap * 100 / frag.free_size) : 0;
+    log_info("%s: %d areas, free %d KB in %d gaps, largest gap %d KB, fragmentation %d%%\n", name,
+        frag.nr_areas, frag.free_size / 1024, frag.nr_gaps, frag.largest_gap / 1024, percent);
+}
+
 // 清理红黑树
-void VirtualMemoryTree::cleanup(VmArea* node)
+void VirtualMemoryTree::cleanup(rb_node* node)
 {
     if(!node)
         return;
     cleanup(node->left);
     cleanup(node->right);
-    delete node;
-}
\ No newline at end of file
+    delete area_of(node);
+}
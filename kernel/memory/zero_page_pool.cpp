@@ -0,0 +1,135 @@
+#include "kernel/zero_page_pool.h"
+
+#include "arch/x86/apic.h"
+#include "kernel/gfp.h"
+#include "kernel/kernel.h"
+#include "kernel/kernel_memory.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+
+void ZeroPagePool::init()
+{
+    count = 0;
+    hits = misses = refilled = drained = 0;
+
+    // CPUID.1:EDX bit 26 = SSE2
+    uint32_t eax, ebx, ecx, edx;
+    arch::cpuid(1, eax, ebx, ecx, edx);
+    use_movnti = edx & (1u << 26);
+
+    shrinker.name = "zero_pool";
+    shrinker.priv = this;
+    shrinker.count = [](kernel::Shrinker* s) -> uint32_t {
+        return ((ZeroPagePool*)s->priv)->size();
+    };
+    shrinker.scan = [](kernel::Shrinker* s, uint32_t nr_pages) -> uint32_t {
+        return ((ZeroPagePool*)s->priv)->drain(nr_pages);
+    };
+    kernel::register_shrinker(&shrinker);
+    log_info("ZeroPagePool: capacity %d pages, movnti %s\n", CAPACITY, use_movnti ? "yes" : "no");
+}
+
+uint32_t ZeroPagePool::get()
+{
+    uint32_t phys = 0;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    if(count) {
+        phys = pages[--count];
+        hits++;
+    } else {
+        misses++;
+    }
+    lock.release_irqrestore(flags);
+    return phys;
+}
+
+uint32_t ZeroPagePool::refill(uint32_t max)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    uint32_t n = 0;
+    while(n < max && count < CAPACITY) {
+        // 空闲页已经不多时不再占用内存，也不为了填池触发回收
+        if(mm.low_on_memory()) {
+            break;
+        }
+        uint32_t phys = mm.alloc_pages(__GFP_NORECLAIM | __GFP_COLD, 0);
+        if(!phys) {
+            break;
+        }
+        clear_page(mm.phys2Virt(phys));
+
+        uint32_t flags;
+        lock.acquire_irqsave(flags);
+        bool full = count >= CAPACITY; // 其他CPU可能同时在补充
+        if(!full) {
+            pages[count++] = phys;
+            refilled++;
+        }
+        lock.release_irqrestore(flags);
+        if(full) {
+            mm.free_pages(phys, 0);
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+uint32_t ZeroPagePool::drain(uint32_t nr)
+{
+    auto& mm = Kernel::instance().kernel_mm();
+    uint32_t n = 0;
+    while(n < nr) {
+        uint32_t phys = 0;
+        uint32_t flags;
+        lock.acquire_irqsave(flags);
+        if(count) {
+            phys = pages[--count];
+            drained++;
+        }
+        lock.release_irqrestore(flags);
+        if(!phys) {
+            break;
+        }
+        mm.free_pages(phys, 0);
+        n++;
+    }
+    return n;
+}
+
+void ZeroPagePool::clear_page(void* addr)
+{
+    if(!use_movnti) {
+        memset(addr, 0, PAGE_SIZE);
+        return;
+    }
+    // 非临时存储直接写内存，不把页面内容带进缓存，也不挤掉其他任务的热数据；
+    // 清零的页要等到被分配后才会被访问
+    uint32_t* p = (uint32_t*)addr;
+    uint32_t n = PAGE_SIZE / 32;
+    asm volatile("1:\n\t"
+                 "movnti %2, 0(%0)\n\t"
+                 "movnti %2, 4(%0)\n\t"
+                 "movnti %2, 8(%0)\n\t"
+                 "movnti %2, 12(%0)\n\t"
+                 "movnti %2, 16(%0)\n\t"
+                 "movnti %2, 20(%0)\n\t"
+                 "movnti %2, 24(%0)\n\t"
+                 "movnti %2, 28(%0)\n\t"
+                 "add $32, %0\n\t"
+                 "dec %1\n\t"
+                 "jnz 1b\n\t"
+                 "sfence"
+                 : "+r"(p), "+r"(n)
+                 : "r"(0u)
+                 : "memory", "cc");
+}
+
+void ZeroPagePool::print_stats()
+{
+    uint32_t total = hits + misses;
+    log_info("zero page pool: %d/%d pages, hit %d miss %d (hit rate %d%%), refilled %d, "
+             "drained %d\n",
+        count, CAPACITY, hits, misses, total ? hits * 100 / total : 0, refilled, drained);
+}
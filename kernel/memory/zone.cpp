@@ -2,9 +2,22 @@
 
 #include <lib/serial.h>
 
+#include "arch/x86/percpu.h"
+#include "kernel/gfp.h"
+#include "kernel/kernel.h"
 #include "kernel/kernel_memory.h"
+#include "kernel/shrinker.h"
 #include "lib/debug.h"
 
+namespace {
+
+// 每个order的批量搬运页数(batch)和缓存上限(high)
+// 缓存为空时一次从伙伴系统取batch个块，超过high时一次归还batch个块
+constexpr uint32_t PCP_BATCH[Zone::PCP_MAX_ORDER + 1] = {16, 8, 4, 2};
+constexpr uint32_t PCP_HIGH[Zone::PCP_MAX_ORDER + 1] = {96, 48, 24, 12};
+
+} // namespace
+
 Zone::Zone()
 {
     // 初始化水位标记
@@ -25,22 +38,106 @@ void Zone::init(ZoneType type, uint32_t start_pfn, uint32_t end_pfn)
 
     // 初始化伙伴系统分配器
     buddy_allocator.init(zone_start_pfn * 4096, size * 4096);
+
+    // 初始化每CPU页面缓存
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        PerCpuPages& p = pcp[cpu];
+        for(uint32_t i = 0; i <= PCP_MAX_ORDER; i++) {
+            kernel::INIT_LIST_HEAD(&p.lists[i]);
+            p.count[i] = 0;
+        }
+        p.alloc_hit = 0;
+        p.alloc_miss = 0;
+        p.free_fast = 0;
+        p.refills = 0;
+        p.drains = 0;
+    }
+    direct_reclaims = 0;
+    direct_reclaimed = 0;
+    kswapd_wakeups = 0;
+    compact_cursor = zone_start_pfn;
+    compact_stalls = 0;
+    compact_success = 0;
+    compact_fail = 0;
+    pages_migrated = 0;
+    migrate_failed = 0;
 }
 
 uint32_t Zone::allocPages(uint32_t gfp_mask, uint32_t order)
 {
     uint32_t count = 1 << order;
+    // 分配后会跌破WMARK_MIN时先同步回收一批缓存
+    if(nr_free_pages < count + watermark[static_cast<int>(WatermarkLevel::WMARK_MIN)] &&
+        !(gfp_mask & __GFP_NORECLAIM)) {
+        directReclaim(count);
+    }
     if(count > nr_free_pages) {
         return 0; // 返回0表示分配失败
     }
 
+    // 小块分配优先走每CPU缓存
+    uint32_t pfn = 0;
+    if(order <= PCP_MAX_ORDER) {
+        pfn = pcpAlloc(gfp_mask, order);
+    }
+
+    if(!pfn) {
+        pfn = buddyAlloc(gfp_mask, order);
+    }
+
+    // 伙伴系统已经空了，空闲页可能都在其他CPU的缓存中：全部归还后再试一次
+    if(!pfn && drainAllPcp()) {
+        pfn = buddyAlloc(gfp_mask, order);
+    }
+
+    // 空闲页足够但没有连续的高阶块时，先归还每CPU缓存，再尝试内存规整
+    if(!pfn && order > 0 && !(gfp_mask & __GFP_NORECLAIM)) {
+        pfn = allocAfterCompact(gfp_mask, order);
+    }
+
+    // 低于WMARK_LOW时交给kswapd在后台回收到WMARK_HIGH
+    if(pfn && isWatermarkReached(WatermarkLevel::WMARK_LOW)) {
+        kswapd_wakeups++;
+        kernel::wakeup_kswapd();
+    }
+    return pfn;
+}
+
+uint32_t Zone::buddyAlloc(uint32_t gfp_mask, uint32_t order)
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
     uint32_t allocated_addr = buddy_allocator.allocate_pages(gfp_mask, order);
-    if(allocated_addr == 0) {
-        return 0;
+    if(allocated_addr != 0) {
+        subFreePages(1u << order);
     }
+    lock.release_irqrestore(flags);
+    return allocated_addr / 4096; // 转换为页帧号，0表示分配失败
+}
 
-    nr_free_pages -= count;
-    return allocated_addr / 4096; // 转换为页帧号
+void Zone::directReclaim(uint32_t count)
+{
+    uint32_t min = watermark[static_cast<int>(WatermarkLevel::WMARK_MIN)];
+    uint32_t target = count + min + RECLAIM_BATCH;
+    if(nr_free_pages >= target) {
+        return;
+    }
+    direct_reclaims++;
+    direct_reclaimed += kernel::shrink_caches(target - nr_free_pages);
+}
+
+uint32_t Zone::balance()
+{
+    uint32_t high = watermark[static_cast<int>(WatermarkLevel::WMARK_HIGH)];
+    uint32_t total = 0;
+    while(nr_free_pages < high) {
+        uint32_t freed = kernel::shrink_caches(high - nr_free_pages);
+        if(freed == 0) {
+            break; // 没有可回收的缓存了
+        }
+        total += freed;
+    }
+    return total;
 }
 
 void Zone::freePages(uint32_t pfn, uint32_t order)
@@ -50,9 +147,48 @@ void Zone::freePages(uint32_t pfn, uint32_t order)
     if(pfn < zone_start_pfn || pfn + count > zone_end_pfn) {
         return;
     }
+    if(!buddy_allocator.contains(pfn * 4096, order)) {
+        log_err("Zone::freePages: invalid pfn 0x%x, order %d\n", pfn, order);
+        return;
+    }
 
+    if(order <= PCP_MAX_ORDER && pcpFree(pfn, order)) {
+        return;
+    }
+
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
     buddy_allocator.free_pages(pfn * 4096, order);
-    nr_free_pages += count;
+    addFreePages(count);
+    lock.release_irqrestore(flags);
+}
+
+void Zone::freeRange(uint32_t pfn, uint32_t nr_pages)
+{
+    if(pfn < zone_start_pfn || pfn + nr_pages > zone_end_pfn) {
+        return;
+    }
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    buddy_allocator.free_range(pfn * 4096, nr_pages);
+    addFreePages(nr_pages);
+    lock.release_irqrestore(flags);
+}
+
+bool Zone::claimRange(uint32_t pfn, uint32_t nr_pages)
+{
+    if(pfn < zone_start_pfn || pfn + nr_pages > zone_end_pfn) {
+        return false;
+    }
+    // 每CPU缓存中的页在伙伴系统看来是已分配的，这里不为了扩展去清空缓存
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    bool ok = buddy_allocator.claim_range(pfn * 4096, nr_pages);
+    if(ok) {
+        subFreePages(nr_pages);
+    }
+    lock.release_irqrestore(flags);
+    return ok;
 }
 
 void Zone::decRefPage(uint32_t pfn)
@@ -60,7 +196,17 @@ void Zone::decRefPage(uint32_t pfn)
     if(pfn < zone_start_pfn || pfn >= zone_end_pfn) {
         return;
     }
-    buddy_allocator.decrement_ref_count(pfn * 4096);
+    uint32_t head = 0;
+    uint32_t order = 0;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    bool release = buddy_allocator.decrement_ref_count(pfn * 4096, head, order);
+    lock.release_irqrestore(flags);
+
+    // 引用计数归零的块经由freePages释放，这样同样能进入每CPU缓存
+    if(release) {
+        freePages(head / 4096, order);
+    }
 }
 
 void Zone::increment_ref_count(uint32_t pfn)
@@ -68,14 +214,177 @@ void Zone::increment_ref_count(uint32_t pfn)
     if(pfn < zone_start_pfn || pfn >= zone_end_pfn) {
         return;
     }
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
     buddy_allocator.increment_ref_count(pfn * 4096);
+    lock.release_irqrestore(flags);
 }
 
+// 关闭本地中断保证不会在访问过程中被调度到其他CPU，锁防止其他CPU同时清空缓存
+Zone::PerCpuPages& Zone::lockLocalPcp(uint32_t& irq_flags)
+{
+    irq_flags = local_irq_save();
+    PerCpuPages& p = pcp[arch::get_cpu_id() % MAX_CPUS];
+    p.lock.acquire();
+    return p;
+}
+
+uint32_t Zone::pcpAlloc(uint32_t gfp_mask, uint32_t order)
+{
+    uint32_t irq_flags;
+    PerCpuPages& p = lockLocalPcp(irq_flags);
+
+    if(p.count[order] == 0) {
+        p.alloc_miss++;
+        if(pcpRefill(p, order) == 0) {
+            p.lock.release();
+            local_irq_restore(irq_flags);
+            return 0;
+        }
+    } else {
+        p.alloc_hit++;
+    }
+
+    // 普通分配取最热的页（链表头），冷页分配取链表尾
+    kernel::list_head* entry =
+        (gfp_mask & __GFP_COLD) ? p.lists[order].prev : p.lists[order].next;
+    kernel::list_del_init(entry);
+    p.count[order]--;
+    subFreePages(1u << order);
+    p.lock.release();
+    local_irq_restore(irq_flags);
+
+    // 块已经只属于调用者，只写它的首页描述符，不需要zone锁：
+    // 规整扫描和伙伴合并只认PG_BUDDY和PG_MOVABLE，这里两者都不会设置
+    uint32_t phys = (uint32_t)Kernel::instance().kernel_mm().virt2Phys(entry);
+    buddy_allocator.prep_new_pages(phys, order);
+    return phys / PAGE_SIZE;
+}
+
+bool Zone::pcpFree(uint32_t pfn, uint32_t order)
+{
+    // 与pcpAlloc相同，释放者独占这个块，清除首页描述符不需要zone锁
+    uint32_t phys = pfn * PAGE_SIZE;
+    buddy_allocator.clear_page_state(phys, order);
+
+    uint32_t irq_flags;
+    PerCpuPages& p = lockLocalPcp(irq_flags);
+    auto entry = (kernel::list_head*)Kernel::instance().kernel_mm().phys2Virt(phys);
+    kernel::list_add(entry, &p.lists[order]);
+    p.count[order]++;
+    p.free_fast++;
+    addFreePages(1u << order);
+
+    // 超过上限时把最冷的一批页归还给伙伴系统
+    if(p.count[order] > PCP_HIGH[order]) {
+        pcpDrain(p, order, PCP_BATCH[order]);
+    }
+    p.lock.release();
+    local_irq_restore(irq_flags);
+    return true;
+}
+
+// 从伙伴系统批量取块放入缓存尾部（冷端），返回取到的块数；调用者持有p.lock
+uint32_t Zone::pcpRefill(PerCpuPages& p, uint32_t order)
+{
+    uint32_t got = 0;
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    for(; got < PCP_BATCH[order]; got++) {
+        uint32_t phys = buddy_allocator.take_free_block(order);
+        if(phys == 0) {
+            break;
+        }
+        auto entry = (kernel::list_head*)Kernel::instance().kernel_mm().phys2Virt(phys);
+        kernel::list_add_tail(entry, &p.lists[order]);
+    }
+    lock.release_irqrestore(flags);
+
+    p.count[order] += got;
+    if(got) {
+        p.refills++;
+    }
+    return got;
+}
 
+// 从缓存尾部（冷端）归还nr个块给伙伴系统；调用者持有p.lock
+void Zone::pcpDrain(PerCpuPages& p, uint32_t order, uint32_t nr)
+{
+    uint32_t flags;
+    lock.acquire_irqsave(flags);
+    while(nr-- && p.count[order]) {
+        kernel::list_head* entry = p.lists[order].prev;
+        kernel::list_del_init(entry);
+        p.count[order]--;
+        uint32_t phys = (uint32_t)Kernel::instance().kernel_mm().virt2Phys(entry);
+        buddy_allocator.return_free_block(phys, order);
+    }
+    lock.release_irqrestore(flags);
+    p.drains++;
+}
+
+void Zone::drainPcp()
+{
+    uint32_t irq_flags;
+    PerCpuPages& p = lockLocalPcp(irq_flags);
+    for(uint32_t order = 0; order <= PCP_MAX_ORDER; order++) {
+        if(p.count[order]) {
+            pcpDrain(p, order, p.count[order]);
+        }
+    }
+    p.lock.release();
+    local_irq_restore(irq_flags);
+}
+
+uint32_t Zone::drainAllPcp()
+{
+    uint32_t drained = 0;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        PerCpuPages& p = pcp[cpu];
+        uint32_t flags;
+        p.lock.acquire_irqsave(flags);
+        for(uint32_t order = 0; order <= PCP_MAX_ORDER; order++) {
+            if(p.count[order]) {
+                drained += p.count[order] << order;
+                pcpDrain(p, order, p.count[order]);
+            }
+        }
+        p.lock.release_irqrestore(flags);
+    }
+    return drained;
+}
+
+void Zone::printPcpStats()
+{
+    log_info("Zone pfn 0x%x-0x%x: free pages %d\n", zone_start_pfn, zone_end_pfn, nr_free_pages);
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        PerCpuPages& p = pcp[cpu];
+        uint32_t total = p.alloc_hit + p.alloc_miss;
+        if(total == 0 && p.free_fast == 0) {
+            continue;
+        }
+        log_info("  cpu%d: hit %d miss %d (hit rate %d%%), free %d, refill %d, drain %d, "
+                 "cached %d/%d/%d/%d\n",
+            cpu, p.alloc_hit, p.alloc_miss, total ? p.alloc_hit * 100 / total : 0, p.free_fast,
+            p.refills, p.drains, p.count[0], p.count[1], p.count[2], p.count[3]);
+    }
+    log_info("  watermark min/low/high %d/%d/%d, direct reclaim %d (%d pages), kswapd wakeups %d\n",
+        watermark[0], watermark[1], watermark[2], direct_reclaims, direct_reclaimed, kswapd_wakeups);
+}
+
+
+
+page* Zone::pageOf(uint32_t pfn)
+{
+    if(pfn < zone_start_pfn || pfn >= zone_end_pfn) {
+        return nullptr;
+    }
+    return buddy_allocator.page_of(pfn * 4096);
+}
 
 uint32_t Zone::getFreePages() const
 {
-    return nr_free_pages;
+    return __atomic_load_n(&nr_free_pages, __ATOMIC_RELAXED);
 }
 
 void Zone::setWatermark(WatermarkLevel level, uint32_t value)
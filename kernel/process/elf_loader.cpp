@@ -8,6 +8,42 @@
 using namespace kernel;
 extern "C" void set_user_entry(uint32_t entry, uint32_t stack);
 
+uint32_t ElfLoader::image_end(const void* elf_data, uint32_t size)
+{
+    if(!elf_data || size < sizeof(ElfHeader)) {
+        return 0;
+    }
+    const ElfHeader* header = static_cast<const ElfHeader*>(elf_data);
+    if(header->phoff > size ||
+        header->phnum > (size - header->phoff) / sizeof(ProgramHeader)) {
+        log_err("ELF program headers exceed the file\n");
+        return 0;
+    }
+    const ProgramHeader* ph = static_cast<const ProgramHeader*>(
+        static_cast<const void*>(static_cast<const char*>(elf_data) + header->phoff));
+
+    // load_elf会复制LOAD、DYNAMIC和EH_FRAME段
+    uint32_t end = USER_IMAGE_START;
+    for(uint16_t i = 0; i < header->phnum; i++) {
+        if(ph[i].type != PT_LOAD && ph[i].type != PT_DYNAMIC && ph[i].type != PT_GNU_EH_FRAME) {
+            continue;
+        }
+        uint32_t mem = ph[i].type == PT_LOAD && ph[i].memsz > ph[i].filesz ? ph[i].memsz
+                                                                           : ph[i].filesz;
+        if(ph[i].offset > size || ph[i].filesz > size - ph[i].offset ||
+            ph[i].vaddr < USER_IMAGE_START || ph[i].vaddr > USER_IMAGE_END ||
+            mem > USER_IMAGE_END - ph[i].vaddr) {
+            log_err("ELF segment %d at 0x%x (%d bytes) is outside the program image\n", i,
+                ph[i].vaddr, mem);
+            return 0;
+        }
+        if(ph[i].vaddr + mem > end) {
+            end = ph[i].vaddr + mem;
+        }
+    }
+    return (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
 // 加载ELF文件到指定的基地址
 bool ElfLoader::load_elf(const void* elf_data, uint32_t size, uint32_t base_address)
 {
@@ -5,13 +5,18 @@
 #include <lib/console.h>
 
 #include "arch/x86/gdt.h"
+#include "arch/x86/tlb.h"
 #include "kernel/process.h"
 #include <cstdint>
 #include <kernel/kernel.h>
 #include <kernel/scheduler.h>
+#include <kernel/syscall.h>
 #include <lib/debug.h>
 #include <lib/string.h>
 
+DEFINE_SLAB_CACHE_OPERATORS(Task, "task")
+DEFINE_SLAB_CACHE_OPERATORS(Context, "context")
+
 uint32_t PidManager::pid_bitmap[(PidManager::MAX_PID + 31) / 32];
 
 int32_t PidManager::alloc()
@@ -32,9 +37,8 @@ int32_t PidManager::alloc()
 
 void PidManager::free(uint32_t pid)
 {
-    if(pid == 0 || pid > MAX_PID)
+    if(pid >= MAX_PID)
         return;
-    pid--;
     uint32_t i = pid / 32;
     uint32_t j = pid % 32;
     pid_bitmap[i] &= ~(1 << j);
@@ -168,11 +172,11 @@ void Context::cloneFiles(Context* source)
 }
 
 
-void Context::cloneMemorySpace(Context* source)
+int Context::cloneMemorySpace(Context* source)
 {
     if(!source) {
         log_err("ProcessManager: Invalid PCB pointer\n");
-        return;
+        return -1;
     }
     log_debug("Copying memory space\n");
 
@@ -181,19 +185,24 @@ void Context::cloneMemorySpace(Context* source)
 
     // 使用COW方式复制内存空间
     auto parent_pgd = source->user_mm.getPageDirectory();
-    auto paddr = kernel_mm.alloc_pages(0, 0); // gfp_mask = 0, order = 0 (1 page)
+    auto paddr = kernel_mm.alloc_pages(__GFP_ZERO, 0); // order = 0 (1 page)
+    if(!paddr) {
+        log_err("ProcessManager: failed to allocate page directory\n");
+        return -1;
+    }
     log_debug("alloc page at 0x%x\n", paddr);
     auto child_pgd = kernel_mm.phys2Virt(paddr);
     log_debug("child_pgd: 0x%x\n", child_pgd);
     PagingValidate((PageDirectory*)parent_pgd);
-    log_info("Copying memory space\n");
-    kernel_mm.paging().copyMemorySpaceCOW((PageDirectory*)parent_pgd, (PageDirectory*)child_pgd);
+    log_debug("Copying memory space\n");
+    int ret = kernel_mm.paging().copyMemorySpaceCOW((PageDirectory*)parent_pgd,
+        (PageDirectory*)child_pgd, &source->user_mm.page_table_lock());
     log_debug("Copying page at 0x%x\n", paddr);
     user_mm.init(
         paddr, child_pgd,
         []() {
             auto page = Kernel::instance().kernel_mm().alloc_pages(
-                0, 0); // gfp_mask = 0, order = 0 (1 page)
+                __GFP_ZERO, 0); // order = 0 (1 page)，页表和堆页面都需要清零
             log_debug("ProcessManager: Allocated Page at %x\n", page);
             return page;
         },
@@ -203,6 +212,20 @@ void Context::cloneMemorySpace(Context* source)
         [](uint32_t physAddr) {
             return (void*)Kernel::instance().kernel_mm().phys2Virt(physAddr);
         });
+    if(ret < 0) {
+        // 复制到一半失败，已经共享的页面和页表要还回去
+        releaseMemorySpace();
+    }
+    return ret;
+}
+
+void Context::releaseMemorySpace()
+{
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    auto pgd = (PageDirectory*)user_mm.getPageDirectory();
+    user_mm.release_user_pages();
+    kernel_mm.paging().freeMemorySpace(pgd);
+    kernel_mm.free_pages(user_mm.getPageDirectoryPhysical(), 0);
 }
 
 
@@ -210,6 +233,14 @@ void Task::print()
 {
     log_info("Process: %s (PID: %d), pcb_addr:0x%x\n", name, task_id, this);
     log_info("  State: %d, Priority: %d, Time: %d/%d\n", state, priority, total_time, time_slice);
+    if(context) {
+        const FaultStats& faults = context->user_mm.fault_stats();
+        log_info("  Resident: %d pages, faults: major %d, minor %d (demand %d, zero %d, cow %d, "
+                 "file %d), bad %d\n",
+            context->user_mm.resident_pages(), faults.major_faults, faults.minor_faults,
+            faults.demand_faults, faults.zero_faults, faults.cow_faults, faults.file_faults,
+            faults.bad_faults);
+    }
 
     regs.print();
     stacks.print();
@@ -261,73 +292,307 @@ int Stacks::allocSpace(UserMemory& mm)
 }
 
 // fork系统调用实现
-// 修改fork中的内存复制逻辑
+// 子进程与父进程共享所有用户页面：可写页面在双方的页表中都改为只读并打上COW标志，
+// 页面引用计数加一，第一次写入时由缺页处理复制（只剩一个引用者时直接恢复写权限）。
+// fork的开销只与页表的数量成正比，不需要复制任何数据页
 int ProcessManager::fork()
 {
-    log_info("fork enter!\n");
-    // Kernel& kernel = Kernel::instance();
-    // auto& kernel_mm = kernel.kernel_mm();
-    //
-    // Task* parent_task = ProcessManager::get_current_task();
-    // debug_info("before fork parent pcb:\n");
-    // parent_task->print();
-    //
-    // // 创建子进程
-    // debug_info("Creating child process\n");
-    // auto child = create_context(parent_task->name);
-    // if(child->def_task.task_id == 0) {
-    //     debug_err("Create process failed\n");
-    //     return -1;
-    // }
-    //
-    // debug_info("Copying parent process memory space\n");
-    // cloneMemorySpace(child, parent_task->context);
-    // child->user_mm.clone(parent_task->context->user_mm);
-    //
-    // debug_info("Copying parent process registers\n");
-    // auto& child_task = child->def_task;
-    // memcpy(&child_task.regs, &parent_task->regs, sizeof(Registers));
-    // child_task.regs.eax = 0; // 子进程返回0
-    //
-    // // 拷贝堆栈数据
-    // child_task.stacks.user_stack = parent_task->stacks.user_stack;
-    // child_task.stacks.user_stack_size = parent_task->stacks.user_stack_size;
-    // // 为栈分配新的物理页面
-    // uint8_t* start = (uint8_t*)child_task.stacks.user_stack;
-    // uint8_t* end = (uint8_t*)child_task.stacks.user_stack + child_task.stacks.user_stack_size;
-    // for(uint8_t* p = start; p < end; p += PAGE_SIZE) {
-    //     copyCOWPage((uint32_t)p, parent_task->context->user_mm.getPageDirectory(),
-    //         child_task.context->user_mm);
-    // }
-    //
-    // // 复制文件描述符表
-    // memcpy(&child_task.context->fd_table, &parent_task->context->fd_table,
-    //     sizeof(child_task.context->fd_table));
-    //
-    // // 复制进程状态和属性
-    // child_task.state = PROCESS_READY;
-    // child_task.priority = parent_task->priority;
-    // child_task.time_slice = parent_task->time_slice;
-    // child_task.total_time = 0; // 新进程从0开始计时
-    // child_task.exit_status = 0;
-    //
-    // // 设置子进程状态为就绪
-    // child_task.state = PROCESS_READY;
-    // debug_info("fork child_task.pcb:\n");
-    // child_task.print();
-    //
-    // appendPCB((Kontext*)child);
-    //
-    // debug_info("fork return, parent: %d, child:%d\n", parent_task->task_id, child_task.task_id);
-    // return child_task.task_id;
-    return 0;
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    Task* parent = get_current_task();
+    if(!parent || !parent->context) {
+        return -1;
+    }
+
+    Context* context = create_context(parent->name);
+    if(context->cloneMemorySpace(parent->context) < 0) {
+        log_err("fork: failed to copy memory space\n");
+        pid_manager.free(context->context_id);
+        delete context;
+        return -1;
+    }
+    context->user_mm.clone(parent->context->user_mm);
+    context->cloneFiles(parent->context);
+    context->next_fd = parent->context->next_fd;
+    memcpy(context->cwd, parent->context->cwd, sizeof(context->cwd));
+
+    auto child = new Task();
+    child->task_id = tid_manager.alloc();
+    child->context = context;
+    memcpy(child->name, parent->name, sizeof(child->name));
+    child->priority = parent->priority;
+    child->time_slice = DEFAULT_TIME_SLICE;
+    child->total_time = 0;
+    child->exit_status = 0;
+    child->affinity = parent->affinity;
+
+    // 进入系统调用时save_context保存了父进程的用户态寄存器，子进程从int 0x80之后返回0
+    memcpy(&child->regs, &parent->regs, sizeof(Registers));
+    child->regs.eax = 0;
+    child->regs.cr3 = context->user_mm.getPageDirectoryPhysical();
+    child->stacks.user_stack = parent->stacks.user_stack;
+    child->stacks.user_stack_size = parent->stacks.user_stack_size;
+    child->alloc_stack(kernel_mm);
+
+    child->state = PROCESS_READY;
+    Kernel::instance().scheduler().enqueue_task(child);
+    log_debug("fork: parent %d, child %d, shared %d pages\n", parent->task_id, child->task_id,
+        context->user_mm.resident_pages());
+    return child->task_id;
+}
+
+// spawn的子进程以内核线程开始执行，在自己的地址空间中加载可执行文件后进入用户态
+static void spawn_task_entry()
+{
+    auto task = ProcessManager::get_current_task();
+    arch::load_cr3(task->regs.cr3);
+
+    // 路径在内核栈上保留一份，switch_to_user_mode之后内核栈被丢弃
+    char path[SPAWN_PATH_MAX];
+    strcpy(path, (const char*)task->kernel_arg);
+    Kernel::instance().kernel_mm().kfree(task->kernel_arg);
+    task->kernel_arg = nullptr;
+
+    sys_execve((uint32_t)path, 0, 0, task);
+
+    // 只有加载失败才会返回
+    log_err("spawn: failed to execute %s\n", path);
+    task->state = EXITED;
+    task->exit_status = -1;
+    while(true) {
+        asm volatile("hlt");
+    }
+}
+
+// 从子进程的描述符表中移除fd。继承来的描述符对象与父进程共享且没有引用计数
+// （MemFS的close会释放对象），只移除表项；OPEN打开的对象属于子进程，
+// 没有其他表项再引用它时关闭
+static void drop_fd(Context* context, bool* owned, int fd)
+{
+    auto file = context->fd_table[fd];
+    bool was_owned = owned[fd];
+    context->fd_table[fd] = nullptr;
+    owned[fd] = false;
+    if(!file || !was_owned) {
+        return;
+    }
+    for(int i = 0; i < MAX_PROCESS_FDS; i++) {
+        if(context->fd_table[i] == file) {
+            return;
+        }
+    }
+    file->close();
+}
+
+// 依次把文件操作应用到子进程的文件描述符表，actions已经复制到内核，
+// 其中的path仍指向父进程的用户空间；失败时关闭已经由OPEN打开的描述符
+static int apply_file_actions(
+    Context* context, UserMemory& parent_mm, const SpawnFileAction* actions, uint32_t nactions)
+{
+    bool owned[MAX_PROCESS_FDS] = {};
+    char path[SPAWN_PATH_MAX];
+    int ret = 0;
+    for(uint32_t i = 0; i < nactions && ret == 0; i++) {
+        const SpawnFileAction& action = actions[i];
+        if(action.fd < 0 || action.fd >= MAX_PROCESS_FDS) {
+            ret = -1;
+            break;
+        }
+        int target = action.fd;
+        switch(action.type) {
+        case SPAWN_FA_OPEN: {
+            if(parent_mm.strncpy_from_user(path, (uint32_t)action.path, sizeof(path)) <= 0) {
+                ret = -1;
+                break;
+            }
+            auto file = kernel::VFSManager::instance().open(path);
+            if(!file) {
+                log_debug("spawn: failed to open %s\n", path);
+                ret = -1;
+                break;
+            }
+            drop_fd(context, owned, target);
+            context->fd_table[target] = file;
+            owned[target] = true;
+            break;
+        }
+        case SPAWN_FA_CLOSE:
+            drop_fd(context, owned, target);
+            break;
+        case SPAWN_FA_DUP2:
+            if(action.newfd < 0 || action.newfd >= MAX_PROCESS_FDS ||
+                !context->fd_table[action.fd]) {
+                ret = -1;
+                break;
+            }
+            target = action.newfd;
+            if(target != action.fd) {
+                drop_fd(context, owned, target);
+                context->fd_table[target] = context->fd_table[action.fd];
+                owned[target] = owned[action.fd];
+            }
+            break;
+        default:
+            ret = -1;
+            break;
+        }
+        if(ret == 0 && target >= context->next_fd) {
+            context->next_fd = target + 1;
+        }
+    }
+    if(ret < 0) {
+        for(int fd = 0; fd < MAX_PROCESS_FDS; fd++) {
+            drop_fd(context, owned, fd);
+        }
+    }
+    return ret;
+}
+
+// spawn系统调用实现
+// fork + execve要复制父进程的页表、把所有页面改为只读，随后又在execve中全部丢弃；
+// spawn直接为子进程建立只含内核映射的地址空间并加载可执行文件，不接触父进程的页表
+int ProcessManager::spawn(
+    const char* user_path, const SpawnFileAction* user_actions, uint32_t nactions)
+{
+    auto& kernel_mm = Kernel::instance().kernel_mm();
+    Task* parent = get_current_task();
+    if(!user_path || !parent || !parent->context || nactions > SPAWN_MAX_FILE_ACTIONS ||
+        (nactions && !user_actions)) {
+        return -1;
+    }
+    // 参数都在父进程的用户空间中，检查地址后复制到内核
+    auto& parent_mm = parent->context->user_mm;
+    char path[SPAWN_PATH_MAX];
+    int path_len = parent_mm.strncpy_from_user(path, (uint32_t)user_path, sizeof(path));
+    if(path_len <= 0) {
+        return -1;
+    }
+    uint32_t len = path_len;
+    SpawnFileAction actions[SPAWN_MAX_FILE_ACTIONS];
+    if(!parent_mm.copy_from_user(
+           actions, (uint32_t)user_actions, nactions * sizeof(SpawnFileAction))) {
+        return -1;
+    }
+    // 在父进程中检查文件是否存在，错误可以直接返回给调用者
+    kernel::FileAttribute attr;
+    if(kernel::VFSManager::instance().stat(path, &attr) < 0) {
+        log_debug("spawn: %s not found\n", path);
+        return -1;
+    }
+
+    // 子进程的名称取路径的最后一段
+    const char* name = path;
+    for(const char* p = path; *p; p++) {
+        if(*p == '/' && p[1]) {
+            name = p + 1;
+        }
+    }
+
+    Context* context = create_context(name);
+    // 内核上下文没有用户页面，复制它只需要复制内核部分的页目录项
+    if(context->cloneMemorySpace(kernel_context) < 0) {
+        log_err("spawn: failed to create address space\n");
+        pid_manager.free(context->context_id);
+        delete context;
+        return -1;
+    }
+    context->cloneFiles(parent->context);
+    context->next_fd = parent->context->next_fd;
+    memcpy(context->cwd, parent->context->cwd, sizeof(context->cwd));
+    if(apply_file_actions(context, parent_mm, actions, nactions) < 0) {
+        log_debug("spawn: invalid file actions\n");
+        context->releaseMemorySpace();
+        pid_manager.free(context->context_id);
+        delete context;
+        return -1;
+    }
+
+    // 子进程从自己的内核栈开始执行，路径放在堆上交给它
+    char* kpath = (char*)kernel_mm.kmalloc(len + 1);
+    if(!kpath) {
+        context->releaseMemorySpace();
+        pid_manager.free(context->context_id);
+        delete context;
+        return -1;
+    }
+    memcpy(kpath, path, len + 1);
+
+    Task* task = kernel_task(context, name, (uint32_t)spawn_task_entry, 0, nullptr);
+    task->kernel_arg = kpath;
+    task->affinity = parent->affinity;
+    if(task->allocUserStack() < 0) {
+        log_err("spawn: failed to allocate user stack\n");
+        kernel_mm.kfree(kpath);
+        kernel_mm.kfree(task->stacks.kernel_stack);
+        tid_manager.free(task->task_id);
+        delete task;
+        context->releaseMemorySpace();
+        pid_manager.free(context->context_id);
+        delete context;
+        return -1;
+    }
+    task->regs.cr3 = context->user_mm.getPageDirectoryPhysical();
+    Kernel::instance().scheduler().enqueue_task(task);
+    log_debug("spawn: parent %d, child %d, path %s\n", parent->task_id, task->task_id, path);
+    return task->task_id;
+}
+
+namespace {
+// 保护任务在PROCESS_WAITING与运行队列之间的转换
+SpinLock wait_lock;
+
+// 调度时当前任务处于PROCESS_WAITING则移出运行队列，返回true表示不要重新入队
+bool dequeue_waiting(Task* task)
+{
+    uint32_t flags;
+    wait_lock.acquire_irqsave(flags);
+    bool waiting = task->state == PROCESS_WAITING;
+    if(waiting) {
+        task->off_runqueue = true;
+    }
+    wait_lock.release_irqrestore(flags);
+    return waiting;
+}
+} // namespace
+
+void ProcessManager::sleep_until(volatile uint32_t* flag)
+{
+    Task* task = get_current_task();
+    uint32_t flags;
+    wait_lock.acquire_irqsave(flags);
+    // 在持锁状态下检查flag，设置flag后调用的wake_task一定能看到PROCESS_WAITING
+    if(*flag) {
+        wait_lock.release_irqrestore(flags);
+        return;
+    }
+    task->state = PROCESS_WAITING;
+    wait_lock.release_irqrestore(flags);
+    // 下一次时钟中断把任务切换出去，被唤醒并重新调度后从这里继续
+    while(task->state == PROCESS_WAITING) {
+        asm volatile("hlt");
+    }
+}
+
+void ProcessManager::wake_task(Task* task)
+{
+    uint32_t flags;
+    wait_lock.acquire_irqsave(flags);
+    if(task->state == PROCESS_WAITING) {
+        task->state = PROCESS_READY;
+        if(task->off_runqueue) {
+            task->off_runqueue = false;
+            Kernel::instance().scheduler().enqueue_task(task);
+        }
+    }
+    wait_lock.release_irqrestore(flags);
 }
 
 // 切换到下一个进程
 bool ProcessManager::schedule()
 {
     auto current = get_current_task();
-    if(current && --current->time_slice > 0) {
+    // 等待中的任务不用等时间片用完，直接让出CPU
+    bool waiting = current && current->state == PROCESS_WAITING;
+    if(current && !waiting && --current->time_slice > 0) {
         //debug_debug("time_slice %d\n", current->time_slice);
         return false;
     }
@@ -339,7 +604,9 @@ bool ProcessManager::schedule()
     // log_debug("got next task: %d(0x%x, pre_cpu:%d), cpu: %d\n", next->task_id, next, next->cpu, cpu);
     // debug_debug("schedule: current: %d, next:%d(0x%x)\n", current->task_id, next->task_id, next);
     current->time_slice = DEFAULT_TIME_SLICE;
-    Kernel::instance().scheduler().enqueue_task(current);
+    if(!waiting || !dequeue_waiting(current)) {
+        Kernel::instance().scheduler().enqueue_task(current);
+    }
     Kernel::instance().scheduler().set_current_task(next);
     debug.is_task_switch = true;
     debug.cur_task = next;
@@ -374,6 +641,11 @@ void ProcessManager::save_context(uint32_t int_num, uint32_t* esp)
     regs.es = esp[9];
     regs.fs = esp[10];
     regs.gs = esp[11];
+    // 从用户态进入中断时，CPU还压入了用户态的esp和ss
+    if((regs.cs & 3) == 3) {
+        regs.esp = esp[15];
+        regs.ss = esp[16];
+    }
     if((regs.cs != 0x08 && regs.cs != 0x1b) || regs.ds == 0) {
         log_debug("cs 0x%x, ds 0x%x, int 0x%x\n", regs.cs, regs.ds, int_num);
         current->print();
@@ -394,6 +666,8 @@ void ProcessManager::restore_context(uint32_t int_num, uint32_t* esp)
 
     Task* next = get_current_task();
     auto& regs = next->regs;
+    // 只有中断帧本身来自用户态时才有esp和ss两个槽位
+    bool user_frame = (esp[13] & 3) == 3;
 
     // 恢复通用寄存器
     esp[7] = regs.eax;
@@ -409,6 +683,10 @@ void ProcessManager::restore_context(uint32_t int_num, uint32_t* esp)
     esp[14] = regs.eflags;
     esp[13] = regs.cs;
     esp[12] = regs.eip;
+    if(user_frame && (regs.cs & 3) == 3) {
+        esp[15] = regs.esp;
+        esp[16] = regs.ss;
+    }
 
     if(regs.cs != 0x08 && regs.cs != 0x1b) {
         log_debug("cs error 0x%x, int_num 0x%x\n", regs.cs, int_num);
@@ -430,9 +708,15 @@ void ProcessManager::restore_context(uint32_t int_num, uint32_t* esp)
     esp[9] = regs.es;
     esp[10] = regs.fs;
     esp[11] = regs.gs;
+    // 同一个任务被中断后返回时TSS和CR3都不变，跳过写入；
+    // CR3不变时不写，TLB中的用户映射得以保留
     auto cpu = arch::apic_get_id();
-    GDT::updateTSS(cpu, next->stacks.esp0, KERNEL_DS);
-    GDT::updateTSSCR3(cpu, next->regs.cr3);
+    if(GDT::tss[cpu].esp0 != next->stacks.esp0 || GDT::tss[cpu].ss0 != KERNEL_DS) {
+        GDT::updateTSS(cpu, next->stacks.esp0, KERNEL_DS);
+    }
+    if(GDT::tss[cpu].cr3 != next->regs.cr3) {
+        GDT::updateTSSCR3(cpu, next->regs.cr3);
+    }
 
     if(debug.is_task_switch && debug.cur_task->cpu != cpu) {
         log_trace("switching task: prev: %d, next:%d\n", debug.prev_task->task_id,
@@ -442,8 +726,7 @@ void ProcessManager::restore_context(uint32_t int_num, uint32_t* esp)
         // next->print();
     }
     next->cpu = cpu;
-    // update cr3
-    asm volatile("mov %%eax, %%cr3\n\t" ::"a"(next->regs.cr3));
+    arch::load_cr3(next->regs.cr3);
 }
 Task* ProcessManager::get_current_task()
 {
@@ -469,6 +752,13 @@ void ProcessManager::switch_to_user_mode(uint32_t entry_point, Task* task)
     __printPDPTE((void*)entry_point, (PageDirectory*)context->user_mm.getPageDirectory());
     log_debug("user stack: 0x%x\n", user_stack);
     __printPDPTE((void*)user_stack, (PageDirectory*)context->user_mm.getPageDirectory());
+    // 下面在内核态直接把iret帧压到用户栈上，此时缺页会变成双重错误，
+    // 栈顶的页必须先映射好
+    if(!context->user_mm.populate(user_stack - 32, 32)) {
+        log_err("switch_to_user_mode: failed to map user stack\n");
+        return;
+    }
+
     auto cpu = arch::apic_get_id();
     GDT::updateTSS(cpu, task->stacks.esp0, KERNEL_DS);
     GDT::updateTSSCR3(cpu, task->regs.cr3);
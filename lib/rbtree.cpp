@@ -0,0 +1,262 @@
+#include "lib/rbtree.h"
+
+namespace kernel {
+
+namespace {
+
+inline bool is_red(const rb_node* node) { return node && node->red; }
+
+inline void augment(rb_root* root, rb_node* node)
+{
+    if(root->augment && node) {
+        root->augment(node);
+    }
+}
+
+// 把parent中指向old_child的指针改为new_child
+inline void change_child(rb_node* old_child, rb_node* new_child, rb_node* parent, rb_root* root)
+{
+    if(!parent)
+        root->node = new_child;
+    else if(parent->left == old_child)
+        parent->left = new_child;
+    else
+        parent->right = new_child;
+}
+
+// 旋转不改变子树包含的节点集合，只需要重新计算被旋转的两个节点（先下后上）
+void left_rotate(rb_node* x, rb_root* root)
+{
+    rb_node* y = x->right;
+    x->right = y->left;
+    if(y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    change_child(x, y, x->parent, root);
+    y->left = x;
+    x->parent = y;
+    augment(root, x);
+    augment(root, y);
+}
+
+void right_rotate(rb_node* y, rb_root* root)
+{
+    rb_node* x = y->left;
+    y->left = x->right;
+    if(x->right)
+        x->right->parent = y;
+    x->parent = y->parent;
+    change_child(y, x, y->parent, root);
+    x->right = y;
+    y->parent = x;
+    augment(root, y);
+    augment(root, x);
+}
+
+rb_node* minimum(rb_node* node)
+{
+    while(node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node* maximum(rb_node* node)
+{
+    while(node->right)
+        node = node->right;
+    return node;
+}
+
+// 删除修复，x可能为空，因此单独传入其父节点
+void erase_fixup(rb_node* x, rb_node* parent, rb_root* root)
+{
+    while(x != root->node && !is_red(x)) {
+        if(x == parent->left) {
+            rb_node* w = parent->right;
+            if(w->red) {
+                w->red = false;
+                parent->red = true;
+                left_rotate(parent, root);
+                w = parent->right;
+            }
+            if(!is_red(w->left) && !is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if(!is_red(w->right)) {
+                    w->left->red = false;
+                    w->red = true;
+                    right_rotate(w, root);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if(w->right)
+                    w->right->red = false;
+                left_rotate(parent, root);
+                x = root->node;
+            }
+        } else {
+            rb_node* w = parent->left;
+            if(w->red) {
+                w->red = false;
+                parent->red = true;
+                right_rotate(parent, root);
+                w = parent->left;
+            }
+            if(!is_red(w->right) && !is_red(w->left)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if(!is_red(w->left)) {
+                    w->right->red = false;
+                    w->red = true;
+                    left_rotate(w, root);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if(w->left)
+                    w->left->red = false;
+                right_rotate(parent, root);
+                x = root->node;
+            }
+        }
+    }
+    if(x)
+        x->red = false;
+}
+
+} // namespace
+
+void rb_augment_propagate(rb_node* node, rb_root* root)
+{
+    if(!root->augment)
+        return;
+    for(; node; node = node->parent) {
+        root->augment(node);
+    }
+}
+
+void rb_insert_color(rb_node* z, rb_root* root)
+{
+    // 新节点改变了到根路径上所有祖先的子树
+    rb_augment_propagate(z, root);
+
+    while(is_red(z->parent)) {
+        rb_node* gp = z->parent->parent;
+        if(z->parent == gp->left) {
+            rb_node* y = gp->right;
+            if(is_red(y)) {
+                z->parent->red = false;
+                y->red = false;
+                gp->red = true;
+                z = gp;
+            } else {
+                if(z == z->parent->right) {
+                    z = z->parent;
+                    left_rotate(z, root);
+                }
+                z->parent->red = false;
+                z->parent->parent->red = true;
+                right_rotate(z->parent->parent, root);
+            }
+        } else {
+            rb_node* y = gp->left;
+            if(is_red(y)) {
+                z->parent->red = false;
+                y->red = false;
+                gp->red = true;
+                z = gp;
+            } else {
+                if(z == z->parent->left) {
+                    z = z->parent;
+                    right_rotate(z, root);
+                }
+                z->parent->red = false;
+                z->parent->parent->red = true;
+                left_rotate(z->parent->parent, root);
+            }
+        }
+    }
+    root->node->red = false;
+}
+
+void rb_erase(rb_node* z, rb_root* root)
+{
+    rb_node* x;
+    rb_node* x_parent;
+    bool removed_red = z->red;
+
+    if(!z->left || !z->right) {
+        x = z->left ? z->left : z->right;
+        x_parent = z->parent;
+        change_child(z, x, z->parent, root);
+        if(x)
+            x->parent = z->parent;
+    } else {
+        // 用后继节点y顶替z的位置
+        rb_node* y = minimum(z->right);
+        removed_red = y->red;
+        x = y->right;
+        if(y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            x_parent->left = x;
+            if(x)
+                x->parent = x_parent;
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        change_child(z, y, z->parent, root);
+        y->parent = z->parent;
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    // 从结构发生变化的最低位置向上重新计算，顶替z的节点也在这条路径上
+    rb_augment_propagate(x_parent, root);
+
+    if(!removed_red)
+        erase_fixup(x, x_parent, root);
+}
+
+rb_node* rb_first(const rb_root* root)
+{
+    return root->node ? minimum(root->node) : nullptr;
+}
+
+rb_node* rb_last(const rb_root* root)
+{
+    return root->node ? maximum(root->node) : nullptr;
+}
+
+rb_node* rb_next(const rb_node* node)
+{
+    if(node->right)
+        return minimum(node->right);
+    rb_node* p = node->parent;
+    while(p && node == p->right) {
+        node = p;
+        p = p->parent;
+    }
+    return p;
+}
+
+rb_node* rb_prev(const rb_node* node)
+{
+    if(node->left)
+        return maximum(node->left);
+    rb_node* p = node->parent;
+    while(p && node == p->left) {
+        node = p;
+        p = p->parent;
+    }
+    return p;
+}
+
+} // namespace kernel
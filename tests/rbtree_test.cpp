@@ -0,0 +1,166 @@
+#include "lib/test_framework.h"
+#include <lib/rbtree.h>
+
+using kernel::rb_node;
+using kernel::rb_root;
+
+// 测试节点：按key排序，max_key为子树中最大的key（增强信息）
+struct TestNode {
+    int key;
+    int max_key;
+    rb_node rb;
+};
+
+static void update_max(rb_node* node)
+{
+    TestNode* n = rb_entry(node, TestNode, rb);
+    n->max_key = n->key;
+    if(node->left && rb_entry(node->left, TestNode, rb)->max_key > n->max_key)
+        n->max_key = rb_entry(node->left, TestNode, rb)->max_key;
+    if(node->right && rb_entry(node->right, TestNode, rb)->max_key > n->max_key)
+        n->max_key = rb_entry(node->right, TestNode, rb)->max_key;
+}
+
+static void insert(rb_root* root, TestNode* node)
+{
+    rb_node* parent = nullptr;
+    rb_node** link = &root->node;
+    while(*link) {
+        parent = *link;
+        link = node->key < rb_entry(parent, TestNode, rb)->key ? &parent->left : &parent->right;
+    }
+    node->max_key = node->key;
+    kernel::rb_link_node(&node->rb, parent, link);
+    kernel::rb_insert_color(&node->rb, root);
+}
+
+// 检查红黑性质、父指针和增强信息，返回黑高，出错返回-1
+static int check(const rb_node* node, const rb_node* parent)
+{
+    if(!node)
+        return 1;
+    if(node->parent != parent)
+        return -1;
+    if(node->red && ((node->left && node->left->red) || (node->right && node->right->red)))
+        return -1;
+    int left = check(node->left, node);
+    int right = check(node->right, node);
+    if(left < 0 || right < 0 || left != right)
+        return -1;
+
+    const TestNode* n = rb_entry(node, TestNode, rb);
+    int max_key = n->key;
+    if(node->left && rb_entry(node->left, TestNode, rb)->max_key > max_key)
+        max_key = rb_entry(node->left, TestNode, rb)->max_key;
+    if(node->right && rb_entry(node->right, TestNode, rb)->max_key > max_key)
+        max_key = rb_entry(node->right, TestNode, rb)->max_key;
+    if(n->max_key != max_key)
+        return -1;
+    return left + (node->red ? 0 : 1);
+}
+
+static bool in_order(const rb_root* root, int expected_count)
+{
+    int count = 0;
+    int prev = -1;
+    for(rb_node* node = kernel::rb_first(root); node; node = kernel::rb_next(node)) {
+        int key = rb_entry(node, TestNode, rb)->key;
+        if(key < prev)
+            return false;
+        prev = key;
+        count++;
+    }
+    return count == expected_count;
+}
+
+static const int NODE_COUNT = 512;
+static TestNode nodes[NODE_COUNT];
+
+// 线性同余生成器，保证每次运行的插入顺序相同
+static unsigned int next_random(unsigned int& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+TEST_CASE(ascending_insert)
+{
+    rb_root root;
+    root.augment = update_max;
+    for(int i = 0; i < NODE_COUNT; i++) {
+        nodes[i].key = i;
+        insert(&root, &nodes[i]);
+    }
+    ASSERT_EQ(true, check(root.node, nullptr) > 0);
+    ASSERT_EQ(true, in_order(&root, NODE_COUNT));
+    ASSERT_EQ(NODE_COUNT - 1, rb_entry(root.node, TestNode, rb)->max_key);
+    ASSERT_EQ(0, rb_entry(kernel::rb_first(&root), TestNode, rb)->key);
+    ASSERT_EQ(NODE_COUNT - 1, rb_entry(kernel::rb_last(&root), TestNode, rb)->key);
+}
+
+TEST_CASE(random_insert_erase)
+{
+    rb_root root;
+    root.augment = update_max;
+    unsigned int seed = 42;
+    for(int i = 0; i < NODE_COUNT; i++) {
+        nodes[i].key = next_random(seed);
+        insert(&root, &nodes[i]);
+    }
+    ASSERT_EQ(true, check(root.node, nullptr) > 0);
+    ASSERT_EQ(true, in_order(&root, NODE_COUNT));
+
+    // 删除偶数下标的节点，每次删除后都检查一次
+    bool valid = true;
+    for(int i = 0; i < NODE_COUNT; i += 2) {
+        kernel::rb_erase(&nodes[i].rb, &root);
+        if(check(root.node, nullptr) < 0) {
+            valid = false;
+        }
+    }
+    ASSERT_EQ(true, valid);
+    ASSERT_EQ(true, in_order(&root, NODE_COUNT / 2));
+
+    int max_key = 0;
+    for(int i = 1; i < NODE_COUNT; i += 2) {
+        if(nodes[i].key > max_key)
+            max_key = nodes[i].key;
+    }
+    ASSERT_EQ(max_key, rb_entry(root.node, TestNode, rb)->max_key);
+
+    for(int i = 1; i < NODE_COUNT; i += 2) {
+        kernel::rb_erase(&nodes[i].rb, &root);
+    }
+    ASSERT_EQ(true, root.node == nullptr);
+}
+
+TEST_CASE(propagate_after_key_change)
+{
+    rb_root root;
+    root.augment = update_max;
+    for(int i = 0; i < 64; i++) {
+        nodes[i].key = i * 2;
+        insert(&root, &nodes[i]);
+    }
+    // 在不改变顺序的前提下修改节点的值，再向上更新增强信息
+    nodes[63].key = 1000;
+    kernel::rb_augment_propagate(&nodes[63].rb, &root);
+    ASSERT_EQ(1000, rb_entry(root.node, TestNode, rb)->max_key);
+    ASSERT_EQ(true, check(root.node, nullptr) > 0);
+
+    ASSERT_EQ(62, rb_entry(kernel::rb_prev(&nodes[32].rb), TestNode, rb)->key);
+    ASSERT_EQ(66, rb_entry(kernel::rb_next(&nodes[32].rb), TestNode, rb)->key);
+}
+
+int main()
+{
+    printf("Running rbtree tests...\n");
+
+    RUN_TEST(ascending_insert);
+    RUN_TEST(random_insert_erase);
+    RUN_TEST(propagate_after_key_change);
+
+    print_test_results();
+
+    return g_test_stats.failed_tests > 0 ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+#include "lib/test_framework.h"
+#include <kernel/virtual_memory_tree.h>
+
+// 参照模型：按起始地址排序的区域数组，线性扫描实现首次适配
+struct ModelArea {
+    uint32_t start;
+    uint32_t size;
+};
+
+static const uint32_t TREE_START = 0x40000000;
+static const uint32_t TREE_END = TREE_START + 0x1000000;
+static const int MAX_AREAS = 4096;
+static const int OP_COUNT = 200000;
+
+static ModelArea model[MAX_AREAS];
+static int model_count;
+
+static uint32_t model_end(int i)
+{
+    return i < model_count ? model[i].start : TREE_END;
+}
+
+static uint32_t model_prev_end(int i)
+{
+    return i > 0 ? model[i - 1].start + model[i - 1].size : TREE_START;
+}
+
+static uint32_t model_allocate(uint32_t size)
+{
+    for(int i = 0; i <= model_count; i++) {
+        uint32_t gap_start = model_prev_end(i);
+        if(model_end(i) - gap_start < size)
+            continue;
+        for(int j = model_count; j > i; j--)
+            model[j] = model[j - 1];
+        model[i].start = gap_start;
+        model[i].size = size;
+        model_count++;
+        return gap_start;
+    }
+    return 0;
+}
+
+static int model_find(uint32_t addr)
+{
+    for(int i = 0; i < model_count; i++) {
+        if(model[i].start == addr)
+            return i;
+    }
+    return -1;
+}
+
+static uint32_t model_free(uint32_t addr)
+{
+    int i = model_find(addr);
+    if(i < 0)
+        return 0;
+    uint32_t size = model[i].size;
+    for(int j = i; j < model_count - 1; j++)
+        model[j] = model[j + 1];
+    model_count--;
+    return size;
+}
+
+static bool model_resize(uint32_t addr, uint32_t new_size)
+{
+    int i = model_find(addr);
+    if(i < 0 || new_size == 0 || new_size > model_end(i + 1) - addr)
+        return false;
+    model[i].size = new_size;
+    return true;
+}
+
+// 由模型计算碎片统计，与树中增强信息得到的结果比较
+static VmFragmentation model_fragmentation()
+{
+    VmFragmentation frag = {};
+    frag.nr_areas = model_count;
+    for(int i = 0; i <= model_count; i++) {
+        uint32_t gap = model_end(i) - model_prev_end(i);
+        frag.free_size += gap;
+        if(gap)
+            frag.nr_gaps++;
+        if(gap > frag.largest_gap)
+            frag.largest_gap = gap;
+    }
+    return frag;
+}
+
+static bool same_fragmentation(const VmFragmentation& a, const VmFragmentation& b)
+{
+    return a.free_size == b.free_size && a.largest_gap == b.largest_gap && a.nr_areas == b.nr_areas &&
+           a.nr_gaps == b.nr_gaps;
+}
+
+// 线性同余生成器，保证每次运行的操作序列相同
+static unsigned int next_random(unsigned int& seed)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+TEST_CASE(first_fit_order)
+{
+    VirtualMemoryTree tree(TREE_START, TREE_END);
+    tree.init();
+
+    uint32_t a = tree.allocate(0x1000);
+    uint32_t b = tree.allocate(0x2000);
+    uint32_t c = tree.allocate(0x1000);
+    ASSERT_EQ(TREE_START, a);
+    ASSERT_EQ(TREE_START + 0x1000, b);
+    ASSERT_EQ(TREE_START + 0x3000, c);
+
+    // 释放中间的区域后，小于等于空隙的分配应当落在空隙里
+    ASSERT_EQ(0x2000u, tree.free(b));
+    ASSERT_EQ(0u, tree.free(b));
+    ASSERT_EQ(b, tree.allocate(0x1000));
+    ASSERT_EQ(TREE_START + 0x4000, tree.allocate(0x2000));
+    ASSERT_EQ(TREE_START + 0x2000, tree.allocate(0x1000));
+
+    ASSERT_EQ(0u, tree.allocate(0));
+    ASSERT_EQ(0u, tree.allocate(TREE_END - TREE_START + 1));
+    ASSERT_EQ(TREE_END - TREE_START - 0x6000, tree.get_largest_gap());
+}
+
+TEST_CASE(resize_in_place)
+{
+    VirtualMemoryTree tree(TREE_START, TREE_END);
+    tree.init();
+
+    uint32_t a = tree.allocate(0x1000);
+    uint32_t b = tree.allocate(0x1000);
+    ASSERT_EQ(false, tree.resize(a, 0x2000));
+    ASSERT_EQ(true, tree.resize(b, 0x3000));
+    ASSERT_EQ(0x3000u, tree.size_of(b));
+    ASSERT_EQ(true, tree.resize(b, 0x1000));
+    ASSERT_EQ(TREE_START + 0x2000, tree.allocate(0x1000));
+    ASSERT_EQ(false, tree.resize(a, 0));
+    ASSERT_EQ(TREE_END - TREE_START - 0x3000, tree.get_free_size());
+}
+
+// 随机的分配、释放和原地调整，每一步都和参照模型比较
+TEST_CASE(random_against_model)
+{
+    VirtualMemoryTree tree(TREE_START, TREE_END);
+    tree.init();
+    model_count = 0;
+
+    unsigned int seed = 7;
+    int mismatches = 0;
+    for(int op = 0; op < OP_COUNT; op++) {
+        unsigned int choice = next_random(seed) % 8;
+        uint32_t size = (next_random(seed) % 64 + 1) * 0x1000;
+        if(choice < 4 && model_count < MAX_AREAS) {
+            if(tree.allocate(size) != model_allocate(size))
+                mismatches++;
+        } else if(model_count > 0) {
+            uint32_t addr = model[next_random(seed) % model_count].start;
+            if(choice < 7) {
+                if(tree.free(addr) != model_free(addr))
+                    mismatches++;
+            } else if(tree.resize(addr, size) != model_resize(addr, size)) {
+                mismatches++;
+            }
+        }
+
+        if(op % 64 == 0 && !same_fragmentation(tree.fragmentation(), model_fragmentation()))
+            mismatches++;
+    }
+    ASSERT_EQ(0, mismatches);
+    ASSERT_EQ(true, same_fragmentation(tree.fragmentation(), model_fragmentation()));
+    ASSERT_EQ(model_fragmentation().largest_gap, tree.get_largest_gap());
+    ASSERT_EQ(model_fragmentation().free_size, tree.get_free_size());
+
+    mismatches = 0;
+    while(model_count > 0) {
+        uint32_t addr = model[0].start;
+        if(tree.free(addr) != model_free(addr))
+            mismatches++;
+    }
+    ASSERT_EQ(0, mismatches);
+    ASSERT_EQ(TREE_END - TREE_START, tree.get_largest_gap());
+}
+
+int main()
+{
+    printf("Running virtual memory tree tests...\n");
+
+    RUN_TEST(first_fit_order);
+    RUN_TEST(resize_in_place);
+    RUN_TEST(random_against_model);
+
+    print_test_results();
+
+    return g_test_stats.failed_tests > 0 ? 1 : 0;
+}
@@ -14,8 +14,8 @@ disk_size=100M
 # 创建空的磁盘镜像文件
 dd if=/dev/zero of=$disk_image bs=1M count=100
 
-# 格式化为ext2文件系统
-mkfs.ext2 $disk_image
+# 格式化为ext2文件系统，块大小与页大小相同，文件mmap直接映射页缓存中的块
+mkfs.ext2 -b 4096 $disk_image
 
 # 创建临时挂载点
 tmp_mount=$(mktemp -d)